@@ -1,113 +1,663 @@
+#define _GNU_SOURCE
 #include "tecnicofs-client-api.h"
+#include "../tecnicofs-protocol.h"
+#include "../tecnicofs-shm.h"
 #include <string.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
 #define error(msg) {fprintf(stderr, msg); exit(EXIT_FAILURE);}
 
-int sockfd = -1;
-struct sockaddr_un client_addr, server_addr;
-socklen_t clientlen, serverlen;
+/* each thread has a session of its own */
+__thread int sockfd = -1;
+__thread int socktype = SOCK_DGRAM;
+__thread struct sockaddr_un client_addr, server_addr;
+__thread socklen_t clientlen, serverlen;
+__thread uint32_t lastRequestId = 0;
 
-int tfsCreate(char *filename, char nodeType) {
-  if (sockfd == -1)
-    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+/*
+ * Requests sent and not yet collected, indexed by id. A reply that
+ * arrives while waiting for another request is parked in its slot, so
+ * replies may come back in any order.
+ */
+typedef struct pendingRequest {
+  uint32_t id; /* 0 if the slot is free */
+  int done;
+  int result;
+  int ring; /* sent through the shared-memory ring */
+} PendingRequest;
+
+static __thread PendingRequest pending[TFS_MAX_PENDING];
+
+/* shared-memory rings attached by tfsMountShm, NULL if none */
+static __thread tfsShmSegment *shm = NULL;
+/* requests placed in the ring whose responses were not consumed yet */
+static __thread int shmInflight = 0;
 
-  char buf[200];
-  int res;
+/*
+ * Returns a fresh request id, never 0.
+ */
+static uint32_t tfsNextId() {
+  if (++lastRequestId == 0)
+    lastRequestId = 1;
+  return lastRequestId;
+}
 
-  if (sprintf(buf, "c %s %c", filename, nodeType) < 0)
-    error("Error: tfsCreate - passing output to buffer\n");
-  
-  if (sendto(sockfd, buf, sizeof(buf)-1, 0, (struct sockaddr *) &server_addr, serverlen) < 0)
-    return TECNICOFS_ERROR_CONNECTION_ERROR;
+/*
+ * Reads exactly len bytes from a stream session.
+ * Returns: len, or -1 if the connection failed
+ */
+static ssize_t tfsReadStream(void *buf, size_t len) {
+  size_t done = 0;
+
+  while (done < len) {
+    ssize_t n = recv(sockfd, (char *) buf + done, len - done, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    done += n;
+  }
+  return len;
+}
 
-  if (recvfrom(sockfd, &res, sizeof(res), 0, 0, 0) < 0)
+/*
+ * Receives one response.
+ * Input:
+ *  - flags: MSG_DONTWAIT to return at once if none is queued
+ *  - id: the request whose response the caller wants
+ *  - payload: buffer for that response's payload (may be NULL)
+ *  - payloadcap: size of payload
+ *  - result: where to store that response's result
+ * Returns: 1 if it was the wanted response, 0 if it was another one (or
+ * none was queued), a negative error otherwise
+ */
+static int tfsReceive(int flags, uint32_t id, void *payload, int payloadcap, int *result) {
+  tfsResponseHeader reply;
+  struct iovec iov[2] = {
+    { .iov_base = &reply, .iov_len = sizeof(reply) },
+    { .iov_base = payload, .iov_len = payloadcap }
+  };
+  struct msghdr msg = { .msg_iov = iov, .msg_iovlen = payload ? 2 : 1 };
+  ssize_t len;
+
+  if (socktype == SOCK_STREAM) {
+    /* the server writes each response whole, so once it starts arriving
+       the rest follows */
+    struct pollfd fds = { .fd = sockfd, .events = POLLIN };
+    if ((flags & MSG_DONTWAIT) && poll(&fds, 1, 0) == 0)
+      return 0;
+    len = tfsReadStream(&reply, sizeof(reply));
+    if (len == sizeof(reply) && reply.payloadlen > 0) {
+      char *dst = payload;
+      for (uint32_t left = reply.payloadlen; left > 0; ) {
+        char discard[256];
+        int n = left;
+        if (dst == NULL || payloadcap == 0) {
+          dst = discard;
+          n = left < sizeof(discard) ? left : sizeof(discard);
+        }
+        else if (n > payloadcap) {
+          n = payloadcap;
+        }
+        if (tfsReadStream(dst, n) != n)
+          return TECNICOFS_ERROR_CONNECTION_ERROR;
+        left -= n;
+        if (dst != discard) {
+          dst += n;
+          payloadcap -= n;
+        }
+        else {
+          dst = NULL;
+        }
+      }
+    }
+  }
+  else {
+    len = recvmsg(sockfd, &msg, flags);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+      return 0;
+  }
+  if (len < (ssize_t) sizeof(reply))
     return TECNICOFS_ERROR_CONNECTION_ERROR;
+  if (reply.magic != TFS_PROTOCOL_MAGIC)
+    return 0;
+
+  if (reply.id == id) {
+    *result = reply.result;
+    return 1;
+  }
 
-  return res;
+  /* park it for tfsPoll/tfsWait, unless nobody is waiting for it */
+  PendingRequest *slot = &pending[reply.id & (TFS_MAX_PENDING - 1)];
+  if (slot->id == reply.id) {
+    slot->result = reply.result;
+    slot->done = 1;
+  }
+  return 0;
 }
 
-int tfsDelete(char *path) {
+/*
+ * Sends an encoded request. While the server's queue is full, replies
+ * are drained meanwhile: otherwise both sides could block on sending.
+ * Returns: 0 or TECNICOFS_ERROR_CONNECTION_ERROR
+ */
+static int tfsSend(char *buf, int len) {
+  int unused;
+
+  /* only the bytes actually used go on the wire; a stream may take them
+     in several pieces */
+  while (len > 0) {
+    ssize_t sent = send(sockfd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent >= 0) {
+      buf += sent;
+      len -= sent;
+      continue;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      return TECNICOFS_ERROR_CONNECTION_ERROR;
+
+    struct pollfd fds = { .fd = sockfd, .events = POLLIN | POLLOUT };
+    if (poll(&fds, 1, -1) < 0 && errno != EINTR)
+      return TECNICOFS_ERROR_CONNECTION_ERROR;
+    if (fds.revents & POLLIN) {
+      if (tfsReceive(MSG_DONTWAIT, 0, NULL, 0, &unused) < 0)
+        return TECNICOFS_ERROR_CONNECTION_ERROR;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Sends an encoded request and waits for its response, parking the
+ * responses of asynchronous requests that arrive meanwhile.
+ * Input:
+ *  - buf, len: the encoded request
+ *  - id: its request id
+ *  - payload: buffer for the response payload (may be NULL)
+ *  - payloadcap: size of payload
+ * Returns: the response's result
+ */
+static int tfsExchange(char *buf, int len, uint32_t id, void *payload, int payloadcap) {
+  int result, ret;
+
+  if ((ret = tfsSend(buf, len)) < 0)
+    return ret;
+
+  while ((ret = tfsReceive(0, id, payload, payloadcap, &result)) == 0);
+  return ret < 0 ? ret : result;
+}
+
+/*
+ * Returns where to encode the next request: a free slot of the request
+ * ring, if rings are attached and one is free, so the request is written
+ * in place; otherwise buf, to send it through the socket.
+ */
+static char *tfsRingSlot(char *buf, int *size) {
+  tfsShmSlot *slot;
+
+  if (shm != NULL && shmInflight < TFS_SHM_SLOTS && (slot = tfsShmProduce(&shm->requests)) != NULL) {
+    *size = TFS_SHM_MAX_MESSAGE;
+    return slot->data;
+  }
+  return buf;
+}
+
+/*
+ * Sends a request encoded in the buffer returned by tfsRingSlot.
+ * Returns: 1 if it went through the ring, 0 if through the socket, or a
+ * negative error
+ */
+static int tfsRingSend(char *dst, char *buf, int len) {
+  if (dst == buf)
+    return tfsSend(buf, len);
+  tfsShmPublish(&shm->requests, len);
+  shmInflight++;
+  return 1;
+}
+
+/*
+ * Consumes one response of the response ring.
+ * Input:
+ *  - wait: whether to wait for one if the ring is empty
+ *  - id: the request whose response the caller wants
+ *  - result: where to store that response's result
+ * Returns: 1 if it was the wanted response, 0 if it was another one (or
+ * there was none), a negative error otherwise
+ */
+static int tfsRingReceive(int wait, uint32_t id, int *result) {
+  tfsShmSlot *slot;
+  tfsResponseHeader reply;
+
+  while ((slot = tfsShmConsume(&shm->responses)) == NULL) {
+    if (__atomic_load_n(&shm->closed, __ATOMIC_ACQUIRE))
+      return TECNICOFS_ERROR_CONNECTION_ERROR;
+    if (!wait)
+      return 0;
+    tfsShmWait(&shm->responses, &shm->closed, 100);
+  }
+  memcpy(&reply, slot->data, sizeof(reply));
+  tfsShmRelease(&shm->responses);
+  shmInflight--;
+
+  if (reply.id == id) {
+    *result = reply.result;
+    return 1;
+  }
+  PendingRequest *pend = &pending[reply.id & (TFS_MAX_PENDING - 1)];
+  if (pend->id == reply.id) {
+    pend->result = reply.result;
+    pend->done = 1;
+  }
+  return 0;
+}
+
+/*
+ * Sends a binary request to the server and waits for its result. The
+ * payload, if any, must be small (a few integers).
+ */
+static int tfsRequest(int opcode, int flags, char *path, char *path2, void *payload, int payloadlen) {
   if (sockfd == -1)
     return TECNICOFS_ERROR_NO_OPEN_SESSION;
-  
-  char buf[200];
-  int res;
-
-  if (sprintf(buf, "d %s", path) < 0)
-    error("Error: tfsDelete - passing output to buffer\n");
-  
-  if (sendto(sockfd, buf, sizeof(buf)-1, 0, (struct sockaddr *) &server_addr, serverlen) < 0)
-    return TECNICOFS_ERROR_CONNECTION_ERROR;
 
-  if (recvfrom(sockfd, &res, sizeof(res), 0, 0, 0) < 0)
-    return TECNICOFS_ERROR_CONNECTION_ERROR;
+  char buf[sizeof(tfsRequestHeader) + 2 * MAX_FILE_NAME + 16];
+  int size = sizeof(buf);
+  char *dst = tfsRingSlot(buf, &size);
+  uint32_t id = tfsNextId();
+  int result, ret;
+
+  int len = tfsEncodeRequest(dst, size, opcode, flags, id, path, path2, payload, payloadlen);
+  if (len < 0)
+    return TECNICOFS_ERROR_OTHER;
+
+  if ((ret = tfsRingSend(dst, buf, len)) < 0)
+    return ret;
+  if (ret == 0) {
+    while ((ret = tfsReceive(0, id, NULL, 0, &result)) == 0);
+  }
+  else {
+    while ((ret = tfsRingReceive(1, id, &result)) == 0);
+  }
+  return ret < 0 ? ret : result;
+}
 
-  return res;
+/*
+ * Encodes one operation, tagged with the given request id.
+ * Returns: the number of bytes used, -1 if it does not fit or is invalid
+ */
+static int tfsEncodeOp(char *buf, int size, uint32_t id, tfsBatchOp *op) {
+  switch (op->op) {
+    case 'c':
+      if (op->nodeType != 'f' && op->nodeType != 'd')
+        return -1;
+      return tfsEncodeRequest(buf, size, TFS_OP_CREATE, op->nodeType == 'f' ? T_FILE : T_DIRECTORY,
+                              id, op->path, NULL, NULL, 0);
+    case 'd':
+      return tfsEncodeRequest(buf, size, TFS_OP_DELETE, 0, id, op->path, NULL, NULL, 0);
+    case 'r':
+      return tfsEncodeRequest(buf, size, TFS_OP_RMTREE, 0, id, op->path, NULL, NULL, 0);
+    case 'l':
+      return tfsEncodeRequest(buf, size, TFS_OP_LOOKUP, 0, id, op->path, NULL, NULL, 0);
+    case 'm':
+      return tfsEncodeRequest(buf, size, TFS_OP_MOVE, 0, id, op->path, op->path2, NULL, 0);
+    case 'p':
+      return tfsEncodeRequest(buf, size, TFS_OP_PRINT, 0, id, op->path, NULL, NULL, 0);
+    default:
+      return -1;
+  }
 }
 
-int tfsMove(char *from, char *to) {
+/*
+ * Runs many operations with as few round trips as possible: operations
+ * are packed into batch datagrams that the server runs in order.
+ * Input:
+ *  - ops: the operations
+ *  - count: number of operations
+ *  - results: array of count ints to store each operation's result
+ *  - flags: TFS_BATCH_STOP_ON_FAILURE to stop at the first failed operation
+ * Returns: number of operations run (results holds theirs), or an error
+ */
+int tfsBatch(tfsBatchOp *ops, int count, int *results, int flags) {
   if (sockfd == -1)
     return TECNICOFS_ERROR_NO_OPEN_SESSION;
-  
-  char buf[200];
-  int res;
-
-  if (sprintf(buf, "m %s %s", from, to) < 0)
-    error("Error: tfsMove - passing output to buffer\n");
-  
-  if (sendto(sockfd, buf, sizeof(buf)-1, 0, (struct sockaddr *) &server_addr, serverlen) < 0)
-    return TECNICOFS_ERROR_CONNECTION_ERROR;
 
-  if (recvfrom(sockfd, &res, sizeof(res), 0, 0, 0) < 0)
-    return TECNICOFS_ERROR_CONNECTION_ERROR;
+  static __thread char buf[TFS_MAX_MESSAGE];
+  static __thread int32_t replies[TFS_MAX_BATCH];
+  int done = 0;
+
+  while (done < count) {
+    int len = sizeof(tfsRequestHeader), n = 0;
+
+    /* pack as many operations as fit in one datagram */
+    while (done + n < count) {
+      int used = tfsEncodeOp(buf + len, sizeof(buf) - len, 0, &ops[done + n]);
+      if (used < 0) {
+        if (n == 0)
+          return done > 0 ? done : TECNICOFS_ERROR_INVALID_COMMAND;
+        break;
+      }
+      len += used;
+      n++;
+    }
+
+    uint32_t id = tfsNextId();
+    tfsRequestHeader header = {
+      .magic = TFS_PROTOCOL_MAGIC, .version = TFS_PROTOCOL_VERSION, .opcode = TFS_OP_BATCH,
+      .flags = flags, .id = id, .pathlen = 0, .path2len = 0,
+      .payloadlen = len - sizeof(tfsRequestHeader)
+    };
+    memcpy(buf, &header, sizeof(header));
+
+    int ran = tfsExchange(buf, len, id, replies, n * sizeof(int32_t));
+    if (ran < 0)
+      return done > 0 ? done : ran;
+
+    for (int i = 0; i < ran; i++)
+      results[done + i] = replies[i];
+    done += ran;
+
+    if (ran < n)
+      break;
+  }
+  return done;
+}
 
-  return res;
+/*
+ * Sends an operation without waiting for its result, so many can be in
+ * flight at once and the server's threads run them in parallel. Collect
+ * the result with tfsPoll or tfsWait.
+ * Input:
+ *  - op: the operation
+ *  - id: where to store the request's id
+ * Returns: 0, TECNICOFS_ERROR_OTHER if TFS_MAX_PENDING requests are
+ * already pending, or another error
+ */
+int tfsSubmit(tfsBatchOp *op, uint32_t *id) {
+  if (sockfd == -1)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+
+  char buf[sizeof(tfsRequestHeader) + 2 * MAX_FILE_NAME];
+  int size = sizeof(buf);
+  uint32_t new_id = tfsNextId();
+  PendingRequest *slot = &pending[new_id & (TFS_MAX_PENDING - 1)];
+
+  if (slot->id != 0)
+    return TECNICOFS_ERROR_OTHER;
+
+  char *dst = tfsRingSlot(buf, &size);
+  int len = tfsEncodeOp(dst, size, new_id, op);
+  if (len < 0)
+    return TECNICOFS_ERROR_INVALID_COMMAND;
+
+  slot->id = new_id;
+  slot->done = 0;
+  int ret = tfsRingSend(dst, buf, len);
+  if (ret < 0) {
+    slot->id = 0;
+    return ret;
+  }
+  slot->ring = ret;
+  *id = new_id;
+  return 0;
 }
 
-int tfsLookup(char *path) {
+/*
+ * Checks, without blocking, whether a submitted request has completed.
+ * Responses already queued on its channel (socket or ring) are collected
+ * first.
+ * Input:
+ *  - id: the request's id
+ *  - result: where to store its result, once completed
+ * Returns: 1 if completed (the id is then released), 0 if still pending,
+ * a negative error otherwise
+ */
+int tfsPoll(uint32_t id, int *result) {
+  PendingRequest *slot = &pending[id & (TFS_MAX_PENDING - 1)];
+  int unused;
 
   if (sockfd == -1)
     return TECNICOFS_ERROR_NO_OPEN_SESSION;
-  
-  char buf[200];
-  int res;
-
-  if (sprintf(buf, "l %s", path) < 0)
-    error("Error: tfsLookup - passing output to buffer\n");
-  
-  if (sendto(sockfd, buf, sizeof(buf)-1, 0, (struct sockaddr *) &server_addr, serverlen) < 0)
-    return TECNICOFS_ERROR_CONNECTION_ERROR;
+  if (id == 0 || slot->id != id)
+    return TECNICOFS_ERROR_OTHER;
+
+  while (!slot->done) {
+    if (slot->ring) {
+      int ret = tfsRingReceive(0, 0, &unused);
+      if (ret < 0)
+        return ret;
+      if (!slot->done && tfsShmConsume(&shm->responses) == NULL)
+        return 0;
+      continue;
+    }
+    struct pollfd fds = { .fd = sockfd, .events = POLLIN };
+    if (poll(&fds, 1, 0) <= 0)
+      return 0;
+    if (tfsReceive(MSG_DONTWAIT, 0, NULL, 0, &unused) < 0)
+      return TECNICOFS_ERROR_CONNECTION_ERROR;
+  }
+  *result = slot->result;
+  slot->id = 0;
+  return 1;
+}
 
-  if (recvfrom(sockfd, &res, sizeof(res), 0, 0, 0) < 0)
-    return TECNICOFS_ERROR_CONNECTION_ERROR;
+/*
+ * Waits for a submitted request to complete.
+ * Input:
+ *  - id: the request's id
+ *  - result: where to store its result
+ * Returns: 0 (the id is then released) or a negative error
+ */
+int tfsWait(uint32_t id, int *result) {
+  PendingRequest *slot = &pending[id & (TFS_MAX_PENDING - 1)];
+  int unused;
+
+  if (sockfd == -1)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+  if (id == 0 || slot->id != id)
+    return TECNICOFS_ERROR_OTHER;
 
-  return res;
+  while (!slot->done) {
+    int ret = slot->ring ? tfsRingReceive(1, 0, &unused) : tfsReceive(0, 0, NULL, 0, &unused);
+    if (ret < 0)
+      return TECNICOFS_ERROR_CONNECTION_ERROR;
+  }
+  *result = slot->result;
+  slot->id = 0;
+  return 0;
+}
+
+/*
+ * Returns the session's socket, to watch from the caller's event loop:
+ * it becomes readable when responses arrive, then call tfsPoll. Requests
+ * that went through shared-memory rings complete without it, so poll
+ * them too.
+ */
+int tfsGetFd() {
+  return sockfd;
+}
+
+int tfsCreate(char *filename, char nodeType) {
+  switch (nodeType) {
+    case 'f':
+      return tfsRequest(TFS_OP_CREATE, T_FILE, filename, NULL, NULL, 0);
+    case 'd':
+      return tfsRequest(TFS_OP_CREATE, T_DIRECTORY, filename, NULL, NULL, 0);
+    default:
+      return TECNICOFS_ERROR_INVALID_COMMAND;
+  }
+}
+
+int tfsDelete(char *path) {
+  return tfsRequest(TFS_OP_DELETE, 0, path, NULL, NULL, 0);
+}
+
+/*
+ * Deletes a node and everything below it. The server detaches it at once
+ * and frees the rest in the background, so this takes no longer for a
+ * large subtree.
+ */
+int tfsDeleteTree(char *path) {
+  return tfsRequest(TFS_OP_RMTREE, 0, path, NULL, NULL, 0);
+}
+
+int tfsMove(char *from, char *to) {
+  return tfsRequest(TFS_OP_MOVE, 0, from, to, NULL, 0);
+}
+
+int tfsLookup(char *path) {
+  return tfsRequest(TFS_OP_LOOKUP, 0, path, NULL, NULL, 0);
 }
 
 int tfsPrint(char * outputFile) {
+  return tfsRequest(TFS_OP_PRINT, TFS_PRINT_TEXT, outputFile, NULL, NULL, 0);
+}
+
+int tfsPrintFormat(char *outputFile, int format) {
+  return tfsRequest(TFS_OP_PRINT, format, outputFile, NULL, NULL, 0);
+}
+
+/*
+ * Has the server write its latency histograms, per opcode and per stage
+ * of a request, and its path cache hits and misses, to a file.
+ * Input:
+ *  - outputFile: the file, opened by the server
+ *  - format: TFS_STATS_TEXT or TFS_STATS_JSON
+ * Returns: SUCCESS or an error
+ */
+int tfsStats(char *outputFile, int format) {
+  return tfsRequest(TFS_OP_STATS, format, outputFile, NULL, NULL, 0);
+}
 
+/*
+ * Starts the server's lock contention profiler, clearing its counters,
+ * or stops it.
+ * Input:
+ *  - enable: nonzero to start, zero to stop
+ * Returns: SUCCESS or an error
+ */
+int tfsLockProfiling(int enable) {
+  return tfsRequest(TFS_OP_LOCKS, enable ? TFS_LOCKS_START : TFS_LOCKS_STOP, NULL, NULL, NULL, 0);
+}
+
+/*
+ * Has the server write the i-nodes whose locks were most contended
+ * while profiling, with their paths, to a file.
+ * Input:
+ *  - outputFile: the file, opened by the server
+ *  - top: number of i-nodes to list, 0 for the server's default
+ * Returns: SUCCESS or an error
+ */
+int tfsLockProfile(char *outputFile, int top) {
+  int32_t count = top;
+  return tfsRequest(TFS_OP_LOCKS, TFS_LOCKS_DUMP, outputFile, NULL, &count, sizeof(count));
+}
+
+/*
+ * Writes to a file at an offset, extending it if needed. Large writes
+ * are split into several requests.
+ * Input:
+ *  - path: the file
+ *  - offset: position of the first byte to write
+ *  - buf: the bytes
+ *  - len: number of bytes
+ * Returns: number of bytes written, or an error
+ */
+int tfsWrite(char *path, long offset, void *buf, int len) {
   if (sockfd == -1)
     return TECNICOFS_ERROR_NO_OPEN_SESSION;
-  
-  char buf[200];
-  int res;
-
-  if (sprintf(buf, "p %s", outputFile) < 0)
-    error("Error: tfsPrint - passing output to buffer\n");
-  
-  if (sendto(sockfd, buf, sizeof(buf)-1, 0, (struct sockaddr *) &server_addr, serverlen) < 0)
-    return TECNICOFS_ERROR_CONNECTION_ERROR;
 
-  if (recvfrom(sockfd, &res, sizeof(res), 0, 0, 0) < 0)
-    return TECNICOFS_ERROR_CONNECTION_ERROR;
-  
-  return res;
+  static __thread char msg[TFS_MAX_MESSAGE];
+  int done = 0;
+
+  do {
+    int64_t pos = offset + done;
+    uint32_t id = tfsNextId();
+    int used = tfsEncodeRequest(msg, sizeof(msg), TFS_OP_WRITE, 0, id, path, NULL, &pos, sizeof(pos));
+    if (used < 0)
+      return TECNICOFS_ERROR_INVALID_COMMAND;
+
+    /* the data goes right after the offset, as much as fits */
+    int n = len - done;
+    if (n > (int) sizeof(msg) - used)
+      n = sizeof(msg) - used;
+    memcpy(msg + used, (char *) buf + done, n);
+    uint32_t payloadlen = sizeof(pos) + n;
+    memcpy(msg + offsetof(tfsRequestHeader, payloadlen), &payloadlen, sizeof(payloadlen));
+
+    int written = tfsExchange(msg, used + n, id, NULL, 0);
+    if (written < 0)
+      return done > 0 ? done : written;
+    done += written;
+    if (written < n)
+      break;
+  } while (done < len);
+  return done;
+}
+
+/*
+ * Reads from a file at an offset. Large reads are split into several
+ * requests; each reply is received straight into buf.
+ * Input:
+ *  - path: the file
+ *  - offset: position of the first byte to read
+ *  - buf: destination
+ *  - len: maximum number of bytes
+ * Returns: number of bytes read (less than len at the end of the file),
+ * or an error
+ */
+int tfsRead(char *path, long offset, void *buf, int len) {
+  if (sockfd == -1)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+
+  char msg[sizeof(tfsRequestHeader) + MAX_FILE_NAME + sizeof(int64_t) + sizeof(int32_t)];
+  char range[sizeof(int64_t) + sizeof(int32_t)];
+  int done = 0;
+
+  while (done < len) {
+    int64_t pos = offset + done;
+    int32_t n = len - done < (int) TFS_MAX_READ ? len - done : (int) TFS_MAX_READ;
+    memcpy(range, &pos, sizeof(pos));
+    memcpy(range + sizeof(pos), &n, sizeof(n));
+
+    uint32_t id = tfsNextId();
+    int used = tfsEncodeRequest(msg, sizeof(msg), TFS_OP_READ, 0, id, path, NULL, range, sizeof(range));
+    if (used < 0)
+      return TECNICOFS_ERROR_INVALID_COMMAND;
+
+    int got = tfsExchange(msg, used, id, (char *) buf + done, n);
+    if (got < 0)
+      return done > 0 ? done : got;
+    done += got;
+    if (got < n)
+      break;
+  }
+  return done;
+}
+
+/*
+ * Sets the size of a file: shrinking discards its tail, growing pads it
+ * with zeros.
+ */
+int tfsTruncate(char *path, long size) {
+  int64_t newsize = size;
+  return tfsRequest(TFS_OP_TRUNCATE, 0, path, NULL, &newsize, sizeof(newsize));
+}
+
+/*
+ * Returns the size of a file, or an error.
+ */
+int tfsSize(char *path) {
+  return tfsRequest(TFS_OP_SIZE, 0, path, NULL, NULL, 0);
 }
 
 /*
@@ -115,29 +665,113 @@ int tfsPrint(char * outputFile) {
  * Returns error if the client already has a active session with this server
 */
 int tfsMount(char * sockPath) {
+  return tfsMountType(sockPath, SOCK_DGRAM);
+}
 
-  pid_t pid = getpid();
-
-  if ((sockfd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
-    return TECNICOFS_ERROR_OPEN_SESSION;
-  }
+/*
+ * Like tfsMount, with a server started with the given socket type:
+ * SOCK_DGRAM, SOCK_SEQPACKET or SOCK_STREAM.
+ */
+int tfsMountType(char * sockPath, int type) {
 
-  bzero((char *) &client_addr, sizeof(client_addr));
-  client_addr.sun_family = AF_UNIX;
+  pid_t pid = getpid(), tid = syscall(SYS_gettid);
 
-  char * clientpath = malloc(sizeof(char) * 100);
-  sprintf(clientpath, "/tmp/client-%d", pid);
-  strcpy(client_addr.sun_path, clientpath);
-  clientlen = SUN_LEN(&client_addr);
+  if (sockfd != -1)
+    return TECNICOFS_ERROR_OPEN_SESSION;
 
-  if (bind(sockfd, (struct sockaddr *) &client_addr, clientlen) < 0)
-    return TECNICOFS_ERROR_CONNECTION_ERROR;
+  if ((sockfd = socket(AF_UNIX, type, 0)) < 0) {
+    return TECNICOFS_ERROR_OPEN_SESSION;
+  }
+  socktype = type;
+
+  /* datagram replies need an address to come back to */
+  if (type == SOCK_DGRAM) {
+    bzero((char *) &client_addr, sizeof(client_addr));
+    client_addr.sun_family = AF_UNIX;
+
+    char * clientpath = malloc(sizeof(char) * 100);
+    sprintf(clientpath, "/tmp/client-%d-%d", pid, tid);
+    strcpy(client_addr.sun_path, clientpath);
+    clientlen = SUN_LEN(&client_addr);
+    free(clientpath);
+
+    if (bind(sockfd, (struct sockaddr *) &client_addr, clientlen) < 0) {
+      close(sockfd);
+      sockfd = -1;
+      return TECNICOFS_ERROR_CONNECTION_ERROR;
+    }
+  }
 
   bzero((char *) &server_addr, sizeof(server_addr));
   server_addr.sun_family = AF_UNIX;
   strcpy(server_addr.sun_path, sockPath);
   serverlen = SUN_LEN(&server_addr);
 
+  /* a connected socket can tell when the server's queue is full */
+  if (connect(sockfd, (struct sockaddr *) &server_addr, serverlen) < 0) {
+    close(sockfd);
+    sockfd = -1;
+    return TECNICOFS_ERROR_CONNECTION_ERROR;
+  }
+
+  memset(pending, 0, sizeof(pending));
+  return 0;
+}
+
+/*
+ * Like tfsMountType, and also attaches shared-memory rings to the
+ * session, so requests and responses skip the socket while both sides
+ * are busy. Needs a SOCK_SEQPACKET or SOCK_STREAM server; if it cannot
+ * attach the rings, the session keeps using the socket alone.
+ */
+int tfsMountShm(char * sockPath, int type) {
+  int ret = tfsMountType(sockPath, type);
+  if (ret < 0)
+    return ret;
+
+  int fd = memfd_create("tecnicofs-rings", MFD_CLOEXEC);
+  if (fd < 0)
+    return 0;
+  tfsShmSegment *seg = MAP_FAILED;
+  if (ftruncate(fd, sizeof(tfsShmSegment)) == 0)
+    seg = mmap(NULL, sizeof(tfsShmSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (seg == MAP_FAILED) {
+    close(fd);
+    return 0;
+  }
+  seg->magic = TFS_SHM_MAGIC;
+  seg->version = TFS_PROTOCOL_VERSION;
+
+  /* the segment travels with the attach request */
+  char buf[sizeof(tfsRequestHeader)];
+  char control[CMSG_SPACE(sizeof(int))];
+  uint32_t id = tfsNextId();
+  int len = tfsEncodeRequest(buf, sizeof(buf), TFS_OP_SHM_ATTACH, 0, id, NULL, NULL, NULL, 0);
+  struct iovec iov = { .iov_base = buf, .iov_len = len };
+  struct msghdr msg = {
+    .msg_iov = &iov, .msg_iovlen = 1,
+    .msg_control = control, .msg_controllen = sizeof(control)
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  int result = TECNICOFS_ERROR_CONNECTION_ERROR;
+  if (sendmsg(sockfd, &msg, MSG_NOSIGNAL) == len) {
+    while ((ret = tfsReceive(0, id, NULL, 0, &result)) == 0);
+    if (ret < 0)
+      result = ret;
+  }
+  close(fd);
+
+  if (result != 0) {
+    munmap(seg, sizeof(tfsShmSegment));
+    return 0;
+  }
+  shm = seg;
+  shmInflight = 0;
   return 0;
 }
 
@@ -146,10 +780,18 @@ int tfsUnmount() {
   if (sockfd == -1)
     return TECNICOFS_ERROR_NO_OPEN_SESSION;
 
+  /* closing the socket makes the server stop serving the rings */
+  if (shm != NULL) {
+    munmap(shm, sizeof(tfsShmSegment));
+    shm = NULL;
+  }
+
   if (close(sockfd) == -1)
     return TECNICOFS_ERROR_NO_OPEN_SESSION;  
 
   sockfd = -1;
+  if (socktype == SOCK_DGRAM)
+    unlink(client_addr.sun_path);
 
   return 0;
 }
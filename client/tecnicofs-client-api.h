@@ -1,14 +1,56 @@
 #ifndef API_H
 #define API_H
 
+#include <stdint.h>
+#include <sys/socket.h>
 #include "tecnicofs-api-constants.h"
 
+/* asynchronous requests that can be pending at once, power of two */
+#define TFS_MAX_PENDING 4096
+
+/* flag for tfsBatch */
+#define TFS_BATCH_STOP_ON_FAILURE 1
+
+/* formats for tfsPrintFormat */
+#define TFS_PRINT_TEXT 0 /* one path per line, as tfsPrint */
+#define TFS_PRINT_NDJSON 1 /* one JSON object per line */
+#define TFS_PRINT_BINARY 2 /* see DumpRecord in server/fs/state.h */
+
+/* formats for tfsStats */
+#define TFS_STATS_TEXT 0 /* a table in microseconds */
+#define TFS_STATS_JSON 1 /* one JSON object, in nanoseconds */
+
+/* one operation for tfsBatch or tfsSubmit, with the letters of the input files */
+typedef struct tfsBatchOp {
+  char op;       /* 'c', 'd', 'l', 'm', 'p' or 'r' (tfsDeleteTree) */
+  char nodeType; /* 'f' or 'd', for 'c' */
+  char *path;
+  char *path2;   /* destination, for 'm' */
+} tfsBatchOp;
+
+/* a session is per thread: each thread that sends requests mounts its own */
 int tfsCreate(char *path, char nodeType);
 int tfsDelete(char *path);
+int tfsDeleteTree(char *path);
 int tfsLookup(char *path);
 int tfsMove(char *from, char *to);
 int tfsPrint(char *outputFile);
+int tfsPrintFormat(char *outputFile, int format);
+int tfsStats(char *outputFile, int format);
+int tfsLockProfiling(int enable);
+int tfsLockProfile(char *outputFile, int top);
+int tfsWrite(char *path, long offset, void *buf, int len);
+int tfsRead(char *path, long offset, void *buf, int len);
+int tfsTruncate(char *path, long size);
+int tfsSize(char *path);
 int tfsMount(char* serverName);
+int tfsMountType(char* serverName, int type);
+int tfsMountShm(char* serverName, int type);
 int tfsUnmount();
+int tfsBatch(tfsBatchOp *ops, int count, int *results, int flags);
+int tfsSubmit(tfsBatchOp *op, uint32_t *id);
+int tfsPoll(uint32_t id, int *result);
+int tfsWait(uint32_t id, int *result);
+int tfsGetFd();
 
 #endif /* CLIENT_H */
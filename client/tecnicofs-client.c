@@ -1,24 +1,46 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "tecnicofs-client-api.h"
 #include "../tecnicofs-api-constants.h"
 
 FILE* inputFile;
 char* serverName;
+int socketType = SOCK_DGRAM;
+int useRings = 0;
 
 static void displayUsage (const char* appName) {
-    printf("Usage: %s inputfile server_socket_name\n", appName);
+    printf("Usage: %s inputfile server_socket_name [dgram|seqpacket|stream|seqpacket-shm|stream-shm]\n", appName);
     exit(EXIT_FAILURE);
 }
 
 static void parseArgs (long argc, char* const argv[]) {
-    if (argc != 3) {
+    if (argc != 3 && argc != 4) {
         fprintf(stderr, "Invalid format:\n");
         displayUsage(argv[0]);
     }
 
     serverName = argv[2];
 
+    if (argc == 4) {
+        if (strcmp(argv[3], "seqpacket") == 0)
+            socketType = SOCK_SEQPACKET;
+        else if (strcmp(argv[3], "stream") == 0)
+            socketType = SOCK_STREAM;
+        else if (strcmp(argv[3], "seqpacket-shm") == 0) {
+            socketType = SOCK_SEQPACKET;
+            useRings = 1;
+        }
+        else if (strcmp(argv[3], "stream-shm") == 0) {
+            socketType = SOCK_STREAM;
+            useRings = 1;
+        }
+        else if (strcmp(argv[3], "dgram") != 0) {
+            fprintf(stderr, "Invalid socket type:\n");
+            displayUsage(argv[0]);
+        }
+    }
+
     inputFile = fopen(argv[1], "r");
 
     if (inputFile== NULL) {
@@ -90,6 +112,15 @@ void *processInput() {
                 else
                   printf("Unable to delete: %s\n", arg1);
                 break;
+            case 'r':
+                if(numTokens != 2)
+                    errorParse();
+                res = tfsDeleteTree(arg1);
+                if (!res)
+                  printf("Deleted tree: %s\n", arg1);
+                else
+                  printf("Unable to delete tree: %s\n", arg1);
+                break;
             case 'm':
                 if(numTokens != 3)
                     errorParse();
@@ -100,14 +131,50 @@ void *processInput() {
                   printf("Unable to move: %s to %s\n", arg1, arg2);
                 break;
             case 'p':
-                if (numTokens != 2)
+                if (numTokens == 2)
+                    res = tfsPrint(arg1);
+                else if (numTokens == 3 && strcmp(arg2, "text") == 0)
+                    res = tfsPrintFormat(arg1, TFS_PRINT_TEXT);
+                else if (numTokens == 3 && strcmp(arg2, "ndjson") == 0)
+                    res = tfsPrintFormat(arg1, TFS_PRINT_NDJSON);
+                else if (numTokens == 3 && strcmp(arg2, "binary") == 0)
+                    res = tfsPrintFormat(arg1, TFS_PRINT_BINARY);
+                else
                     errorParse();
-                res = tfsPrint(arg1);
                 if (!res)
                     printf("Printed the File System Tree to %s\n", arg1);
                 else
                     printf("Unable to print the File System Tree to %s\n", arg1);
                 break;
+            case 's':
+                if (numTokens == 2 || (numTokens == 3 && strcmp(arg2, "text") == 0))
+                    res = tfsStats(arg1, TFS_STATS_TEXT);
+                else if (numTokens == 3 && strcmp(arg2, "json") == 0)
+                    res = tfsStats(arg1, TFS_STATS_JSON);
+                else
+                    errorParse();
+                if (!res)
+                    printf("Printed the server statistics to %s\n", arg1);
+                else
+                    printf("Unable to print the server statistics to %s\n", arg1);
+                break;
+            case 'k':
+                if (numTokens < 2)
+                    errorParse();
+                if (numTokens == 2 && (strcmp(arg1, "on") == 0 || strcmp(arg1, "off") == 0)) {
+                    res = tfsLockProfiling(strcmp(arg1, "on") == 0);
+                    if (!res)
+                        printf("Lock profiling %s\n", arg1);
+                    else
+                        printf("Unable to turn lock profiling %s\n", arg1);
+                    break;
+                }
+                res = tfsLockProfile(arg1, numTokens == 3 ? atoi(arg2) : 0);
+                if (!res)
+                    printf("Printed the lock profile to %s\n", arg1);
+                else
+                    printf("Unable to print the lock profile to %s\n", arg1);
+                break;
             case '#':
                 break;
             default: { /* error */
@@ -123,7 +190,7 @@ int main(int argc, char* argv[]) {
     
     parseArgs(argc, argv);
 
-    if (tfsMount(serverName) == 0)
+    if ((useRings ? tfsMountShm(serverName, socketType) : tfsMountType(serverName, socketType)) == 0)
       printf("Mounted! (socket = %s)\n", serverName);
     else {
       fprintf(stderr, "Unable to mount socket: %s\n", serverName);
@@ -0,0 +1,561 @@
+/*
+ * Load generator: builds a tree of a preset shape on the server, then
+ * runs a mix of operations on it from concurrent clients (threads, or
+ * processes with -P), each with a session of its own, and prints the
+ * throughput and latency percentiles as JSON.
+ *
+ * Clients run closed-loop (each request sent as soon as the previous one
+ * is answered) unless given a rate with -r: requests are then scheduled
+ * at random (Poisson) arrival times, and latency is measured from the
+ * time a request was due, so a slow server is not hidden by clients
+ * that fall behind.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "tecnicofs-client-api.h"
+#include "../tecnicofs-api-constants.h"
+
+#define OP_LOOKUP 0
+#define OP_CREATE 1
+#define OP_DELETE 2
+#define OP_MOVE 3
+#define OPS 4
+
+/* files a client created and has not deleted yet, at most */
+#define MAX_OWNED 4096
+/* creates sent per batch while building the tree */
+#define SETUP_BATCH 256
+/* directory all the load runs under */
+#define LOAD_ROOT "/load"
+
+/* latency histograms, log-linear as the server's (see server/fs/stats.h) */
+#define HIST_SUB_BITS 5
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 36
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 2) * (HIST_SUB_BUCKETS / 2))
+
+typedef struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+} Histogram;
+
+/* share of each operation, in any unit */
+typedef struct mix {
+    const char *name;
+    int weights[OPS];
+} Mix;
+
+/* a tree of depth levels of fanout directories, with files in the leaves */
+typedef struct shape {
+    const char *name;
+    int depth;
+    int fanout;
+    int files;
+} Shape;
+
+/* what a client did, in memory shared by every client */
+typedef struct clientResult {
+    Histogram latency[OPS];
+    uint64_t errors[OPS];
+    uint64_t finished; /* when its last operation was answered */
+} ClientResult;
+
+typedef struct shared {
+    pthread_barrier_t start;
+    ClientResult clients[];
+} Shared;
+
+static const char *opnames[OPS] = { "lookup", "create", "delete", "move" };
+
+static Mix mixes[] = {
+    { "lookup-heavy", { 90, 4, 4, 2 } },
+    { "create-heavy", { 10, 50, 40, 0 } },
+    { "move-heavy", { 20, 10, 10, 60 } },
+    { "mixed", { 50, 20, 15, 15 } },
+};
+
+static Shape shapes[] = {
+    { "flat", 1, 64, 16 },
+    { "wide", 2, 32, 4 },
+    { "deep", 8, 2, 8 },
+    { "balanced", 3, 8, 8 },
+};
+
+/* options */
+static char *serverName;
+static char *typeName = "dgram";
+static int socketType = SOCK_DGRAM;
+static int useRings = 0;
+static int numClients = 4;
+static int useProcesses = 0;
+static Mix mix;
+static Shape *shape = &shapes[3];
+static double duration = 10;
+static long opsPerClient = 0;
+static double rate = 0;
+static unsigned int seed = 1;
+
+static int numLeaves;
+static Shared *shared;
+
+static void displayUsage(const char *appName) {
+    printf("Usage: %s server_socket_name [-t dgram|seqpacket|stream|seqpacket-shm|stream-shm]\n"
+           "       [-c clients] [-P] [-m lookup-heavy|create-heavy|move-heavy|mixed|l:N,c:N,d:N,m:N]\n"
+           "       [-s flat|wide|deep|balanced] [-d seconds | -n ops_per_client] [-r ops_per_second] [-S seed]\n",
+           appName);
+    exit(EXIT_FAILURE);
+}
+
+static uint64_t now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000UL + t.tv_nsec;
+}
+
+static void histAdd(Histogram *h, uint64_t value) {
+    int bucket;
+
+    if (value >= (1UL << HIST_MAX_BITS))
+        value = (1UL << HIST_MAX_BITS) - 1;
+    if (value < HIST_SUB_BUCKETS)
+        bucket = value;
+    else {
+        int shift = 63 - __builtin_clzl(value) - HIST_SUB_BITS + 1;
+        bucket = shift * (HIST_SUB_BUCKETS / 2) + (value >> shift);
+    }
+    h->buckets[bucket]++;
+    h->count++;
+    h->sum += value;
+    if (value > h->max)
+        h->max = value;
+}
+
+static void histMerge(Histogram *into, Histogram *h) {
+    into->count += h->count;
+    into->sum += h->sum;
+    if (h->max > into->max)
+        into->max = h->max;
+    for (int b = 0; b < HIST_BUCKETS; b++)
+        into->buckets[b] += h->buckets[b];
+}
+
+/* largest value of the bucket holding the given fraction of the values */
+static uint64_t histPercentile(Histogram *h, double fraction) {
+    uint64_t rank = ceil(h->count * fraction), seen = 0;
+
+    if (rank == 0)
+        rank = 1;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank) {
+            if (b < HIST_SUB_BUCKETS)
+                return b;
+            int shift = (b - HIST_SUB_BUCKETS) / (HIST_SUB_BUCKETS / 2) + 1;
+            uint64_t limit = ((uint64_t) (b - shift * (HIST_SUB_BUCKETS / 2)) << shift) + (1UL << shift) - 1;
+            return limit < h->max ? limit : h->max;
+        }
+    }
+    return h->max;
+}
+
+static void printLatency(Histogram *h) {
+    printf("{\"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}",
+           h->count ? h->sum / (double) h->count / 1000 : 0, histPercentile(h, 0.5) / 1000.0,
+           histPercentile(h, 0.9) / 1000.0, histPercentile(h, 0.99) / 1000.0,
+           histPercentile(h, 0.999) / 1000.0, h->max / 1000.0);
+}
+
+/* parses "l:N,c:N,d:N,m:N", any of them left out meaning 0 */
+static int parseMix(char *spec) {
+    for (int i = 0; i < (int) (sizeof(mixes) / sizeof(mixes[0])); i++) {
+        if (strcmp(spec, mixes[i].name) == 0) {
+            mix = mixes[i];
+            return 0;
+        }
+    }
+
+    int total = 0;
+    char op;
+    int weight, used;
+    mix.name = spec;
+    memset(mix.weights, 0, sizeof(mix.weights));
+    while (sscanf(spec, "%c:%d%n", &op, &weight, &used) == 2 && weight >= 0) {
+        char *ops = "lcdm", *at = strchr(ops, op);
+        if (at == NULL || op == '\0')
+            return -1;
+        mix.weights[at - ops] = weight;
+        total += weight;
+        spec += used;
+        if (*spec == '\0')
+            return total > 0 ? 0 : -1;
+        if (*spec++ != ',')
+            return -1;
+    }
+    return -1;
+}
+
+static void parseArgs(int argc, char *argv[]) {
+    int opt;
+
+    mix = mixes[3];
+    while ((opt = getopt(argc, argv, "t:c:Pm:s:d:n:r:S:")) != -1) {
+        switch (opt) {
+            case 't':
+                typeName = optarg;
+                useRings = strcmp(optarg, "seqpacket-shm") == 0 || strcmp(optarg, "stream-shm") == 0;
+                if (strcmp(optarg, "seqpacket") == 0 || strcmp(optarg, "seqpacket-shm") == 0)
+                    socketType = SOCK_SEQPACKET;
+                else if (strcmp(optarg, "stream") == 0 || strcmp(optarg, "stream-shm") == 0)
+                    socketType = SOCK_STREAM;
+                else if (strcmp(optarg, "dgram") == 0)
+                    socketType = SOCK_DGRAM;
+                else
+                    displayUsage(argv[0]);
+                break;
+            case 'c':
+                if ((numClients = atoi(optarg)) <= 0)
+                    displayUsage(argv[0]);
+                break;
+            case 'P':
+                useProcesses = 1;
+                break;
+            case 'm':
+                if (parseMix(optarg) < 0) {
+                    fprintf(stderr, "Error: invalid operation mix %s\n", optarg);
+                    displayUsage(argv[0]);
+                }
+                break;
+            case 's':
+                shape = NULL;
+                for (int i = 0; i < (int) (sizeof(shapes) / sizeof(shapes[0])); i++) {
+                    if (strcmp(optarg, shapes[i].name) == 0)
+                        shape = &shapes[i];
+                }
+                if (shape == NULL)
+                    displayUsage(argv[0]);
+                break;
+            case 'd':
+                if ((duration = atof(optarg)) <= 0)
+                    displayUsage(argv[0]);
+                break;
+            case 'n':
+                if ((opsPerClient = atol(optarg)) <= 0)
+                    displayUsage(argv[0]);
+                break;
+            case 'r':
+                if ((rate = atof(optarg)) <= 0)
+                    displayUsage(argv[0]);
+                break;
+            case 'S':
+                seed = atoi(optarg);
+                break;
+            default:
+                displayUsage(argv[0]);
+        }
+    }
+    if (argc - optind != 1)
+        displayUsage(argv[0]);
+    serverName = argv[optind];
+}
+
+static int mount() {
+    return useRings ? tfsMountShm(serverName, socketType) : tfsMountType(serverName, socketType);
+}
+
+/* path of the index-th directory of a level: the index written in base fanout */
+static void dirPath(char *path, int index, int depth) {
+    int len = sprintf(path, LOAD_ROOT);
+    int digits[depth];
+
+    for (int level = depth - 1; level >= 0; level--) {
+        digits[level] = index % shape->fanout;
+        index /= shape->fanout;
+    }
+    for (int level = 0; level < depth; level++)
+        len += sprintf(path + len, "/d%d", digits[level]);
+}
+
+static void leafPath(char *path, int leaf) {
+    dirPath(path, leaf, shape->depth);
+}
+
+/*
+ * Sends the creates queued in ops, exiting if the batch is not served.
+ * The server does not tell why a create failed, so one that fails is
+ * taken to exist already.
+ */
+static void setupFlush(tfsBatchOp *ops, int *count) {
+    int results[SETUP_BATCH];
+
+    if (*count == 0)
+        return;
+    int done = tfsBatch(ops, *count, results, 0);
+    for (int i = 0; i < *count; i++) {
+        if (done < 0 || i >= done) {
+            fprintf(stderr, "Error: unable to create %s\n", ops[i].path);
+            exit(EXIT_FAILURE);
+        }
+        free(ops[i].path);
+    }
+    *count = 0;
+}
+
+static void setupCreate(tfsBatchOp *ops, int *count, char nodeType, char *path) {
+    ops[*count] = (tfsBatchOp) { .op = 'c', .nodeType = nodeType, .path = strdup(path), .path2 = NULL };
+    if (ops[*count].path == NULL) {
+        fprintf(stderr, "Error: allocating the tree\n");
+        exit(EXIT_FAILURE);
+    }
+    if (++*count == SETUP_BATCH)
+        setupFlush(ops, count);
+}
+
+/*
+ * Creates the tree of the shape, level by level, with its files in the
+ * leaves. What already exists (from a previous run) is kept.
+ */
+static void setupTree() {
+    tfsBatchOp ops[SETUP_BATCH];
+    char path[MAX_FILE_NAME];
+    int count = 0, dirs = 1;
+
+    setupCreate(ops, &count, 'd', LOAD_ROOT);
+    for (int level = 1; level <= shape->depth; level++) {
+        dirs *= shape->fanout;
+        for (int dir = 0; dir < dirs; dir++) {
+            dirPath(path, dir, level);
+            setupCreate(ops, &count, 'd', path);
+        }
+        /* parents go out before their entries */
+        setupFlush(ops, &count);
+    }
+    numLeaves = dirs;
+    for (int leaf = 0; leaf < numLeaves; leaf++) {
+        leafPath(path, leaf);
+        int len = strlen(path);
+        for (int file = 0; file < shape->files; file++) {
+            snprintf(path + len, sizeof(path) - len, "/f%d", file);
+            setupCreate(ops, &count, 'f', path);
+        }
+    }
+    setupFlush(ops, &count);
+}
+
+/*
+ * A client: runs operations of the mix until the time or the number of
+ * operations is up. Files it creates get names of its own, so creates,
+ * deletes and moves of different clients never collide.
+ */
+static void *clientThread(void *arg) {
+    int self = (int) (intptr_t) arg;
+    ClientResult *result = &shared->clients[self];
+    unsigned int state = seed * 7919 + self;
+    int owned[MAX_OWNED], ownedLeaf[MAX_OWNED], numOwned = 0, nextName = 0;
+    char path[MAX_FILE_NAME], path2[MAX_FILE_NAME];
+    int total = 0;
+
+    for (int op = 0; op < OPS; op++)
+        total += mix.weights[op];
+    if (mount() != 0) {
+        fprintf(stderr, "Error: client %d unable to mount %s\n", self, serverName);
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_barrier_wait(&shared->start);
+    uint64_t start = now(), due = start;
+    uint64_t end = start + (uint64_t) (duration * 1e9);
+    double interval = rate > 0 ? 1e9 * numClients / rate : 0;
+
+    for (long n = 0; opsPerClient > 0 ? n < opsPerClient : due < end; n++) {
+        if (interval > 0) {
+            /* exponential gaps make Poisson arrivals */
+            due += (uint64_t) (-log(1.0 - rand_r(&state) / (RAND_MAX + 1.0)) * interval);
+            uint64_t t = now();
+            if (due > t) {
+                struct timespec wake = { due / 1000000000UL, due % 1000000000UL };
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL);
+            }
+        }
+        else
+            due = now();
+
+        int pick = rand_r(&state) % total, op = 0;
+        while (pick >= mix.weights[op])
+            pick -= mix.weights[op++];
+        /* deletes and moves need a file of the client's own, creates room for one */
+        if ((op == OP_DELETE || op == OP_MOVE) && numOwned == 0)
+            op = OP_CREATE;
+        else if (op == OP_CREATE && numOwned == MAX_OWNED)
+            op = OP_DELETE;
+
+        int leaf = rand_r(&state) % numLeaves, res, which = 0;
+        leafPath(path, leaf);
+        int len = strlen(path);
+        switch (op) {
+            case OP_LOOKUP:
+                snprintf(path + len, sizeof(path) - len, "/f%d", rand_r(&state) % shape->files);
+                res = tfsLookup(path) < 0;
+                break;
+            case OP_CREATE:
+                snprintf(path + len, sizeof(path) - len, "/c%d-%d", self, nextName);
+                res = tfsCreate(path, 'f');
+                if (res == 0) {
+                    owned[numOwned] = nextName++;
+                    ownedLeaf[numOwned++] = leaf;
+                }
+                break;
+            case OP_DELETE:
+            case OP_MOVE:
+                which = rand_r(&state) % numOwned;
+                leafPath(path, ownedLeaf[which]);
+                len = strlen(path);
+                snprintf(path + len, sizeof(path) - len, "/c%d-%d", self, owned[which]);
+                if (op == OP_DELETE) {
+                    res = tfsDelete(path);
+                    if (res == 0) {
+                        owned[which] = owned[--numOwned];
+                        ownedLeaf[which] = ownedLeaf[numOwned];
+                    }
+                }
+                else {
+                    leafPath(path2, leaf);
+                    len = strlen(path2);
+                    snprintf(path2 + len, sizeof(path2) - len, "/c%d-%d", self, owned[which]);
+                    /* moving within the same directory is refused */
+                    res = leaf == ownedLeaf[which] ? tfsLookup(path) < 0 : tfsMove(path, path2);
+                    if (res == 0)
+                        ownedLeaf[which] = leaf;
+                }
+                break;
+        }
+        histAdd(&result->latency[op], now() - due);
+        if (res != 0)
+            result->errors[op]++;
+    }
+    result->finished = now();
+
+    /* leave the tree as it was */
+    for (int i = 0; i < numOwned; i++) {
+        leafPath(path, ownedLeaf[i]);
+        int len = strlen(path);
+        snprintf(path + len, sizeof(path) - len, "/c%d-%d", self, owned[i]);
+        tfsDelete(path);
+    }
+    tfsUnmount();
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    parseArgs(argc, argv);
+
+    size_t size = sizeof(Shared) + numClients * sizeof(ClientResult);
+    shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        fprintf(stderr, "Error: allocating the results\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (mount() != 0) {
+        fprintf(stderr, "Unable to mount socket: %s\n", serverName);
+        exit(EXIT_FAILURE);
+    }
+    uint64_t setupStart = now();
+    setupTree();
+    double setupTime = (now() - setupStart) / 1e9;
+    tfsUnmount();
+
+    /* the main thread releases the clients once they are all mounted */
+    pthread_barrierattr_t attr;
+    pthread_barrierattr_init(&attr);
+    pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_barrier_init(&shared->start, &attr, numClients + 1);
+
+    pthread_t threads[numClients];
+    pid_t pids[numClients];
+    for (int i = 0; i < numClients; i++) {
+        if (useProcesses) {
+            if ((pids[i] = fork()) == 0) {
+                clientThread((void *) (intptr_t) i);
+                exit(EXIT_SUCCESS);
+            }
+            if (pids[i] < 0) {
+                fprintf(stderr, "Error: unable to start client %d\n", i);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (pthread_create(&threads[i], NULL, clientThread, (void *) (intptr_t) i) != 0) {
+            fprintf(stderr, "Error: unable to start client %d\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_barrier_wait(&shared->start);
+    uint64_t start = now();
+    for (int i = 0; i < numClients; i++) {
+        int status;
+        if (useProcesses ? waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0
+                         : pthread_join(threads[i], NULL) != 0) {
+            fprintf(stderr, "Error: client %d failed\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    /* the deletes cleaning up after the clients are left out */
+    uint64_t finished = start;
+    for (int i = 0; i < numClients; i++) {
+        if (shared->clients[i].finished > finished)
+            finished = shared->clients[i].finished;
+    }
+    double elapsed = (finished - start) / 1e9;
+
+    static Histogram byOp[OPS], all;
+    uint64_t errors[OPS] = { 0 }, totalErrors = 0;
+    for (int i = 0; i < numClients; i++) {
+        for (int op = 0; op < OPS; op++) {
+            histMerge(&byOp[op], &shared->clients[i].latency[op]);
+            errors[op] += shared->clients[i].errors[op];
+        }
+    }
+    for (int op = 0; op < OPS; op++) {
+        histMerge(&all, &byOp[op]);
+        totalErrors += errors[op];
+    }
+
+    printf("{\n");
+    printf("  \"server\": \"%s\", \"socket\": \"%s\", \"clients\": %d, \"mode\": \"%s\",\n", serverName, typeName,
+           numClients, useProcesses ? "processes" : "threads");
+    printf("  \"mix\": \"%s\", \"weights\": {\"lookup\": %d, \"create\": %d, \"delete\": %d, \"move\": %d},\n",
+           mix.name, mix.weights[OP_LOOKUP], mix.weights[OP_CREATE], mix.weights[OP_DELETE], mix.weights[OP_MOVE]);
+    printf("  \"shape\": \"%s\", \"depth\": %d, \"fanout\": %d, \"files_per_leaf\": %d, \"setup_s\": %.3f,\n",
+           shape->name, shape->depth, shape->fanout, shape->files, setupTime);
+    printf("  \"rate\": %.1f, \"seconds\": %.3f, \"ops\": %lu, \"errors\": %lu,\n", rate, elapsed, all.count,
+           totalErrors);
+    printf("  \"throughput\": %.1f,\n", all.count / elapsed);
+    printf("  \"latency_us\": ");
+    printLatency(&all);
+    printf(",\n  \"by_op\": {\n");
+    int first = 1;
+    for (int op = 0; op < OPS; op++) {
+        if (byOp[op].count == 0)
+            continue;
+        printf("%s    \"%s\": {\"ops\": %lu, \"errors\": %lu, \"latency_us\": ", first ? "" : ",\n", opnames[op],
+               byOp[op].count, errors[op]);
+        printLatency(&byOp[op]);
+        printf("}");
+        first = 0;
+    }
+    printf("\n  }\n}\n");
+
+    munmap(shared, size);
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,127 @@
+/*
+ * Measures how long dumping the tree takes as it grows, in each format,
+ * against the recursive printer it replaced (one fprintf per node), and
+ * dumps a chain of directories deeper than any stack would allow.
+ * Build with `make bench` (the artificial delay is compiled out).
+ *
+ * Usage: ./bench/dump_bench [max_nodes] [chain_depth]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../fs/state.h"
+
+/* entries per directory, one in DIR_EVERY of them a directory */
+#define FANOUT 16
+#define DIR_EVERY 4
+
+static double elapsed(struct timespec *from, struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1000000000.0;
+}
+
+/*
+ * The printer inode_dump_tree replaced, for reference.
+ */
+static void print_recursive(FILE *fp, int inumber, char *name) {
+    fprintf(fp, "%s\n", name);
+    if (inode_at(inumber)->nodeType != T_DIRECTORY)
+        return;
+    DirTable *table = dir_table(inode_dir(inode_at(inumber)));
+    for (int i = 0; i < table->capacity; i++) {
+        if (table->entries[i].inumber != FREE_INODE) {
+            char path[MAX_FILE_NAME];
+            snprintf(path, sizeof(path), "%s/%s", name, table->entries[i].name);
+            print_recursive(fp, table->entries[i].inumber, path);
+        }
+    }
+}
+
+/*
+ * Adds a node to a directory, exiting if it cannot.
+ */
+static int add_node(int parent, type nodeType, char *name) {
+    int inumber = inode_create(nodeType);
+    if (inumber == FAIL || dir_add_entry(parent, inumber, name) == FAIL) {
+        fprintf(stderr, "Error: unable to add %s\n", name);
+        exit(EXIT_FAILURE);
+    }
+    return inumber;
+}
+
+int main(int argc, char *argv[]) {
+    long max_nodes = argc > 1 ? atol(argv[1]) : 1000000;
+    int chain = argc > 2 ? atoi(argv[2]) : 10000;
+    char *formats[] = { "text", "ndjson", "binary" };
+    struct timespec t0, t1;
+    char name[MAX_FILE_NAME];
+
+    if (max_nodes <= 0 || chain <= 0) {
+        fprintf(stderr, "Usage: %s [max_nodes] [chain_depth]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    int out = open("/dev/null", O_WRONLY);
+    FILE *fp = fopen("/dev/null", "w");
+    int *dirs = malloc(sizeof(int) * (max_nodes / DIR_EVERY + 2));
+    if (out < 0 || fp == NULL || dirs == NULL) {
+        fprintf(stderr, "Error: unable to set up the benchmark.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    inode_table_init();
+    dirs[0] = inode_create(T_DIRECTORY);
+    long ndirs = 1, nodes = 1;
+
+    printf("%10s %12s", "nodes", "recursive");
+    for (int f = DUMP_TEXT; f <= DUMP_BINARY; f++)
+        printf(" %12s", formats[f]);
+    printf("   (ms)\n");
+
+    for (long size = 1000; size <= max_nodes; size *= 10) {
+        /* grow the tree breadth first to size nodes */
+        for (; nodes < size; nodes++) {
+            int parent = dirs[(nodes - 1) / FANOUT];
+            snprintf(name, sizeof(name), "n%ld", nodes);
+            if (nodes % DIR_EVERY == 0)
+                dirs[ndirs++] = add_node(parent, T_DIRECTORY, name);
+            else
+                add_node(parent, T_FILE, name);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        print_recursive(fp, FS_ROOT, "");
+        fflush(fp);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        printf("%10ld %12.1f", nodes, elapsed(&t0, &t1) * 1000);
+
+        for (int f = DUMP_TEXT; f <= DUMP_BINARY; f++) {
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            long dumped = inode_dump_tree(out, f);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            if (dumped != nodes) {
+                fprintf(stderr, "Error: dumped %ld of %ld nodes\n", dumped, nodes);
+                exit(EXIT_FAILURE);
+            }
+            printf(" %12.1f", elapsed(&t0, &t1) * 1000);
+        }
+        printf("\n");
+    }
+
+    /* a chain the recursive printer would truncate, and that would
+       overflow its stack if long enough */
+    int parent = FS_ROOT;
+    for (int depth = 0; depth < chain; depth++)
+        parent = add_node(parent, T_DIRECTORY, depth == 0 ? "chain" : "d");
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    long dumped = inode_dump_tree(out, DUMP_TEXT);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("\nchain of %d directories: %ld nodes dumped as text in %.1f ms\n", chain, dumped,
+           elapsed(&t0, &t1) * 1000);
+
+    inode_table_destroy();
+    free(dirs);
+    fclose(fp);
+    close(out);
+    return 0;
+}
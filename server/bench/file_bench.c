@@ -0,0 +1,92 @@
+/*
+ * Measures file contents throughput for several file sizes: appending
+ * writes, reads that copy the data and reads that only describe it
+ * (what the server sends from). Build with `make bench`.
+ *
+ * Usage: ./bench/file_bench [block_size] [total_mb]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../fs/filedata.h"
+
+#define MAX_IOV 64
+
+static double elapsed(struct timespec *from, struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1000000000.0;
+}
+
+int main(int argc, char *argv[]) {
+    int block = argc > 1 ? atoi(argv[1]) : 65536;
+    long total = (argc > 2 ? atol(argv[2]) : 256) << 20;
+    long sizes[] = { 4L << 10, 64L << 10, 1L << 20, 16L << 20, 64L << 20 };
+    struct timespec t0, t1;
+    struct iovec iov[MAX_IOV];
+
+    if (block <= 0 || total <= 0) {
+        fprintf(stderr, "Usage: %s [block_size] [total_mb]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    char *buf = malloc(block);
+    if (buf == NULL) {
+        fprintf(stderr, "Error: allocating the buffer.\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(buf, 'x', block);
+
+    printf("blocks of %d bytes, about %ld MB moved per size\n", block, total >> 20);
+    printf("%10s %14s %14s %14s\n", "file size", "write MB/s", "read MB/s", "read_iov MB/s");
+
+    for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        long size = sizes[s];
+        int rounds = total / size > 0 ? total / size : 1;
+        double mb = (double) size * rounds / (1 << 20);
+        unsigned long check = 0;
+        FileData *file = NULL;
+
+        /* write: a fresh file per round, built by appending */
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int r = 0; r < rounds; r++) {
+            if (file != NULL)
+                file_destroy(file);
+            file = file_create();
+            for (long pos = 0; pos < size; pos += block)
+                file_write(file, pos, buf, size - pos < block ? size - pos : block);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        double write_secs = elapsed(&t0, &t1);
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int r = 0; r < rounds; r++)
+            for (long pos = 0; pos < size; pos += block)
+                check += file_read(file, pos, buf, block);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        double read_secs = elapsed(&t0, &t1);
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int r = 0; r < rounds; r++) {
+            for (long pos = 0; pos < size; ) {
+                int niov;
+                int n = file_read_iov(file, pos, block, iov, MAX_IOV, &niov);
+                /* touch the first byte of each piece, as a send would */
+                for (int i = 0; i < niov; i++)
+                    check += *(char *) iov[i].iov_base;
+                pos += n;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        double iov_secs = elapsed(&t0, &t1);
+
+        if (file_size(file) != size) {
+            fprintf(stderr, "Error: file has %ld bytes, expected %ld\n", file_size(file), size);
+            exit(EXIT_FAILURE);
+        }
+        printf("%10ld %14.0f %14.0f %14.0f\n", size, mb / write_secs, mb / read_secs, mb / iov_secs);
+        file_destroy(file);
+        if (check == 0)
+            printf("(no data read)\n");
+    }
+    free(buf);
+    return 0;
+}
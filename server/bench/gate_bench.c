@@ -0,0 +1,114 @@
+/*
+ * Measures what marking a change as finished costs as threads are added:
+ * the global mutex and condition variable every operation signalled
+ * for print_tecnicofs_tree before, against entering and leaving the
+ * quiescence gate. A closer takes the gate every millisecond meanwhile,
+ * as prints and checkpoints do. Build with `make bench`.
+ *
+ * Usage: ./bench/gate_bench [max_threads] [ops_per_thread]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "../fs/gate.h"
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int terminated = 0;
+static volatile int running;
+static long ops;
+
+static double elapsed(struct timespec *from, struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1000000000.0;
+}
+
+/*
+ * Stands for the work of an operation.
+ */
+static void work(volatile unsigned long *sink) {
+    for (int i = 0; i < 64; i++)
+        *sink += i;
+}
+
+/*
+ * What every operation did before: terminate().
+ */
+static void *before(void *arg) {
+    volatile unsigned long sink = 0;
+    for (long i = 0; i < ops; i++) {
+        work(&sink);
+        pthread_mutex_lock(&mutex);
+        terminated = 1;
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&mutex);
+    }
+    return NULL;
+}
+
+static void *after(void *arg) {
+    volatile unsigned long sink = 0;
+    for (long i = 0; i < ops; i++) {
+        gate_enter();
+        work(&sink);
+        gate_exit();
+    }
+    return NULL;
+}
+
+/*
+ * Takes the gate every millisecond, as print_tecnicofs_tree does.
+ */
+static void *closer(void *arg) {
+    long *closes = arg;
+    while (running) {
+        usleep(1000);
+        gate_close();
+        gate_open();
+        (*closes)++;
+    }
+    return NULL;
+}
+
+static double run(int nthreads, void *(*body)(void *)) {
+    pthread_t threads[nthreads];
+    struct timespec t0, t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, body, NULL) != 0) {
+            fprintf(stderr, "Error: unable to create thread.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return ops * nthreads / elapsed(&t0, &t1);
+}
+
+int main(int argc, char *argv[]) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 32;
+    ops = argc > 2 ? atol(argv[2]) : 1000000;
+
+    if (max_threads <= 0 || ops <= 0) {
+        fprintf(stderr, "Usage: %s [max_threads] [ops_per_thread]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    printf("%d CPUs online\n", (int) sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%8s %16s %16s %10s\n", "threads", "terminate ops/s", "gate ops/s", "closes");
+
+    for (int nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+        double old = run(nthreads, before);
+        long closes = 0;
+        pthread_t closing;
+        running = 1;
+        pthread_create(&closing, NULL, closer, &closes);
+        double new = run(nthreads, after);
+        running = 0;
+        pthread_join(closing, NULL);
+        printf("%8d %16.0f %16.0f %10ld\n", nthreads, old, new, closes);
+    }
+    return 0;
+}
@@ -0,0 +1,97 @@
+/*
+ * Measures inode_create throughput while the i-node table grows, and how
+ * create/delete churn scales with the number of threads.
+ * Build with `make bench` (the artificial delay is compiled out).
+ *
+ * Usage: ./bench/inode_bench [total_inodes] [report_every] [max_threads]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../fs/state.h"
+
+#define CHURN_OPS 2000000
+#define CHURN_LIVE 256
+
+static double elapsed(struct timespec *from, struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1000000000.0;
+}
+
+/*
+ * Creates and deletes i-nodes, keeping CHURN_LIVE of them alive.
+ */
+static void *churn(void *arg) {
+    int ops = *((int *) arg);
+    int live[CHURN_LIVE];
+
+    for (int i = 0; i < CHURN_LIVE; i++) {
+        live[i] = inode_create(T_FILE);
+    }
+    for (int i = 0; i < ops; i++) {
+        int slot = i % CHURN_LIVE;
+        inode_delete(live[slot]);
+        if ((live[slot] = inode_create(T_FILE)) == FAIL) {
+            fprintf(stderr, "Error: inode_create failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < CHURN_LIVE; i++) {
+        inode_delete(live[i]);
+    }
+    inode_cache_flush();
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int total = argc > 1 ? atoi(argv[1]) : 1000000;
+    int step = argc > 2 ? atoi(argv[2]) : 100000;
+    int max_threads = argc > 3 ? atoi(argv[3]) : 8;
+    struct timespec t0, t1;
+
+    if (total <= 0 || step <= 0 || max_threads <= 0) {
+        fprintf(stderr, "Usage: %s [total_inodes] [report_every] [max_threads]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    inode_table_init();
+    printf("%12s %12s %14s\n", "inodes", "ns/create", "creates/s");
+
+    for (int done = 0; done < total; done += step) {
+        int n = (total - done < step) ? total - done : step;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int i = 0; i < n; i++) {
+            if (inode_create(T_FILE) == FAIL) {
+                fprintf(stderr, "Error: inode_create failed after %d i-nodes\n", done + i);
+                exit(EXIT_FAILURE);
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        double secs = elapsed(&t0, &t1);
+        printf("%12d %12.1f %14.0f\n", done + n, secs * 1e9 / n, n / secs);
+    }
+
+    inode_table_destroy();
+    inode_table_init();
+    printf("\n%12s %14s\n", "threads", "create+del/s");
+
+    for (int nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+        pthread_t threads[nthreads];
+        int ops = CHURN_OPS / nthreads;
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int i = 0; i < nthreads; i++) {
+            if (pthread_create(&threads[i], NULL, churn, &ops) != 0) {
+                fprintf(stderr, "Error: unable to create thread.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (int i = 0; i < nthreads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        printf("%12d %14.0f\n", nthreads, (double) ops * nthreads / elapsed(&t0, &t1));
+    }
+
+    inode_table_destroy();
+    return 0;
+}
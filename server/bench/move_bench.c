@@ -0,0 +1,222 @@
+/*
+ * Stress test and benchmark of move. Threads move files and directories
+ * of their own back and forth between shared directories, at different
+ * depths and in every direction, so their moves cross each other's paths;
+ * a watchdog fails the run if no move finishes for a while, and the tree
+ * is checked at the end. Then each thread renames within a directory of
+ * its own, to show unrelated moves scale with threads.
+ * Build with `make bench` (the artificial delay is compiled out).
+ *
+ * Usage: ./bench/move_bench [seconds] [max_threads] [dirs]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "../fs/operations.h"
+
+/* nodes each thread moves around in the shared directories */
+#define OWNED 8
+/* seconds without any move finishing taken for a deadlock */
+#define STALL_SECONDS 5
+
+typedef struct mover {
+    int self;
+    int shared; /* move between the shared directories, or rename in a private one */
+    unsigned int seed;
+    int where[OWNED]; /* shared directory each node is in */
+    long moves;
+    long failed;
+} Mover;
+
+static int ndirs;
+static char **dirs; /* /dK and /dK/s */
+static volatile int running;
+static int finished; /* movers that saw running cleared */
+
+/*
+ * Path of a node a thread owns: one in OWNED is a directory, with a file.
+ */
+static void node_path(char *path, Mover *m, int node, int dir) {
+    snprintf(path, MAX_FILE_NAME, "%s/%c%d-%d", dirs[dir], node == 0 ? 'D' : 'f', m->self, node);
+}
+
+static void *mover(void *arg) {
+    Mover *m = arg;
+    char from[MAX_FILE_NAME], to[MAX_FILE_NAME];
+
+    while (running) {
+        if (m->shared) {
+            int node = rand_r(&m->seed) % OWNED;
+            int dir = rand_r(&m->seed) % (ndirs - 1);
+            if (dir >= m->where[node])
+                dir++;
+            node_path(from, m, node, m->where[node]);
+            node_path(to, m, node, dir);
+            if (move(from, to) == SUCCESS)
+                m->where[node] = dir;
+            else
+                m->failed++;
+        }
+        else {
+            snprintf(from, MAX_FILE_NAME, "/p%d/%c", m->self, m->moves % 2 ? 'b' : 'a');
+            snprintf(to, MAX_FILE_NAME, "/p%d/%c", m->self, m->moves % 2 ? 'a' : 'b');
+            if (move(from, to) != SUCCESS)
+                m->failed++;
+        }
+        __atomic_store_n(&m->moves, m->moves + 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&finished, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/*
+ * Runs nthreads movers for seconds, watching that moves keep finishing.
+ * Returns: moves per second
+ */
+static double run(int nthreads, int shared, int seconds) {
+    pthread_t threads[nthreads];
+    Mover movers[nthreads];
+    char path[MAX_FILE_NAME];
+    struct timespec t0, t1;
+    long last = -1, total = 0;
+    int stalled = 0;
+
+    for (int i = 0; i < nthreads; i++) {
+        movers[i] = (Mover) { .self = i, .shared = shared, .seed = i + 1 };
+        if (shared) {
+            for (int node = 0; node < OWNED; node++) {
+                movers[i].where[node] = (i + node) % ndirs;
+                node_path(path, &movers[i], node, movers[i].where[node]);
+                create(path, node == 0 ? T_DIRECTORY : T_FILE);
+            }
+            node_path(path, &movers[i], 0, movers[i].where[0]);
+            strcat(path, "/f");
+            create(path, T_FILE);
+        }
+        else {
+            snprintf(path, MAX_FILE_NAME, "/p%d", i);
+            create(path, T_DIRECTORY);
+            strcat(path, "/a");
+            create(path, T_FILE);
+        }
+    }
+
+    running = 1;
+    finished = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, mover, &movers[i]) != 0) {
+            fprintf(stderr, "Error: unable to create thread.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    /* watch until every mover stops, as it is stuck in a move if not */
+    for (int s = 0; __atomic_load_n(&finished, __ATOMIC_ACQUIRE) < nthreads; s++) {
+        if (s == seconds)
+            running = 0;
+        sleep(1);
+        total = 0;
+        for (int i = 0; i < nthreads; i++)
+            total += __atomic_load_n(&movers[i].moves, __ATOMIC_RELAXED);
+        stalled = total == last ? stalled + 1 : 0;
+        if (stalled == STALL_SECONDS) {
+            fprintf(stderr, "Error: deadlock, no move finished in %d s (%ld moves)\n", STALL_SECONDS, total);
+            exit(EXIT_FAILURE);
+        }
+        last = total;
+    }
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    /* every node is where its last move left it, and nowhere else */
+    total = 0;
+    for (int i = 0; i < nthreads; i++) {
+        total += movers[i].moves;
+        if (movers[i].failed > 0) {
+            fprintf(stderr, "Error: %ld moves of thread %d failed\n", movers[i].failed, i);
+            exit(EXIT_FAILURE);
+        }
+        for (int node = 0; shared && node < OWNED; node++) {
+            for (int dir = 0; dir < ndirs; dir++) {
+                node_path(path, &movers[i], node, dir);
+                if ((search(path, LOOKUP) != FAIL) != (dir == movers[i].where[node])) {
+                    fprintf(stderr, "Error: %s %s\n", path, dir == movers[i].where[node] ? "lost" : "duplicated");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            node_path(path, &movers[i], node, movers[i].where[node]);
+            if (node == 0) {
+                strcat(path, "/f");
+                if (search(path, LOOKUP) == FAIL) {
+                    fprintf(stderr, "Error: %s lost\n", path);
+                    exit(EXIT_FAILURE);
+                }
+                delete(path);
+                path[strlen(path) - 2] = '\0';
+            }
+            delete(path);
+        }
+        if (!shared) {
+            snprintf(path, MAX_FILE_NAME, "/p%d/%c", i, movers[i].moves % 2 ? 'b' : 'a');
+            delete(path);
+            snprintf(path, MAX_FILE_NAME, "/p%d", i);
+            delete(path);
+        }
+    }
+    return total / ((t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1000000000.0);
+}
+
+int main(int argc, char *argv[]) {
+    int seconds = argc > 1 ? atoi(argv[1]) : 3;
+    int max_threads = argc > 2 ? atoi(argv[2]) : 8;
+    int top = argc > 3 ? atoi(argv[3]) : 4;
+    char path[MAX_FILE_NAME];
+
+    if (seconds <= 0 || max_threads <= 0 || top <= 0) {
+        fprintf(stderr, "Usage: %s [seconds] [max_threads] [dirs]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    init_fs(NULL);
+    ndirs = 2 * top;
+    dirs = malloc(sizeof(char *) * ndirs);
+    if (dirs == NULL) {
+        fprintf(stderr, "Error: unable to set up the benchmark.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < top; i++) {
+        dirs[2 * i] = malloc(MAX_FILE_NAME);
+        dirs[2 * i + 1] = malloc(MAX_FILE_NAME);
+        if (dirs[2 * i] == NULL || dirs[2 * i + 1] == NULL) {
+            fprintf(stderr, "Error: unable to set up the benchmark.\n");
+            exit(EXIT_FAILURE);
+        }
+        snprintf(dirs[2 * i], MAX_FILE_NAME, "/d%d", i);
+        snprintf(dirs[2 * i + 1], MAX_FILE_NAME, "/d%d/s", i);
+        create(dirs[2 * i], T_DIRECTORY);
+        create(dirs[2 * i + 1], T_DIRECTORY);
+    }
+
+    printf("%8s %16s %16s\n", "threads", "crossing/s", "unrelated/s");
+    for (int nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+        double crossing = run(nthreads, 1, seconds);
+        double unrelated = run(nthreads, 0, seconds);
+        printf("%8d %16.0f %16.0f\n", nthreads, crossing, unrelated);
+    }
+
+    for (int i = top - 1; i >= 0; i--) {
+        snprintf(path, MAX_FILE_NAME, "/d%d/s", i);
+        delete(path);
+        snprintf(path, MAX_FILE_NAME, "/d%d", i);
+        delete(path);
+        free(dirs[2 * i]);
+        free(dirs[2 * i + 1]);
+    }
+    free(dirs);
+    destroy_fs();
+    return 0;
+}
@@ -0,0 +1,116 @@
+/*
+ * Measures CircularQueue throughput with producers and consumers pinned
+ * to separate CPUs (round-robin when there are fewer CPUs than threads).
+ * Build with `make bench`.
+ *
+ * Usage: ./bench/queue_bench [items] [capacity] [max_pairs] [blocking(0|1)]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include "../circularqueue/circularqueue.h"
+
+typedef struct benchThread {
+    CircularQueue *queue;
+    long items;
+    int cpu;
+    int blocking;
+    unsigned long sum; /* consumers: checksum of what they took */
+} BenchThread;
+
+static long ncpus;
+
+static double elapsed(struct timespec *from, struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1000000000.0;
+}
+
+static void pin(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu % ncpus, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static void *producer(void *arg) {
+    BenchThread *t = arg;
+    pin(t->cpu);
+    for (long i = 1; i <= t->items; i++) {
+        void *element = (void *) (uintptr_t) i;
+        if (t->blocking)
+            enQueueWait(t->queue, element);
+        else
+            while (enQueue(t->queue, element) == FAIL)
+                sched_yield();
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    BenchThread *t = arg;
+    pin(t->cpu);
+    for (long i = 0; i < t->items; i++) {
+        void *element;
+        if (t->blocking)
+            element = deQueueWait(t->queue);
+        else
+            while ((element = deQueue(t->queue)) == NULL)
+                sched_yield();
+        t->sum += (uintptr_t) element;
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    long items = argc > 1 ? atol(argv[1]) : 4000000;
+    int capacity = argc > 2 ? atoi(argv[2]) : 1024;
+    int max_pairs = argc > 3 ? atoi(argv[3]) : 4;
+    int blocking = argc > 4 ? atoi(argv[4]) : 1;
+    struct timespec t0, t1;
+
+    if (items <= 0 || capacity <= 0 || max_pairs <= 0) {
+        fprintf(stderr, "Usage: %s [items] [capacity] [max_pairs] [blocking(0|1)]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("%ld CPUs, capacity %d, %s calls\n", ncpus, capacity, blocking ? "blocking" : "non-blocking");
+    printf("%10s %10s %14s %10s\n", "producers", "consumers", "items/s", "ns/item");
+
+    for (int pairs = 1; pairs <= max_pairs; pairs *= 2) {
+        CircularQueue *queue = initQueue(capacity);
+        pthread_t threads[2 * pairs];
+        BenchThread args[2 * pairs];
+        long per_thread = items / pairs;
+        unsigned long sum = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int i = 0; i < 2 * pairs; i++) {
+            /* producers on even CPUs, consumers on odd ones */
+            args[i] = (BenchThread) { queue, per_thread, i < pairs ? 2 * i : 2 * (i - pairs) + 1, blocking, 0 };
+            if (pthread_create(&threads[i], NULL, i < pairs ? producer : consumer, &args[i]) != 0) {
+                fprintf(stderr, "Error: unable to create a thread\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (int i = 0; i < 2 * pairs; i++) {
+            pthread_join(threads[i], NULL);
+            sum += args[i].sum;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        unsigned long expected = (unsigned long) pairs * per_thread * (per_thread + 1) / 2;
+        if (sum != expected) {
+            fprintf(stderr, "Error: lost or duplicated elements (%lu != %lu)\n", sum, expected);
+            exit(EXIT_FAILURE);
+        }
+        double secs = elapsed(&t0, &t1);
+        long total = per_thread * pairs;
+        printf("%10d %10d %14.0f %10.1f\n", pairs, pairs, total / secs, secs * 1e9 / total);
+        destroyQueue(queue);
+    }
+    return 0;
+}
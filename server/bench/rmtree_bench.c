@@ -0,0 +1,110 @@
+/*
+ * Measures delete_tree as the subtree grows: the time the caller waits,
+ * which is the detach alone, and the time the workers then take to free
+ * the subtree, with 1 to max_threads of them, against deleting the same
+ * subtree leaf-first, one delete per node, as clients had to before.
+ * What delete_tree still does per node is drop the cached paths of the
+ * subtree, which building it left in the path cache.
+ * Build with `make bench` (the artificial delay is compiled out).
+ *
+ * Usage: ./bench/rmtree_bench [max_nodes] [max_threads]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "../fs/operations.h"
+
+/* entries per directory of the subtree */
+#define FANOUT 16
+
+static double elapsed(struct timespec *from, struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1000000000.0;
+}
+
+/*
+ * Builds /t, a subtree of at least nodes nodes, FANOUT entries per
+ * directory, breadth first.
+ * Returns: the number of nodes, /t included
+ */
+static long build(long nodes, char (*paths)[MAX_FILE_NAME]) {
+    long count = 1, parent = 0;
+
+    snprintf(paths[0], MAX_FILE_NAME, "/t");
+    create(paths[0], T_DIRECTORY);
+    while (count < nodes) {
+        for (int i = 0; i < FANOUT && count < nodes; i++, count++) {
+            snprintf(paths[count], MAX_FILE_NAME, "%s/%d", paths[parent], i);
+            create(paths[count], T_DIRECTORY);
+        }
+        parent++;
+    }
+    return count;
+}
+
+static void *worker(void *arg) {
+    while (reclaim_pending() > 0) {
+        reclaim_work();
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    long max_nodes = argc > 1 ? atol(argv[1]) : 1000000;
+    int max_threads = argc > 2 ? atoi(argv[2]) : 8;
+    struct timespec t0, t1, t2;
+
+    if (max_nodes <= 0 || max_threads <= 0) {
+        fprintf(stderr, "Usage: %s [max_nodes] [max_threads]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    char (*paths)[MAX_FILE_NAME] = malloc(sizeof(*paths) * (max_nodes + FANOUT));
+    if (paths == NULL) {
+        fprintf(stderr, "Error: unable to set up the benchmark.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    init_fs(NULL);
+    printf("%10s %8s %14s %14s %14s\n", "nodes", "threads", "delete_tree us", "reclaim ms", "leaf-first ms");
+
+    for (long size = 1000; size <= max_nodes; size *= 10) {
+        long nodes = build(size, paths);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (long i = nodes - 1; i >= 0; i--) {
+            if (delete(paths[i]) == FAIL) {
+                fprintf(stderr, "Error: unable to delete %s\n", paths[i]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        double leaf_first = elapsed(&t0, &t1);
+
+        for (int nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+            pthread_t threads[nthreads];
+
+            build(size, paths);
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            if (delete_tree("/t") == FAIL) {
+                fprintf(stderr, "Error: unable to delete /t\n");
+                exit(EXIT_FAILURE);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            for (int i = 0; i < nthreads; i++) {
+                if (pthread_create(&threads[i], NULL, worker, NULL) != 0) {
+                    fprintf(stderr, "Error: unable to create thread.\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            for (int i = 0; i < nthreads; i++)
+                pthread_join(threads[i], NULL);
+            clock_gettime(CLOCK_MONOTONIC, &t2);
+
+            printf("%10ld %8d %14.1f %14.1f %14.1f\n", nodes, nthreads, elapsed(&t0, &t1) * 1e6,
+                   elapsed(&t1, &t2) * 1000, leaf_first * 1000);
+        }
+    }
+
+    destroy_fs();
+    free(paths);
+    return 0;
+}
@@ -0,0 +1,409 @@
+/*
+ * Measures the state.c primitives every request is built from
+ * (inode_create, inode_get, dir_add_entry, dir_reset_entry and
+ * lookup_sub_node) across table sizes, directory fan-outs and thread
+ * counts, in ns/op and, where perf_event_open is allowed, cache misses
+ * per op. Build with `make bench` (the artificial delay is compiled out).
+ *
+ * Usage: ./bench/state_bench [ops] [max_table] [max_fanout] [max_threads]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+#include "../fs/operations.h"
+
+#define P_CREATE 0
+#define P_GET 1
+#define P_ADD 2
+#define P_RESET 3
+#define P_LOOKUP 4
+#define PRIMITIVES 5
+
+/* entries added to a directory before they are reset, so its fan-out
+   stays within this of the one measured */
+#define DIR_BATCH 256
+/* fan-out of the directory threads look up in together */
+#define SHARED_FANOUT 1024
+
+typedef struct sample {
+    uint64_t ns;
+    uint64_t misses;
+    int counted; /* misses were counted */
+} Sample;
+
+/* what a thread measures */
+typedef struct work {
+    int primitive;
+    long ops;
+    int dir; /* P_ADD and P_RESET: a directory of the thread's own; P_LOOKUP: the one looked up */
+    int fanout; /* entries dir holds, named by entry_name */
+    int *inumbers; /* P_GET: i-nodes to read */
+    int ninumbers;
+    unsigned int seed;
+    pthread_barrier_t *start;
+    Sample result[PRIMITIVES];
+} Work;
+
+static const char *names[PRIMITIVES] = {
+    "inode_create", "inode_get", "dir_add_entry", "dir_reset_entry", "lookup_sub_node"
+};
+
+static uint64_t now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000UL + t.tv_nsec;
+}
+
+/*
+ * Opens a counter of the calling thread's cache misses, disabled.
+ * Returns: its descriptor, or -1 if the kernel does not allow it
+ */
+static int counter_open() {
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+static void counter_start(int fd) {
+#ifdef __linux__
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+/*
+ * Stops a counter and adds what it counted to a sample.
+ */
+static void counter_stop(int fd, Sample *s) {
+#ifdef __linux__
+    uint64_t count;
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &count, sizeof(count)) == sizeof(count)) {
+            s->misses += count;
+            s->counted = 1;
+        }
+    }
+#endif
+}
+
+/*
+ * Name of the i-th entry of a directory.
+ */
+static void entry_name(char *name, long i) {
+    snprintf(name, MAX_FILE_NAME, "e%ld", i);
+}
+
+static char **entry_names(long first, long count) {
+    char **list = malloc(sizeof(char *) * count);
+    if (list == NULL) {
+        fprintf(stderr, "Error: allocating names.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (long i = 0; i < count; i++) {
+        list[i] = malloc(MAX_FILE_NAME);
+        if (list[i] == NULL) {
+            fprintf(stderr, "Error: allocating names.\n");
+            exit(EXIT_FAILURE);
+        }
+        entry_name(list[i], first + i);
+    }
+    return list;
+}
+
+static void free_names(char **list, long count) {
+    for (long i = 0; i < count; i++)
+        free(list[i]);
+    free(list);
+}
+
+/*
+ * Creates a directory holding fanout files, named by entry_name.
+ */
+static int make_dir(int fanout) {
+    char name[MAX_FILE_NAME];
+    int dir = inode_create(T_DIRECTORY);
+
+    for (int i = 0; i < fanout; i++) {
+        entry_name(name, i);
+        if (dir == FAIL || dir_add_entry(dir, inode_create(T_FILE), name) == FAIL) {
+            fprintf(stderr, "Error: unable to fill a directory.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return dir;
+}
+
+/*
+ * Deletes a directory made by make_dir and its files.
+ */
+static void drop_dir(int dir) {
+    DirTable *table = dir_table(inode_dir(inode_at(dir)));
+    for (int i = 0; i < table->capacity; i++) {
+        if (table->entries[i].inumber != FREE_INODE)
+            inode_delete(table->entries[i].inumber);
+    }
+    inode_delete(dir);
+}
+
+/*
+ * Runs a primitive ops times on the calling thread, timing only the
+ * primitive itself. P_ADD also measures the P_RESET that undoes it.
+ */
+static void *run(void *arg) {
+    Work *w = arg;
+    int fd = counter_open();
+    Sample *s = &w->result[w->primitive];
+    uint64_t t0;
+    type nType;
+    union Data data;
+
+    memset(w->result, 0, sizeof(w->result));
+    pthread_barrier_wait(w->start);
+
+    if (w->primitive == P_CREATE) {
+        int *created = malloc(sizeof(int) * w->ops);
+        if (created == NULL) {
+            fprintf(stderr, "Error: allocating i-nodes.\n");
+            exit(EXIT_FAILURE);
+        }
+        counter_start(fd);
+        t0 = now();
+        for (long i = 0; i < w->ops; i++)
+            created[i] = inode_create(T_FILE);
+        s->ns = now() - t0;
+        counter_stop(fd, s);
+        for (long i = 0; i < w->ops; i++) {
+            if (created[i] == FAIL) {
+                fprintf(stderr, "Error: inode_create failed.\n");
+                exit(EXIT_FAILURE);
+            }
+            inode_delete(created[i]);
+        }
+        inode_cache_flush();
+        free(created);
+    }
+    else if (w->primitive == P_GET) {
+        /* indices drawn up front, so only the reads are timed */
+        int *order = malloc(sizeof(int) * w->ops);
+        if (order == NULL) {
+            fprintf(stderr, "Error: allocating i-nodes.\n");
+            exit(EXIT_FAILURE);
+        }
+        for (long i = 0; i < w->ops; i++)
+            order[i] = w->inumbers[rand_r(&w->seed) % w->ninumbers];
+        counter_start(fd);
+        t0 = now();
+        for (long i = 0; i < w->ops; i++)
+            inode_get(order[i], &nType, &data);
+        s->ns = now() - t0;
+        counter_stop(fd, s);
+        free(order);
+    }
+    else if (w->primitive == P_LOOKUP) {
+        char **order = malloc(sizeof(char *) * w->ops);
+        char **entries = entry_names(0, w->fanout);
+        if (order == NULL) {
+            fprintf(stderr, "Error: allocating names.\n");
+            exit(EXIT_FAILURE);
+        }
+        for (long i = 0; i < w->ops; i++)
+            order[i] = entries[rand_r(&w->seed) % w->fanout];
+        Directory *dir = inode_dir(inode_at(w->dir));
+        counter_start(fd);
+        t0 = now();
+        for (long i = 0; i < w->ops; i++) {
+            if (lookup_sub_node(order[i], dir) == FAIL) {
+                fprintf(stderr, "Error: %s not found.\n", order[i]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        s->ns = now() - t0;
+        counter_stop(fd, s);
+        free(order);
+        free_names(entries, w->fanout);
+    }
+    else {
+        /* entries beyond the directory's own, added and reset a batch at a time */
+        char **extra = entry_names(w->fanout, DIR_BATCH);
+        int sub = inode_create(T_FILE);
+        Sample *reset = &w->result[P_RESET];
+
+        for (long done = 0; done < w->ops; done += DIR_BATCH) {
+            int n = w->ops - done < DIR_BATCH ? w->ops - done : DIR_BATCH;
+            counter_start(fd);
+            t0 = now();
+            for (int i = 0; i < n; i++)
+                dir_add_entry(w->dir, sub, extra[i]);
+            s->ns += now() - t0;
+            counter_stop(fd, s);
+
+            counter_start(fd);
+            t0 = now();
+            for (int i = 0; i < n; i++)
+                dir_reset_entry(w->dir, sub, extra[i]);
+            reset->ns += now() - t0;
+            counter_stop(fd, reset);
+        }
+        inode_delete(sub);
+        free_names(extra, DIR_BATCH);
+    }
+
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+/*
+ * Runs a primitive on nthreads threads, ops times on each.
+ * Input:
+ *  - dirs: directory of each thread, see Work
+ * Returns: through result, the samples of every thread added up
+ */
+static void measure(int primitive, int nthreads, long ops, int *dirs, int fanout,
+                    int *inumbers, int ninumbers, Sample *result) {
+    pthread_t threads[nthreads];
+    Work work[nthreads];
+    pthread_barrier_t start;
+
+    pthread_barrier_init(&start, NULL, nthreads);
+    for (int i = 0; i < nthreads; i++) {
+        work[i] = (Work) { primitive, ops, dirs[i], fanout, inumbers, ninumbers, i + 1, &start };
+        if (pthread_create(&threads[i], NULL, run, &work[i]) != 0) {
+            fprintf(stderr, "Error: unable to create thread.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memset(result, 0, sizeof(Sample) * PRIMITIVES);
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+        for (int p = 0; p < PRIMITIVES; p++) {
+            result[p].ns += work[i].result[p].ns;
+            result[p].misses += work[i].result[p].misses;
+            result[p].counted |= work[i].result[p].counted;
+        }
+    }
+    pthread_barrier_destroy(&start);
+}
+
+/*
+ * Prints a row: time per op on each thread and misses per op.
+ */
+static void report(const char *primitive, const char *param, long value, Sample *s, long ops) {
+    printf("%-16s %10s %10ld %10.1f", primitive, param, value, (double) s->ns / ops);
+    if (s->counted)
+        printf(" %12.2f\n", (double) s->misses / ops);
+    else
+        printf(" %12s\n", "-");
+}
+
+int main(int argc, char *argv[]) {
+    long ops = argc > 1 ? atol(argv[1]) : 1000000;
+    long max_table = argc > 2 ? atol(argv[2]) : 1 << 20;
+    int max_fanout = argc > 3 ? atoi(argv[3]) : 1 << 17;
+    int max_threads = argc > 4 ? atoi(argv[4]) : 8;
+    Sample s[PRIMITIVES];
+
+    if (ops <= 0 || max_table <= 0 || max_fanout <= 0 || max_threads <= 0 || max_table >= INODE_TABLE_MAX) {
+        fprintf(stderr, "Usage: %s [ops] [max_table] [max_fanout] [max_threads]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    int *inumbers = malloc(sizeof(int) * max_table);
+    int *dirs = malloc(sizeof(int) * max_threads);
+    if (inumbers == NULL || dirs == NULL) {
+        fprintf(stderr, "Error: unable to set up the benchmark.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    inode_table_init();
+    inode_create(T_DIRECTORY);
+    {
+        int fd = counter_open();
+        if (fd < 0)
+            printf("cache misses not counted: perf_event_open unavailable\n");
+        else
+            close(fd);
+    }
+    printf("%-16s %10s %10s %10s %12s\n", "primitive", "varying", "value", "ns/op", "misses/op");
+
+    /* i-node table sizes: creates while the table holds size i-nodes,
+       and reads spread over all of them */
+    long live = 0;
+    for (long size = 1024; size <= max_table; size *= 4) {
+        for (; live < size; live++) {
+            if ((inumbers[live] = inode_create(T_FILE)) == FAIL) {
+                fprintf(stderr, "Error: inode_create failed after %ld i-nodes\n", live);
+                exit(EXIT_FAILURE);
+            }
+        }
+        measure(P_CREATE, 1, ops, dirs, 0, inumbers, live, s);
+        report(names[P_CREATE], "table", size, &s[P_CREATE], ops);
+        measure(P_GET, 1, ops, dirs, 0, inumbers, live, s);
+        report(names[P_GET], "table", size, &s[P_GET], ops);
+    }
+    for (long i = 0; i < live; i++)
+        inode_delete(inumbers[i]);
+    inode_cache_flush();
+
+    /* directory fan-outs */
+    for (int fanout = 8; fanout <= max_fanout; fanout *= 8) {
+        dirs[0] = make_dir(fanout);
+        measure(P_ADD, 1, ops, dirs, fanout, NULL, 0, s);
+        report(names[P_ADD], "fanout", fanout, &s[P_ADD], ops);
+        report(names[P_RESET], "fanout", fanout, &s[P_RESET], ops);
+        measure(P_LOOKUP, 1, ops, dirs, fanout, NULL, 0, s);
+        report(names[P_LOOKUP], "fanout", fanout, &s[P_LOOKUP], ops);
+        drop_dir(dirs[0]);
+    }
+
+    /* threads: creates and reads of a shared table, changes to a
+       directory per thread and lookups in a shared one */
+    live = max_table < SHARED_FANOUT * 64 ? max_table : SHARED_FANOUT * 64;
+    for (long i = 0; i < live; i++)
+        inumbers[i] = inode_create(T_FILE);
+    int shared = make_dir(SHARED_FANOUT);
+    for (int nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+        measure(P_CREATE, nthreads, ops, dirs, 0, inumbers, live, s);
+        report(names[P_CREATE], "threads", nthreads, &s[P_CREATE], ops * nthreads);
+        measure(P_GET, nthreads, ops, dirs, 0, inumbers, live, s);
+        report(names[P_GET], "threads", nthreads, &s[P_GET], ops * nthreads);
+
+        for (int i = 0; i < nthreads; i++)
+            dirs[i] = make_dir(SHARED_FANOUT);
+        measure(P_ADD, nthreads, ops, dirs, SHARED_FANOUT, NULL, 0, s);
+        report(names[P_ADD], "threads", nthreads, &s[P_ADD], ops * nthreads);
+        report(names[P_RESET], "threads", nthreads, &s[P_RESET], ops * nthreads);
+        for (int i = 0; i < nthreads; i++) {
+            drop_dir(dirs[i]);
+            dirs[i] = shared;
+        }
+        measure(P_LOOKUP, nthreads, ops, dirs, SHARED_FANOUT, NULL, 0, s);
+        report(names[P_LOOKUP], "threads", nthreads, &s[P_LOOKUP], ops * nthreads);
+    }
+
+    inode_table_destroy();
+    free(inumbers);
+    free(dirs);
+    return 0;
+}
@@ -0,0 +1,77 @@
+/*
+ * Measures how many logged changes per second the write-ahead log
+ * commits at each durability level, with threads that each log a change
+ * and wait for it to commit, as workers do before replying. Build with
+ * `make bench`.
+ *
+ * Usage: ./bench/wal_bench [threads] [seconds] [log_file]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "../fs/wal.h"
+
+static volatile int running;
+
+static double elapsed(struct timespec *from, struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1000000000.0;
+}
+
+static void *committer(void *arg) {
+    long id = (long) arg;
+    char name[64];
+
+    for (long i = 0; running; i++) {
+        snprintf(name, sizeof(name), "/bench/t%ld/f%ld", id, i);
+        wal_append(WAL_CREATE, 'f', name, NULL, 0, NULL, 0);
+        wal_commit();
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int nthreads = argc > 1 ? atoi(argv[1]) : 8;
+    int seconds = argc > 2 ? atoi(argv[2]) : 2;
+    char *path = argc > 3 ? argv[3] : "wal_bench.log";
+    char *levels[] = { "none", "batched", "per-op" };
+    struct timespec t0, t1;
+
+    if (nthreads <= 0 || seconds <= 0) {
+        fprintf(stderr, "Usage: %s [threads] [seconds] [log_file]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    pthread_t *threads = malloc(sizeof(pthread_t) * nthreads);
+    if (threads == NULL) {
+        fprintf(stderr, "Error: allocating threads.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%d threads, %d s per level, log %s\n", nthreads, seconds, path);
+    printf("%10s %14s %14s\n", "durability", "ops/s", "ops/sync");
+
+    for (int level = WAL_NONE; level <= WAL_PER_OP; level++) {
+        unsigned long records, syncs;
+
+        if (wal_start(path, level, 1) != 0)
+            exit(EXIT_FAILURE);
+        running = 1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (long i = 0; i < nthreads; i++)
+            pthread_create(&threads[i], NULL, committer, (void *) i);
+        sleep(seconds);
+        running = 0;
+        for (int i = 0; i < nthreads; i++)
+            pthread_join(threads[i], NULL);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        wal_stats(&records, &syncs);
+        printf("%10s %14.0f %14.1f\n", levels[level], records / elapsed(&t0, &t1),
+               syncs > 0 ? (double) records / syncs : 0.0);
+        wal_close();
+    }
+    unlink(path);
+    free(threads);
+    return 0;
+}
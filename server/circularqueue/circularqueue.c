@@ -1,99 +1,222 @@
 #include <stdio.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "circularqueue.h"
 
-CircularQueue* initQueue() {
+static void futexWait(unsigned int *word, unsigned int value) {
+	syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static void futexWake(unsigned int *word, int count) {
+	syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+static void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+// wake one thread sleeping on word, if any; the fence pairs with the
+// sleeper's seq_cst increment of waiting, so either we see the sleeper
+// or its retry sees our change
+static void wakeOne(unsigned int *word, int *waiting) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiting, __ATOMIC_RELAXED) > 0) {
+		__atomic_fetch_add(word, 1, __ATOMIC_RELEASE);
+		futexWake(word, 1);
+	}
+}
+
+// capacity is rounded up to a power of two
+CircularQueue* initQueue(int capacity) {
 	CircularQueue *newQueue;
-	newQueue = malloc(sizeof(CircularQueue));
-	newQueue->front = -1;
-	newQueue->rear = -1;
+	int size = 1;
+
+	while (size < capacity)
+		size <<= 1;
+
+	if (posix_memalign((void **) &newQueue, QUEUE_CACHE_LINE, sizeof(CircularQueue)) != 0 ||
+	    posix_memalign((void **) &newQueue->slots, QUEUE_CACHE_LINE, sizeof(QueueSlot) * size) != 0) {
+		fprintf(stderr, "Error: allocating a queue.\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < size; i++) {
+		newQueue->slots[i].sequence = i;
+		newQueue->slots[i].element = NULL;
+	}
+	newQueue->front = 0;
+	newQueue->rear = 0;
+	newQueue->notEmpty = 0;
+	newQueue->notFull = 0;
+	newQueue->consumersWaiting = 0;
+	newQueue->producersWaiting = 0;
+	newQueue->size = size;
 	newQueue->isCompleted = 0;
 	return newQueue;
 }
 
-// change the state of the circular queue
+// change the state of the circular queue; once completed, blocked calls
+// return instead of waiting
 void changeState(CircularQueue *queue) {
 
-	if (queue->isCompleted == 0)
-		queue->isCompleted = 1;
-	else
-		queue->isCompleted = 0;
+	__atomic_store_n(&queue->isCompleted, !queue->isCompleted, __ATOMIC_SEQ_CST);
+	__atomic_fetch_add(&queue->notEmpty, 1, __ATOMIC_RELEASE);
+	__atomic_fetch_add(&queue->notFull, 1, __ATOMIC_RELEASE);
+	futexWake(&queue->notEmpty, INT_MAX);
+	futexWake(&queue->notFull, INT_MAX);
 }
 
-// check if it is full
+// check if it is full (a snapshot, others may change it meanwhile)
 int isFull(CircularQueue *queue) {
-	if ((queue->front == queue->rear +1) || (queue->front == 0 && queue->rear == SIZE - 1)) 
+	unsigned long front = __atomic_load_n(&queue->front, __ATOMIC_ACQUIRE);
+	unsigned long rear = __atomic_load_n(&queue->rear, __ATOMIC_ACQUIRE);
+	if (rear - front >= (unsigned long) queue->size)
 		return FULL;
 	return NOTFULL;
 }
 
-// check if it is empty
+// check if it is empty (a snapshot, others may change it meanwhile)
 int isEmpty(CircularQueue *queue) {
-  if (queue->front == -1) return EMPTY;
-  return NOTEMPTY;
+	unsigned long front = __atomic_load_n(&queue->front, __ATOMIC_ACQUIRE);
+	unsigned long rear = __atomic_load_n(&queue->rear, __ATOMIC_ACQUIRE);
+	if (rear == front || (long) (rear - front) < 0)
+		return EMPTY;
+	return NOTEMPTY;
 }
 
-// add elements
-int enQueue(CircularQueue *queue, char* element) {
-
-	if (isFull(queue))
-		return FAIL;
-
-    if (queue->front == -1) 
-    	queue->front = 0;
-
-    queue->rear = (queue->rear + 1) % SIZE;
-    strcpy(queue->inputCommands[queue->rear], element);
-
-    return SUCCESS;
+// number of elements (a snapshot, others may change it meanwhile)
+unsigned long queueLength(CircularQueue *queue) {
+	unsigned long front = __atomic_load_n(&queue->front, __ATOMIC_ACQUIRE);
+	unsigned long rear = __atomic_load_n(&queue->rear, __ATOMIC_ACQUIRE);
+	if ((long) (rear - front) < 0)
+		return 0;
+	return rear - front;
 }
 
-// remove elements
-char* deQueue(CircularQueue *queue) {
+// add an element (not NULL) without blocking; FAIL if full
+int enQueue(CircularQueue *queue, void* element) {
+
+	unsigned long mask = queue->size - 1;
+	unsigned long pos = __atomic_load_n(&queue->rear, __ATOMIC_RELAXED);
+	QueueSlot *slot;
+
+	while (1) {
+		slot = &queue->slots[pos & mask];
+		long diff = (long) __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - (long) pos;
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&queue->rear, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (diff < 0)
+			return FAIL;
+		else
+			pos = __atomic_load_n(&queue->rear, __ATOMIC_RELAXED);
+	}
+
+	slot->element = element;
+	__atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+	wakeOne(&queue->notEmpty, &queue->consumersWaiting);
+	return SUCCESS;
+}
 
-  char* element;
+// remove an element without blocking; NULL if empty
+void* deQueue(CircularQueue *queue) {
+
+	unsigned long mask = queue->size - 1;
+	unsigned long pos = __atomic_load_n(&queue->front, __ATOMIC_RELAXED);
+	QueueSlot *slot;
+
+	while (1) {
+		slot = &queue->slots[pos & mask];
+		long diff = (long) __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - (long) (pos + 1);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&queue->front, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (diff < 0)
+			return NULL;
+		else
+			pos = __atomic_load_n(&queue->front, __ATOMIC_RELAXED);
+	}
+
+	void *element = slot->element;
+	// free the slot for the producer one lap ahead
+	__atomic_store_n(&slot->sequence, pos + mask + 1, __ATOMIC_RELEASE);
+	wakeOne(&queue->notFull, &queue->producersWaiting);
+	return element;
+}
 
-  if (isEmpty(queue)) 
-  	return NULL;
-  else {
+// add an element, waiting while the queue is full; FAIL if it completes
+int enQueueWait(CircularQueue *queue, void* element) {
+
+	while (1) {
+		for (int i = 0; i < QUEUE_SPINS; i++) {
+			if (enQueue(queue, element) == SUCCESS)
+				return SUCCESS;
+			cpuRelax();
+		}
+
+		unsigned int seen = __atomic_load_n(&queue->notFull, __ATOMIC_ACQUIRE);
+		__atomic_fetch_add(&queue->producersWaiting, 1, __ATOMIC_SEQ_CST);
+		int done = enQueue(queue, element) == SUCCESS;
+		if (!done && !__atomic_load_n(&queue->isCompleted, __ATOMIC_SEQ_CST))
+			futexWait(&queue->notFull, seen);
+		__atomic_fetch_sub(&queue->producersWaiting, 1, __ATOMIC_RELAXED);
+		if (done)
+			return SUCCESS;
+		if (__atomic_load_n(&queue->isCompleted, __ATOMIC_ACQUIRE))
+			return FAIL;
+	}
+}
 
-    element = queue->inputCommands[queue->front];
-
-    if (queue->front == queue->rear) {
-      queue->front = -1;
-      queue->rear = -1;
-    } 
-    // Q has only one element, so we reset the 
-    // queue after dequeing it. ?
-    else 
-      queue->front = (queue->front + 1) % SIZE;
-    return element;
-  }
+// remove an element, waiting while the queue is empty; NULL once it is
+// empty and completed
+void* deQueueWait(CircularQueue *queue) {
+
+	void *element;
+
+	while (1) {
+		for (int i = 0; i < QUEUE_SPINS; i++) {
+			if ((element = deQueue(queue)) != NULL)
+				return element;
+			cpuRelax();
+		}
+
+		unsigned int seen = __atomic_load_n(&queue->notEmpty, __ATOMIC_ACQUIRE);
+		__atomic_fetch_add(&queue->consumersWaiting, 1, __ATOMIC_SEQ_CST);
+		element = deQueue(queue);
+		if (element == NULL && !__atomic_load_n(&queue->isCompleted, __ATOMIC_SEQ_CST))
+			futexWait(&queue->notEmpty, seen);
+		__atomic_fetch_sub(&queue->consumersWaiting, 1, __ATOMIC_RELAXED);
+		if (element != NULL)
+			return element;
+		if (__atomic_load_n(&queue->isCompleted, __ATOMIC_ACQUIRE) && isEmpty(queue))
+			return NULL;
+	}
 }
 
 // Display the queue
 void display(CircularQueue *queue) {
 
-  int i;
-
   if (isEmpty(queue))
 
     printf("DEBUG (QUEUE): Empty Queue\n");
 
   else {
 
-    printf("DEBUG (QUEUE): Front -> %d ", queue->front);
-    printf("DEBUG (QUEUE): Items -> ");
-
-    for (i = queue->front; i != queue->rear; i = (i + 1) % SIZE) {
-      printf("%s ", queue->inputCommands[i]);
-    }
-
-    printf("%s ", queue->inputCommands[i]);
-    printf("DEBUG (QUEUE): Rear -> %d \n", queue->rear);
+    unsigned long front = __atomic_load_n(&queue->front, __ATOMIC_ACQUIRE);
+    unsigned long rear = __atomic_load_n(&queue->rear, __ATOMIC_ACQUIRE);
+    printf("DEBUG (QUEUE): Front -> %lu ", front);
+    printf("DEBUG (QUEUE): Items -> %lu ", rear - front);
+    printf("DEBUG (QUEUE): Rear -> %lu \n", rear);
   }
 }
 
 // destroy the queue
 void destroyQueue(CircularQueue *queue) {
+	free(queue->slots);
 	free(queue);
-}
\ No newline at end of file
+}
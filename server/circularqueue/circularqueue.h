@@ -5,8 +5,6 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define SIZE 10
-#define MAX_INPUT_SIZE 100
 #define FULL 1
 #define NOTFULL 0
 #define EMPTY 1
@@ -14,21 +12,43 @@
 #define FAIL -1
 #define SUCCESS 0
 
+#define QUEUE_CACHE_LINE 64
+// tries of a blocking call before it sleeps
+#define QUEUE_SPINS 128
+
+// a slot's sequence tells whose turn it is: pos when free for the
+// producer of position pos, pos + 1 when holding that producer's element
+typedef struct QueueSlot {
+	unsigned long sequence;
+	void *element;
+} __attribute__((aligned(QUEUE_CACHE_LINE))) QueueSlot;
+
+// bounded multi-producer/multi-consumer ring (D. Vyukov's algorithm):
+// producers and consumers claim positions with a CAS on rear/front and
+// hand slots over through their sequence numbers, without locks
 typedef struct Queue {
 
-	int rear, front;								// initially both are -1
-	int size;										// 10
+	unsigned long rear __attribute__((aligned(QUEUE_CACHE_LINE)));	// next position to enqueue
+	unsigned long front __attribute__((aligned(QUEUE_CACHE_LINE)));	// next position to dequeue
+	unsigned int notEmpty __attribute__((aligned(QUEUE_CACHE_LINE)));	// futex words, bumped
+	unsigned int notFull;											// to wake sleepers
+	int consumersWaiting;
+	int producersWaiting;
 	int isCompleted; 								// state
-	char inputCommands[SIZE][MAX_INPUT_SIZE];
+	int size;										// capacity, power of two
+	QueueSlot *slots;
 } CircularQueue;
 
-CircularQueue* initQueue();
+CircularQueue* initQueue(int capacity);
 void changeState(CircularQueue *queue);
 void display(CircularQueue *queue);
-char* deQueue(CircularQueue *queue);
-int enQueue(CircularQueue *queue, char* element);
-int isEmpty(CircularQueue *queue); 
+void* deQueue(CircularQueue *queue);
+void* deQueueWait(CircularQueue *queue);
+int enQueue(CircularQueue *queue, void* element);
+int enQueueWait(CircularQueue *queue, void* element);
+int isEmpty(CircularQueue *queue);
 int isFull(CircularQueue *queue);
+unsigned long queueLength(CircularQueue *queue);
 void destroyQueue(CircularQueue *queue);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "arena.h"
+#include "state.h"
+
+/*
+ * First bytes of an image. Free blocks of each class are linked through
+ * their first word, as Refs.
+ */
+typedef struct arenaHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t layout; /* the file system's structure sizes, see arena_open */
+	uint64_t size; /* bytes of the file */
+	uint64_t top; /* first byte never handed out */
+	uint32_t clean; /* set by arena_close, cleared while mapped */
+	Ref free[ARENA_CLASSES];
+	char root[ARENA_ROOT_SIZE] __attribute__((aligned(CACHE_LINE)));
+} ArenaHeader;
+
+/* blocks start after the header, page aligned */
+#define ARENA_DATA_START ((sizeof(ArenaHeader) + 4095) & ~4095UL)
+
+char *arena_base = NULL;
+
+static ArenaHeader *header = NULL;
+static int arena_fd = -1;
+static int was_clean = 1;
+static pthread_mutex_t class_locks[ARENA_CLASSES];
+static pthread_mutex_t grow_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ * Returns the class of blocks able to hold size bytes.
+ */
+static int arena_class(size_t size) {
+	int c = 0;
+	while (((size_t) 1 << (c + ARENA_MIN_CLASS)) < size)
+		c++;
+	if (c >= ARENA_CLASSES) {
+		fprintf(stderr, "Error: %zu bytes are too many for the image.\n", size);
+		exit(EXIT_FAILURE);
+	}
+	return c;
+}
+
+
+/*
+ * Makes sure the file backs the image up to end.
+ * Input:
+ *  - end: offset one past the last byte needed
+ */
+static void arena_grow(uint64_t end) {
+	if (end <= __atomic_load_n(&header->size, __ATOMIC_ACQUIRE))
+		return;
+
+	pthread_mutex_lock(&grow_lock);
+	uint64_t size = header->size;
+	while (size < end)
+		size += ARENA_GROW;
+	if (size > ARENA_MAX_SIZE || (size != header->size && ftruncate(arena_fd, size) < 0)) {
+		fprintf(stderr, "Error: unable to grow the image to %lu bytes.\n", (unsigned long) size);
+		exit(EXIT_FAILURE);
+	}
+	__atomic_store_n(&header->size, size, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&grow_lock);
+}
+
+
+/*
+ * Maps an image, creating it if the file does not exist.
+ * Input:
+ *  - path: the image file
+ *  - layout: a signature of the structures stored in the image; an image
+ *            written with another layout is refused
+ *  - created: where to store whether the image is new (and so empty)
+ * Returns: SUCCESS or FAIL (the file is not a valid image)
+ */
+int arena_open(char *path, uint64_t layout, int *created) {
+	struct stat st;
+
+	arena_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (arena_fd < 0 || fstat(arena_fd, &st) < 0) {
+		fprintf(stderr, "Error: unable to open image %s.\n", path);
+		return FAIL;
+	}
+	*created = st.st_size == 0;
+	if (!*created && st.st_size < (off_t) ARENA_DATA_START) {
+		fprintf(stderr, "Error: %s is too short to be an image.\n", path);
+		close(arena_fd);
+		return FAIL;
+	}
+	if (*created && ftruncate(arena_fd, ARENA_GROW) < 0) {
+		fprintf(stderr, "Error: unable to size image %s.\n", path);
+		close(arena_fd);
+		return FAIL;
+	}
+
+	/* reserve the whole range now, so the image never moves as it grows */
+	char *base = mmap(NULL, ARENA_MAX_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, arena_fd, 0);
+	if (base == MAP_FAILED) {
+		fprintf(stderr, "Error: unable to map image %s.\n", path);
+		close(arena_fd);
+		return FAIL;
+	}
+	header = (ArenaHeader *) base;
+
+	if (*created) {
+		header->magic = ARENA_MAGIC;
+		header->version = ARENA_VERSION;
+		header->layout = layout;
+		header->size = ARENA_GROW;
+		header->top = ARENA_DATA_START;
+		header->clean = 1;
+	}
+	else if (header->magic != ARENA_MAGIC || header->version != ARENA_VERSION || header->layout != layout ||
+	         header->size > (uint64_t) st.st_size || header->top > header->size || header->top < ARENA_DATA_START) {
+		fprintf(stderr, "Error: %s is not an image of this version of the server.\n", path);
+		munmap(base, ARENA_MAX_SIZE);
+		close(arena_fd);
+		header = NULL;
+		return FAIL;
+	}
+
+	for (int c = 0; c < ARENA_CLASSES; c++)
+		pthread_mutex_init(&class_locks[c], NULL);
+	was_clean = header->clean;
+	header->clean = 0;
+	arena_base = base;
+	return SUCCESS;
+}
+
+
+/*
+ * Writes the image back to its file and unmaps it, marking it clean.
+ * Nothing may use the image meanwhile.
+ */
+void arena_close() {
+	if (header == NULL)
+		return;
+	arena_sync(1);
+	munmap(header, ARENA_MAX_SIZE);
+	close(arena_fd);
+	header = NULL;
+	arena_base = NULL;
+}
+
+
+/*
+ * Writes the image back to its file.
+ * Input:
+ *  - clean: whether to also mark the image clean, once written; the
+ *           image may not change afterwards
+ */
+void arena_sync(int clean) {
+	if (header == NULL)
+		return;
+	msync(header, __atomic_load_n(&header->size, __ATOMIC_ACQUIRE), MS_SYNC);
+	if (clean) {
+		header->clean = 1;
+		msync(header, sizeof(ArenaHeader), MS_SYNC);
+	}
+}
+
+
+/*
+ * Returns whether the image had been closed by arena_close when it was
+ * mapped: otherwise the server stopped in the middle of requests.
+ */
+int arena_was_clean() {
+	return was_clean;
+}
+
+
+/*
+ * Returns the ARENA_ROOT_SIZE bytes of the header kept for the file
+ * system's roots (zero in a new image).
+ */
+void *arena_root() {
+	return header->root;
+}
+
+
+/*
+ * Allocates a block of the image, reusing a freed block of its class if
+ * there is one.
+ * Input:
+ *  - size: bytes needed
+ * Returns: the block, never NULL; its contents are undefined
+ */
+void *arena_alloc(size_t size) {
+	int c = arena_class(size);
+
+	pthread_mutex_lock(&class_locks[c]);
+	Ref block = header->free[c];
+	if (block != 0)
+		header->free[c] = *(Ref *) ref_ptr(block);
+	pthread_mutex_unlock(&class_locks[c]);
+
+	return block != 0 ? ref_ptr(block) : arena_reserve((size_t) 1 << (c + ARENA_MIN_CLASS));
+}
+
+
+/*
+ * Allocates a block of the image that is never freed, of exactly size
+ * bytes (rounded to 16).
+ * Input:
+ *  - size: bytes needed
+ * Returns: the block, never NULL
+ */
+void *arena_reserve(size_t size) {
+	size = (size + 15) & ~(size_t) 15;
+	uint64_t offset = __atomic_fetch_add(&header->top, size, __ATOMIC_RELAXED);
+	arena_grow(offset + size);
+	return arena_base + offset;
+}
+
+
+/*
+ * Returns a block to the free blocks of its class.
+ * Input:
+ *  - ptr: the block, from arena_alloc
+ *  - size: the size it was allocated with
+ */
+void arena_free(void *ptr, size_t size) {
+	int c = arena_class(size);
+
+	pthread_mutex_lock(&class_locks[c]);
+	*(Ref *) ptr = header->free[c];
+	header->free[c] = ref_of(ptr);
+	pthread_mutex_unlock(&class_locks[c]);
+}
+
+
+/*
+ * Allocates memory for the file system image: from the arena if an
+ * image is mapped, from the heap otherwise.
+ * Input:
+ *  - size: bytes needed
+ * Returns: the memory, never NULL
+ */
+void *pmalloc(size_t size) {
+	if (arena_base != NULL)
+		return arena_alloc(size);
+
+	void *ptr = malloc(size);
+	if (ptr == NULL) {
+		fprintf(stderr, "Error: allocating %zu bytes.\n", size);
+		exit(EXIT_FAILURE);
+	}
+	return ptr;
+}
+
+
+/*
+ * Releases memory from pmalloc.
+ * Input:
+ *  - ptr: the memory (may be NULL)
+ *  - size: the size it was allocated with
+ */
+void pfree(void *ptr, size_t size) {
+	if (ptr == NULL)
+		return;
+	if (arena_base != NULL)
+		arena_free(ptr, size);
+	else
+		free(ptr);
+}
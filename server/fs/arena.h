@@ -0,0 +1,57 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Persistent arena: the file system image (i-node table, directories and
+ * file contents) can live in a file mapped into memory, so a restart
+ * only maps the file back. Structures in the image refer to each other
+ * with Refs, offsets from the start of the mapping, so the image does
+ * not depend on the address it is mapped at.
+ *
+ * Without an image, arena_base is NULL and a Ref is just the address,
+ * so the same code serves both modes.
+ */
+#define ARENA_MAGIC 0x54465349 /* "TFSI" */
+#define ARENA_VERSION 1
+/* address space reserved for the mapping; the file grows on demand */
+#define ARENA_MAX_SIZE (1UL << 38)
+#define ARENA_GROW (64UL << 20)
+/* blocks come in powers of two, from 1 << ARENA_MIN_CLASS bytes */
+#define ARENA_MIN_CLASS 4
+#define ARENA_CLASSES 28
+/* room in the header for the file system's own roots */
+#define ARENA_ROOT_SIZE (64 << 10)
+
+typedef uintptr_t Ref;
+
+extern char *arena_base;
+
+/*
+ * Returns the reference to store for a pointer into the image.
+ */
+static inline Ref ref_of(void *ptr) {
+	return ptr ? (Ref) ((char *) ptr - arena_base) : 0;
+}
+
+/*
+ * Returns the pointer a stored reference stands for.
+ */
+static inline void *ref_ptr(Ref ref) {
+	return ref ? arena_base + ref : NULL;
+}
+
+int arena_open(char *path, uint64_t layout, int *created);
+void arena_close();
+void arena_sync(int clean);
+int arena_was_clean();
+void *arena_root();
+void *arena_alloc(size_t size);
+void *arena_reserve(size_t size);
+void arena_free(void *ptr, size_t size);
+void *pmalloc(size_t size);
+void pfree(void *ptr, size_t size);
+
+#endif /* ARENA_H */
@@ -0,0 +1,429 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "checkpoint.h"
+#include "state.h"
+#include "wal.h"
+
+/*
+ * Buffered output of a checkpoint. After an error nothing more is
+ * written, but the i-nodes saved still have to be released.
+ */
+typedef struct checkpointWriter {
+	int fd;
+	char *buf;
+	int len;
+	off_t written; /* bytes handed to the file */
+	off_t synced; /* bytes asked to be written back */
+	uint64_t hash;
+	uint64_t nodes;
+	int failed;
+} CheckpointWriter;
+
+/*
+ * A directory entry to load: the i-node it names, in the checkpoint, and
+ * the directory to add it to, already loaded.
+ */
+typedef struct pendingEntry {
+	int inumber;
+	int parent;
+	char *name;
+	int namelen;
+} PendingEntry;
+
+
+/*
+ * Writes out the buffered bytes. Every write but the last is a whole
+ * buffer, a multiple of the word wal_hash works on, so hashing buffer by
+ * buffer matches hashing the file at once.
+ */
+static void checkpoint_flush(CheckpointWriter *w) {
+	if (w->failed || w->len == 0) {
+		w->len = 0;
+		return;
+	}
+	w->hash = wal_hash(w->buf, w->len, w->hash);
+	for (char *p = w->buf; w->len > 0; ) {
+		ssize_t n = write(w->fd, p, w->len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			w->failed = true;
+			break;
+		}
+		p += n;
+		w->len -= n;
+		w->written += n;
+	}
+	w->len = 0;
+
+	if (w->written - w->synced >= CHECKPOINT_WRITEBACK) {
+		sync_file_range(w->fd, w->synced, w->written - w->synced, SYNC_FILE_RANGE_WRITE);
+		w->synced = w->written;
+	}
+}
+
+
+/*
+ * Appends bytes to the checkpoint.
+ */
+static void checkpoint_put(CheckpointWriter *w, const void *data, size_t len) {
+	const char *p = data;
+
+	while (len > 0) {
+		size_t n = CHECKPOINT_BUFFER_SIZE - w->len;
+		if (n > len)
+			n = len;
+		memcpy(w->buf + w->len, p, n);
+		w->len += n;
+		p += n;
+		len -= n;
+		if (w->len == CHECKPOINT_BUFFER_SIZE)
+			checkpoint_flush(w);
+	}
+}
+
+
+/*
+ * Appends a saved i-node to the checkpoint and releases it.
+ * Input:
+ *  - w: the checkpoint
+ *  - snap: the saved i-node
+ */
+static void checkpoint_node(CheckpointWriter *w, InodeSnapshot *snap) {
+	CheckpointNode node = { .inumber = snap->inumber, .nodeType = snap->nodeType, .size = 0, .count = 0, .unused = 0 };
+
+	if (snap->table != NULL) {
+		for (int i = 0; i < snap->table->capacity; i++)
+			if (snap->table->entries[i].inumber != FREE_INODE)
+				node.count++;
+		checkpoint_put(w, &node, sizeof(node));
+		for (int i = 0; i < snap->table->capacity; i++) {
+			DirEntry *e = &snap->table->entries[i];
+			if (e->inumber == FREE_INODE)
+				continue;
+			CheckpointEntry entry = { .inumber = e->inumber, .namelen = strnlen(e->name, MAX_FILE_NAME) };
+			checkpoint_put(w, &entry, sizeof(entry));
+			checkpoint_put(w, e->name, entry.namelen);
+		}
+	}
+	else {
+		FileSnapshot *contents = snap->contents;
+		Ref *chunks = contents != NULL ? contents->chunks : NULL;
+		int nchunks = contents != NULL ? (contents->size + FILE_CHUNK_SIZE - 1) >> FILE_CHUNK_BITS : 0;
+		if (contents != NULL && nchunks > contents->capacity)
+			nchunks = contents->capacity;
+
+		node.size = contents != NULL ? contents->size : 0;
+		for (int i = 0; i < nchunks; i++)
+			if (chunks[i] != 0)
+				node.count++;
+		checkpoint_put(w, &node, sizeof(node));
+		for (int32_t i = 0; i < nchunks; i++) {
+			if (chunks[i] == 0)
+				continue;
+			checkpoint_put(w, &i, sizeof(i));
+			checkpoint_put(w, ref_ptr(chunks[i]), FILE_CHUNK_SIZE);
+		}
+	}
+	w->nodes++;
+	inode_snapshot_release(snap);
+}
+
+
+/*
+ * Writes out the i-nodes saved since the previous call.
+ */
+static void checkpoint_drain(CheckpointWriter *w) {
+	InodeSnapshot *snap = inode_snapshot_next();
+	while (snap != NULL) {
+		InodeSnapshot *next = snap->next;
+		checkpoint_node(w, snap);
+		snap = next;
+	}
+}
+
+
+/*
+ * Makes a rename in the directory of a file durable.
+ */
+static void checkpoint_sync_dir(char *path) {
+	char *slash = strrchr(path, '/');
+	char *dir = slash == NULL ? strdup(".") : strndup(path, slash == path ? 1 : slash - path);
+	if (dir == NULL) {
+		fprintf(stderr, "Error: allocating the checkpoint directory name.\n");
+		exit(EXIT_FAILURE);
+	}
+	int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+	free(dir);
+}
+
+
+/*
+ * Writes the checkpoint started by inode_snapshot_begin, to a temporary
+ * file renamed over path once complete and synced, so path always holds
+ * a whole checkpoint. Runs alongside the requests.
+ * Input:
+ *  - path: the checkpoint file
+ *  - lsn: last change logged before the cut
+ *  - count: number of i-nodes in the table at the cut
+ * Returns: number of bytes written, or FAIL
+ */
+long checkpoint_write(char *path, uint64_t lsn, int count) {
+	CheckpointWriter w = { .len = 0, .written = 0, .synced = 0, .hash = WAL_HASH_SEED, .nodes = 0, .failed = false };
+	char *tmp = malloc(strlen(path) + sizeof(".tmp"));
+
+	if (tmp == NULL || (w.buf = malloc(CHECKPOINT_BUFFER_SIZE)) == NULL) {
+		fprintf(stderr, "Error: allocating a checkpoint buffer.\n");
+		exit(EXIT_FAILURE);
+	}
+	strcpy(tmp, path);
+	strcat(tmp, ".tmp");
+	w.fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (w.fd < 0)
+		w.failed = true;
+
+	CheckpointHeader header = { .magic = CHECKPOINT_MAGIC, .version = CHECKPOINT_VERSION, .lsn = lsn };
+	checkpoint_put(&w, &header, sizeof(header));
+
+	/* i-nodes past count were free at the cut */
+	for (int i = 0; i < count; i++) {
+		inode_snapshot_take(i);
+		if (i % CHECKPOINT_DRAIN == CHECKPOINT_DRAIN - 1)
+			checkpoint_drain(&w);
+	}
+	checkpoint_drain(&w);
+	checkpoint_flush(&w);
+
+	CheckpointTrailer trailer = { .nodes = w.nodes, .checksum = w.hash };
+	checkpoint_put(&w, &trailer, sizeof(trailer));
+	checkpoint_flush(&w);
+
+	if (!w.failed && (fsync(w.fd) < 0 || rename(tmp, path) < 0))
+		w.failed = true;
+	if (w.fd >= 0)
+		close(w.fd);
+	if (w.failed) {
+		fprintf(stderr, "Warning: unable to write checkpoint %s\n", path);
+		unlink(tmp);
+	}
+	else
+		checkpoint_sync_dir(path);
+
+	free(w.buf);
+	free(tmp);
+	return w.failed ? FAIL : (long) w.written;
+}
+
+
+/*
+ * Returns the bytes of a checkpoint, checked against its checksum, or
+ * NULL if it is not a valid checkpoint.
+ */
+static char *checkpoint_read(char *path, off_t *size) {
+	struct stat st;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < (off_t) (sizeof(CheckpointHeader) + sizeof(CheckpointTrailer))) {
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	char *buf = malloc(st.st_size);
+	if (buf == NULL) {
+		fprintf(stderr, "Error: allocating %ld bytes to load a checkpoint.\n", (long) st.st_size);
+		exit(EXIT_FAILURE);
+	}
+	for (off_t done = 0; done < st.st_size; ) {
+		ssize_t n = pread(fd, buf + done, st.st_size - done, done);
+		if (n <= 0) {
+			free(buf);
+			close(fd);
+			return NULL;
+		}
+		done += n;
+	}
+	close(fd);
+
+	CheckpointHeader *header = (CheckpointHeader *) buf;
+	CheckpointTrailer trailer;
+	off_t body = st.st_size - sizeof(trailer);
+	memcpy(&trailer, buf + body, sizeof(trailer));
+	if (header->magic != CHECKPOINT_MAGIC || header->version != CHECKPOINT_VERSION ||
+	    wal_hash(buf, body, WAL_HASH_SEED) != trailer.checksum) {
+		free(buf);
+		return NULL;
+	}
+	*size = body;
+	return buf;
+}
+
+
+/*
+ * Returns the position of the record after the one at pos, or size if
+ * the record does not fit in the checkpoint.
+ */
+static off_t checkpoint_next(char *buf, off_t pos, off_t size) {
+	if (size - pos < (off_t) sizeof(CheckpointNode))
+		return size;
+
+	CheckpointNode *node = (CheckpointNode *) (buf + pos);
+	pos += sizeof(CheckpointNode);
+	if (node->nodeType == T_DIRECTORY) {
+		for (int i = 0; i < node->count; i++) {
+			if (size - pos < (off_t) sizeof(CheckpointEntry))
+				return size;
+			pos += sizeof(CheckpointEntry) + ((CheckpointEntry *) (buf + pos))->namelen;
+		}
+	}
+	else
+		pos += (off_t) node->count * (sizeof(int32_t) + FILE_CHUNK_SIZE);
+	return pos < size ? pos : size;
+}
+
+
+/*
+ * Creates the contents of a loaded file.
+ * Input:
+ *  - inumber: the new i-node
+ *  - node: its record in the checkpoint, followed by its chunks
+ */
+static void checkpoint_load_file(int inumber, CheckpointNode *node) {
+	char *p = (char *) (node + 1);
+
+	for (int i = 0; i < node->count; i++, p += sizeof(int32_t) + FILE_CHUNK_SIZE) {
+		int32_t index;
+		memcpy(&index, p, sizeof(index));
+		long offset = (long) index << FILE_CHUNK_BITS;
+		long len = node->size - offset < FILE_CHUNK_SIZE ? node->size - offset : FILE_CHUNK_SIZE;
+		if (index < 0 || len <= 0)
+			continue;
+		inode_write_file(inumber, offset, p + sizeof(int32_t), len);
+	}
+	inode_truncate_file(inumber, node->size);
+}
+
+
+/*
+ * Adds an entry to the list of entries to load.
+ */
+static void checkpoint_push(PendingEntry **stack, int *len, int *capacity, PendingEntry entry) {
+	if (*len == *capacity) {
+		*capacity = *capacity ? *capacity * 2 : 64;
+		*stack = realloc(*stack, sizeof(PendingEntry) * *capacity);
+		if (*stack == NULL) {
+			fprintf(stderr, "Error: allocating the checkpoint entries.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	(*stack)[(*len)++] = entry;
+}
+
+
+/*
+ * Loads a checkpoint into an empty file system (with just its root),
+ * walking the tree from the root. I-nodes get new numbers.
+ * Input:
+ *  - path: the checkpoint file
+ *  - lsn: where to store the lsn the checkpoint was taken at
+ * Returns: number of i-nodes loaded (0 if there is no checkpoint), or
+ *          FAIL if the checkpoint is not valid or does not fit in the
+ *          i-node table
+ */
+long checkpoint_load(char *path, uint64_t *lsn) {
+	off_t size;
+	char *buf;
+
+	*lsn = 0;
+	if (access(path, F_OK) < 0 && errno == ENOENT)
+		return 0;
+	if ((buf = checkpoint_read(path, &size)) == NULL) {
+		fprintf(stderr, "Error: %s is not a valid checkpoint\n", path);
+		return FAIL;
+	}
+
+	/* index the records by i-number */
+	int max = 0;
+	long loaded = 0;
+	for (off_t pos = sizeof(CheckpointHeader); pos < size; pos = checkpoint_next(buf, pos, size)) {
+		CheckpointNode *node = (CheckpointNode *) (buf + pos);
+		if (node->inumber < 0 || node->inumber >= INODE_TABLE_MAX) {
+			fprintf(stderr, "Error: checkpoint %s holds i-node %d\n", path, node->inumber);
+			free(buf);
+			return FAIL;
+		}
+		if (node->inumber >= max)
+			max = node->inumber + 1;
+	}
+	off_t *records = malloc(sizeof(off_t) * (max > 0 ? max : 1));
+	if (records == NULL) {
+		fprintf(stderr, "Error: allocating the checkpoint index.\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < max; i++)
+		records[i] = -1;
+	for (off_t pos = sizeof(CheckpointHeader); pos < size; pos = checkpoint_next(buf, pos, size))
+		records[((CheckpointNode *) (buf + pos))->inumber] = pos;
+
+	/* each i-node is loaded once, even from a damaged tree */
+	PendingEntry *stack = NULL;
+	int len = 0, capacity = 0;
+	if (max > FS_ROOT && records[FS_ROOT] >= 0)
+		checkpoint_push(&stack, &len, &capacity, (PendingEntry) { FS_ROOT, FREE_INODE, NULL, 0 });
+	while (len > 0) {
+		PendingEntry pending = stack[--len];
+		if (pending.parent != FREE_INODE &&
+		    (pending.inumber < 0 || pending.inumber >= max || records[pending.inumber] < 0 ||
+		     pending.namelen <= 0 || pending.namelen >= MAX_FILE_NAME))
+			continue;
+
+		off_t pos = records[pending.inumber];
+		CheckpointNode *node = (CheckpointNode *) (buf + pos);
+		records[pending.inumber] = -1;
+
+		int inumber = FS_ROOT;
+		if (pending.parent != FREE_INODE) {
+			char name[MAX_FILE_NAME];
+			memcpy(name, pending.name, pending.namelen);
+			name[pending.namelen] = '\0';
+			if ((inumber = inode_create(node->nodeType)) == FAIL) {
+				/* a partial tree is not loaded: the log replayed over it would be wrong */
+				fprintf(stderr, "Error: checkpoint %s holds more i-nodes than the table\n", path);
+				free(stack);
+				free(records);
+				free(buf);
+				return FAIL;
+			}
+			dir_add_entry(pending.parent, inumber, name);
+		}
+		loaded++;
+
+		if (node->nodeType != T_DIRECTORY) {
+			checkpoint_load_file(inumber, node);
+			continue;
+		}
+		pos += sizeof(CheckpointNode);
+		for (int i = 0; i < node->count; i++) {
+			CheckpointEntry *entry = (CheckpointEntry *) (buf + pos);
+			pos += sizeof(CheckpointEntry);
+			checkpoint_push(&stack, &len, &capacity, (PendingEntry) { entry->inumber, inumber, buf + pos, entry->namelen });
+			pos += entry->namelen;
+		}
+	}
+
+	CheckpointHeader *header = (CheckpointHeader *) buf;
+	*lsn = header->lsn;
+	free(stack);
+	free(records);
+	free(buf);
+	return loaded;
+}
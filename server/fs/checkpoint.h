@@ -0,0 +1,56 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+
+/*
+ * Checkpoints: compact binary images of every i-node, written while the
+ * file system keeps changing. A checkpoint starts at a quiescent cut (see
+ * inode_snapshot_begin); i-nodes changed afterwards are saved as they
+ * were by their first change, so the image is the file system at the
+ * cut. The lsn of the last change logged before the cut is stored with
+ * it, and recovery replays the log from there.
+ *
+ * File layout: a CheckpointHeader, one CheckpointNode per i-node followed
+ * by its entries (directories: CheckpointEntry and name) or its chunks
+ * (files: int32 index and FILE_CHUNK_SIZE bytes, holes left out), and a
+ * CheckpointTrailer with a checksum of everything before it.
+ */
+#define CHECKPOINT_MAGIC 0x54465343 /* "TFSC" */
+#define CHECKPOINT_VERSION 1
+/* bytes buffered before a write */
+#define CHECKPOINT_BUFFER_SIZE (1 << 20)
+/* bytes written between asking the kernel to write them back, so the
+ * final sync does not flood the disk the log syncs to */
+#define CHECKPOINT_WRITEBACK (16 << 20)
+/* i-nodes saved between writing out those saved by changes meanwhile */
+#define CHECKPOINT_DRAIN 1024
+
+typedef struct checkpointHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t lsn; /* last change logged before the cut */
+} CheckpointHeader;
+
+typedef struct checkpointNode {
+	int32_t inumber;
+	int32_t nodeType;
+	int64_t size; /* files: bytes */
+	int32_t count; /* entries of a directory, chunks of a file */
+	int32_t unused;
+} CheckpointNode;
+
+typedef struct checkpointEntry {
+	int32_t inumber;
+	uint16_t namelen; /* bytes of the name that follows, no NUL */
+} __attribute__((packed)) CheckpointEntry;
+
+typedef struct checkpointTrailer {
+	uint64_t nodes;
+	uint64_t checksum; /* wal_hash of the bytes before the trailer */
+} CheckpointTrailer;
+
+long checkpoint_write(char *path, uint64_t lsn, int count);
+long checkpoint_load(char *path, uint64_t *lsn);
+
+#endif /* CHECKPOINT_H */
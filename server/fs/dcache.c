@@ -0,0 +1,326 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "dcache.h"
+#include "state.h"
+#include "epoch.h"
+
+/*
+ * Readers walk the bucket chains without locks, inside an epoch critical
+ * section. Writers (inserts and invalidations) serialize on tree_mutex,
+ * which also guards the parent/children links, publish chain links with
+ * release stores and retire the entries they unlink.
+ */
+static DcacheEntry *buckets[DCACHE_BUCKETS];
+
+/* hit/miss counters are per thread so probes share no cache line */
+typedef struct dcacheCounters {
+	unsigned long hits;
+	unsigned long misses;
+	struct dcacheCounters *next;
+} __attribute__((aligned(CACHE_LINE))) DcacheCounters;
+
+static DcacheCounters *counters = NULL;
+static __thread DcacheCounters *my_counters = NULL;
+
+static pthread_mutex_t tree_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* incremented by every invalidation, see dcache_snapshot */
+static unsigned long invalidations = 0;
+static int count = 0;
+
+
+/*
+ * Hashes a normalized path (FNV-1a).
+ */
+static unsigned int path_hash(char *path) {
+	unsigned int hash = 2166136261u;
+	for (; *path; path++) {
+		hash ^= (unsigned char) *path;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/*
+ * Returns the calling thread's counters, registering them on first use.
+ */
+static DcacheCounters *thread_counters() {
+	if (my_counters != NULL)
+		return my_counters;
+
+	DcacheCounters *c;
+	if (posix_memalign((void **) &c, CACHE_LINE, sizeof(DcacheCounters)) != 0) {
+		fprintf(stderr, "Error: allocating dcache counters.\n");
+		exit(EXIT_FAILURE);
+	}
+	c->hits = 0;
+	c->misses = 0;
+	c->next = __atomic_load_n(&counters, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&counters, &c->next, c, true,
+	                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	my_counters = c;
+	return c;
+}
+
+
+/*
+ * Finds the entry of a normalized path. The caller must hold tree_mutex
+ * or be inside an epoch critical section.
+ */
+static DcacheEntry *find_entry(char *path, unsigned int hash) {
+	DcacheEntry *entry = __atomic_load_n(&buckets[hash % DCACHE_BUCKETS], __ATOMIC_ACQUIRE);
+	for (; entry != NULL; entry = __atomic_load_n(&entry->next, __ATOMIC_ACQUIRE)) {
+		if (entry->hash == hash && strcmp(entry->path, path) == 0)
+			return entry;
+	}
+	return NULL;
+}
+
+
+/*
+ * Removes an entry and every entry below it. The caller must hold
+ * tree_mutex.
+ */
+static void remove_subtree(DcacheEntry *entry) {
+	while (entry->children != NULL)
+		remove_subtree(entry->children);
+
+	if (entry->parent != NULL) {
+		DcacheEntry **link = &entry->parent->children;
+		while (*link != entry)
+			link = &(*link)->sibling;
+		*link = entry->sibling;
+	}
+
+	DcacheEntry **link = &buckets[entry->hash % DCACHE_BUCKETS];
+	while (*link != entry)
+		link = &(*link)->next;
+	__atomic_store_n(link, entry->next, __ATOMIC_RELEASE);
+
+	/* lock-free readers may still be looking at the entry */
+	epoch_retire(entry, free);
+	count--;
+}
+
+
+/*
+ * Initializes the path cache.
+ */
+void dcache_init() {
+	for (int i = 0; i < DCACHE_BUCKETS; i++) {
+		buckets[i] = NULL;
+	}
+	for (DcacheCounters *c = counters; c != NULL; c = c->next) {
+		c->hits = 0;
+		c->misses = 0;
+	}
+	invalidations = 0;
+	count = 0;
+}
+
+
+/*
+ * Releases every cached entry.
+ */
+void dcache_destroy() {
+	for (int i = 0; i < DCACHE_BUCKETS; i++) {
+		while (buckets[i] != NULL) {
+			DcacheEntry *entry = buckets[i];
+			buckets[i] = entry->next;
+			free(entry);
+		}
+	}
+	count = 0;
+}
+
+
+/*
+ * Writes a path without leading, trailing or repeated slashes.
+ * Input:
+ *  - path: the path to normalize
+ *  - normalized: buffer of MAX_FILE_NAME bytes for the result
+ * Returns: length of the normalized path, FAIL if it does not fit
+ */
+int dcache_normalize(char *path, char *normalized) {
+	int len = 0;
+
+	for (; *path; path++) {
+		if (*path == '/' && (len == 0 || normalized[len - 1] == '/'))
+			continue;
+		if (len == MAX_FILE_NAME - 1)
+			return FAIL;
+		normalized[len++] = *path;
+	}
+	if (len > 0 && normalized[len - 1] == '/')
+		len--;
+	normalized[len] = '\0';
+	return len;
+}
+
+
+/*
+ * Returns a token to pass to dcache_insert_path. Take it before resolving a
+ * path: if the path is invalidated meanwhile, the insert is dropped so
+ * a stale i-number is never cached.
+ */
+unsigned long dcache_snapshot() {
+	return __atomic_load_n(&invalidations, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * Resolves a path with a single probe.
+ * Input:
+ *  - path: path of node
+ * Returns:
+ *  inumber: the node's i-number, if cached
+ *     FAIL: otherwise
+ */
+int dcache_lookup(char *path) {
+	char normalized[MAX_FILE_NAME];
+
+	if (dcache_normalize(path, normalized) <= 0)
+		return FAIL;
+
+	unsigned int hash = path_hash(normalized);
+	DcacheCounters *c = thread_counters();
+	int inumber = FAIL;
+
+	epoch_enter();
+	DcacheEntry *entry = find_entry(normalized, hash);
+	if (entry != NULL)
+		inumber = entry->inumber;
+	epoch_exit();
+
+	/* only this thread writes its counters */
+	if (inumber != FAIL)
+		__atomic_store_n(&c->hits, c->hits + 1, __ATOMIC_RELAXED);
+	else
+		__atomic_store_n(&c->misses, c->misses + 1, __ATOMIC_RELAXED);
+	return inumber;
+}
+
+
+/*
+ * Caches a resolved path whose parent path is cached. The caller must
+ * hold tree_mutex.
+ * Returns: SUCCESS, or FAIL if it could not be cached
+ */
+static int insert_entry(char *path, int inumber) {
+	unsigned int hash = path_hash(path);
+	DcacheEntry *parent = NULL;
+
+	if (count >= DCACHE_MAX_ENTRIES)
+		return FAIL;
+	if (find_entry(path, hash) != NULL)
+		return SUCCESS;
+
+	char *slash = strrchr(path, '/');
+	if (slash != NULL) {
+		*slash = '\0';
+		parent = find_entry(path, path_hash(path));
+		*slash = '/';
+		if (parent == NULL)
+			return FAIL;
+	}
+
+	DcacheEntry *entry = malloc(sizeof(DcacheEntry));
+	if (entry == NULL)
+		return FAIL;
+	strcpy(entry->path, path);
+	entry->hash = hash;
+	entry->inumber = inumber;
+	entry->children = NULL;
+	entry->parent = parent;
+	if (parent != NULL) {
+		entry->sibling = parent->children;
+		parent->children = entry;
+	}
+	else {
+		entry->sibling = NULL;
+	}
+
+	entry->next = buckets[hash % DCACHE_BUCKETS];
+	__atomic_store_n(&buckets[hash % DCACHE_BUCKETS], entry, __ATOMIC_RELEASE);
+
+	count++;
+	return SUCCESS;
+}
+
+
+/*
+ * Caches the prefixes of a resolved path. Paths below root are only
+ * cached when their parent path is, so invalidating a directory reaches
+ * every entry below. Prefixes already cached, as all are once the path
+ * was resolved before, are found without taking tree_mutex, which is
+ * taken once to insert the rest.
+ * Input:
+ *  - path: normalized path of node
+ *  - inumbers: i-number of each component resolved
+ *  - ends: length of the path prefix of each component resolved
+ *  - depth: number of components resolved
+ *  - snapshot: value of dcache_snapshot taken before resolving the path
+ */
+void dcache_insert_path(char *path, int *inumbers, int *ends, int depth, unsigned long snapshot) {
+	char prefix[MAX_FILE_NAME];
+	int missing = depth;
+
+	/* the deepest cached prefix, as its parents are cached too */
+	epoch_enter();
+	while (missing > 0) {
+		memcpy(prefix, path, ends[missing - 1]);
+		prefix[ends[missing - 1]] = '\0';
+		if (find_entry(prefix, path_hash(prefix)) != NULL)
+			break;
+		missing--;
+	}
+	epoch_exit();
+	if (missing == depth)
+		return;
+
+	pthread_mutex_lock(&tree_mutex);
+	if (invalidations == snapshot) {
+		for (; missing < depth; missing++) {
+			memcpy(prefix, path, ends[missing]);
+			prefix[ends[missing]] = '\0';
+			if (insert_entry(prefix, inumbers[missing]) == FAIL)
+				break;
+		}
+	}
+	pthread_mutex_unlock(&tree_mutex);
+}
+
+
+/*
+ * Drops a path and everything cached below it. Call it after changing
+ * the file system, while still holding the i-node locks.
+ * Input:
+ *  - path: path of node
+ */
+void dcache_invalidate(char *path) {
+	char normalized[MAX_FILE_NAME];
+
+	if (dcache_normalize(path, normalized) <= 0)
+		return;
+
+	pthread_mutex_lock(&tree_mutex);
+	__atomic_fetch_add(&invalidations, 1, __ATOMIC_RELEASE);
+	DcacheEntry *entry = find_entry(normalized, path_hash(normalized));
+	if (entry != NULL)
+		remove_subtree(entry);
+	pthread_mutex_unlock(&tree_mutex);
+}
+
+
+/*
+ * Reads the hit and miss counters of dcache_lookup.
+ */
+void dcache_stats(unsigned long *hits, unsigned long *misses) {
+	*hits = 0;
+	*misses = 0;
+	for (DcacheCounters *c = __atomic_load_n(&counters, __ATOMIC_ACQUIRE); c != NULL; c = c->next) {
+		*hits += __atomic_load_n(&c->hits, __ATOMIC_RELAXED);
+		*misses += __atomic_load_n(&c->misses, __ATOMIC_RELAXED);
+	}
+}
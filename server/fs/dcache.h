@@ -0,0 +1,33 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include "../../tecnicofs-api-constants.h"
+
+/* the cache maps full paths to i-numbers */
+#define DCACHE_BUCKETS (1 << 16)
+#define DCACHE_MAX_ENTRIES (1 << 20)
+
+/*
+ * A cached path. Entries form a tree mirroring the file system, so the
+ * entries below a path can be dropped together when it is moved.
+ */
+typedef struct dcacheEntry {
+	char path[MAX_FILE_NAME]; /* normalized path, without leading slash */
+	unsigned int hash;
+	int inumber;
+	struct dcacheEntry *next; /* next entry of the hash bucket */
+	struct dcacheEntry *parent; /* entry of the parent path, NULL below root */
+	struct dcacheEntry *children; /* first entry one level below */
+	struct dcacheEntry *sibling; /* next entry with the same parent */
+} DcacheEntry;
+
+void dcache_init();
+void dcache_destroy();
+int dcache_normalize(char *path, char *normalized);
+unsigned long dcache_snapshot();
+int dcache_lookup(char *path);
+void dcache_insert_path(char *path, int *inumbers, int *ends, int depth, unsigned long snapshot);
+void dcache_invalidate(char *path);
+void dcache_stats(unsigned long *hits, unsigned long *misses);
+
+#endif /* DCACHE_H */
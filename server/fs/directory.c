@@ -0,0 +1,302 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "state.h"
+#include "epoch.h"
+#include "slab.h"
+
+#define DIR_TABLE_SIZE(capacity) (sizeof(DirTable) + sizeof(DirEntry) * (capacity))
+
+/* tables up to DIR_SLAB_MAX_CAPACITY slots come from slabs, one cache per
+   capacity; larger ones are rare and come from malloc. Directories of a
+   mapped image come from the image instead. */
+#define DIR_SLAB_MAX_CAPACITY 64
+
+static SlabCache dir_cache = SLAB_CACHE("directories", sizeof(Directory));
+static SlabCache table_caches[] = {
+    SLAB_CACHE("dir tables 8", DIR_TABLE_SIZE(8)),
+    SLAB_CACHE("dir tables 16", DIR_TABLE_SIZE(16)),
+    SLAB_CACHE("dir tables 32", DIR_TABLE_SIZE(32)),
+    SLAB_CACHE("dir tables 64", DIR_TABLE_SIZE(64))
+};
+
+
+/*
+ * Hashes an entry name (FNV-1a).
+ * Input:
+ *  - name: entry name
+ * Returns: the hash of name
+ */
+static unsigned int dir_hash(char *name) {
+    unsigned int hash = 2166136261u;
+    for (; *name; name++) {
+        hash ^= (unsigned char) *name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+/*
+ * Allocates a table of free slots.
+ * Input:
+ *  - capacity: number of slots
+ * Returns: the table
+ */
+static DirTable *dir_alloc_table(int capacity) {
+    DirTable *table;
+    if (arena_base != NULL)
+        table = arena_alloc(DIR_TABLE_SIZE(capacity));
+    else if (capacity <= DIR_SLAB_MAX_CAPACITY)
+        table = slab_alloc(&table_caches[__builtin_ctz(capacity / DIR_MIN_CAPACITY)]);
+    else
+        table = malloc(DIR_TABLE_SIZE(capacity));
+    if (table == NULL) {
+        fprintf(stderr, "Error: allocating directory entries.\n");
+        exit(EXIT_FAILURE);
+    }
+    table->capacity = capacity;
+    for (int i = 0; i < capacity; i++) {
+        table->entries[i].inumber = FREE_INODE;
+        table->entries[i].name[0] = '\0';
+    }
+    return table;
+}
+
+
+/*
+ * Releases a table allocated by dir_alloc_table.
+ * Input:
+ *  - table: the table
+ */
+static void dir_free_table(void *table) {
+    if (arena_base != NULL)
+        arena_free(table, DIR_TABLE_SIZE(((DirTable *) table)->capacity));
+    else if (((DirTable *) table)->capacity <= DIR_SLAB_MAX_CAPACITY)
+        slab_free(table);
+    else
+        free(table);
+}
+
+
+/*
+ * Rehashes all entries of a directory into a new table. The old table is
+ * retired, since lock-free readers may still be probing it.
+ * Input:
+ *  - dir: the directory
+ *  - capacity: new number of slots, power of two
+ */
+static void dir_resize(Directory *dir, int capacity) {
+    DirTable *old = dir_table(dir);
+    DirTable *table = dir_alloc_table(capacity);
+    int mask = capacity - 1;
+
+    for (int i = 0; i < old->capacity; i++) {
+        if (old->entries[i].inumber == FREE_INODE)
+            continue;
+        int slot = old->entries[i].hash & mask;
+        while (table->entries[slot].inumber != FREE_INODE)
+            slot = (slot + 1) & mask;
+        table->entries[slot] = old->entries[i];
+    }
+    __atomic_store_n(&dir->table, ref_of(table), __ATOMIC_RELEASE);
+    epoch_retire(old, dir_free_table);
+}
+
+
+/*
+ * Finds the slot holding the given name.
+ * Input:
+ *  - table: the directory's slots
+ *  - name: entry name
+ *  - hash: hash of name
+ * Returns:
+ *  slot: index of the entry, if found
+ *  FAIL: otherwise
+ */
+static int dir_find_slot(DirTable *table, char *name, unsigned int hash) {
+    int mask = table->capacity - 1;
+
+    for (int slot = hash & mask; table->entries[slot].inumber != FREE_INODE; slot = (slot + 1) & mask) {
+        if (table->entries[slot].hash == hash && strcmp(table->entries[slot].name, name) == 0)
+            return slot;
+    }
+    return FAIL;
+}
+
+
+/*
+ * Releases a directory whose table has already been retired.
+ */
+static void dir_release(void *dir) {
+    if (arena_base != NULL)
+        arena_free(dir, sizeof(Directory));
+    else
+        slab_free(dir);
+}
+
+
+/*
+ * Creates an empty directory.
+ * Returns: the new directory
+ */
+Directory *dir_create() {
+    Directory *dir = arena_base != NULL ? arena_alloc(sizeof(Directory)) : slab_alloc(&dir_cache);
+    dir->count = 0;
+    dir->table = ref_of(dir_alloc_table(DIR_MIN_CAPACITY));
+    return dir;
+}
+
+
+/*
+ * Releases a directory and its entries once no lock-free reader can
+ * reach them.
+ * Input:
+ *  - dir: the directory
+ */
+void dir_destroy(Directory *dir) {
+    epoch_retire(dir_table(dir), dir_free_table);
+    epoch_retire(dir, dir_release);
+}
+
+
+/*
+ * Copies the slots of a directory, for a checkpoint. The copy comes from
+ * the heap and is released with free.
+ * Input:
+ *  - dir: the directory
+ * Returns: the copy
+ */
+DirTable *dir_copy(Directory *dir) {
+    DirTable *table = dir_table(dir);
+    DirTable *copy = malloc(DIR_TABLE_SIZE(table->capacity));
+    if (copy == NULL) {
+        fprintf(stderr, "Error: allocating a directory copy.\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(copy, table, DIR_TABLE_SIZE(table->capacity));
+    return copy;
+}
+
+
+/*
+ * Looks for an entry by name.
+ * Input:
+ *  - dir: the directory
+ *  - name: entry name
+ * Returns:
+ *  inumber: the entry's i-number, if found
+ *     FAIL: otherwise
+ */
+int dir_lookup(Directory *dir, char *name) {
+    DirTable *table = dir_table(dir);
+    int slot = dir_find_slot(table, name, dir_hash(name));
+    return slot == FAIL ? FAIL : table->entries[slot].inumber;
+}
+
+
+/*
+ * Looks for an entry by name without holding the directory's lock.
+ * Writers may change the table meanwhile, so the probe is bounded and
+ * the result may be wrong: callers must validate it against the
+ * i-node's version. Must run inside an epoch critical section.
+ * Input:
+ *  - dir: the directory
+ *  - name: entry name
+ * Returns:
+ *  inumber: the entry's i-number, if found
+ *     FAIL: otherwise
+ */
+int dir_lookup_optimistic(Directory *dir, char *name) {
+    DirTable *table = dir_table(dir);
+    unsigned int hash = dir_hash(name);
+    int mask = table->capacity - 1;
+    int slot = hash & mask;
+
+    for (int probes = 0; probes < table->capacity; probes++, slot = (slot + 1) & mask) {
+        DirEntry *entry = &table->entries[slot];
+        int inumber = __atomic_load_n(&entry->inumber, __ATOMIC_ACQUIRE);
+        if (inumber == FREE_INODE)
+            break;
+        if (__atomic_load_n(&entry->hash, __ATOMIC_RELAXED) == hash &&
+            strncmp(entry->name, name, MAX_FILE_NAME) == 0)
+            return inumber;
+    }
+    return FAIL;
+}
+
+
+/*
+ * Adds an entry, growing the table when it becomes 3/4 full.
+ * Input:
+ *  - dir: the directory
+ *  - name: entry name
+ *  - inumber: entry i-number
+ * Returns: SUCCESS or FAIL (if the name already exists)
+ */
+int dir_insert(Directory *dir, char *name, int inumber) {
+    unsigned int hash = dir_hash(name);
+
+    DirTable *table = dir_table(dir);
+
+    if (dir_find_slot(table, name, hash) != FAIL)
+        return FAIL;
+
+    if ((dir->count + 1) * 4 > table->capacity * 3) {
+        dir_resize(dir, table->capacity * 2);
+        table = dir_table(dir);
+    }
+
+    int mask = table->capacity - 1;
+    int slot = hash & mask;
+    while (table->entries[slot].inumber != FREE_INODE)
+        slot = (slot + 1) & mask;
+
+    strcpy(table->entries[slot].name, name);
+    table->entries[slot].hash = hash;
+    /* publish the slot once its name is in place */
+    __atomic_store_n(&table->entries[slot].inumber, inumber, __ATOMIC_RELEASE);
+    dir->count++;
+    return SUCCESS;
+}
+
+
+/*
+ * Removes an entry. Later entries of the probe sequence are shifted back
+ * into the freed slot, so no tombstones are needed. The table shrinks
+ * when it becomes 1/8 full.
+ * Input:
+ *  - dir: the directory
+ *  - name: entry name
+ * Returns:
+ *  inumber: the removed entry's i-number
+ *     FAIL: if there is no such entry
+ */
+int dir_remove(Directory *dir, char *name) {
+    DirTable *table = dir_table(dir);
+    int mask = table->capacity - 1;
+    int hole = dir_find_slot(table, name, dir_hash(name));
+
+    if (hole == FAIL)
+        return FAIL;
+
+    int inumber = table->entries[hole].inumber;
+
+    for (int slot = (hole + 1) & mask; table->entries[slot].inumber != FREE_INODE; slot = (slot + 1) & mask) {
+        int home = table->entries[slot].hash & mask;
+        /* move the entry back unless its home lies cyclically in (hole, slot] */
+        if ((slot > hole && (home <= hole || home > slot)) ||
+            (slot < hole && (home <= hole && home > slot))) {
+            table->entries[hole] = table->entries[slot];
+            hole = slot;
+        }
+    }
+    __atomic_store_n(&table->entries[hole].inumber, FREE_INODE, __ATOMIC_RELEASE);
+    table->entries[hole].name[0] = '\0';
+    dir->count--;
+
+    if (table->capacity > DIR_MIN_CAPACITY && dir->count * 8 < table->capacity)
+        dir_resize(dir, table->capacity / 2);
+
+    return inumber;
+}
@@ -0,0 +1,53 @@
+#ifndef DIRECTORY_H
+#define DIRECTORY_H
+
+#include "../../tecnicofs-api-constants.h"
+#include "arena.h"
+
+/* slots of an empty directory, always a power of two */
+#define DIR_MIN_CAPACITY 8
+
+/*
+ * Contains the name of the entry and respective i-number
+ */
+typedef struct dirEntry {
+	char name[MAX_FILE_NAME];
+	int inumber;
+	unsigned int hash; /* hash of name, compared before the name itself */
+} DirEntry;
+
+/*
+ * Slots of a directory. The capacity lives with the slots so lock-free
+ * readers always see a matching pair.
+ */
+typedef struct dirTable {
+	int capacity; /* number of slots, power of two */
+	DirEntry entries[];
+} DirTable;
+
+/*
+ * Directory contents: an open addressing hash table (linear probing)
+ * indexed by entry name, resized to keep lookups O(1). Tables replaced
+ * by a resize are released through epoch_retire.
+ */
+typedef struct directory {
+	int count; /* number of entries in use */
+	Ref table; /* DirTable, see dir_table */
+} Directory;
+
+/*
+ * Returns the current slots of a directory.
+ */
+static inline DirTable *dir_table(Directory *dir) {
+	return ref_ptr(__atomic_load_n(&dir->table, __ATOMIC_ACQUIRE));
+}
+
+Directory *dir_create();
+void dir_destroy(Directory *dir);
+DirTable *dir_copy(Directory *dir);
+int dir_lookup(Directory *dir, char *name);
+int dir_lookup_optimistic(Directory *dir, char *name);
+int dir_insert(Directory *dir, char *name, int inumber);
+int dir_remove(Directory *dir, char *name);
+
+#endif /* DIRECTORY_H */
@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "epoch.h"
+#include "state.h"
+
+#define EPOCH_ACTIVE 1UL
+
+typedef struct retired {
+	void *ptr;
+	void (*release)(void *);
+	unsigned long epoch; /* global epoch when the object was retired */
+	struct retired *next;
+} Retired;
+
+/*
+ * Per-thread state. state is zero while the thread is outside a critical
+ * section, and (epoch << 1) | EPOCH_ACTIVE while inside one.
+ */
+typedef struct epochRecord {
+	unsigned long state;
+	int nesting;
+	int nretired;
+	Retired *retired; /* newest first */
+	struct epochRecord *next;
+} __attribute__((aligned(CACHE_LINE))) EpochRecord;
+
+static struct {
+	unsigned long epoch;
+	char pad[CACHE_LINE - sizeof(unsigned long)];
+} global __attribute__((aligned(CACHE_LINE)));
+
+/* every thread that ever entered a critical section, never shrinks */
+static EpochRecord *records = NULL;
+static __thread EpochRecord *self = NULL;
+
+
+/*
+ * Returns the calling thread's record, registering it on first use.
+ */
+static EpochRecord *epoch_self() {
+	if (self != NULL)
+		return self;
+
+	EpochRecord *record;
+	if (posix_memalign((void **) &record, CACHE_LINE, sizeof(EpochRecord)) != 0) {
+		fprintf(stderr, "Error: allocating epoch record.\n");
+		exit(EXIT_FAILURE);
+	}
+	record->state = 0;
+	record->nesting = 0;
+	record->nretired = 0;
+	record->retired = NULL;
+	record->next = __atomic_load_n(&records, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&records, &record->next, record, true,
+	                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	self = record;
+	return record;
+}
+
+
+/*
+ * Advances the global epoch if every thread inside a critical section
+ * has already observed the current one.
+ */
+static void epoch_try_advance() {
+	unsigned long epoch = __atomic_load_n(&global.epoch, __ATOMIC_ACQUIRE);
+
+	for (EpochRecord *r = __atomic_load_n(&records, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+		unsigned long state = __atomic_load_n(&r->state, __ATOMIC_ACQUIRE);
+		if ((state & EPOCH_ACTIVE) && (state >> 1) != epoch)
+			return;
+	}
+	__atomic_compare_exchange_n(&global.epoch, &epoch, epoch + 1, false,
+	                            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Releases the calling thread's retired objects that no reader can
+ * reference anymore: those retired two or more epochs ago.
+ */
+static void epoch_reclaim(EpochRecord *record) {
+	unsigned long epoch = __atomic_load_n(&global.epoch, __ATOMIC_ACQUIRE);
+	Retired **link = &record->retired;
+
+	while (*link != NULL) {
+		Retired *r = *link;
+		if (r->epoch + 2 <= epoch) {
+			*link = r->next;
+			r->release(r->ptr);
+			free(r);
+			record->nretired--;
+		}
+		else {
+			link = &r->next;
+		}
+	}
+}
+
+
+/*
+ * Starts a read-side critical section. Critical sections may nest.
+ */
+void epoch_enter() {
+	EpochRecord *record = epoch_self();
+
+	if (record->nesting++ > 0)
+		return;
+	unsigned long epoch = __atomic_load_n(&global.epoch, __ATOMIC_RELAXED);
+	__atomic_store_n(&record->state, (epoch << 1) | EPOCH_ACTIVE, __ATOMIC_RELAXED);
+	/* the announcement must be visible before any shared pointer is read */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+
+/*
+ * Ends a read-side critical section.
+ */
+void epoch_exit() {
+	EpochRecord *record = self;
+
+	if (--record->nesting > 0)
+		return;
+	__atomic_store_n(&record->state, 0, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Defers the release of an object that has been unlinked from every
+ * shared structure.
+ * Input:
+ *  - ptr: the object
+ *  - release: function that frees it
+ */
+void epoch_retire(void *ptr, void (*release)(void *)) {
+	EpochRecord *record = epoch_self();
+	Retired *r = malloc(sizeof(Retired));
+
+	if (r == NULL) {
+		fprintf(stderr, "Error: allocating retired object.\n");
+		exit(EXIT_FAILURE);
+	}
+	r->ptr = ptr;
+	r->release = release;
+	r->epoch = __atomic_load_n(&global.epoch, __ATOMIC_ACQUIRE);
+	r->next = record->retired;
+	record->retired = r;
+
+	if (++record->nretired >= EPOCH_RECLAIM_BATCH) {
+		epoch_try_advance();
+		epoch_reclaim(record);
+	}
+}
+
+
+/*
+ * Releases every retired object of every thread. Only call it when no
+ * other thread is running, e.g. on shutdown.
+ */
+void epoch_drain() {
+	for (EpochRecord *r = records; r != NULL; r = r->next) {
+		while (r->retired != NULL) {
+			Retired *retired = r->retired;
+			r->retired = retired->next;
+			retired->release(retired->ptr);
+			free(retired);
+		}
+		r->nretired = 0;
+	}
+}
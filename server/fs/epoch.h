@@ -0,0 +1,19 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/*
+ * Epoch-based reclamation. Threads that read shared structures without
+ * locks do so between epoch_enter and epoch_exit. Memory unlinked by a
+ * writer is handed to epoch_retire and only released once every thread
+ * that could still hold a reference to it has left its critical section.
+ */
+
+/* retired objects a thread accumulates before trying to reclaim */
+#define EPOCH_RECLAIM_BATCH 64
+
+void epoch_enter();
+void epoch_exit();
+void epoch_retire(void *ptr, void (*release)(void *));
+void epoch_drain();
+
+#endif /* EPOCH_H */
@@ -0,0 +1,500 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "filedata.h"
+#include "state.h"
+#include "slab.h"
+
+static SlabCache file_cache = SLAB_CACHE("files", sizeof(FileData));
+static SlabCache chunk_cache = SLAB_CACHE("file chunks", FILE_CHUNK_SIZE);
+/* what holes read as */
+static const char zero_chunk[FILE_CHUNK_SIZE];
+/* serializes destroying a file with releasing its snapshot */
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Chunks pinned by reads being sent, see file_read_pinned. Pins are only
+ * taken with the file read-locked, so a writer, holding it write-locked,
+ * sees every pin on its chunks or none: when none is held anywhere, the
+ * table is not even looked at.
+ */
+#define PIN_BUCKETS 256
+
+typedef struct pinnedChunk {
+    Ref chunk;
+    int pins;
+    int released; /* the file let go of it, freed on the last unpin */
+    struct pinnedChunk *next;
+} PinnedChunk;
+
+static PinnedChunk *pinned[PIN_BUCKETS];
+static long npinned = 0;
+static pthread_mutex_t pin_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ * Returns the references to the chunks of a file.
+ */
+static inline Ref *file_chunks(FileData *file) {
+    return ref_ptr(file->chunks);
+}
+
+
+/*
+ * Allocates an object of a file: from the image if one is mapped, from
+ * the given cache otherwise.
+ */
+static void *file_alloc(SlabCache *cache) {
+    return arena_base != NULL ? arena_alloc(cache->size) : slab_alloc(cache);
+}
+
+
+/*
+ * Releases an object allocated by file_alloc.
+ */
+static void file_free(SlabCache *cache, void *ptr) {
+    if (arena_base != NULL)
+        arena_free(ptr, cache->size);
+    else
+        slab_free(ptr);
+}
+
+
+/*
+ * Finds the pin of a chunk. Called with pin_lock held.
+ * Returns: the link to it, pointing to NULL if it is not pinned
+ */
+static PinnedChunk **pin_find(Ref chunk) {
+    PinnedChunk **link = &pinned[(chunk / FILE_CHUNK_SIZE) % PIN_BUCKETS];
+    while (*link != NULL && (*link)->chunk != chunk)
+        link = &(*link)->next;
+    return link;
+}
+
+
+/*
+ * Checks whether a read being sent uses a chunk, which may then not be
+ * changed in place.
+ */
+static int chunk_pinned(Ref chunk) {
+    if (__atomic_load_n(&npinned, __ATOMIC_ACQUIRE) == 0)
+        return false;
+
+    pthread_mutex_lock(&pin_lock);
+    int found = *pin_find(chunk) != NULL;
+    pthread_mutex_unlock(&pin_lock);
+    return found;
+}
+
+
+/*
+ * Releases a chunk no file or snapshot uses any more, once no read being
+ * sent uses it either.
+ */
+static void chunk_free(Ref chunk) {
+    if (__atomic_load_n(&npinned, __ATOMIC_ACQUIRE) > 0) {
+        pthread_mutex_lock(&pin_lock);
+        PinnedChunk *pin = *pin_find(chunk);
+        if (pin != NULL)
+            pin->released = true;
+        pthread_mutex_unlock(&pin_lock);
+        if (pin != NULL)
+            return;
+    }
+    file_free(&chunk_cache, ref_ptr(chunk));
+}
+
+
+/*
+ * Checks whether a chunk of a file is shared with its snapshot, and so
+ * may not be changed or released.
+ * Input:
+ *  - file: the file contents
+ *  - index: index of the chunk
+ */
+static inline int file_shared(FileData *file, int index) {
+    FileSnapshot *snap = file->snapshot;
+    return snap != NULL && index < snap->capacity && snap->chunks[index] != 0 &&
+           snap->chunks[index] == file_chunks(file)[index];
+}
+
+
+/*
+ * Gives a file its own copy of a chunk shared with its snapshot or
+ * pinned by a read being sent.
+ * Input:
+ *  - file: the file contents
+ *  - index: index of the chunk
+ * Returns: the chunk, now the file's only
+ */
+static char *file_unshare(FileData *file, int index) {
+    Ref *chunks = file_chunks(file);
+    int shared = file_shared(file, index);
+    if (shared || chunk_pinned(chunks[index])) {
+        Ref old = chunks[index];
+        char *copy = file_alloc(&chunk_cache);
+        memcpy(copy, ref_ptr(old), FILE_CHUNK_SIZE);
+        chunks[index] = ref_of(copy);
+        /* a snapshot releases the chunks it shared itself */
+        if (!shared)
+            chunk_free(old);
+    }
+    return ref_ptr(chunks[index]);
+}
+
+
+/*
+ * Allocates the contents of an empty file.
+ * Returns: the file contents
+ */
+FileData *file_create() {
+    FileData *file = file_alloc(&file_cache);
+    file->size = 0;
+    file->capacity = 0;
+    file->chunks = 0;
+    file->snapshot = NULL;
+    return file;
+}
+
+
+/*
+ * Releases the contents of a file. Chunks shared with a snapshot are
+ * left to it.
+ * Input:
+ *  - file: the file contents
+ */
+void file_destroy(FileData *file) {
+    Ref *chunks = file_chunks(file);
+
+    pthread_mutex_lock(&snapshot_lock);
+    for (int i = 0; i < file->capacity; i++)
+        if (chunks[i] && !file_shared(file, i))
+            chunk_free(chunks[i]);
+    if (file->snapshot != NULL)
+        file->snapshot->orphaned = true;
+    pthread_mutex_unlock(&snapshot_lock);
+
+    pfree(chunks, sizeof(Ref) * file->capacity);
+    file_free(&file_cache, file);
+}
+
+
+/*
+ * Returns the size of a file in bytes.
+ * Input:
+ *  - file: the file contents
+ */
+long file_size(FileData *file) {
+    return file->size;
+}
+
+
+/*
+ * Makes room for at least count chunk references. Only the reference
+ * array is copied, never the chunks.
+ * Input:
+ *  - file: the file contents
+ *  - count: number of chunks needed
+ */
+static void file_reserve(FileData *file, int count) {
+    if (count <= file->capacity)
+        return;
+
+    int capacity = file->capacity ? file->capacity : 1;
+    while (capacity < count)
+        capacity *= 2;
+
+    Ref *old = file_chunks(file);
+    Ref *chunks = pmalloc(sizeof(Ref) * capacity);
+    if (old != NULL)
+        memcpy(chunks, old, sizeof(Ref) * file->capacity);
+    memset(chunks + file->capacity, 0, sizeof(Ref) * (capacity - file->capacity));
+    pfree(old, sizeof(Ref) * file->capacity);
+    file->chunks = ref_of(chunks);
+    file->capacity = capacity;
+}
+
+
+/*
+ * Writes len bytes at offset, extending the file (with zeros between its
+ * old end and offset) if needed.
+ * Input:
+ *  - file: the file contents
+ *  - offset: position of the first byte to write
+ *  - buf: the bytes
+ *  - len: number of bytes
+ * Returns: number of bytes written, or FAIL if the file would exceed
+ *  FILE_MAX_SIZE
+ */
+int file_write(FileData *file, long offset, char *buf, int len) {
+    if (offset < 0 || len < 0 || offset > FILE_MAX_SIZE - (long) len)
+        return FAIL;
+    if (len == 0)
+        return 0;
+
+    file_reserve(file, (offset + len + FILE_CHUNK_SIZE - 1) >> FILE_CHUNK_BITS);
+
+    Ref *chunks = file_chunks(file);
+    for (int done = 0; done < len; ) {
+        long pos = offset + done;
+        int index = pos >> FILE_CHUNK_BITS;
+        int start = pos & (FILE_CHUNK_SIZE - 1);
+        int count = FILE_CHUNK_SIZE - start;
+        if (count > len - done)
+            count = len - done;
+
+        if (chunks[index] == 0) {
+            char *chunk = file_alloc(&chunk_cache);
+            /* only clear what this write does not cover */
+            memset(chunk, 0, start);
+            memset(chunk + start + count, 0, FILE_CHUNK_SIZE - start - count);
+            chunks[index] = ref_of(chunk);
+        }
+        memcpy(file_unshare(file, index) + start, buf + done, count);
+        done += count;
+    }
+
+    if (offset + len > file->size)
+        file->size = offset + len;
+    return len;
+}
+
+
+/*
+ * Describes up to len bytes from offset as pieces of the file's chunks,
+ * storing the chunk of each piece in chunks, if not NULL (0 for holes).
+ */
+static int file_describe(FileData *file, long offset, int len, struct iovec *iov, int maxiov, int *niov,
+                         Ref *chunks) {
+    int done = 0;
+
+    *niov = 0;
+    if (offset < 0 || len < 0)
+        return FAIL;
+    if (offset >= file->size)
+        return 0;
+    if (len > file->size - offset)
+        len = file->size - offset;
+
+    while (done < len && *niov < maxiov) {
+        long pos = offset + done;
+        int index = pos >> FILE_CHUNK_BITS;
+        int start = pos & (FILE_CHUNK_SIZE - 1);
+        int count = FILE_CHUNK_SIZE - start;
+        if (count > len - done)
+            count = len - done;
+
+        Ref chunk = index < file->capacity ? file_chunks(file)[index] : 0;
+        iov[*niov].iov_base = (char *) (chunk ? ref_ptr(chunk) : zero_chunk) + start;
+        iov[*niov].iov_len = count;
+        if (chunks != NULL)
+            chunks[*niov] = chunk;
+        (*niov)++;
+        done += count;
+    }
+    return done;
+}
+
+
+/*
+ * Describes up to len bytes from offset as pieces of the file's chunks,
+ * without copying them. The pieces stay valid until the file is next
+ * written or truncated.
+ * Input:
+ *  - file: the file contents
+ *  - offset: position of the first byte to read
+ *  - len: maximum number of bytes
+ *  - iov: where to store the pieces
+ *  - maxiov: room in iov
+ *  - niov: where to store the number of pieces used
+ * Returns: number of bytes described (less than len at the end of the
+ *  file or when iov is full), or FAIL for a negative offset or length
+ */
+int file_read_iov(FileData *file, long offset, int len, struct iovec *iov, int maxiov, int *niov) {
+    return file_describe(file, offset, len, iov, maxiov, niov, NULL);
+}
+
+
+/*
+ * Like file_read_iov, but the pieces stay valid and unchanged until
+ * file_unpin, however the file changes meanwhile: writes copy a pinned
+ * chunk before changing it, and a pinned chunk released is only freed on
+ * its last unpin. So the file's lock can be dropped before the pieces
+ * are sent. Called with the file read-locked.
+ * Input:
+ *  - file: the file contents
+ *  - offset: position of the first byte to read
+ *  - len: maximum number of bytes
+ *  - iov: where to store the pieces
+ *  - maxiov: room in iov
+ *  - niov: where to store the number of pieces used
+ *  - chunks: room for maxiov chunks, to pass to file_unpin
+ * Returns: number of bytes described, or FAIL for a negative offset or
+ *  length
+ */
+int file_read_pinned(FileData *file, long offset, int len, struct iovec *iov, int maxiov, int *niov,
+                     Ref *chunks) {
+    int done = file_describe(file, offset, len, iov, maxiov, niov, chunks);
+
+    pthread_mutex_lock(&pin_lock);
+    for (int i = 0; i < *niov; i++) {
+        if (chunks[i] == 0)
+            continue;
+        PinnedChunk **link = pin_find(chunks[i]);
+        if (*link == NULL) {
+            PinnedChunk *pin = malloc(sizeof(PinnedChunk));
+            if (pin == NULL) {
+                fprintf(stderr, "Error: allocating a chunk pin.\n");
+                exit(EXIT_FAILURE);
+            }
+            pin->chunk = chunks[i];
+            pin->pins = 0;
+            pin->released = false;
+            pin->next = NULL;
+            *link = pin;
+            __atomic_add_fetch(&npinned, 1, __ATOMIC_RELEASE);
+        }
+        (*link)->pins++;
+    }
+    pthread_mutex_unlock(&pin_lock);
+    return done;
+}
+
+
+/*
+ * Lets go of the chunks of a read, freeing those no file uses any more.
+ * Input:
+ *  - chunks: as stored by file_read_pinned
+ *  - count: the number of pieces it described
+ */
+void file_unpin(Ref *chunks, int count) {
+    pthread_mutex_lock(&pin_lock);
+    for (int i = 0; i < count; i++) {
+        if (chunks[i] == 0)
+            continue;
+        PinnedChunk **link = pin_find(chunks[i]);
+        PinnedChunk *pin = *link;
+        if (--pin->pins > 0)
+            continue;
+        *link = pin->next;
+        __atomic_sub_fetch(&npinned, 1, __ATOMIC_RELEASE);
+        if (pin->released)
+            file_free(&chunk_cache, ref_ptr(pin->chunk));
+        free(pin);
+    }
+    pthread_mutex_unlock(&pin_lock);
+}
+
+
+/*
+ * Copies up to len bytes from offset into buf.
+ * Input:
+ *  - file: the file contents
+ *  - offset: position of the first byte to read
+ *  - buf: destination
+ *  - len: maximum number of bytes
+ * Returns: number of bytes read (less than len at the end of the file),
+ *  or FAIL for a negative offset or length
+ */
+int file_read(FileData *file, long offset, char *buf, int len) {
+    struct iovec iov[16];
+    int done = 0;
+
+    while (done < len) {
+        int niov;
+        int count = file_read_iov(file, offset + done, len - done, iov, 16, &niov);
+        if (count <= 0)
+            return done ? done : count;
+        for (int i = 0; i < niov; i++) {
+            memcpy(buf + done, iov[i].iov_base, iov[i].iov_len);
+            done += iov[i].iov_len;
+        }
+    }
+    return done;
+}
+
+
+/*
+ * Sets the size of a file. Shrinking releases the chunks past the new
+ * end; growing leaves a hole.
+ * Input:
+ *  - file: the file contents
+ *  - size: the new size in bytes
+ * Returns: SUCCESS or FAIL for a size out of range
+ */
+int file_truncate(FileData *file, long size) {
+    if (size < 0 || size > FILE_MAX_SIZE)
+        return FAIL;
+
+    if (size < file->size) {
+        Ref *chunks = file_chunks(file);
+        int keep = (size + FILE_CHUNK_SIZE - 1) >> FILE_CHUNK_BITS;
+        for (int i = keep; i < file->capacity; i++) {
+            if (chunks[i] && !file_shared(file, i))
+                chunk_free(chunks[i]);
+            chunks[i] = 0;
+        }
+        /* keep the tail of the last chunk zeroed */
+        int start = size & (FILE_CHUNK_SIZE - 1);
+        if (start && keep <= file->capacity && chunks[keep - 1])
+            memset(file_unshare(file, keep - 1) + start, 0, FILE_CHUNK_SIZE - start);
+        if (size == 0) {
+            pfree(chunks, sizeof(Ref) * file->capacity);
+            file->chunks = 0;
+            file->capacity = 0;
+        }
+    }
+    file->size = size;
+    return SUCCESS;
+}
+
+
+/*
+ * Takes a snapshot of a file's contents, sharing its chunks, for a
+ * checkpoint. Called with the file locked against changes.
+ * Input:
+ *  - file: the file contents, without a snapshot
+ * Returns: the snapshot, to pass to file_snapshot_release once written
+ */
+FileSnapshot *file_snapshot(FileData *file) {
+    FileSnapshot *snap = malloc(sizeof(FileSnapshot));
+    Ref *chunks = malloc(sizeof(Ref) * (file->capacity ? file->capacity : 1));
+    if (snap == NULL || chunks == NULL) {
+        fprintf(stderr, "Error: allocating a file snapshot.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (file->capacity > 0)
+        memcpy(chunks, file_chunks(file), sizeof(Ref) * file->capacity);
+    snap->size = file->size;
+    snap->capacity = file->capacity;
+    snap->chunks = chunks;
+    snap->orphaned = false;
+    file->snapshot = snap;
+    return snap;
+}
+
+
+/*
+ * Ends the sharing of a file's chunks with its snapshot: the chunks the
+ * file no longer uses are released, and the snapshot is freed. Called
+ * with the file locked against changes, unless it was destroyed.
+ * Input:
+ *  - file: the file contents, only used if the snapshot is not orphaned
+ *  - snap: the snapshot
+ */
+void file_snapshot_release(FileData *file, FileSnapshot *snap) {
+    pthread_mutex_lock(&snapshot_lock);
+    for (int i = 0; i < snap->capacity; i++) {
+        if (snap->chunks[i] == 0)
+            continue;
+        if (snap->orphaned || i >= file->capacity || file_chunks(file)[i] != snap->chunks[i])
+            chunk_free(snap->chunks[i]);
+    }
+    if (!snap->orphaned)
+        file->snapshot = NULL;
+    pthread_mutex_unlock(&snapshot_lock);
+
+    free(snap->chunks);
+    free(snap);
+}
@@ -0,0 +1,53 @@
+#ifndef FILEDATA_H
+#define FILEDATA_H
+
+#include <limits.h>
+#include <sys/uio.h>
+#include "arena.h"
+
+/* file contents are kept in fixed-size chunks, a power of two */
+#define FILE_CHUNK_BITS 12
+#define FILE_CHUNK_SIZE (1 << FILE_CHUNK_BITS)
+
+/* sizes and offsets travel as 32 bit results in replies */
+#define FILE_MAX_SIZE INT_MAX
+
+/*
+ * File contents: an array of references to chunks, grown by doubling, so
+ * a write never copies data already stored. A null chunk is a hole that
+ * reads as zeros. Bytes of a chunk past the end of the file are always
+ * zero, so extending a file never exposes old data.
+ */
+typedef struct fileData {
+	long size; /* bytes */
+	int capacity; /* slots of chunks */
+	Ref chunks; /* array of capacity Refs to chunks */
+	struct fileSnapshot *snapshot; /* checkpoint sharing the chunks, or NULL */
+} FileData;
+
+/*
+ * The contents of a file as a checkpoint saw them. The chunks are shared
+ * with the file, which copies a shared chunk before changing it (and
+ * never releases one) until file_snapshot_release.
+ */
+typedef struct fileSnapshot {
+	long size;
+	int capacity;
+	Ref *chunks; /* copy of the file's chunk references */
+	int orphaned; /* the file was destroyed, the snapshot owns every chunk */
+} FileSnapshot;
+
+FileData *file_create();
+void file_destroy(FileData *file);
+long file_size(FileData *file);
+int file_write(FileData *file, long offset, char *buf, int len);
+int file_read(FileData *file, long offset, char *buf, int len);
+int file_read_iov(FileData *file, long offset, int len, struct iovec *iov, int maxiov, int *niov);
+int file_read_pinned(FileData *file, long offset, int len, struct iovec *iov, int maxiov, int *niov,
+                     Ref *chunks);
+void file_unpin(Ref *chunks, int count);
+int file_truncate(FileData *file, long size);
+FileSnapshot *file_snapshot(FileData *file);
+void file_snapshot_release(FileData *file, FileSnapshot *snap);
+
+#endif /* FILEDATA_H */
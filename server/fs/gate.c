@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sched.h>
+#include <pthread.h>
+#include "gate.h"
+#include "state.h"
+
+/*
+ * Per-thread state: the number of changes the thread is in, nested.
+ */
+typedef struct gateRecord {
+	int inside;
+	struct gateRecord *next;
+} __attribute__((aligned(CACHE_LINE))) GateRecord;
+
+static struct {
+	int closed;
+	char pad[CACHE_LINE - sizeof(int)];
+} gate __attribute__((aligned(CACHE_LINE)));
+
+/* held by the closer while the gate is closed */
+static pthread_mutex_t gate_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gate_opened = PTHREAD_COND_INITIALIZER;
+
+/* every thread that ever entered the gate, never shrinks */
+static GateRecord *records = NULL;
+static __thread GateRecord *self = NULL;
+
+
+/*
+ * Returns the calling thread's record, registering it on first use.
+ */
+static GateRecord *gate_self() {
+	if (self != NULL)
+		return self;
+
+	GateRecord *record;
+	if (posix_memalign((void **) &record, CACHE_LINE, sizeof(GateRecord)) != 0) {
+		fprintf(stderr, "Error: allocating gate record.\n");
+		exit(EXIT_FAILURE);
+	}
+	record->inside = 0;
+	record->next = __atomic_load_n(&records, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&records, &record->next, record, true,
+	                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	self = record;
+	return record;
+}
+
+
+/*
+ * Enters the gate before a change, waiting while it is closed. Entries
+ * may nest.
+ */
+void gate_enter() {
+	GateRecord *record = gate_self();
+
+	if (record->inside++ > 0)
+		return;
+	while (true) {
+		/* announce the entry before checking the gate: a closer that
+		   misses it is seen by this check, and the other way round */
+		__atomic_store_n(&record->inside, 1, __ATOMIC_SEQ_CST);
+		if (!__atomic_load_n(&gate.closed, __ATOMIC_SEQ_CST))
+			return;
+
+		__atomic_store_n(&record->inside, 0, __ATOMIC_RELEASE);
+		pthread_mutex_lock(&gate_lock);
+		while (__atomic_load_n(&gate.closed, __ATOMIC_ACQUIRE))
+			pthread_cond_wait(&gate_opened, &gate_lock);
+		pthread_mutex_unlock(&gate_lock);
+	}
+}
+
+
+/*
+ * Leaves the gate after a change.
+ */
+void gate_exit() {
+	GateRecord *record = self;
+
+	if (record->inside > 1) {
+		record->inside--;
+		return;
+	}
+	__atomic_store_n(&record->inside, 0, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Closes the gate and waits until no change is in progress. The calling
+ * thread may not be inside the gate.
+ */
+void gate_close() {
+	pthread_mutex_lock(&gate_lock);
+	__atomic_store_n(&gate.closed, true, __ATOMIC_SEQ_CST);
+	for (GateRecord *r = __atomic_load_n(&records, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+		while (__atomic_load_n(&r->inside, __ATOMIC_ACQUIRE) != 0)
+			sched_yield();
+	}
+}
+
+
+/*
+ * Reopens the gate closed by gate_close, letting the waiting changes in.
+ */
+void gate_open() {
+	__atomic_store_n(&gate.closed, false, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&gate_opened);
+	pthread_mutex_unlock(&gate_lock);
+}
@@ -0,0 +1,19 @@
+#ifndef GATE_H
+#define GATE_H
+
+/*
+ * Quiescence gate. Every change to the file system runs between
+ * gate_enter and gate_exit, which only touch a record of the calling
+ * thread's own (and read a flag that changes only when the gate closes).
+ * gate_close stops new changes from starting and waits for those in
+ * progress, giving the closer a view of the tree no change is touching,
+ * until gate_open. Closers are served one at a time, and are not starved
+ * by a steady stream of changes.
+ */
+
+void gate_enter();
+void gate_exit();
+void gate_close();
+void gate_open();
+
+#endif /* GATE_H */
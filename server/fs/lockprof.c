@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "lockprof.h"
+#include "stats.h"
+#include "state.h"
+
+/* locks a thread holds at once that get their hold time measured */
+#define LOCKPROF_MAX_HELD 256
+
+typedef struct heldLock {
+	int inumber;
+	int mode;
+	uint64_t since;
+} HeldLock;
+
+int lockprof_enabled = false;
+__thread int lockprof_depth = 0;
+
+/* counters of each i-node, allocated a segment at a time */
+static LockProfile *segments[INODE_MAX_SEGMENTS];
+static __thread HeldLock held[LOCKPROF_MAX_HELD];
+
+/* the profiling window, in stats_now time */
+static uint64_t started = 0, stopped = 0;
+
+
+/*
+ * Returns the counters of an i-node, allocating their segment on first
+ * use. Segments are published with a CAS, as those of the i-node table.
+ */
+static LockProfile *lockprof_at(int inumber) {
+	int seg = inumber >> INODE_SEGMENT_BITS;
+	LockProfile *segment = __atomic_load_n(&segments[seg], __ATOMIC_ACQUIRE);
+
+	if (segment == NULL) {
+		LockProfile *fresh = calloc(INODE_SEGMENT_SIZE, sizeof(LockProfile));
+		if (fresh == NULL) {
+			fprintf(stderr, "Error: allocating lock profile segment.\n");
+			exit(EXIT_FAILURE);
+		}
+		if (__atomic_compare_exchange_n(&segments[seg], &segment, fresh, false,
+		                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			segment = fresh;
+		else
+			free(fresh);
+	}
+	return &segment[inumber & (INODE_SEGMENT_SIZE - 1)];
+}
+
+
+/*
+ * Clears the counters and starts profiling.
+ */
+void lockprof_start() {
+	for (int seg = 0; seg < INODE_MAX_SEGMENTS; seg++) {
+		LockProfile *segment = __atomic_load_n(&segments[seg], __ATOMIC_ACQUIRE);
+		if (segment != NULL)
+			memset(segment, 0, INODE_SEGMENT_SIZE * sizeof(LockProfile));
+	}
+	started = stats_now();
+	stopped = 0;
+	__atomic_store_n(&lockprof_enabled, true, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Stops profiling, keeping the counters.
+ */
+void lockprof_stop() {
+	if (__atomic_exchange_n(&lockprof_enabled, false, __ATOMIC_ACQ_REL))
+		stopped = stats_now();
+}
+
+
+/*
+ * Counts an acquisition of an i-node lock by the calling thread, and
+ * starts timing how long it is held.
+ * Input:
+ *  - inumber: the i-node
+ *  - mode: LOCKPROF_READ or LOCKPROF_WRITE
+ *  - contended: whether the lock was taken when asked for
+ *  - waited: ns blocked
+ */
+void lockprof_acquired(int inumber, int mode, int contended, uint64_t waited) {
+	LockProfile *profile = lockprof_at(inumber);
+
+	__atomic_fetch_add(&profile->acquired[mode], 1, __ATOMIC_RELAXED);
+	if (contended) {
+		__atomic_fetch_add(&profile->contended[mode], 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&profile->wait[mode], waited, __ATOMIC_RELAXED);
+	}
+	if (lockprof_depth < LOCKPROF_MAX_HELD)
+		held[lockprof_depth++] = (HeldLock) { inumber, mode, stats_now() };
+}
+
+
+/*
+ * Counts the time an i-node lock taken while profiling was held, as the
+ * calling thread releases it. Locks are not always released in the order
+ * taken, so the most recent acquisition of the i-node is the one ended.
+ */
+void lockprof_released(int inumber) {
+	for (int i = lockprof_depth - 1; i >= 0; i--) {
+		if (held[i].inumber == inumber) {
+			LockProfile *profile = lockprof_at(inumber);
+			__atomic_fetch_add(&profile->hold[held[i].mode], stats_now() - held[i].since, __ATOMIC_RELAXED);
+			held[i] = held[--lockprof_depth];
+			return;
+		}
+	}
+}
+
+
+/*
+ * Whether an i-node's lock is more contended than another's: threads
+ * waited longer for it, or else found it taken more often, or else took
+ * it more often.
+ */
+static bool lockprof_before(LockProfile *a, LockProfile *b) {
+	uint64_t ka[3] = { a->wait[0] + a->wait[1], a->contended[0] + a->contended[1], a->acquired[0] + a->acquired[1] };
+	uint64_t kb[3] = { b->wait[0] + b->wait[1], b->contended[0] + b->contended[1], b->acquired[0] + b->acquired[1] };
+
+	for (int k = 0; k < 3; k++) {
+		if (ka[k] != kb[k])
+			return ka[k] > kb[k];
+	}
+	return false;
+}
+
+
+/*
+ * Finds the most contended i-nodes, see lockprof_before.
+ * Input:
+ *  - inumbers: where to store their inumbers, most contended first
+ *  - profiles: where to store a copy of their counters
+ *  - max: room in both
+ * Returns: the number found, never more than max
+ */
+int lockprof_top(int *inumbers, LockProfile *profiles, int max) {
+	int found = 0;
+
+	for (int seg = 0; seg < INODE_MAX_SEGMENTS; seg++) {
+		LockProfile *segment = __atomic_load_n(&segments[seg], __ATOMIC_ACQUIRE);
+		if (segment == NULL)
+			continue;
+		for (int i = 0; i < INODE_SEGMENT_SIZE; i++) {
+			LockProfile copy;
+			for (int mode = LOCKPROF_READ; mode <= LOCKPROF_WRITE; mode++) {
+				copy.acquired[mode] = __atomic_load_n(&segment[i].acquired[mode], __ATOMIC_RELAXED);
+				copy.contended[mode] = __atomic_load_n(&segment[i].contended[mode], __ATOMIC_RELAXED);
+				copy.wait[mode] = __atomic_load_n(&segment[i].wait[mode], __ATOMIC_RELAXED);
+				copy.hold[mode] = __atomic_load_n(&segment[i].hold[mode], __ATOMIC_RELAXED);
+			}
+			if (copy.acquired[LOCKPROF_READ] + copy.acquired[LOCKPROF_WRITE] == 0)
+				continue;
+
+			/* insert in order, dropping the last if full */
+			int pos = found;
+			while (pos > 0 && lockprof_before(&copy, &profiles[pos - 1]))
+				pos--;
+			if (pos == max)
+				continue;
+			int last = found < max ? found : max - 1;
+			memmove(&inumbers[pos + 1], &inumbers[pos], (last - pos) * sizeof(int));
+			memmove(&profiles[pos + 1], &profiles[pos], (last - pos) * sizeof(LockProfile));
+			inumbers[pos] = (seg << INODE_SEGMENT_BITS) | i;
+			profiles[pos] = copy;
+			if (found < max)
+				found++;
+		}
+	}
+	return found;
+}
+
+
+/*
+ * Returns how long the profile covers, in ns, and whether profiling is
+ * still on.
+ */
+uint64_t lockprof_window(int *enabled) {
+	*enabled = lockprof_on();
+	if (started == 0)
+		return 0;
+	return (*enabled || stopped == 0 ? stats_now() : stopped) - started;
+}
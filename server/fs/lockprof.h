@@ -0,0 +1,53 @@
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include <stdint.h>
+
+/*
+ * Lock contention profiler for the i-node locks taken by rwlock_read and
+ * rwlock_write. While enabled it counts, per i-node and per mode, the
+ * acquisitions, those that had to wait, the time waited and the time
+ * the lock was held. While disabled, a lock costs one more load of a
+ * flag and an unlock one more load of a thread-local counter.
+ *
+ * Counters live beside the i-node table, in segments of the same size,
+ * so profiling never changes the table (or an image mapped with it).
+ */
+#define LOCKPROF_READ 0
+#define LOCKPROF_WRITE 1
+
+/* i-nodes listed by a dump when not told how many */
+#define LOCKPROF_DEFAULT_TOP 20
+
+typedef struct lockProfile {
+	uint64_t acquired[2]; /* indexed by LOCKPROF_READ or LOCKPROF_WRITE */
+	uint64_t contended[2]; /* acquisitions that found the lock taken */
+	uint64_t wait[2]; /* ns blocked */
+	uint64_t hold[2]; /* ns held */
+} LockProfile;
+
+extern int lockprof_enabled;
+/* locks the calling thread holds that were taken while profiling */
+extern __thread int lockprof_depth;
+
+static inline int lockprof_on() {
+	return __builtin_expect(__atomic_load_n(&lockprof_enabled, __ATOMIC_RELAXED), 0);
+}
+
+void lockprof_start();
+void lockprof_stop();
+void lockprof_acquired(int inumber, int mode, int contended, uint64_t waited);
+void lockprof_released(int inumber);
+int lockprof_top(int *inumbers, LockProfile *profiles, int max);
+uint64_t lockprof_window(int *enabled);
+
+/*
+ * To be called before unlocking an i-node lock taken by rwlock_read or
+ * rwlock_write.
+ */
+static inline void lockprof_release(int inumber) {
+	if (__builtin_expect(lockprof_depth > 0, 0))
+		lockprof_released(inumber);
+}
+
+#endif /* LOCKPROF_H */
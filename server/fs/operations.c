@@ -2,45 +2,42 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
 
-pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-int terminated = false;
+struct timespec begin, end;
 
-void waitCond() {
-	if (pthread_cond_wait(&cond, &mutex) != 0) {
-		fprintf(stderr, "Error: Failed to wait for the condition.\n");
-		exit(EXIT_FAILURE);
-	}
-}
-
-void signalCond() {
-	if (pthread_cond_signal(&cond) != 0) {
-		fprintf(stderr, "Error: Failed to signal for the condition.\n");
-		exit(EXIT_FAILURE);
-	}
-}
-
-void lock() {
-	if (pthread_mutex_lock(&mutex) != 0) {
-		fprintf(stderr, "Error: Failed to lock mutex.\n");
-		exit(EXIT_FAILURE);
-	}
-}
+static SlabCache lock_cache = SLAB_CACHE("lock arrays", sizeof(ArrayLocks));
 
+/* the image was mapped as it was left by a server that did not save it */
+static int image_dirty = false;
 
-void unlock() {
-	if (pthread_mutex_unlock(&mutex) != 0) {
-		fprintf(stderr, "Error: Failed to unlock mutex.\n");
-		exit(EXIT_FAILURE);
+/*
+ * Locks an i-node in a mode, timing the wait if the lock is taken and
+ * counting the acquisition while lock profiling is on.
+ * Input:
+ *  - i: inumber of the i-node
+ *  - mode: LOCKPROF_READ or LOCKPROF_WRITE
+ * Returns: 0, or the error of pthread_rwlock_rdlock or _wrlock
+ */
+static int rwlock_lock(int i, int mode) {
+	pthread_rwlock_t *lock = &inode_at(i)->lock;
+	int status = mode == LOCKPROF_WRITE ? pthread_rwlock_trywrlock(lock) : pthread_rwlock_tryrdlock(lock);
+	int contended = status == EBUSY;
+	uint64_t waited = 0;
+
+	/* only a lock that is taken is timed */
+	if (contended) {
+		uint64_t start = stats_now();
+		status = mode == LOCKPROF_WRITE ? pthread_rwlock_wrlock(lock) : pthread_rwlock_rdlock(lock);
+		waited = stats_now() - start;
+		stats_lock_wait(waited);
 	}
-}
-
-void terminate() {
-	lock();
-	terminated = true;
-	signalCond();
-	unlock();
+	if (status == 0 && lockprof_on())
+		lockprof_acquired(i, mode, contended, waited);
+	return status;
 }
 
 /* Given a lock, this function will lock that lock for reading
@@ -48,7 +45,7 @@ void terminate() {
  *  - lock: lock
  */
 void rwlock_read(int i) {
-	if(pthread_rwlock_rdlock(&inode_table[i].lock) != 0) {
+	if(rwlock_lock(i, LOCKPROF_READ) != 0) {
 		fprintf(stderr, "Error: Failed to read-lock inode.\n");
 		exit(EXIT_FAILURE);
 	}
@@ -58,7 +55,7 @@ void rwlock_read(int i) {
  *  - lock: lock
  */
 void rwlock_write(int i) {
-	if(pthread_rwlock_wrlock(&inode_table[i].lock) != 0) {
+	if(rwlock_lock(i, LOCKPROF_WRITE) != 0) {
 		fprintf(stderr, "Error: Failed to write-lock inode.\n");
 		exit(EXIT_FAILURE);
 	}
@@ -77,8 +74,8 @@ void split_parent_child_from_path(char * path, char ** parent, char ** child) {
 	int n_slashes = 0, last_slash_location = 0;
 	int len = strlen(path);
 
-	// deal with trailing slash ( a/x vs a/x/ )
-	if (path[len-1] == '/') {
+	// deal with trailing slash ( a/x vs a/x/ ); an empty path has none
+	if (len > 0 && path[len-1] == '/') {
 		path[len-1] = '\0';
 	}
 
@@ -103,9 +100,30 @@ void split_parent_child_from_path(char * path, char ** parent, char ** child) {
 
 /*
  * Initializes tecnicofs and creates root node.
+ * Input:
+ *  - image: file to keep the file system in, mapped into memory, or NULL
+ *           to keep it in memory only. An existing image is used as it
+ *           is: only a new one gets a root node.
  */
-void init_fs() {
+void init_fs(char *image) {
 	inode_table_init();
+	dcache_init();
+
+	if (image != NULL) {
+		int created = inode_table_mount(image);
+		if (created == FAIL)
+			exit(EXIT_FAILURE);
+		if (!created) {
+			image_dirty = !arena_was_clean();
+			if (image_dirty)
+				fprintf(stderr, "Warning: image %s was not closed cleanly and may be inconsistent\n", image);
+			if (!inode_valid(FS_ROOT)) {
+				fprintf(stderr, "Error: image %s has no root node\n", image);
+				exit(EXIT_FAILURE);
+			}
+			return;
+		}
+	}
 
 	/* create root inode */
 	int root = inode_create(T_DIRECTORY);
@@ -117,30 +135,152 @@ void init_fs() {
 }
 
 
+/*
+ * Redoes a change read from the log.
+ * Input:
+ *  - entry: the change
+ */
+static void replay_change(WalEntry *entry) {
+	switch (entry->op) {
+		case WAL_CREATE:
+			create(entry->name, entry->nodeType);
+			break;
+		case WAL_DELETE:
+			delete(entry->name);
+			break;
+		case WAL_MOVE:
+			move(entry->name, entry->name2);
+			break;
+		case WAL_WRITE:
+			write_file(entry->name, entry->arg, entry->data, entry->datalen);
+			break;
+		case WAL_TRUNCATE:
+			truncate_file(entry->name, entry->arg);
+			break;
+		case WAL_RMTREE:
+			delete_tree(entry->name);
+			break;
+		default:
+			fprintf(stderr, "Warning: skipping a log record of unknown kind %d\n", entry->op);
+	}
+}
+
+
+/*
+ * Loads the most recent checkpoint into a new tecnicofs (just the root).
+ * Input:
+ *  - checkpoint: the checkpoint file
+ *  - lsn: where to store the last logged change the checkpoint holds,
+ *         0 if there is no checkpoint yet
+ * Returns: number of nodes loaded, or FAIL
+ */
+long load_fs(char *checkpoint, uint64_t *lsn) {
+	return checkpoint_load(checkpoint, lsn);
+}
+
+
+/*
+ * Recovers the changes kept in a log, then logs every new change to it.
+ * A log is not replayed over an image that was saved cleanly, as the
+ * image already holds its changes, and a log that is not empty is not
+ * replayed over an image that was not: it may hold some of the changes
+ * already, which would then be applied twice.
+ * Input:
+ *  - log: the log file
+ *  - after: changes up to this lsn are already loaded from a checkpoint
+ *  - durability: WAL_NONE, WAL_BATCHED or WAL_PER_OP
+ * Returns: number of changes replayed, or FAIL
+ */
+long start_log(char *log, uint64_t after, int durability) {
+	int saved = arena_base != NULL && arena_was_clean();
+	struct stat st;
+
+	if (image_dirty && stat(log, &st) == 0 && st.st_size > 0) {
+		fprintf(stderr, "Error: the image was not saved cleanly, so log %s cannot be replayed over it\n", log);
+		return FAIL;
+	}
+	long replayed = saved ? 0 : wal_replay(log, after, replay_change);
+
+	if (replayed == FAIL) {
+		fprintf(stderr, "Error: unable to read log %s\n", log);
+		return FAIL;
+	}
+	if (wal_start(log, durability, saved) == FAIL)
+		return FAIL;
+	return replayed;
+}
+
+
+/*
+ * Writes a checkpoint of tecnicofs while requests go on. Changes are
+ * stopped only for the cut: the checkpoint starts, and the log moves to
+ * a new file, with the gate closed. The log moved aside is dropped
+ * once the checkpoint is on disk. One checkpoint is taken at a time.
+ * Input:
+ *  - checkpoint: the checkpoint file
+ * Returns: number of bytes written, or FAIL
+ */
+long checkpoint_fs(char *checkpoint) {
+	static pthread_mutex_t checkpointing = PTHREAD_MUTEX_INITIALIZER;
+
+	pthread_mutex_lock(&checkpointing);
+	gate_close();
+	int count = inode_table_count();
+	inode_snapshot_begin();
+	uint64_t lsn = wal_rotate();
+	gate_open();
+
+	long written = checkpoint_write(checkpoint, lsn, count);
+	/* every i-node was saved by then, so no change saves one any more */
+	inode_snapshot_end();
+	if (written != FAIL)
+		wal_discard_rotated();
+	pthread_mutex_unlock(&checkpointing);
+	return written;
+}
+
+
+/*
+ * Stops every change to tecnicofs, waiting for those in progress, and
+ * writes the image back, marked clean, and the log. A log whose changes
+ * are all saved in the image is emptied. Only exiting is allowed
+ * afterwards.
+ */
+void stop_fs() {
+	gate_close();
+	/* an image must not keep i-nodes no directory leads to */
+	reclaim_drain();
+	inode_table_sync(1);
+	wal_flush(arena_base != NULL);
+}
+
+
 /*
  * Destroy tecnicofs and inode table.
  */
 void destroy_fs() {
+	wal_close();
+	dcache_destroy();
+	/* release what was retired before an image is unmapped */
+	epoch_drain();
 	inode_table_destroy();
+	epoch_drain();
+	slab_thread_flush();
+	slab_reclaim();
 }
 
 
 /*
  * Checks if content of directory is not empty.
  * Input:
- *  - entries: entries of directory
+ *  - dir: contents of directory
  * Returns: SUCCESS or FAIL
  */
 
-int is_dir_empty(DirEntry *dirEntries) {
-	if (dirEntries == NULL) {
+int is_dir_empty(Directory *dir) {
+	if (dir == NULL || dir->count != 0) {
 		return FAIL;
 	}
-	for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-		if (dirEntries[i].inumber != FREE_INODE) {
-			return FAIL;
-		}
-	}
 	return SUCCESS;
 }
 
@@ -149,22 +289,17 @@ int is_dir_empty(DirEntry *dirEntries) {
  * Looks for node in directory entry from name.
  * Input:
  *  - name: path of node
- *  - entries: entries of directory
+ *  - dir: contents of directory
  * Returns:
  *  - inumber: found node's inumber
  *  - FAIL: if not found
  */
-int lookup_sub_node(char *name, DirEntry *entries) {
+int lookup_sub_node(char *name, Directory *dir) {
 
-	if (entries == NULL) {
+	if (dir == NULL) {
 		return FAIL;
 	}
-	for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (entries[i].inumber != FREE_INODE && strcmp(entries[i].name, name) == 0) {
-            return entries[i].inumber;
-        }
-    }
-	return FAIL;
+	return dir_lookup(dir, name);
 }
 
 
@@ -179,7 +314,7 @@ int create(char *name, type nodeType){
 
 	int parent_inumber, child_inumber;
 	char *parent_name, *child_name, name_copy[MAX_FILE_NAME];
-	ArrayLocks *arr = malloc(sizeof(ArrayLocks));
+	ArrayLocks *arr = slab_alloc(&lock_cache);
 	arr->contador = 0;
 
 	/* use for copy */
@@ -188,14 +323,15 @@ int create(char *name, type nodeType){
 
 	strcpy(name_copy, name);
 	split_parent_child_from_path(name_copy, &parent_name, &child_name);
+	gate_enter();
 	parent_inumber = lookup(parent_name, CREATE, arr);
 
 	if (parent_inumber == FAIL) {
 		printf("Error: failed to create %s, invalid parent dir %s\n",
 		        name, parent_name);
 		unlocknodes(arr);
-		free(arr);
-		terminate();
+		slab_free(arr);
+		gate_exit();
 		return FAIL;
 	}
 
@@ -205,16 +341,16 @@ int create(char *name, type nodeType){
 		printf("Error: failed to create %s, parent %s is not a dir\n",
 		        name, parent_name);
 		unlocknodes(arr);
-		free(arr);
-		terminate();
+		slab_free(arr);
+		gate_exit();
 		return FAIL;
 	}
 
-	if (lookup_sub_node(child_name, pdata.dirEntries) != FAIL) {
+	if (lookup_sub_node(child_name, pdata.dir) != FAIL) {
 		printf("Error: failed to create %s, already exists in dir %s\n", child_name, parent_name);
 		unlocknodes(arr);
-		free(arr);
-		terminate();
+		slab_free(arr);
+		gate_exit();
 		return FAIL;
 	}
 
@@ -224,21 +360,22 @@ int create(char *name, type nodeType){
 	if (child_inumber == FAIL) {
 		printf("Error: failed to create %s in  %s, couldn't allocate inode\n", child_name, parent_name);
 		unlocknodes(arr);
-		free(arr);
-		terminate();
+		slab_free(arr);
+		gate_exit();
 		return FAIL;
 	}
 
 	if (dir_add_entry(parent_inumber, child_inumber, child_name) == FAIL) {
 		printf("Error: could not add entry %s in dir %s\n", child_name, parent_name);
 		unlocknodes(arr);
-		free(arr);
-		terminate();
+		slab_free(arr);
+		gate_exit();
 		return FAIL;
 	}
+	wal_append(WAL_CREATE, nodeType, name, NULL, 0, NULL, 0);
 	unlocknodes(arr);
-	free(arr);
-	terminate();
+	slab_free(arr);
+	gate_exit();
 	return SUCCESS;
 }
 
@@ -252,94 +389,165 @@ void unlocknodes(ArrayLocks *arr) {
 
 	for (int pos = 0; pos <= arr->contador; pos++) {
 		int i = arr->locks[pos];
-		if (pthread_rwlock_unlock(&inode_table[i].lock) != 0) {
+		lockprof_release(i);
+		if (pthread_rwlock_unlock(&inode_at(i)->lock) != 0) {
 			fprintf(stderr, "Error: failed unlocking locks.\n");
 			exit(EXIT_FAILURE);
 		}
 	}
 }
 
-int move(char* name, char* last_name){
+/*
+ * Locks the directories on a path below an i-node the caller holds
+ * locked, top-down as lookup does: read-locks those on the way and
+ * write-locks the last.
+ * Input:
+ *  - inumber: the locked i-node the path starts at
+ *  - path: normalized path relative to it, not empty. ATENTION: the
+ *          function alters this parameter
+ *  - arr: where the locks taken are recorded
+ * Returns:
+ *  inumber: identifier of the last directory
+ *     FAIL: if a component does not exist or is not a directory
+ */
+static int lock_branch(int inumber, char *path, ArrayLocks *arr) {
+	char *saveptr;
+	char *component = strtok_r(path, "/", &saveptr);
+	uint64_t start = stats_now();
+	type nType;
+	union Data data;
 
-	int parent_inumber, new_parent_inumber, child_inumber;
-	char *parent_name, *new_parent_name, *child_name, *new_child_name, name_copy[MAX_FILE_NAME], new_name_copy[MAX_FILE_NAME];
-	ArrayLocks *arr = malloc(sizeof(ArrayLocks));
-	arr->contador = 0;
+	while (component != NULL) {
+		inode_get(inumber, &nType, &data);
+		if (nType != T_DIRECTORY || (inumber = lookup_sub_node(component, data.dir)) == FAIL)
+			break;
+		component = strtok_r(NULL, "/", &saveptr);
+		if (component == NULL)
+			rwlock_write(inumber);
+		else
+			rwlock_read(inumber);
+		arr->locks[++arr->contador] = inumber;
+	}
+	stats_resolve(stats_now() - start);
+	return component == NULL ? inumber : FAIL;
+}
 
-	type pType;
-	union Data pdata;
 
-	strcpy(name_copy, name);
-	split_parent_child_from_path(name_copy, &parent_name, &child_name);
+/*
+ * Moves (renames) a node. Both parent directories are write-locked, and
+ * every lock is taken in one global order, so moves in opposite
+ * directions cannot deadlock: the directories the two parent paths
+ * share, down to their closest common ancestor, are locked once, top-down
+ * as any lookup does; then the branch below it that starts at the lowest
+ * inumber, top-down, and then the other. Moves in unrelated directories
+ * only share read locks.
+ * Input:
+ *  - name: path of node
+ *  - last_name: its new path, which must not exist yet nor lie inside
+ *               the node itself
+ * Returns: SUCCESS or FAIL
+ */
+int move(char* name, char* last_name){
 
-	parent_inumber = lookup(parent_name, LOOKUP, arr);
+	int ancestor, parent_inumber, new_parent_inumber = FAIL, child_inumber = FAIL, result = FAIL;
+	char *parent_name, *new_parent_name, *child_name, *new_child_name, name_copy[MAX_FILE_NAME], new_name_copy[MAX_FILE_NAME];
+	char common[MAX_FILE_NAME], branch[MAX_FILE_NAME], new_branch[MAX_FILE_NAME];
 
-	if (parent_inumber == FAIL) {
-		printf("Error: failed to find %s, invalid parent dir %s\n",
-		        child_name, parent_name);
-		unlocknodes(arr);
-		free(arr);
-		terminate();
+	type pType, npType;
+	union Data pdata, npdata;
+
+	/* the root cannot be moved, nor a node into itself or below */
+	int len = dcache_normalize(name, name_copy);
+	if (len <= 0 || dcache_normalize(last_name, new_name_copy) <= 0) {
+		printf("Error: cannot move %s to %s\n", name, last_name);
 		return FAIL;
 	}
-
-	inode_get(parent_inumber, &pType, &pdata);
-
-	child_inumber = lookup_sub_node(child_name, pdata.dirEntries);
-
-	if (child_inumber == FAIL) {
-		printf("Error: child %s does not exists in dir %s\n", child_name, parent_name);
-		unlocknodes(arr);
-		free(arr);
-		terminate();
+	if (strncmp(new_name_copy, name_copy, len) == 0 && (new_name_copy[len] == '\0' || new_name_copy[len] == '/')) {
+		printf("Error: cannot move %s into itself\n", name);
 		return FAIL;
 	}
-
-	strcpy(new_name_copy, last_name);
+	split_parent_child_from_path(name_copy, &parent_name, &child_name);
 	split_parent_child_from_path(new_name_copy, &new_parent_name, &new_child_name);
 
-	new_parent_inumber = lookup(new_parent_name, LOOKUP, arr);
-
-	if (new_parent_inumber == FAIL){
-		printf("Error: new directory %s does not exist, invalid parent dir\n", new_parent_name);
-		unlocknodes(arr);
-		free(arr);
-		terminate();
-		return FAIL;
-
+	/* length of the components both parent paths start with */
+	int shared = 0;
+	for (int i = 0; ; i++) {
+		char a = parent_name[i], b = new_parent_name[i];
+		if ((a == '/' || a == '\0') && (b == '/' || b == '\0'))
+			shared = i;
+		if (a != b || a == '\0')
+			break;
 	}
+	memcpy(common, parent_name, shared);
+	common[shared] = '\0';
+	strcpy(branch, parent_name[shared] == '/' ? parent_name + shared + 1 : parent_name + shared);
+	strcpy(new_branch, new_parent_name[shared] == '/' ? new_parent_name + shared + 1 : new_parent_name + shared);
 
-	inode_get(new_parent_inumber, &pType, &pdata);
+	ArrayLocks *arr = slab_alloc(&lock_cache);
+	arr->contador = 0;
 
-	if(pType != T_DIRECTORY) {
-		printf("Error: new parent %s is not a dir\n", new_parent_name);
-		unlocknodes(arr);
-		free(arr);
-		terminate();
-		return FAIL;
+	gate_enter();
+	/* the common ancestor is write-locked if it is one of the parents */
+	ancestor = lookup(common, *branch == '\0' || *new_branch == '\0' ? CREATE : LOOKUP, arr);
+	parent_inumber = new_parent_inumber = ancestor;
+
+	if (ancestor != FAIL && *branch != '\0' && *new_branch != '\0') {
+		/* both parents lie below it: lock the branch with the lower inumber first */
+		char first[MAX_FILE_NAME], new_first[MAX_FILE_NAME];
+		sscanf(branch, "%[^/]", first);
+		sscanf(new_branch, "%[^/]", new_first);
+		inode_get(ancestor, &pType, &pdata);
+		int top = pType == T_DIRECTORY ? lookup_sub_node(first, pdata.dir) : FAIL;
+		int new_top = pType == T_DIRECTORY ? lookup_sub_node(new_first, pdata.dir) : FAIL;
+
+		if (top == FAIL || new_top == FAIL)
+			parent_inumber = FAIL;
+		else if (top < new_top) {
+			parent_inumber = lock_branch(ancestor, branch, arr);
+			new_parent_inumber = parent_inumber == FAIL ? FAIL : lock_branch(ancestor, new_branch, arr);
+		}
+		else {
+			new_parent_inumber = lock_branch(ancestor, new_branch, arr);
+			parent_inumber = new_parent_inumber == FAIL ? FAIL : lock_branch(ancestor, branch, arr);
+		}
+	}
+	else if (ancestor != FAIL && *branch != '\0')
+		parent_inumber = lock_branch(ancestor, branch, arr);
+	else if (ancestor != FAIL && *new_branch != '\0')
+		new_parent_inumber = lock_branch(ancestor, new_branch, arr);
+
+	if (parent_inumber != FAIL)
+		inode_get(parent_inumber, &pType, &pdata);
+	if (new_parent_inumber != FAIL)
+		inode_get(new_parent_inumber, &npType, &npdata);
+
+	if (parent_inumber == FAIL || pType != T_DIRECTORY)
+		printf("Error: failed to find %s, invalid parent dir %s\n", child_name, parent_name);
+	else if ((child_inumber = lookup_sub_node(child_name, pdata.dir)) == FAIL)
+		printf("Error: child %s does not exists in dir %s\n", child_name, parent_name);
+	else if (new_parent_inumber == FAIL || npType != T_DIRECTORY)
+		printf("Error: new directory %s does not exist, invalid parent dir\n", new_parent_name);
+	else if (lookup_sub_node(new_child_name, npdata.dir) != FAIL)
+		printf("Error: %s already exists in dir %s\n", new_child_name, new_parent_name);
+	else if (dir_reset_entry(parent_inumber, child_inumber, child_name) == FAIL)
+		printf("Error: could not reset entry %s in dir %s\n", child_name, parent_name);
+	else {
+		/* every cached path below the old name is now stale */
+		dcache_invalidate(name);
+		if (dir_add_entry(new_parent_inumber, child_inumber, new_child_name) == FAIL) {
+			printf("Error: could not add entry %s in dir %s\n", new_child_name, new_parent_name);
+			dir_add_entry(parent_inumber, child_inumber, child_name);
+		}
+		else {
+			wal_append(WAL_MOVE, 0, name, last_name, 0, NULL, 0);
+			result = SUCCESS;
+		}
 	}
-
-	if (dir_reset_entry(parent_inumber, child_inumber)) {
-        printf("Error: could not reset entry %s in dir %s\n", child_name, parent_name);
-        unlocknodes(arr);
-        free(arr);
-		terminate();
-        return FAIL;
-    }
-
-    if (dir_add_entry(new_parent_inumber, child_inumber, new_child_name) == FAIL) {
-        printf("Error: could not add entry %s in dir %s\n",
-               child_name, parent_name);
-        unlocknodes(arr);
-        free(arr);
-		terminate();
-        return FAIL;
-    }
 
 	unlocknodes(arr);
-	free(arr);
-	terminate();
-	return SUCCESS;
+	slab_free(arr);
+	gate_exit();
+	return result;
 }
 /*
  * Deletes a node given a path.
@@ -351,7 +559,7 @@ int delete(char *name){
 
 	int parent_inumber, child_inumber;
 	char *parent_name, *child_name, name_copy[MAX_FILE_NAME];
-	ArrayLocks *arr = malloc(sizeof(ArrayLocks));
+	ArrayLocks *arr = slab_alloc(&lock_cache);
 	arr->contador = 0;
 
 	/* use for copy */
@@ -360,14 +568,15 @@ int delete(char *name){
 
 	strcpy(name_copy, name);
 	split_parent_child_from_path(name_copy, &parent_name, &child_name);
+	gate_enter();
 	parent_inumber = lookup(parent_name, DELETE, arr);
 
 	if (parent_inumber == FAIL) {
 		printf("Error: failed to delete %s, invalid parent dir %s\n",
 		        child_name, parent_name);
 		unlocknodes(arr);
-		free(arr);
-		terminate();
+		slab_free(arr);
+		gate_exit();
 		return FAIL;
 	}
 
@@ -377,64 +586,392 @@ int delete(char *name){
 		printf("Error: failed to delete %s, parent %s is not a dir\n",
 		        child_name, parent_name);
 		unlocknodes(arr);
-		free(arr);
-		terminate();
+		slab_free(arr);
+		gate_exit();
 		return FAIL;
 	}
 
-	child_inumber = lookup_sub_node(child_name, pdata.dirEntries);
+	child_inumber = lookup_sub_node(child_name, pdata.dir);
 
 	if (child_inumber == FAIL) {
 		printf("Error: could not delete %s, does not exist in dir %s\n",
 		       name, parent_name);
 		unlocknodes(arr);
-		free(arr);
-		terminate();
+		slab_free(arr);
+		gate_exit();
 		return FAIL;
 	}
 
 	inode_get(child_inumber, &cType, &cdata);
 
-	if (cType == T_DIRECTORY && is_dir_empty(cdata.dirEntries) == FAIL) {
+	if (cType == T_DIRECTORY && is_dir_empty(cdata.dir) == FAIL) {
 		printf("Error: could not delete %s: is a directory and not empty\n",
 		       name);
 		unlocknodes(arr);
-		free(arr);
-		terminate();
+		slab_free(arr);
+		gate_exit();
 		return FAIL;
 	}
 
 	/* remove entry from folder that contained deleted node */
-	if (dir_reset_entry(parent_inumber, child_inumber) == FAIL) {
+	if (dir_reset_entry(parent_inumber, child_inumber, child_name) == FAIL) {
 		printf("Error: failed to delete %s from dir %s\n",
 		       child_name, parent_name);
 		unlocknodes(arr);
-		free(arr);
-		terminate();
+		slab_free(arr);
+		gate_exit();
 		return FAIL;
 	}
+	dcache_invalidate(name);
 
 	if (inode_delete(child_inumber) == FAIL) {
 		printf("Error: could not delete inode number %d from dir %s\n",
 		       child_inumber, parent_name);
 		unlocknodes(arr);
-		free(arr);
-		terminate();
+		slab_free(arr);
+		gate_exit();
+		return FAIL;
+	}
+	wal_append(WAL_DELETE, 0, name, NULL, 0, NULL, 0);
+
+	unlocknodes(arr);
+	slab_free(arr);
+	gate_exit();
+	return SUCCESS;
+}
+
+/*
+ * Deletes a node and everything below it. The node is detached from its
+ * parent at once; the i-nodes of the subtree are freed afterwards by the
+ * workers, see reclaim.h, so for a large subtree this only takes longer
+ * than for a single file by dropping the paths below it that the path
+ * cache holds.
+ * Input:
+ *  - name: path of node
+ * Returns: SUCCESS or FAIL
+ */
+int delete_tree(char *name){
+
+	int parent_inumber, child_inumber;
+	char *parent_name, *child_name, name_copy[MAX_FILE_NAME];
+	ArrayLocks *arr = slab_alloc(&lock_cache);
+	arr->contador = 0;
+
+	/* use for copy */
+	type pType;
+	union Data pdata;
+
+	strcpy(name_copy, name);
+	split_parent_child_from_path(name_copy, &parent_name, &child_name);
+	gate_enter();
+	parent_inumber = lookup(parent_name, DELETE, arr);
+
+	if (parent_inumber == FAIL) {
+		printf("Error: failed to delete %s, invalid parent dir %s\n",
+		        child_name, parent_name);
+		unlocknodes(arr);
+		slab_free(arr);
+		gate_exit();
 		return FAIL;
 	}
 
+	inode_get(parent_inumber, &pType, &pdata);
+
+	/* the root has no parent to be detached from */
+	if(pType != T_DIRECTORY || *child_name == '\0') {
+		printf("Error: failed to delete %s, parent %s is not a dir\n",
+		        child_name, parent_name);
+		unlocknodes(arr);
+		slab_free(arr);
+		gate_exit();
+		return FAIL;
+	}
+
+	child_inumber = lookup_sub_node(child_name, pdata.dir);
+
+	if (child_inumber == FAIL) {
+		printf("Error: could not delete %s, does not exist in dir %s\n",
+		       name, parent_name);
+		unlocknodes(arr);
+		slab_free(arr);
+		gate_exit();
+		return FAIL;
+	}
+
+	/* once out of its parent, no request can reach the subtree */
+	if (dir_reset_entry(parent_inumber, child_inumber, child_name) == FAIL) {
+		printf("Error: failed to delete %s from dir %s\n",
+		       child_name, parent_name);
+		unlocknodes(arr);
+		slab_free(arr);
+		gate_exit();
+		return FAIL;
+	}
+	dcache_invalidate(name);
+	wal_append(WAL_RMTREE, 0, name, NULL, 0, NULL, 0);
+
 	unlocknodes(arr);
-	free(arr);
-	terminate();
+	slab_free(arr);
+	/* queued inside the gate, so stop_fs frees it before saving */
+	reclaim_tree(child_inumber);
+	gate_exit();
 	return SUCCESS;
 }
 
+/*
+ * Looks up a file and locks it, for the operations on file contents.
+ * Input:
+ *  - name: path of the file
+ *  - function_type: WRITE to write-lock it, LOOKUP to read-lock it
+ *  - arr: where the locks taken are recorded
+ * Returns:
+ *  inumber: identifier of the file's i-node
+ *     FAIL: if not found or not a file
+ */
+static int lookup_file(char *name, int function_type, ArrayLocks *arr) {
+	type nType;
+
+	int inumber = lookup(name, function_type, arr);
+	if (inumber == FAIL) {
+		printf("Error: file %s does not exist\n", name);
+		return FAIL;
+	}
+	inode_get(inumber, &nType, NULL);
+	if (nType != T_FILE) {
+		printf("Error: %s is not a file\n", name);
+		return FAIL;
+	}
+	return inumber;
+}
+
+
+/*
+ * Writes to a file at an offset, extending it if needed.
+ * Input:
+ *  - name: path of the file
+ *  - offset: position of the first byte to write
+ *  - buf: the bytes
+ *  - len: number of bytes
+ * Returns: number of bytes written or FAIL
+ */
+int write_file(char *name, long offset, char *buf, int len) {
+	ArrayLocks arr;
+	arr.contador = 0;
+
+	gate_enter();
+	int inumber = lookup_file(name, WRITE, &arr);
+	int result = inumber == FAIL ? FAIL : inode_write_file(inumber, offset, buf, len);
+	if (result > 0)
+		wal_append(WAL_WRITE, 0, name, NULL, offset, buf, result);
+	unlocknodes(&arr);
+	gate_exit();
+	return result;
+}
+
+
+/*
+ * Reads from a file without copying its contents: iov is filled with
+ * pieces of the file's storage, pinned so they stay valid and unchanged
+ * once the file's locks are released, which they are on return. The
+ * caller must pass chunks to file_unpin once done with iov, whatever the
+ * result.
+ * Input:
+ *  - name: path of the file
+ *  - offset: position of the first byte to read
+ *  - len: maximum number of bytes
+ *  - iov: where to store the pieces
+ *  - maxiov: room in iov; len should not exceed
+ *            (maxiov - 1) * FILE_CHUNK_SIZE to be read whole
+ *  - niov: where to store the number of pieces used
+ *  - chunks: room for maxiov chunks, where the pinned ones are stored
+ * Returns: number of bytes read (less than len at the end of the file)
+ *  or FAIL
+ */
+int read_file(char *name, long offset, int len, struct iovec *iov, int maxiov, int *niov, Ref *chunks) {
+	union Data data;
+	ArrayLocks arr;
+	int result;
+
+	*niov = 0;
+	arr.contador = 0;
+	int inumber = lookup_file(name, LOOKUP, &arr);
+	if (inumber == FAIL)
+		result = FAIL;
+	else {
+		inode_get(inumber, NULL, &data);
+		if (data.file == NULL)
+			result = offset < 0 || len < 0 ? FAIL : 0;
+		else
+			result = file_read_pinned(data.file, offset, len, iov, maxiov, niov, chunks);
+	}
+	unlocknodes(&arr);
+	return result;
+}
+
+
+/*
+ * Sets the size of a file, releasing what lies past a smaller size or
+ * leaving a hole (reading as zeros) up to a larger one.
+ * Input:
+ *  - name: path of the file
+ *  - size: the new size in bytes
+ * Returns: SUCCESS or FAIL
+ */
+int truncate_file(char *name, long size) {
+	ArrayLocks arr;
+	arr.contador = 0;
+
+	gate_enter();
+	int inumber = lookup_file(name, WRITE, &arr);
+	int result = inumber == FAIL ? FAIL : inode_truncate_file(inumber, size);
+	if (result == SUCCESS)
+		wal_append(WAL_TRUNCATE, 0, name, NULL, size, NULL, 0);
+	unlocknodes(&arr);
+	gate_exit();
+	return result;
+}
+
+
+/*
+ * Returns the size of a file in bytes, or FAIL.
+ * Input:
+ *  - name: path of the file
+ */
+long size_file(char *name) {
+	union Data data;
+	ArrayLocks arr;
+	arr.contador = 0;
+	long size = FAIL;
+
+	int inumber = lookup_file(name, LOOKUP, &arr);
+	if (inumber != FAIL) {
+		inode_get(inumber, NULL, &data);
+		size = data.file ? file_size(data.file) : 0;
+	}
+	unlocknodes(&arr);
+	return size;
+}
+
+/*
+ * Walks a normalized path without taking locks. Each step validates the
+ * directory's version before reading its entries, then samples the
+ * child's version and re-validates the directory's, so the child was
+ * really an entry of the directory when its version was read.
+ * Input:
+ *  - path: normalized path of node
+ *  - inumber: where to store the result (FAIL if not found)
+ *  - resolved: i-numbers of the components resolved
+ *  - ends: length of the path prefix of each resolved component
+ *  - depth: number of components resolved
+ * Returns: SUCCESS, or FAIL if a concurrent change was observed
+ */
+static int walk_optimistic(char *path, int *inumber, int *resolved, int *ends, int *depth) {
+	inode_t *inode = inode_at(FS_ROOT);
+	unsigned int version = inode_read_begin(inode);
+	int current = FS_ROOT;
+	char *component = path;
+
+	*depth = 0;
+	if (version & 1)
+		return FAIL;
+
+	while (*component != '\0') {
+		char *end = strchr(component, '/');
+		int child = FAIL;
+
+		if (end != NULL)
+			*end = '\0';
+		type nodeType = __atomic_load_n(&inode->nodeType, __ATOMIC_RELAXED);
+		Directory *dir = inode_dir(inode);
+		/* type and contents must be of the same version before the
+		   contents are read: a file's are freed without epochs */
+		if (!inode_read_validate(inode, version))
+			return FAIL;
+		if (nodeType == T_DIRECTORY && dir != NULL)
+			child = dir_lookup_optimistic(dir, component);
+		if (end != NULL)
+			*end = '/';
+		else
+			end = component + strlen(component);
+
+		if (child == FAIL || !inode_in_table(child)) {
+			if (!inode_read_validate(inode, version))
+				return FAIL;
+			*inumber = FAIL;
+			return SUCCESS;
+		}
+
+		inode_t *next = inode_at(child);
+		unsigned int next_version = inode_read_begin(next);
+		if ((next_version & 1) || !inode_read_validate(inode, version))
+			return FAIL;
+
+		resolved[*depth] = child;
+		ends[*depth] = end - path;
+		(*depth)++;
+		current = child;
+		inode = next;
+		version = next_version;
+		component = (*end == '/') ? end + 1 : end;
+	}
+	*inumber = current;
+	return SUCCESS;
+}
+
+
+/*
+ * Looks up a path without locking any i-node, retrying a few times if
+ * writers change the path meanwhile. Directory memory freed by writers
+ * is reclaimed through epochs, so it stays valid during the walk.
+ * Input:
+ *  - name: path of node
+ *  - inumber: where to store the result (FAIL if not found)
+ * Returns: SUCCESS, or FAIL if no consistent view could be read
+ */
+static int lookup_optimistic(char *name, int *inumber) {
+	char path[MAX_FILE_NAME];
+	int resolved[MAX_PATH_DEPTH], ends[MAX_PATH_DEPTH], depth = 0;
+	int status = FAIL;
+
+	if (dcache_normalize(name, path) == FAIL)
+		return FAIL;
+	unsigned long snapshot = dcache_snapshot();
+
+	epoch_enter();
+	for (int attempt = 0; attempt < OPTIMISTIC_RETRIES && status == FAIL; attempt++) {
+		status = walk_optimistic(path, inumber, resolved, ends, &depth);
+	}
+	epoch_exit();
+
+	if (status == SUCCESS && *inumber != FAIL)
+		dcache_insert_path(path, resolved, ends, depth, snapshot);
+	return status;
+}
+
+
 int search(char *name, int function_type) {
-	ArrayLocks *arr = malloc(sizeof(ArrayLocks));
+	uint64_t start = stats_now();
+
+	/* resolve the whole path with one probe if it was resolved before */
+	int cached = dcache_lookup(name);
+	if (cached != FAIL) {
+		stats_resolve(stats_now() - start);
+		return cached;
+	}
+
+	/* pure lookups first try to walk the path without locks */
+	int inumber;
+	int status = function_type == LOOKUP ? lookup_optimistic(name, &inumber) : FAIL;
+	stats_resolve(stats_now() - start);
+	if (status == SUCCESS) {
+		return inumber;
+	}
+
+	ArrayLocks *arr = slab_alloc(&lock_cache);
 	arr->contador = 0;
 	int lookupResult = lookup(name, function_type, arr);
 	unlocknodes(arr);
-	free(arr);
+	slab_free(arr);
 	return lookupResult;
 }
 /*
@@ -450,6 +987,12 @@ int lookup(char *name, int function_type, ArrayLocks *arr) {
 	char delim[] = "/";
 	char *saveptr;
 	strcpy(full_path, name);
+	uint64_t start = stats_now();
+
+	/* resolved prefixes of the path are added to the path cache */
+	char prefix[MAX_FILE_NAME];
+	int prefix_len = 0, resolved[MAX_PATH_DEPTH], ends[MAX_PATH_DEPTH], depth = 0;
+	unsigned long snapshot = dcache_snapshot();
 
 
 	/* start at root node */
@@ -463,14 +1006,15 @@ int lookup(char *name, int function_type, ArrayLocks *arr) {
 	inode_get(current_inumber, &nType, &data);
 
 	char *path = strtok_r(full_path, delim, &saveptr);
+	char *last = path;
 
 	/* root node */
 	if (path == NULL) {
 		/* write-lock function Create or Delete if it is in root */
-		if (function_type == CREATE || function_type == DELETE) {
+		if (function_type == CREATE || function_type == DELETE || function_type == WRITE) {
 			rwlock_write(current_inumber);
 			arr->locks[arr->contador] = current_inumber;
-			terminate();
+			stats_resolve(stats_now() - start);
 			return current_inumber;
 		}	 
 	}
@@ -479,13 +1023,14 @@ int lookup(char *name, int function_type, ArrayLocks *arr) {
 	rwlock_read(current_inumber);
 	arr->locks[arr->contador] = current_inumber;
 
-	/* search for all sub nodes */
-	while (path != NULL && (current_inumber = lookup_sub_node(path, data.dirEntries)) != FAIL) {
+	/* search for all sub nodes; only directories have any */
+	while (path != NULL &&
+	       (current_inumber = nType == T_DIRECTORY ? lookup_sub_node(path, data.dir) : FAIL) != FAIL) {
 
 		/* Checks if it is the last node of path in order to read or write lock */
 		inode_get(current_inumber, &nType, &data);
 		path = strtok_r(NULL, delim, &saveptr);
-		if (path == NULL && (function_type == CREATE || function_type == DELETE)) {
+		if (path == NULL && (function_type == CREATE || function_type == DELETE || function_type == WRITE)) {
 			rwlock_write(current_inumber);
 			arr->locks[++arr->contador] = current_inumber;
 		} else {
@@ -493,29 +1038,117 @@ int lookup(char *name, int function_type, ArrayLocks *arr) {
 			rwlock_read(current_inumber);
 			arr->locks[++arr->contador] = current_inumber;
 		}
+
+		prefix_len += sprintf(prefix + prefix_len, "%s%s", prefix_len ? "/" : "", last);
+		resolved[depth] = current_inumber;
+		ends[depth++] = prefix_len;
+		last = path;
 	}
-	terminate();
+	dcache_insert_path(prefix, resolved, ends, depth, snapshot);
+	stats_resolve(stats_now() - start);
 	return current_inumber;
 }
 
 
 /*
- * Prints tecnicofs tree.
+ * Prints tecnicofs tree, once the requests in progress end.
+ * Input:
+ *  - outputFile: the output file to be written
+ *  - format: DUMP_TEXT, DUMP_NDJSON or DUMP_BINARY
+ * Returns: SUCCESS or FAIL
+ */
+int print_tecnicofs_tree(char *outputFile, int format){
+	if (format != DUMP_TEXT && format != DUMP_NDJSON && format != DUMP_BINARY)
+		return FAIL;
+	int fd = open(outputFile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Error: Failed open output file.\n");
+		return FAIL;
+	}
+	gate_close();
+	long nodes = inode_dump_tree(fd, format);
+	gate_open();
+	if (close(fd) < 0)
+		nodes = FAIL;
+	return nodes == FAIL ? FAIL : SUCCESS;
+}
+
+
+/*
+ * Writes the latency histograms of the requests served so far.
+ * Input:
+ *  - outputFile: the output file to be written
+ *  - format: STATS_TEXT or STATS_JSON
+ *  - names: name of each kind of request, see stats_dump
+ * Returns: SUCCESS or FAIL
+ */
+int print_tecnicofs_stats(char *outputFile, int format, const char *const *names){
+	if (format != STATS_TEXT && format != STATS_JSON)
+		return FAIL;
+	int fd = open(outputFile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Error: Failed open output file.\n");
+		return FAIL;
+	}
+	long written = stats_dump(fd, format, names);
+	if (close(fd) < 0)
+		written = FAIL;
+	return written == FAIL ? FAIL : SUCCESS;
+}
+
+
+/*
+ * Writes the i-nodes whose locks were most contended while lock
+ * profiling was on, with their paths, found once the requests in
+ * progress end.
  * Input:
  *  - outputFile: the output file to be written
+ *  - top: number of i-nodes to list
+ * Returns: SUCCESS or FAIL
  */
-int print_tecnicofs_tree(char *outputFile){
-	lock();
-	while (!terminated)
-		waitCond();
-	FILE * fp = fopen(outputFile, "w");
+int print_lock_profile(char *outputFile, int top){
+	if (top <= 0)
+		top = LOCKPROF_DEFAULT_TOP;
+	int *inumbers = malloc(sizeof(int) * top);
+	char **paths = malloc(sizeof(char *) * top);
+	LockProfile *profiles = malloc(sizeof(LockProfile) * top);
+	if (inumbers == NULL || paths == NULL || profiles == NULL) {
+		fprintf(stderr, "Error: allocating the lock profile.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	int enabled;
+	uint64_t window = lockprof_window(&enabled);
+	int count = lockprof_top(inumbers, profiles, top);
+	gate_close();
+	inode_find_paths(inumbers, paths, count);
+	gate_open();
+
+	FILE *fp = fopen(outputFile, "w");
 	if (fp == NULL) {
 		fprintf(stderr, "Error: Failed open output file.\n");
-		return -1;
 	}
-	inode_print_tree(fp, FS_ROOT, "");
-	fclose(fp);
-	terminated = false;
-	unlock();
-	return 0;
+	else {
+		fprintf(fp, "lock profile %s, %.3f s, %d most contended i-nodes\n", enabled ? "on" : "off",
+		        window / 1e9, count);
+		fprintf(fp, "%-32s %8s %5s %12s %12s %12s %12s\n", "path", "inumber", "mode", "acquired", "contended",
+		        "wait (ms)", "hold (ms)");
+		for (int i = 0; i < count; i++) {
+			for (int mode = LOCKPROF_READ; mode <= LOCKPROF_WRITE; mode++) {
+				LockProfile *p = &profiles[i];
+				fprintf(fp, "%-32s %8d %5s %12lu %12lu %12.3f %12.3f\n",
+				        mode == LOCKPROF_WRITE ? "" : paths[i] ? paths[i] : "(removed)", inumbers[i],
+				        mode == LOCKPROF_WRITE ? "write" : "read", p->acquired[mode], p->contended[mode],
+				        p->wait[mode] / 1e6, p->hold[mode] / 1e6);
+			}
+		}
+	}
+	int result = fp != NULL && fclose(fp) == 0 ? SUCCESS : FAIL;
+
+	for (int i = 0; i < count; i++)
+		free(paths[i]);
+	free(inumbers);
+	free(paths);
+	free(profiles);
+	return result;
 }
@@ -1,29 +1,57 @@
 #ifndef FS_H
 #define FS_H
 #include "state.h"
+#include "dcache.h"
+#include "epoch.h"
+#include "gate.h"
+#include "slab.h"
+#include "wal.h"
+#include "checkpoint.h"
+#include "stats.h"
+#include "lockprof.h"
+#include "reclaim.h"
 
 #define CREATE 1
 #define DELETE 2
 #define LOOKUP 3
+#define WRITE 4 /* lookup write-locks the node itself, to change its contents */
+
+/* a path has at most one component per two characters, plus the root */
+#define MAX_PATH_DEPTH (MAX_FILE_NAME / 2 + 1)
+
+/* attempts of a lock-free lookup before falling back to locking */
+#define OPTIMISTIC_RETRIES 8
 
 typedef struct ArrayLock {
     int contador;
-    int locks[INODE_TABLE_SIZE];
+    int locks[2 * MAX_PATH_DEPTH]; /* move locks two paths */
 } ArrayLocks;
 
-struct timespec begin, end;
+extern struct timespec begin, end;
 
 void rwlock_read(int i);
 void rwlock_write(int i);
-void init_fs();
+void init_fs(char *image);
+long load_fs(char *checkpoint, uint64_t *lsn);
+long start_log(char *log, uint64_t after, int durability);
+long checkpoint_fs(char *checkpoint);
+void stop_fs();
 void destroy_fs();
-int is_dir_empty(DirEntry *dirEntries);
+int is_dir_empty(Directory *dir);
+int lookup_sub_node(char *name, Directory *dir);
 int create(char *name, type nodeType);
 int delete(char *name);
+int delete_tree(char *name);
 int move(char *name, char *new_name);
 int search(char *name, int function_type);
 int lookup(char *name, int function_type, ArrayLocks *arr);
 void unlocknodes(ArrayLocks *arr);
-int print_tecnicofs_tree(char *outputFile);
+int write_file(char *name, long offset, char *buf, int len);
+int read_file(char *name, long offset, int len, struct iovec *iov, int maxiov, int *niov, Ref *chunks);
+int truncate_file(char *name, long size);
+long size_file(char *name);
+int print_tecnicofs_tree(char *outputFile, int format);
+int print_tecnicofs_stats(char *outputFile, int format, const char *const *names);
+int print_lock_profile(char *outputFile, int top);
 
 #endif /* FS_H */
@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "reclaim.h"
+#include "gate.h"
+#include "state.h"
+
+/* i-nodes of detached subtrees waiting to be freed, a stack */
+static int *pending = NULL;
+static long count = 0, capacity = 0;
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* pending i-nodes, plus those a worker took and has not freed yet */
+static long outstanding = 0;
+static unsigned long reclaimed = 0;
+
+/* wakes idle workers when there is work to share */
+static void (*notify)() = NULL;
+
+
+/*
+ * Adds i-nodes to the pending ones. Called with pending_lock held.
+ */
+static void reclaim_push(int *inumbers, long n) {
+	if (count + n > capacity) {
+		long grown = capacity ? capacity : RECLAIM_BATCH;
+		while (grown < count + n)
+			grown *= 2;
+		int *bigger = realloc(pending, sizeof(int) * grown);
+		if (bigger == NULL) {
+			fprintf(stderr, "Error: allocating pending i-nodes.\n");
+			exit(EXIT_FAILURE);
+		}
+		pending = bigger;
+		capacity = grown;
+	}
+	memcpy(&pending[count], inumbers, sizeof(int) * n);
+	count += n;
+	__atomic_add_fetch(&outstanding, n, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Sets the function called when pending i-nodes are enough to keep
+ * more than one worker busy.
+ */
+void reclaim_notify(void (*wake)()) {
+	notify = wake;
+}
+
+
+/*
+ * Queues a subtree detached from the tree to be freed.
+ * Input:
+ *  - inumber: its root
+ */
+void reclaim_tree(int inumber) {
+	pthread_mutex_lock(&pending_lock);
+	reclaim_push(&inumber, 1);
+	pthread_mutex_unlock(&pending_lock);
+	if (notify != NULL)
+		notify();
+}
+
+
+/*
+ * Frees up to RECLAIM_BATCH pending i-nodes, adding the entries of the
+ * directories among them to the pending ones first.
+ * Returns: the number freed
+ */
+static int reclaim_batch() {
+	int taken[RECLAIM_BATCH], n;
+
+	pthread_mutex_lock(&pending_lock);
+	n = count < RECLAIM_BATCH ? count : RECLAIM_BATCH;
+	count -= n;
+	memcpy(taken, &pending[count], sizeof(int) * n);
+	pthread_mutex_unlock(&pending_lock);
+
+	for (int i = 0; i < n; i++) {
+		inode_t *inode = inode_at(taken[i]);
+		Directory *dir = inode->nodeType == T_DIRECTORY ? inode_dir(inode) : NULL;
+
+		if (dir != NULL && dir->count > 0) {
+			DirTable *table = dir_table(dir);
+			int *entries = malloc(sizeof(int) * dir->count);
+			int found = 0;
+			if (entries == NULL) {
+				fprintf(stderr, "Error: allocating pending i-nodes.\n");
+				exit(EXIT_FAILURE);
+			}
+			for (int slot = 0; slot < table->capacity && found < dir->count; slot++) {
+				if (table->entries[slot].inumber != FREE_INODE)
+					entries[found++] = table->entries[slot].inumber;
+			}
+			pthread_mutex_lock(&pending_lock);
+			reclaim_push(entries, found);
+			int share = count > RECLAIM_BATCH;
+			pthread_mutex_unlock(&pending_lock);
+			free(entries);
+			if (share && notify != NULL)
+				notify();
+		}
+		inode_delete(taken[i]);
+	}
+	__atomic_sub_fetch(&outstanding, n, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&reclaimed, n, __ATOMIC_RELAXED);
+	return n;
+}
+
+
+/*
+ * Frees a batch of pending i-nodes, if any, as a change to the file
+ * system, so checkpoints and prints see none half freed.
+ * Returns: the number freed, 0 if none is pending
+ */
+int reclaim_work() {
+	if (__atomic_load_n(&outstanding, __ATOMIC_ACQUIRE) == 0)
+		return 0;
+
+	gate_enter();
+	int n = reclaim_batch();
+	gate_exit();
+	return n;
+}
+
+
+/*
+ * Frees every pending i-node. To be called with the gate closed, so no
+ * worker holds any it has taken.
+ */
+void reclaim_drain() {
+	while (reclaim_batch() > 0);
+}
+
+
+/*
+ * Returns the number of i-nodes waiting to be freed.
+ */
+long reclaim_pending() {
+	return __atomic_load_n(&outstanding, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Returns the number of i-nodes freed so far.
+ */
+unsigned long reclaim_total() {
+	return __atomic_load_n(&reclaimed, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,23 @@
+#ifndef RECLAIM_H
+#define RECLAIM_H
+
+/*
+ * Background reclamation of the subtrees removed by delete_tree. A
+ * subtree, once detached from its parent, is reachable by no one, so its
+ * i-nodes are freed without locking the tree: reclaim_tree queues its
+ * root, and the workers take the pending i-nodes a batch at a time when
+ * they have no request to serve, each directory adding its entries to
+ * the pending ones, so a large subtree is spread across them.
+ */
+
+/* i-nodes freed per call to reclaim_work */
+#define RECLAIM_BATCH 64
+
+void reclaim_notify(void (*wake)());
+void reclaim_tree(int inumber);
+int reclaim_work();
+void reclaim_drain();
+long reclaim_pending();
+unsigned long reclaim_total();
+
+#endif /* RECLAIM_H */
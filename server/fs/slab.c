@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "slab.h"
+#include "state.h"
+
+/* which list of its cache a slab is on */
+#define SLAB_FULL 0
+#define SLAB_PARTIAL 1
+#define SLAB_EMPTY 2
+
+/* objects are aligned to this, and start this far into their slab */
+#define SLAB_ALIGN 16
+
+/*
+ * Header at the start of every slab.
+ */
+struct slab {
+	SlabCache *cache;
+	Slab *prev, *next; /* neighbours on the cache's partial or empty list */
+	void *free; /* free objects, linked through their first word */
+	int inuse; /* objects handed out */
+	int list; /* SLAB_FULL (on no list), SLAB_PARTIAL or SLAB_EMPTY */
+} __attribute__((aligned(CACHE_LINE)));
+
+/*
+ * Objects a thread has ready for one cache.
+ */
+typedef struct magazine {
+	int count;
+	void *objects[SLAB_MAGAZINE];
+} Magazine;
+
+static __thread Magazine magazines[SLAB_MAX_CACHES];
+
+/* caches used so far, for slab_stats and slab_reclaim */
+static pthread_mutex_t registry = PTHREAD_MUTEX_INITIALIZER;
+static SlabCache *caches = NULL;
+static int ncaches = 0;
+
+
+/*
+ * Returns the slab holding an object.
+ */
+static inline Slab *slab_of(void *ptr) {
+	return (Slab *) ((uintptr_t) ptr & ~((uintptr_t) SLAB_SIZE - 1));
+}
+
+
+/*
+ * Registers a cache on its first use, giving it its magazine index.
+ * Input:
+ *  - cache: the cache
+ * Returns: the cache's id
+ */
+static int slab_register(SlabCache *cache) {
+	pthread_mutex_lock(&registry);
+	if (cache->id < 0) {
+		if (ncaches == SLAB_MAX_CACHES) {
+			fprintf(stderr, "Error: too many slab caches.\n");
+			exit(EXIT_FAILURE);
+		}
+		cache->stride = (cache->size + SLAB_ALIGN - 1) & ~(size_t) (SLAB_ALIGN - 1);
+		if (cache->stride < sizeof(void *))
+			cache->stride = SLAB_ALIGN;
+		cache->perslab = (SLAB_SIZE - sizeof(Slab)) / cache->stride;
+		if (cache->perslab < 1) {
+			fprintf(stderr, "Error: %s do not fit in a slab.\n", cache->name);
+			exit(EXIT_FAILURE);
+		}
+		cache->next = caches;
+		caches = cache;
+		__atomic_store_n(&cache->id, ncaches++, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&registry);
+	return cache->id;
+}
+
+
+/*
+ * Adds a slab to one of its cache's lists.
+ * Input:
+ *  - slab: the slab, on no list
+ *  - list: SLAB_PARTIAL or SLAB_EMPTY
+ */
+static void slab_link(Slab *slab, int list) {
+	SlabCache *cache = slab->cache;
+	Slab **head = list == SLAB_EMPTY ? &cache->empty : &cache->partial;
+
+	slab->list = list;
+	slab->prev = NULL;
+	slab->next = *head;
+	if (*head != NULL)
+		(*head)->prev = slab;
+	*head = slab;
+	if (list == SLAB_EMPTY)
+		cache->nempty++;
+}
+
+
+/*
+ * Removes a slab from the list it is on, if any.
+ * Input:
+ *  - slab: the slab
+ */
+static void slab_unlink(Slab *slab) {
+	SlabCache *cache = slab->cache;
+
+	if (slab->list == SLAB_FULL)
+		return;
+	if (slab->prev != NULL)
+		slab->prev->next = slab->next;
+	else if (slab->list == SLAB_EMPTY)
+		cache->empty = slab->next;
+	else
+		cache->partial = slab->next;
+	if (slab->next != NULL)
+		slab->next->prev = slab->prev;
+	if (slab->list == SLAB_EMPTY)
+		cache->nempty--;
+	slab->list = SLAB_FULL;
+}
+
+
+/*
+ * Maps a new slab for a cache and puts it on the empty list. Called with
+ * the cache locked.
+ * Input:
+ *  - cache: the cache
+ */
+static void slab_map(SlabCache *cache) {
+	/* map twice the size and trim, to get a slab aligned to its size */
+	char *area = mmap(NULL, 2 * SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (area == MAP_FAILED) {
+		fprintf(stderr, "Error: mapping a slab for %s.\n", cache->name);
+		exit(EXIT_FAILURE);
+	}
+	char *start = (char *) (((uintptr_t) area + SLAB_SIZE - 1) & ~((uintptr_t) SLAB_SIZE - 1));
+	if (start > area)
+		munmap(area, start - area);
+	if (area + 2 * SLAB_SIZE > start + SLAB_SIZE)
+		munmap(start + SLAB_SIZE, area + 2 * SLAB_SIZE - (start + SLAB_SIZE));
+
+	Slab *slab = (Slab *) start;
+	slab->cache = cache;
+	slab->inuse = 0;
+	slab->free = NULL;
+	char *objects = start + sizeof(Slab);
+	for (int i = cache->perslab - 1; i >= 0; i--) {
+		void *object = objects + i * cache->stride;
+		*(void **) object = slab->free;
+		slab->free = object;
+	}
+	cache->nslabs++;
+	cache->allocated++;
+	slab_link(slab, SLAB_EMPTY);
+}
+
+
+/*
+ * Returns a slab to the OS. Called with the cache locked.
+ * Input:
+ *  - slab: the slab, empty and on no list
+ */
+static void slab_unmap(Slab *slab) {
+	slab->cache->nslabs--;
+	slab->cache->released++;
+	munmap(slab, SLAB_SIZE);
+}
+
+
+/*
+ * Fills a thread's magazine with SLAB_BATCH objects of its cache.
+ * Input:
+ *  - cache: the cache
+ *  - mag: the calling thread's magazine for it
+ */
+static void slab_refill(SlabCache *cache, Magazine *mag) {
+	pthread_mutex_lock(&cache->lock);
+	while (mag->count < SLAB_BATCH) {
+		if (cache->partial == NULL && cache->empty == NULL)
+			slab_map(cache);
+		Slab *slab = cache->partial != NULL ? cache->partial : cache->empty;
+
+		void *object = slab->free;
+		slab->free = *(void **) object;
+		mag->objects[mag->count++] = object;
+		cache->inuse++;
+		if (slab->inuse++ == 0) {
+			slab_unlink(slab);
+			slab_link(slab, SLAB_PARTIAL);
+		}
+		if (slab->free == NULL)
+			slab_unlink(slab);
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+
+/*
+ * Returns the count oldest objects of a thread's magazine to their
+ * slabs. Slabs left empty are kept for reuse, up to SLAB_KEEP_EMPTY,
+ * and returned to the OS beyond that.
+ * Input:
+ *  - cache: the cache
+ *  - mag: the calling thread's magazine for it
+ *  - count: number of objects
+ */
+static void slab_flush(SlabCache *cache, Magazine *mag, int count) {
+	pthread_mutex_lock(&cache->lock);
+	for (int i = 0; i < count; i++) {
+		void *object = mag->objects[i];
+		Slab *slab = slab_of(object);
+
+		*(void **) object = slab->free;
+		slab->free = object;
+		cache->inuse--;
+		if (slab->list == SLAB_FULL)
+			slab_link(slab, SLAB_PARTIAL);
+		if (--slab->inuse == 0) {
+			slab_unlink(slab);
+			if (cache->nempty < SLAB_KEEP_EMPTY)
+				slab_link(slab, SLAB_EMPTY);
+			else
+				slab_unmap(slab);
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	mag->count -= count;
+	memmove(mag->objects, mag->objects + count, sizeof(void *) * mag->count);
+}
+
+
+/*
+ * Allocates an object.
+ * Input:
+ *  - cache: cache of the object's size
+ * Returns: the object, never NULL
+ */
+void *slab_alloc(SlabCache *cache) {
+	int id = __atomic_load_n(&cache->id, __ATOMIC_ACQUIRE);
+	if (id < 0)
+		id = slab_register(cache);
+
+	Magazine *mag = &magazines[id];
+	if (mag->count == 0)
+		slab_refill(cache, mag);
+	return mag->objects[--mag->count];
+}
+
+
+/*
+ * Releases an object allocated by slab_alloc, from any thread.
+ * Input:
+ *  - ptr: the object
+ */
+void slab_free(void *ptr) {
+	if (ptr == NULL)
+		return;
+
+	SlabCache *cache = slab_of(ptr)->cache;
+	Magazine *mag = &magazines[cache->id];
+	if (mag->count == SLAB_MAGAZINE)
+		slab_flush(cache, mag, SLAB_BATCH);
+	mag->objects[mag->count++] = ptr;
+}
+
+
+/*
+ * Returns every object cached by the calling thread to its cache.
+ * Threads that stop using the file system should call this before
+ * exiting.
+ */
+void slab_thread_flush() {
+	pthread_mutex_lock(&registry);
+	for (SlabCache *cache = caches; cache != NULL; cache = cache->next) {
+		if (magazines[cache->id].count > 0)
+			slab_flush(cache, &magazines[cache->id], magazines[cache->id].count);
+	}
+	pthread_mutex_unlock(&registry);
+}
+
+
+/*
+ * Returns every empty slab of every cache to the OS.
+ * Returns: the number of bytes released
+ */
+long slab_reclaim() {
+	long released = 0;
+
+	pthread_mutex_lock(&registry);
+	for (SlabCache *cache = caches; cache != NULL; cache = cache->next) {
+		pthread_mutex_lock(&cache->lock);
+		while (cache->empty != NULL) {
+			Slab *slab = cache->empty;
+			slab_unlink(slab);
+			slab_unmap(slab);
+			released += SLAB_SIZE;
+		}
+		pthread_mutex_unlock(&cache->lock);
+	}
+	pthread_mutex_unlock(&registry);
+	return released;
+}
+
+
+/*
+ * Prints the usage of every cache: objects in use (including those in
+ * thread magazines) against the capacity of its slabs, and the slabs
+ * mapped and returned to the OS so far.
+ * Input:
+ *  - fp: where to print
+ */
+void slab_stats(FILE *fp) {
+	fprintf(fp, "%-16s %8s %10s %10s %7s %7s %9s %9s %9s\n", "cache", "size", "in use", "capacity",
+	        "slabs", "empty", "KB", "mapped", "released");
+
+	pthread_mutex_lock(&registry);
+	for (SlabCache *cache = caches; cache != NULL; cache = cache->next) {
+		pthread_mutex_lock(&cache->lock);
+		fprintf(fp, "%-16s %8zu %10ld %10ld %7ld %7ld %9ld %9ld %9ld\n", cache->name, cache->size,
+		        cache->inuse, cache->nslabs * cache->perslab, cache->nslabs, cache->nempty,
+		        cache->nslabs * (SLAB_SIZE / 1024), cache->allocated, cache->released);
+		pthread_mutex_unlock(&cache->lock);
+	}
+	pthread_mutex_unlock(&registry);
+}
@@ -0,0 +1,57 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+/*
+ * Slab allocator for the file system's fixed-size objects (directory
+ * tables, lock arrays, file chunks). Each cache carves objects of one
+ * size out of SLAB_SIZE slabs mapped from the OS. Threads allocate from
+ * and free to a small per-thread magazine per cache, and only take the
+ * cache's lock to move SLAB_BATCH objects at a time. Slabs are aligned
+ * to their size, so slab_free finds an object's slab (and cache) from
+ * its address alone.
+ */
+#define SLAB_SIZE (1 << 17)
+/* caches the per-thread magazines have room for */
+#define SLAB_MAX_CACHES 16
+/* objects a magazine holds, and moves to or from its cache at a time */
+#define SLAB_MAGAZINE 32
+#define SLAB_BATCH (SLAB_MAGAZINE / 2)
+/* empty slabs a cache keeps for reuse; more are returned to the OS */
+#define SLAB_KEEP_EMPTY 8
+
+typedef struct slab Slab;
+
+/*
+ * A cache of objects of one size. Define caches statically with
+ * SLAB_CACHE; they register themselves (for slab_stats) on first use.
+ */
+typedef struct slabCache {
+	const char *name;
+	size_t size; /* object size, as requested */
+	pthread_mutex_t lock;
+	int id; /* index of the per-thread magazines, -1 until first used */
+	size_t stride; /* object size, rounded for alignment */
+	int perslab; /* objects per slab */
+	Slab *partial; /* slabs with free objects */
+	Slab *empty; /* slabs without objects in use */
+	long nslabs;
+	long nempty;
+	long inuse; /* objects out of the slabs, including those in magazines */
+	long allocated; /* slabs ever mapped */
+	long released; /* slabs returned to the OS */
+	struct slabCache *next; /* registered caches */
+} SlabCache;
+
+#define SLAB_CACHE(name, size) \
+	{ (name), (size), PTHREAD_MUTEX_INITIALIZER, -1, 0, 0, NULL, NULL, 0, 0, 0, 0, 0, NULL }
+
+void *slab_alloc(SlabCache *cache);
+void slab_free(void *ptr);
+void slab_thread_flush();
+long slab_reclaim();
+void slab_stats(FILE *fp);
+
+#endif /* SLAB_H */
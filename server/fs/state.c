@@ -2,16 +2,313 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
 #include "state.h"
 
-inode_t inode_table[INODE_TABLE_SIZE];
+inode_t *inode_segments[INODE_MAX_SEGMENTS];
+
+/*
+ * Free i-nodes live in per-thread caches. Caches exchange whole batches
+ * with a shared lock-free stack (the pool): a batch is a chain of free
+ * i-nodes linked through next_free, and batches are linked through the
+ * next_batch field of their first i-node. The pool head packs the
+ * inumber of the top batch (plus one, so zero means empty) with a tag
+ * that is bumped on every update to rule out ABA.
+ *
+ * The pool, the table's high water mark and the segments make up the
+ * root of the table, kept in the image header when the table is mapped
+ * from a file.
+ */
+typedef struct inodeTableRoot {
+    uint64_t pool __attribute__((aligned(CACHE_LINE)));
+    /* slots ever reserved, grows by batches */
+    int high_water __attribute__((aligned(CACHE_LINE)));
+    /* segments of a mapped table; inode_segments points to them once used */
+    Ref segments[INODE_MAX_SEGMENTS] __attribute__((aligned(CACHE_LINE)));
+} InodeTableRoot;
+
+static InodeTableRoot heap_root;
+static InodeTableRoot *table_root = &heap_root;
+
+/* serializes setting up the segments of a mapped table */
+static pthread_mutex_t segment_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Checkpoints. While one is taken, the first change to each i-node saves
+ * the i-node as it was (see inode_snapshot) on the snapshots list, for
+ * the checkpointer to write.
+ */
+static unsigned int snapshot_gen = 0; /* of the checkpoint being taken, or the last one */
+static int snapshot_active = false;
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static InodeSnapshot *snapshots = NULL;
+
+static __thread struct {
+    int count;
+    int inumbers[INODE_CACHE_MAX];
+} cache;
+
+
+/*
+ * Initializes the i-nodes of a new segment as free.
+ * Input:
+ *  - segment: the segment
+ */
+static void inode_segment_init(inode_t *segment) {
+    for (int i = 0; i < INODE_SEGMENT_SIZE; i++) {
+        segment[i].nodeType = T_NONE;
+        segment[i].data = 0;
+        segment[i].next_free = FREE_INODE;
+        segment[i].next_batch = FREE_INODE;
+        segment[i].version = 0;
+        segment[i].snapshot_gen = 0;
+        if(pthread_rwlock_init(&segment[i].lock, NULL) != 0){
+            printf("Error: initializing locks.");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+
+/*
+ * Returns a segment of the table, setting it up on first use if the
+ * table is mapped from an image: the locks and versions it holds were
+ * left by the previous run, so they are reset. Doing this per segment,
+ * when first needed, keeps mounting an image independent of its size.
+ * Input:
+ *  - seg: index of the segment
+ * Returns: the segment, or NULL if it was never allocated
+ */
+inode_t *inode_segment_activate(int seg) {
+    inode_t *segment = __atomic_load_n(&inode_segments[seg], __ATOMIC_ACQUIRE);
+
+    if (segment != NULL || arena_base == NULL)
+        return segment;
+
+    pthread_mutex_lock(&segment_lock);
+    segment = inode_segments[seg];
+    if (segment == NULL && table_root->segments[seg] != 0) {
+        segment = ref_ptr(table_root->segments[seg]);
+        for (int i = 0; i < INODE_SEGMENT_SIZE; i++) {
+            if(pthread_rwlock_init(&segment[i].lock, NULL) != 0){
+                printf("Error: initializing locks.");
+                exit(EXIT_FAILURE);
+            }
+            segment[i].version = 0;
+            segment[i].snapshot_gen = 0;
+        }
+        __atomic_store_n(&inode_segments[seg], segment, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&segment_lock);
+    return segment;
+}
+
+
+/*
+ * Makes sure the segment of the i-nodes table holding an inumber is
+ * allocated. Segments are published with a CAS, so concurrent callers
+ * agree on a single segment.
+ * Input:
+ *  - inumber: identifier of an i-node of the segment
+ */
+static void inode_segment_ensure(int inumber) {
+    int seg = inumber >> INODE_SEGMENT_BITS;
+
+    if (__atomic_load_n(&inode_segments[seg], __ATOMIC_ACQUIRE) != NULL)
+        return;
+
+    /* segments of a mapped table are never released, so they are reserved */
+    if (arena_base != NULL) {
+        pthread_mutex_lock(&segment_lock);
+        if (table_root->segments[seg] == 0) {
+            inode_t *segment = arena_reserve(sizeof(inode_t) * INODE_SEGMENT_SIZE);
+            inode_segment_init(segment);
+            table_root->segments[seg] = ref_of(segment);
+        }
+        pthread_mutex_unlock(&segment_lock);
+        inode_segment_activate(seg);
+        return;
+    }
+
+    inode_t *segment = malloc(sizeof(inode_t) * INODE_SEGMENT_SIZE);
+    if (segment == NULL) {
+        fprintf(stderr, "Error: allocating i-node segment.\n");
+        exit(EXIT_FAILURE);
+    }
+    inode_segment_init(segment);
+
+    inode_t *expected = NULL;
+    if (!__atomic_compare_exchange_n(&inode_segments[seg], &expected, segment, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        /* another thread published the segment first */
+        for (int i = 0; i < INODE_SEGMENT_SIZE; i++)
+            pthread_rwlock_destroy(&segment[i].lock);
+        free(segment);
+    }
+}
+
+
+/*
+ * Pushes a chain of free i-nodes onto the shared pool.
+ * Input:
+ *  - first: inumber of the first i-node of the chain
+ */
+static void pool_push(int first) {
+    uint64_t head = __atomic_load_n(&table_root->pool, __ATOMIC_RELAXED);
+    uint64_t new_head;
+
+    do {
+        inode_at(first)->next_batch = (int) (uint32_t) head - 1;
+        new_head = ((head >> 32) + 1) << 32 | (uint32_t) (first + 1);
+    } while (!__atomic_compare_exchange_n(&table_root->pool, &head, new_head, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+
+/*
+ * Pops a chain of free i-nodes from the shared pool.
+ * Returns:
+ *  inumber: first i-node of the chain
+ *  FREE_INODE: if the pool is empty
+ */
+static int pool_pop() {
+    uint64_t head = __atomic_load_n(&table_root->pool, __ATOMIC_ACQUIRE);
+    uint64_t new_head;
+    int first;
+
+    do {
+        if ((uint32_t) head == 0)
+            return FREE_INODE;
+        first = (int) (uint32_t) head - 1;
+        /* may read a stale link if the batch was popped meanwhile, the tag makes the CAS fail then */
+        int next = __atomic_load_n(&inode_at(first)->next_batch, __ATOMIC_RELAXED);
+        new_head = ((head >> 32) + 1) << 32 | (uint32_t) (next + 1);
+    } while (!__atomic_compare_exchange_n(&table_root->pool, &head, new_head, true,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+    return first;
+}
+
+
+/*
+ * Moves up to INODE_BATCH i-nodes from the calling thread's cache to the
+ * shared pool.
+ */
+static void cache_flush_batch() {
+    int n = cache.count < INODE_BATCH ? cache.count : INODE_BATCH;
+    if (n == 0)
+        return;
+
+    cache.count -= n;
+    int *batch = &cache.inumbers[cache.count];
+    for (int i = 0; i < n - 1; i++) {
+        inode_at(batch[i])->next_free = batch[i + 1];
+    }
+    inode_at(batch[n - 1])->next_free = FREE_INODE;
+    pool_push(batch[0]);
+}
+
+
+/*
+ * Refills the calling thread's cache with a batch from the shared pool
+ * or, if the pool is empty, with never used slots from the table.
+ * Returns: SUCCESS or FAIL (if the table is full)
+ */
+static int cache_refill() {
+    int inumber = pool_pop();
+
+    if (inumber != FREE_INODE) {
+        for (; inumber != FREE_INODE; inumber = inode_at(inumber)->next_free) {
+            cache.inumbers[cache.count++] = inumber;
+        }
+        return SUCCESS;
+    }
+
+    /* batches never straddle segments since INODE_BATCH divides INODE_SEGMENT_SIZE */
+    int first = __atomic_fetch_add(&table_root->high_water, INODE_BATCH, __ATOMIC_RELAXED);
+    if (first > INODE_TABLE_MAX - INODE_BATCH) {
+        return FAIL;
+    }
+    inode_segment_ensure(first);
+    /* handed out from the top of the cache, so store them in reverse order */
+    for (int i = INODE_BATCH - 1; i >= 0; i--) {
+        cache.inumbers[cache.count++] = first + i;
+    }
+    return SUCCESS;
+}
+
+
+/*
+ * Returns the free i-nodes cached by the calling thread to the shared
+ * pool. Threads that stop creating i-nodes should call this before
+ * exiting.
+ */
+void inode_cache_flush() {
+    while (cache.count > 0)
+        cache_flush_batch();
+}
 
 
 /*
- * Sleeps for synchronization testing.
+ * Releases the contents of an i-node.
+ * Input:
+ *  - inode: the i-node
  */
-void insert_delay(int cycles) {
-    for (int i = 0; i < cycles; i++) {}
+static void inode_free_data(inode_t *inode) {
+    if (inode->nodeType == T_DIRECTORY) {
+        if (inode->data)
+            dir_destroy(inode_dir(inode));
+    }
+    else if (inode->data) {
+        file_destroy(inode_filedata(inode));
+    }
+    inode->data = 0;
+}
+
+
+/*
+ * Saves an i-node as it was when the checkpoint being taken started, if
+ * this is the first time the checkpoint sees it. Called before every
+ * change to an i-node, with the i-node locked against other changes.
+ * Input:
+ *  - inode: the i-node
+ *  - inumber: its identifier
+ */
+static void inode_snapshot(inode_t *inode, int inumber) {
+    if (!__atomic_load_n(&snapshot_active, __ATOMIC_ACQUIRE))
+        return;
+
+    /* claim the i-node, so it is saved once */
+    unsigned int seen = __atomic_load_n(&inode->snapshot_gen, __ATOMIC_RELAXED);
+    if (seen == snapshot_gen || !__atomic_compare_exchange_n(&inode->snapshot_gen, &seen, snapshot_gen,
+                                                             false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return;
+    /* free i-nodes are not part of the checkpoint */
+    if (inode->nodeType == T_NONE)
+        return;
+
+    InodeSnapshot *snap = malloc(sizeof(InodeSnapshot));
+    if (snap == NULL) {
+        fprintf(stderr, "Error: allocating an i-node snapshot.\n");
+        exit(EXIT_FAILURE);
+    }
+    snap->inumber = inumber;
+    snap->nodeType = inode->nodeType;
+    snap->table = NULL;
+    snap->file = NULL;
+    snap->contents = NULL;
+    if (inode->nodeType == T_DIRECTORY) {
+        snap->table = dir_copy(inode_dir(inode));
+    }
+    else if (inode->data != 0) {
+        snap->file = inode_filedata(inode);
+        snap->contents = file_snapshot(snap->file);
+    }
+
+    pthread_mutex_lock(&snapshot_lock);
+    snap->next = snapshots;
+    snapshots = snap;
+    pthread_mutex_unlock(&snapshot_lock);
 }
 
 
@@ -19,35 +316,149 @@ void insert_delay(int cycles) {
  * Initializes the i-nodes table.
  */
 void inode_table_init() {
-    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
-        inode_table[i].nodeType = T_NONE;
-        inode_table[i].data.dirEntries = NULL;
-        inode_table[i].data.fileContents = NULL;
-        if(pthread_rwlock_init(&inode_table[i].lock, NULL) != 0){
-            printf("Error: initializing locks.");
-            exit(EXIT_FAILURE);
+    for (int seg = 0; seg < INODE_MAX_SEGMENTS; seg++) {
+        inode_segments[seg] = NULL;
+    }
+    table_root = &heap_root;
+    table_root->pool = 0;
+    table_root->high_water = 0;
+    cache.count = 0;
+}
+
+
+/*
+ * Returns a signature of the structures an image holds, so an image
+ * written by a build with other sizes is refused.
+ */
+static uint64_t inode_table_layout() {
+    uint64_t sizes[] = {
+        sizeof(inode_t), INODE_SEGMENT_SIZE, sizeof(InodeTableRoot), sizeof(Directory),
+        sizeof(DirTable), sizeof(DirEntry), sizeof(FileData), FILE_CHUNK_SIZE
+    };
+    uint64_t hash = 14695981039346656037UL;
+    for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        hash ^= sizes[i];
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+
+/*
+ * Maps the i-nodes table, with all directories and file contents, from
+ * an image file, creating the image if the file does not exist. Only the
+ * header is read: segments are set up as they are first used.
+ * Input:
+ *  - image: path of the image file
+ * Returns:
+ *  1: if the image is new, and so the table empty
+ *  0: if the image already held a file system
+ *  FAIL: if the file is not a valid image
+ */
+int inode_table_mount(char *image) {
+    int created;
+
+    if (sizeof(InodeTableRoot) > ARENA_ROOT_SIZE) {
+        fprintf(stderr, "Error: the i-node table root does not fit in an image header.\n");
+        return FAIL;
+    }
+    if (arena_open(image, inode_table_layout(), &created) == FAIL)
+        return FAIL;
+
+    for (int seg = 0; seg < INODE_MAX_SEGMENTS; seg++) {
+        inode_segments[seg] = NULL;
+    }
+    table_root = arena_root();
+    cache.count = 0;
+    return created;
+}
+
+
+/*
+ * Writes a mapped i-nodes table back to its image. The final sync also
+ * rebuilds the pool of free i-nodes from the table, so the i-nodes left
+ * in thread caches are not lost, and marks the image clean; nothing may
+ * change the table afterwards.
+ * Input:
+ *  - final: whether this is the last sync before the server exits
+ */
+void inode_table_sync(int final) {
+    if (arena_base == NULL)
+        return;
+
+    if (final) {
+        int first = FREE_INODE, last = FREE_INODE, n = 0;
+
+        table_root->pool = 0;
+        cache.count = 0;
+        for (int inumber = inode_table_count() - 1; inumber >= 0; inumber--) {
+            if (!inode_in_table(inumber) || inode_at(inumber)->nodeType != T_NONE)
+                continue;
+            inode_at(inumber)->next_free = first;
+            first = inumber;
+            if (n++ == 0)
+                last = inumber;
+            if (n == INODE_BATCH) {
+                pool_push(first);
+                first = FREE_INODE;
+                n = 0;
+            }
+        }
+        if (n > 0) {
+            inode_at(last)->next_free = FREE_INODE;
+            pool_push(first);
         }
     }
+    arena_sync(final);
 }
 
 /*
- * Releases the allocated memory for the i-nodes tables.
+ * Releases the allocated memory for the i-nodes tables. A table mapped
+ * from an image is written back and unmapped instead.
  */
 
 void inode_table_destroy() {
-    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
-        if (inode_table[i].nodeType != T_NONE) {
-            /* as data is an union, the same pointer is used for both dirEntries and fileContents */
-            /* just release one of them */
-	        if (inode_table[i].data.dirEntries){
-                free(inode_table[i].data.dirEntries);
-                if(pthread_rwlock_destroy(&inode_table[i].lock) != 0){
-                    printf("Error: destroying locks.");
-                    exit(EXIT_FAILURE);
-                }
+    if (arena_base != NULL) {
+        inode_table_sync(1);
+        arena_close();
+        inode_table_init();
+        return;
+    }
+
+    for (int seg = 0; seg < INODE_MAX_SEGMENTS && inode_segments[seg]; seg++) {
+        for (int i = 0; i < INODE_SEGMENT_SIZE; i++) {
+            inode_t *inode = &inode_segments[seg][i];
+            if (inode->nodeType != T_NONE)
+                inode_free_data(inode);
+            if(pthread_rwlock_destroy(&inode->lock) != 0){
+                printf("Error: destroying locks.");
+                exit(EXIT_FAILURE);
             }
         }
+        free(inode_segments[seg]);
+        inode_segments[seg] = NULL;
     }
+    table_root->pool = 0;
+    table_root->high_water = 0;
+    cache.count = 0;
+}
+
+/*
+ * Checks if an inumber identifies an i-node in use.
+ * Input:
+ *  - inumber: identifier of the i-node
+ * Returns: true or false
+ */
+int inode_valid(int inumber) {
+    return inode_in_table(inumber) && inode_at(inumber)->nodeType != T_NONE;
+}
+
+/*
+ * Returns the number of i-node slots the table has reserved so far.
+ */
+int inode_table_count() {
+    int count = __atomic_load_n(&table_root->high_water, __ATOMIC_RELAXED);
+    return count < INODE_TABLE_MAX ? count : INODE_TABLE_MAX;
 }
 
 /*
@@ -62,26 +473,25 @@ int inode_create(type nType) {
     /* Used for testing synchronization speedup */
     insert_delay(DELAY);
 
-    for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-        if (inode_table[inumber].nodeType == T_NONE) {
-            inode_table[inumber].nodeType = nType;
-
-            if (nType == T_DIRECTORY) {
-                /* Initializes entry table */
-                inode_table[inumber].data.dirEntries = malloc(sizeof(DirEntry) * MAX_DIR_ENTRIES);
+    if (cache.count == 0 && cache_refill() == FAIL)
+        return FAIL;
 
-                for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-                    inode_table[inumber].data.dirEntries[i].inumber = FREE_INODE;
-                }
-            }
-            else {
-                inode_table[inumber].data.fileContents = NULL;
-            }
+    int inumber = cache.inumbers[--cache.count];
+    inode_t *inode = inode_at(inumber);
+    inode_snapshot(inode, inumber);
+    inode_write_begin(inode);
+    inode->nodeType = nType;
 
-            return inumber;
-        }
+    if (nType == T_DIRECTORY) {
+        /* Initializes entry table */
+        inode->data = ref_of(dir_create());
+    }
+    else {
+        inode->data = 0;
     }
-    return FAIL;
+    inode_write_end(inode);
+
+    return inumber;
 }
 
 /*
@@ -94,15 +504,29 @@ int inode_delete(int inumber) {
     /* Used for testing synchronization speedup */
     insert_delay(DELAY);
 
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
+    if (!inode_valid(inumber)) {
         printf("inode_delete: invalid inumber\n");
         return FAIL;
     }
 
-    inode_table[inumber].nodeType = T_NONE;
-    /* see inode_table_destroy function */
-    if (inode_table[inumber].data.dirEntries)
-        free(inode_table[inumber].data.dirEntries);
+    /* callers hold the parent, which keeps out everyone but a checkpoint
+       saving the i-node, so its own lock is free but for that */
+    inode_t *inode = inode_at(inumber);
+    if (pthread_rwlock_wrlock(&inode->lock) != 0) {
+        fprintf(stderr, "Error: failed locking an i-node to delete.\n");
+        exit(EXIT_FAILURE);
+    }
+    inode_snapshot(inode, inumber);
+    inode_write_begin(inode);
+    inode_free_data(inode);
+    inode->nodeType = T_NONE;
+    inode_write_end(inode);
+    pthread_rwlock_unlock(&inode->lock);
+
+    /* the i-node goes back to the calling thread's cache */
+    if (cache.count == INODE_CACHE_MAX)
+        cache_flush_batch();
+    cache.inumbers[cache.count++] = inumber;
     return SUCCESS;
 }
 
@@ -119,56 +543,160 @@ int inode_get(int inumber, type *nType, union Data *data) {
     /* Used for testing synchronization speedup */
     insert_delay(DELAY);
 
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
+    if (!inode_valid(inumber)) {
         fprintf(stderr, "Error @ inode_get: invalid inumber %d\n", inumber);
         return FAIL;
     }
 
     if (nType)
-        *nType = inode_table[inumber].nodeType;
+        *nType = inode_at(inumber)->nodeType;
 
     if (data)
-        *data = inode_table[inumber].data;
+        data->dir = inode_dir(inode_at(inumber));
 
     return SUCCESS;
 }
 
 
+/*
+ * Checks that an inumber identifies a file, for the file_* wrappers.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - caller: name to report errors with
+ * Returns: the i-node, or NULL
+ */
+static inode_t *inode_check_file(int inumber, char *caller) {
+    if (!inode_valid(inumber)) {
+        printf("%s: invalid inumber\n", caller);
+        return NULL;
+    }
+
+    if (inode_at(inumber)->nodeType != T_FILE) {
+        printf("%s: not a file\n", caller);
+        return NULL;
+    }
+    return inode_at(inumber);
+}
+
+
+/*
+ * Replaces the contents of a file.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - fileContents: the new contents
+ *  - len: length of fileContents
+ * Returns: SUCCESS or FAIL
+ */
+int inode_set_file(int inumber, char *fileContents, int len) {
+    /* Used for testing synchronization speedup */
+    insert_delay(DELAY);
+
+    inode_t *inode = inode_check_file(inumber, "inode_set_file");
+    if (inode == NULL || len < 0)
+        return FAIL;
+
+    inode_snapshot(inode, inumber);
+    inode_write_begin(inode);
+    if (inode->data == 0)
+        inode->data = ref_of(file_create());
+    file_truncate(inode_filedata(inode), 0);
+    int result = file_write(inode_filedata(inode), 0, fileContents, len);
+    inode_write_end(inode);
+    return result == FAIL ? FAIL : SUCCESS;
+}
+
+
+/*
+ * Writes to a file at an offset, extending it if needed.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - offset: position of the first byte to write
+ *  - buf: the bytes
+ *  - len: number of bytes
+ * Returns: number of bytes written or FAIL
+ */
+int inode_write_file(int inumber, long offset, char *buf, int len) {
+    /* Used for testing synchronization speedup */
+    insert_delay(DELAY);
+
+    inode_t *inode = inode_check_file(inumber, "inode_write_file");
+    if (inode == NULL)
+        return FAIL;
+
+    inode_snapshot(inode, inumber);
+    inode_write_begin(inode);
+    if (inode->data == 0)
+        inode->data = ref_of(file_create());
+    int result = file_write(inode_filedata(inode), offset, buf, len);
+    inode_write_end(inode);
+    return result;
+}
+
+
+/*
+ * Sets the size of a file.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - size: the new size in bytes
+ * Returns: SUCCESS or FAIL
+ */
+int inode_truncate_file(int inumber, long size) {
+    /* Used for testing synchronization speedup */
+    insert_delay(DELAY);
+
+    inode_t *inode = inode_check_file(inumber, "inode_truncate_file");
+    if (inode == NULL)
+        return FAIL;
+
+    inode_snapshot(inode, inumber);
+    inode_write_begin(inode);
+    if (inode->data == 0)
+        inode->data = ref_of(file_create());
+    int result = file_truncate(inode_filedata(inode), size);
+    inode_write_end(inode);
+    return result;
+}
+
+
 /*
  * Resets an entry for a directory.
  * Input:
  *  - inumber: identifier of the i-node
  *  - sub_inumber: identifier of the sub i-node entry
+ *  - sub_name: name of the sub i-node entry
  * Returns: SUCCESS or FAIL
  */
-int dir_reset_entry(int inumber, int sub_inumber) {
+int dir_reset_entry(int inumber, int sub_inumber, char *sub_name) {
     /* Used for testing synchronization speedup */
     insert_delay(DELAY);
 
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
+    if (!inode_valid(inumber)) {
         printf("inode_reset_entry: invalid inumber\n");
         return FAIL;
     }
 
-    if (inode_table[inumber].nodeType != T_DIRECTORY) {
+    if (inode_at(inumber)->nodeType != T_DIRECTORY) {
         printf("inode_reset_entry: can only reset entry to directories\n");
         return FAIL;
     }
 
-    if ((sub_inumber < FREE_INODE) || (sub_inumber > INODE_TABLE_SIZE) || (inode_table[sub_inumber].nodeType == T_NONE)) {
+    if (!inode_valid(sub_inumber)) {
         printf("inode_reset_entry: invalid entry inumber\n");
         return FAIL;
     }
 
 
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (inode_table[inumber].data.dirEntries[i].inumber == sub_inumber) {
-            inode_table[inumber].data.dirEntries[i].inumber = FREE_INODE;
-            inode_table[inumber].data.dirEntries[i].name[0] = '\0';
-            return SUCCESS;
-        }
+    inode_t *inode = inode_at(inumber);
+
+    if (dir_lookup(inode_dir(inode), sub_name) != sub_inumber) {
+        printf("inode_reset_entry: %s is not entry %d\n", sub_name, sub_inumber);
+        return FAIL;
     }
-    return FAIL;
+    inode_snapshot(inode, inumber);
+    inode_write_begin(inode);
+    dir_remove(inode_dir(inode), sub_name);
+    inode_write_end(inode);
+    return SUCCESS;
 }
 
 
@@ -184,17 +712,17 @@ int dir_add_entry(int inumber, int sub_inumber, char *sub_name) {
     /* Used for testing synchronization speedup */
     insert_delay(DELAY);
 
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
+    if (!inode_valid(inumber)) {
         printf("inode_add_entry: invalid inumber\n");
         return FAIL;
     }
 
-    if (inode_table[inumber].nodeType != T_DIRECTORY) {
+    if (inode_at(inumber)->nodeType != T_DIRECTORY) {
         printf("inode_add_entry: can only add entry to directories\n");
         return FAIL;
     }
 
-    if ((sub_inumber < 0) || (sub_inumber > INODE_TABLE_SIZE) || (inode_table[sub_inumber].nodeType == T_NONE)) {
+    if (!inode_valid(sub_inumber)) {
         printf("inode_add_entry: invalid entry inumber\n");
         return FAIL;
     }
@@ -205,40 +733,400 @@ int dir_add_entry(int inumber, int sub_inumber, char *sub_name) {
         return FAIL;
     }
 
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (inode_table[inumber].data.dirEntries[i].inumber == FREE_INODE) {
-            inode_table[inumber].data.dirEntries[i].inumber = sub_inumber;
-            strcpy(inode_table[inumber].data.dirEntries[i].name, sub_name);
-            return SUCCESS;
+    inode_t *inode = inode_at(inumber);
+    inode_snapshot(inode, inumber);
+    inode_write_begin(inode);
+    int result = dir_insert(inode_dir(inode), sub_name, sub_inumber);
+    inode_write_end(inode);
+    return result;
+}
+
+
+/*
+ * Output of inode_dump_tree, written to its file a large buffer at a
+ * time.
+ */
+typedef struct dumpBuffer {
+    int fd;
+    char *buf;
+    size_t len;
+    int failed;
+} DumpBuffer;
+
+/*
+ * A directory being listed by inode_dump_tree: its slots, the next one
+ * to visit and the length of its path.
+ */
+typedef struct dumpFrame {
+    DirTable *table;
+    int slot;
+    size_t pathlen;
+} DumpFrame;
+
+
+/*
+ * Writes out what is buffered.
+ */
+static void dump_flush(DumpBuffer *out) {
+    char *p = out->buf;
+
+    while (out->len > 0 && !out->failed) {
+        ssize_t n = write(out->fd, p, out->len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            out->failed = true;
+            break;
         }
+        p += n;
+        out->len -= n;
     }
-    return FAIL;
+    out->len = 0;
 }
 
 
 /*
- * Prints the i-nodes table.
- * Input:
- *  - inumber: identifier of the i-node
- *  - name: pointer to the name of current file/dir
+ * Appends bytes to the output.
  */
-void inode_print_tree(FILE *fp, int inumber, char *name) {
-    
-    if (inode_table[inumber].nodeType == T_FILE) {
-        fprintf(fp, "%s\n", name);
+static void dump_put(DumpBuffer *out, const void *data, size_t len) {
+    if (out->len + len > DUMP_BUFFER_SIZE)
+        dump_flush(out);
+    if (len > DUMP_BUFFER_SIZE) {
+        /* a path longer than the buffer goes out on its own */
+        DumpBuffer direct = { out->fd, (char *) data, len, out->failed };
+        dump_flush(&direct);
+        out->failed = direct.failed;
         return;
     }
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
+}
+
+
+/* appends a string constant to the output */
+#define dump_put_literal(out, s) dump_put(out, s, sizeof(s) - 1)
+
+/*
+ * Appends a number (not negative) to the output in decimal.
+ */
+static void dump_put_number(DumpBuffer *out, long n) {
+    char digits[24];
+    int i = sizeof(digits);
+
+    do {
+        digits[--i] = '0' + n % 10;
+        n /= 10;
+    } while (n > 0);
+    dump_put(out, digits + i, sizeof(digits) - i);
+}
+
+
+/*
+ * Appends a path to the output as a JSON string.
+ */
+static void dump_put_json(DumpBuffer *out, const char *s, size_t len) {
+    dump_put(out, "\"", 1);
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        char esc[8];
+        if (c == '"' || c == '\\') {
+            esc[0] = '\\';
+            esc[1] = c;
+            dump_put(out, esc, 2);
+        }
+        else if (c < 0x20) {
+            dump_put(out, esc, snprintf(esc, sizeof(esc), "\\u%04x", c));
+        }
+        else {
+            size_t run = 1;
+            while (i + run < len && (unsigned char) s[i + run] >= 0x20 && s[i + run] != '"' && s[i + run] != '\\')
+                run++;
+            dump_put(out, s + i, run);
+            i += run - 1;
+        }
+    }
+    dump_put(out, "\"", 1);
+}
 
-    if (inode_table[inumber].nodeType == T_DIRECTORY) {
-        fprintf(fp, "%s\n", name);
-        for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-            if (inode_table[inumber].data.dirEntries[i].inumber != FREE_INODE) {
-                char path[MAX_FILE_NAME];
-                if (snprintf(path, sizeof(path), "%s/%s", name, inode_table[inumber].data.dirEntries[i].name) > sizeof(path)) {
-                    fprintf(stderr, "truncation when building full path\n");
+
+/*
+ * Appends one node to the output, in the given format.
+ * Input:
+ *  - out: the output
+ *  - format: DUMP_TEXT, DUMP_NDJSON or DUMP_BINARY
+ *  - inode: the node
+ *  - inumber: its identifier
+ *  - path: its path, without a NUL (the root's is empty)
+ *  - pathlen: bytes of the path
+ *  - namelen: bytes of its name, at the end of the path
+ *  - depth: number of directories above it
+ */
+static void dump_node(DumpBuffer *out, int format, inode_t *inode, int inumber,
+                      char *path, size_t pathlen, size_t namelen, int depth) {
+    int isdir = inode->nodeType == T_DIRECTORY;
+    long size = isdir ? inode_dir(inode)->count : (inode->data != 0 ? file_size(inode_filedata(inode)) : 0);
+
+    switch (format) {
+        case DUMP_TEXT:
+            path[pathlen] = '\n';
+            dump_put(out, path, pathlen + 1);
+            break;
+        case DUMP_NDJSON:
+            dump_put_literal(out, "{\"path\":");
+            dump_put_json(out, pathlen > 0 ? path : "/", pathlen > 0 ? pathlen : 1);
+            if (isdir)
+                dump_put_literal(out, ",\"type\":\"directory\",\"inumber\":");
+            else
+                dump_put_literal(out, ",\"type\":\"file\",\"inumber\":");
+            dump_put_number(out, inumber);
+            if (isdir)
+                dump_put_literal(out, ",\"entries\":");
+            else
+                dump_put_literal(out, ",\"size\":");
+            dump_put_number(out, size);
+            dump_put_literal(out, "}\n");
+            break;
+        case DUMP_BINARY: {
+            DumpRecord rec = { .nodeType = isdir ? 'd' : 'f', .unused = 0, .namelen = namelen,
+                               .depth = depth, .inumber = inumber, .size = size };
+            dump_put(out, &rec, sizeof(rec));
+            dump_put(out, path + pathlen - namelen, namelen);
+            break;
+        }
+    }
+}
+
+
+/*
+ * Dumps the tree of the file system, from the root, in preorder: each
+ * node is followed by the subtrees of its entries. Walks the tree with a
+ * stack of its own, so its depth is only bounded by memory, as are the
+ * paths built. The tree may not change meanwhile.
+ * Input:
+ *  - fd: the file to write to
+ *  - format: DUMP_TEXT (one path per line), DUMP_NDJSON (one JSON object
+ *            per line) or DUMP_BINARY (DumpRecords, see state.h)
+ * Returns: number of nodes dumped, or FAIL if writing failed
+ */
+long inode_dump_tree(int fd, int format) {
+    DumpBuffer out = { fd, malloc(DUMP_BUFFER_SIZE), 0, false };
+    size_t pathcap = 256, depthcap = 64;
+    char *path = malloc(pathcap);
+    DumpFrame *stack = malloc(sizeof(DumpFrame) * depthcap);
+    int depth = 0;
+    long nodes = 0;
+
+    if (out.buf == NULL || path == NULL || stack == NULL) {
+        fprintf(stderr, "Error: allocating the tree dump buffers.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (format == DUMP_BINARY) {
+        DumpHeader header = { DUMP_MAGIC, DUMP_VERSION };
+        dump_put(&out, &header, sizeof(header));
+    }
+
+    dump_node(&out, format, inode_at(FS_ROOT), FS_ROOT, path, 0, 0, 0);
+    nodes++;
+    stack[0] = (DumpFrame) { dir_table(inode_dir(inode_at(FS_ROOT))), 0, 0 };
+    while (depth >= 0) {
+        DumpFrame *frame = &stack[depth];
+        if (frame->slot == frame->table->capacity) {
+            depth--;
+            continue;
+        }
+        DirEntry *entry = &frame->table->entries[frame->slot++];
+        if (entry->inumber == FREE_INODE)
+            continue;
+
+        inode_t *inode = inode_at(entry->inumber);
+        if (inode->nodeType != T_FILE && inode->nodeType != T_DIRECTORY)
+            continue;
+
+        /* room for "/name" and the newline written after it */
+        size_t namelen = strnlen(entry->name, MAX_FILE_NAME);
+        size_t pathlen = frame->pathlen + 1 + namelen;
+        if (pathlen + 1 > pathcap) {
+            while (pathlen + 1 > pathcap)
+                pathcap *= 2;
+            if ((path = realloc(path, pathcap)) == NULL) {
+                fprintf(stderr, "Error: allocating the tree dump path.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        path[frame->pathlen] = '/';
+        memcpy(path + frame->pathlen + 1, entry->name, namelen);
+
+        dump_node(&out, format, inode, entry->inumber, path, pathlen, namelen, depth + 1);
+        nodes++;
+        if (inode->nodeType == T_DIRECTORY) {
+            if (++depth == (int) depthcap) {
+                depthcap *= 2;
+                if ((stack = realloc(stack, sizeof(DumpFrame) * depthcap)) == NULL) {
+                    fprintf(stderr, "Error: allocating the tree dump stack.\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            stack[depth] = (DumpFrame) { dir_table(inode_dir(inode)), 0, pathlen };
+        }
+    }
+
+    if (format == DUMP_BINARY) {
+        DumpRecord end = { .nodeType = 0, .unused = 0, .namelen = 0, .depth = 0, .inumber = FREE_INODE, .size = nodes };
+        dump_put(&out, &end, sizeof(end));
+    }
+    dump_flush(&out);
+    free(out.buf);
+    free(path);
+    free(stack);
+    return out.failed ? FAIL : nodes;
+}
+
+
+/*
+ * Finds the paths of some i-nodes, walking the tree from the root as
+ * inode_dump_tree does. The tree may not change meanwhile.
+ * Input:
+ *  - inumbers: the i-nodes
+ *  - paths: where to store the path of each, allocated with malloc, or
+ *           NULL for those not in the tree
+ *  - count: number of i-nodes
+ * Returns: number of paths found
+ */
+int inode_find_paths(int *inumbers, char **paths, int count) {
+    size_t pathcap = 256, depthcap = 64;
+    char *path = malloc(pathcap);
+    DumpFrame *stack = malloc(sizeof(DumpFrame) * depthcap);
+    int depth = 0, found = 0;
+
+    if (path == NULL || stack == NULL) {
+        fprintf(stderr, "Error: allocating the path search buffers.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < count; i++) {
+        paths[i] = inumbers[i] == FS_ROOT ? strdup("/") : NULL;
+        found += paths[i] != NULL;
+    }
+
+    stack[0] = (DumpFrame) { dir_table(inode_dir(inode_at(FS_ROOT))), 0, 0 };
+    while (depth >= 0 && found < count) {
+        DumpFrame *frame = &stack[depth];
+        if (frame->slot == frame->table->capacity) {
+            depth--;
+            continue;
+        }
+        DirEntry *entry = &frame->table->entries[frame->slot++];
+        if (entry->inumber == FREE_INODE)
+            continue;
+
+        size_t namelen = strnlen(entry->name, MAX_FILE_NAME);
+        size_t pathlen = frame->pathlen + 1 + namelen;
+        if (pathlen + 1 > pathcap) {
+            while (pathlen + 1 > pathcap)
+                pathcap *= 2;
+            if ((path = realloc(path, pathcap)) == NULL) {
+                fprintf(stderr, "Error: allocating the path search buffers.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        path[frame->pathlen] = '/';
+        memcpy(path + frame->pathlen + 1, entry->name, namelen);
+        path[pathlen] = '\0';
+
+        for (int i = 0; i < count; i++) {
+            if (inumbers[i] == entry->inumber && paths[i] == NULL) {
+                paths[i] = strdup(path);
+                found++;
+            }
+        }
+        if (inode_at(entry->inumber)->nodeType == T_DIRECTORY) {
+            if (++depth == (int) depthcap) {
+                depthcap *= 2;
+                if ((stack = realloc(stack, sizeof(DumpFrame) * depthcap)) == NULL) {
+                    fprintf(stderr, "Error: allocating the path search buffers.\n");
+                    exit(EXIT_FAILURE);
                 }
-                inode_print_tree(fp, inode_table[inumber].data.dirEntries[i].inumber, path);
             }
+            stack[depth] = (DumpFrame) { dir_table(inode_dir(inode_at(entry->inumber))), 0, pathlen };
         }
     }
+
+    free(path);
+    free(stack);
+    return found;
+}
+
+
+/*
+ * Starts a checkpoint: from now on, the first change to each i-node
+ * saves it first. Must be called while no i-node is being changed, so the
+ * checkpoint is a consistent cut of the file system.
+ */
+void inode_snapshot_begin() {
+    snapshot_gen++;
+    __atomic_store_n(&snapshot_active, true, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Saves an i-node for the checkpoint being taken, unless a change saved
+ * it already. The checkpointer calls this for every i-node in the table
+ * when the checkpoint started.
+ * Input:
+ *  - inumber: identifier of the i-node
+ */
+void inode_snapshot_take(int inumber) {
+    if (!inode_in_table(inumber))
+        return;
+
+    inode_t *inode = inode_at(inumber);
+    if (__atomic_load_n(&inode->snapshot_gen, __ATOMIC_ACQUIRE) == snapshot_gen)
+        return;
+    if (pthread_rwlock_rdlock(&inode->lock) != 0) {
+        fprintf(stderr, "Error: failed locking an i-node for a checkpoint.\n");
+        exit(EXIT_FAILURE);
+    }
+    inode_snapshot(inode, inumber);
+    pthread_rwlock_unlock(&inode->lock);
+}
+
+
+/*
+ * Returns the i-nodes saved since the previous call, as a list linked
+ * through next; each is handed to inode_snapshot_release once written.
+ */
+InodeSnapshot *inode_snapshot_next() {
+    pthread_mutex_lock(&snapshot_lock);
+    InodeSnapshot *list = snapshots;
+    snapshots = NULL;
+    pthread_mutex_unlock(&snapshot_lock);
+    return list;
+}
+
+
+/*
+ * Releases a saved i-node, giving the chunks it shares back to its file.
+ * Input:
+ *  - snap: the saved i-node
+ */
+void inode_snapshot_release(InodeSnapshot *snap) {
+    if (snap->contents != NULL) {
+        inode_t *inode = inode_at(snap->inumber);
+        if (pthread_rwlock_wrlock(&inode->lock) != 0) {
+            fprintf(stderr, "Error: failed locking an i-node for a checkpoint.\n");
+            exit(EXIT_FAILURE);
+        }
+        file_snapshot_release(snap->file, snap->contents);
+        pthread_rwlock_unlock(&inode->lock);
+    }
+    free(snap->table);
+    free(snap);
+}
+
+
+/*
+ * Ends a checkpoint. Must be called while no i-node is being changed;
+ * the i-nodes saved meanwhile are still returned by inode_snapshot_next.
+ */
+void inode_snapshot_end() {
+    __atomic_store_n(&snapshot_active, false, __ATOMIC_RELEASE);
 }
@@ -6,56 +6,194 @@
 #include <pthread.h>
 #include <stdbool.h>
 #include "../../tecnicofs-api-constants.h"
+#include "arena.h"
+#include "directory.h"
+#include "filedata.h"
 
 /* FS root inode number */
 #define FS_ROOT 0
 
 #define FREE_INODE -1
-#define INODE_TABLE_SIZE 50
-#define MAX_DIR_ENTRIES 20
+
+/* The i-node table is a directory of fixed-size segments that are
+ * allocated on demand, so i-nodes never move once handed out */
+#define INODE_SEGMENT_BITS 12
+#define INODE_SEGMENT_SIZE (1 << INODE_SEGMENT_BITS)
+#define INODE_MAX_SEGMENTS 4096
+#define INODE_TABLE_MAX (INODE_SEGMENT_SIZE * INODE_MAX_SEGMENTS)
+
+/* free i-nodes move between thread caches and the shared pool in batches */
+#define INODE_BATCH 32
+#define INODE_CACHE_MAX (2 * INODE_BATCH)
+
+#define CACHE_LINE 64
 
 #define SUCCESS 0
 #define FAIL -1
 
+#ifndef DELAY
 #define DELAY 5000
+#endif
 
 
 /*
- * Contains the name of the entry and respective i-number
- */
-typedef struct dirEntry {
-	char name[MAX_FILE_NAME];
-	int inumber;
-} DirEntry;
-
-/*
- * Data is either text (file) or entries (DirEntry)
+ * Data is either contents (file) or entries (Directory)
  */
 union Data {
-	char *fileContents; /* for files */
-	DirEntry *dirEntries; /* for directories */
+	FileData *file; /* for files, NULL while empty */
+	Directory *dir; /* for directories */
 };
 
 /*
- * I-node definition
+ * I-node definition. When the table is mapped from an image, lock and
+ * version are reset when the i-node's segment is first used.
  */
 typedef struct inode_t {
 	type nodeType;
 	pthread_rwlock_t lock; /* inode's rwlock */
-	union Data data;
+	Ref data; /* union Data, stored as a reference into the image */
+	int next_free; /* next free i-node of a batch, only meaningful while T_NONE */
+	int next_batch; /* next batch in the free pool, only meaningful while T_NONE */
+	unsigned int version; /* seqlock: odd while the i-node is being changed */
+	unsigned int snapshot_gen; /* last checkpoint that saw the i-node, see inode_snapshot_begin */
     /* more i-node attributes will be added in future exercises */
 } inode_t;
 
-inode_t inode_table[INODE_TABLE_SIZE];
-void insert_delay(int cycles);
+/* formats of inode_dump_tree */
+#define DUMP_TEXT 0
+#define DUMP_NDJSON 1
+#define DUMP_BINARY 2
+
+/* bytes of output buffered before a write */
+#define DUMP_BUFFER_SIZE (1 << 20)
+
+#define DUMP_MAGIC 0x54465354 /* "TFST" */
+#define DUMP_VERSION 1
+
+/*
+ * A DUMP_BINARY dump is a DumpHeader followed by a DumpRecord per node,
+ * in preorder, each followed by the node's name. Paths are rebuilt from
+ * the depths. A record with nodeType 0 ends the dump, with the number of
+ * nodes as its size.
+ */
+typedef struct dumpHeader {
+	uint32_t magic;
+	uint32_t version;
+} DumpHeader;
+
+typedef struct dumpRecord {
+	uint8_t nodeType; /* 'f' or 'd' */
+	uint8_t unused;
+	uint16_t namelen; /* bytes of the name that follows, no NUL; 0 for the root */
+	uint32_t depth; /* directories above the node */
+	int32_t inumber;
+	int64_t size; /* bytes of a file, entries of a directory */
+} __attribute__((packed)) DumpRecord;
+
+/*
+ * An i-node as it was when a checkpoint started: directories are copied,
+ * files share their chunks with the live contents.
+ */
+typedef struct inodeSnapshot {
+	int inumber;
+	type nodeType;
+	DirTable *table; /* directories: copy of the slots */
+	FileData *file; /* files: the live contents, NULL while empty */
+	FileSnapshot *contents; /* files: the contents as they were */
+	struct inodeSnapshot *next;
+} InodeSnapshot;
+
+extern inode_t *inode_segments[INODE_MAX_SEGMENTS];
+
+inode_t *inode_segment_activate(int seg);
+
+/*
+ * Returns the i-node with the given inumber. The inumber must have been
+ * handed out by inode_create, so its segment is already allocated.
+ */
+static inline inode_t *inode_at(int inumber) {
+	inode_t *segment = inode_segments[inumber >> INODE_SEGMENT_BITS];
+	/* segments of a mapped image are set up on first use */
+	if (__builtin_expect(segment == NULL, 0))
+		segment = inode_segment_activate(inumber >> INODE_SEGMENT_BITS);
+	return &segment[inumber & (INODE_SEGMENT_SIZE - 1)];
+}
+
+/*
+ * Checks that an inumber read without locks lies in an allocated
+ * segment, so inode_at can be called on it.
+ */
+static inline int inode_in_table(int inumber) {
+	return inumber >= 0 && inumber < INODE_TABLE_MAX &&
+	       (__atomic_load_n(&inode_segments[inumber >> INODE_SEGMENT_BITS], __ATOMIC_ACQUIRE) != NULL ||
+	        inode_segment_activate(inumber >> INODE_SEGMENT_BITS) != NULL);
+}
+
+/*
+ * Return the contents of an i-node, for its type.
+ */
+static inline Directory *inode_dir(inode_t *inode) {
+	return ref_ptr(__atomic_load_n(&inode->data, __ATOMIC_ACQUIRE));
+}
+
+static inline FileData *inode_filedata(inode_t *inode) {
+	return ref_ptr(__atomic_load_n(&inode->data, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * Sleeps for synchronization testing. Inlined, so that built with
+ * -DDELAY=0 (as the benchmarks are) no trace of it is left.
+ */
+static inline void insert_delay(int cycles) {
+	for (int i = 0; i < cycles; i++) {}
+}
+
+/*
+ * Writers bracket every change to an i-node's type or contents with
+ * inode_write_begin/inode_write_end, while holding its write lock (or
+ * owning it exclusively). Lock-free readers sample the version with
+ * inode_read_begin and discard what they read if inode_read_validate
+ * fails.
+ */
+static inline void inode_write_begin(inode_t *inode) {
+	__atomic_store_n(&inode->version, inode->version + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void inode_write_end(inode_t *inode) {
+	__atomic_store_n(&inode->version, inode->version + 1, __ATOMIC_RELEASE);
+}
+
+static inline unsigned int inode_read_begin(inode_t *inode) {
+	return __atomic_load_n(&inode->version, __ATOMIC_ACQUIRE);
+}
+
+static inline int inode_read_validate(inode_t *inode, unsigned int version) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return (version & 1) == 0 && __atomic_load_n(&inode->version, __ATOMIC_RELAXED) == version;
+}
+
 void inode_table_init();
+int inode_table_mount(char *image);
+void inode_table_sync(int final);
 void inode_table_destroy();
+int inode_valid(int inumber);
+int inode_table_count();
+void inode_cache_flush();
 int inode_create(type nType);
 int inode_delete(int inumber);
 int inode_get(int inumber, type *nType, union Data *data);
 int inode_set_file(int inumber, char *fileContents, int len);
-int dir_reset_entry(int inumber, int sub_inumber);
+int inode_write_file(int inumber, long offset, char *buf, int len);
+int inode_truncate_file(int inumber, long size);
+int dir_reset_entry(int inumber, int sub_inumber, char *sub_name);
 int dir_add_entry(int inumber, int sub_inumber, char *sub_name);
-void inode_print_tree(FILE *fp, int inumber, char *name);
+long inode_dump_tree(int fd, int format);
+int inode_find_paths(int *inumbers, char **paths, int count);
+void inode_snapshot_begin();
+void inode_snapshot_take(int inumber);
+InodeSnapshot *inode_snapshot_next();
+void inode_snapshot_release(InodeSnapshot *snap);
+void inode_snapshot_end();
 
 #endif /* INODES_H */
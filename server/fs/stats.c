@@ -0,0 +1,322 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "stats.h"
+#include "state.h"
+#include "dcache.h"
+
+typedef struct statsHistogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[STATS_BUCKETS];
+} StatsHistogram;
+
+/*
+ * Per-thread histograms, STATS_STAGES for each kind of request, allocated
+ * on the first request of the kind. Only the owner writes them. A record
+ * outlives its thread and is taken over by the next thread to register,
+ * so threads that come and go (one per shared-memory session) neither
+ * lose their counts nor grow the list.
+ */
+typedef struct statsRecord {
+	int used;
+	StatsHistogram *ops[STATS_OPS];
+	struct statsRecord *next;
+} __attribute__((aligned(CACHE_LINE))) StatsRecord;
+
+/* every record ever allocated, never shrinks */
+static StatsRecord *records = NULL;
+static __thread StatsRecord *self = NULL;
+static pthread_key_t release_key;
+static pthread_once_t release_once = PTHREAD_ONCE_INIT;
+
+/* the request the calling thread is serving */
+static __thread uint64_t resolving = 0;
+static __thread uint64_t waiting = 0;
+
+static const char *stage_names[STATS_STAGES] = {
+	"total", "receive", "parse", "resolve", "lock", "execute", "send"
+};
+
+/* percentiles reported, in thousandths */
+static const int percentiles[] = { 500, 900, 990, 999 };
+#define PERCENTILES ((int) (sizeof(percentiles) / sizeof(percentiles[0])))
+
+
+/*
+ * Frees the record of an exiting thread for the next one.
+ */
+static void stats_release(void *record) {
+	__atomic_store_n(&((StatsRecord *) record)->used, false, __ATOMIC_RELEASE);
+}
+
+static void stats_init_key() {
+	if (pthread_key_create(&release_key, stats_release) != 0) {
+		fprintf(stderr, "Error: creating stats key.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+/*
+ * Returns the calling thread's record, taking over a free one or
+ * registering a new one on first use.
+ */
+static StatsRecord *stats_self() {
+	if (self != NULL)
+		return self;
+
+	StatsRecord *record;
+	for (record = __atomic_load_n(&records, __ATOMIC_ACQUIRE); record != NULL; record = record->next) {
+		int expected = false;
+		if (!__atomic_load_n(&record->used, __ATOMIC_RELAXED) &&
+		    __atomic_compare_exchange_n(&record->used, &expected, true, false,
+		                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+	}
+	if (record == NULL) {
+		if (posix_memalign((void **) &record, CACHE_LINE, sizeof(StatsRecord)) != 0) {
+			fprintf(stderr, "Error: allocating stats record.\n");
+			exit(EXIT_FAILURE);
+		}
+		record->used = true;
+		for (int op = 0; op < STATS_OPS; op++)
+			record->ops[op] = NULL;
+		record->next = __atomic_load_n(&records, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&records, &record->next, record, true,
+		                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+
+	pthread_once(&release_once, stats_init_key);
+	pthread_setspecific(release_key, record);
+	self = record;
+	return record;
+}
+
+
+/*
+ * Index of the bucket of a value: its STATS_SUB_BITS high bits, offset
+ * by half a power of two's worth of buckets per bit below them.
+ */
+static int stats_bucket(uint64_t value) {
+	if (value >= (1UL << STATS_MAX_BITS))
+		value = (1UL << STATS_MAX_BITS) - 1;
+	if (value < STATS_SUB_BUCKETS)
+		return value;
+	int shift = 63 - __builtin_clzl(value) - STATS_SUB_BITS + 1;
+	return shift * (STATS_SUB_BUCKETS / 2) + (value >> shift);
+}
+
+
+/*
+ * Largest value that falls in a bucket.
+ */
+static uint64_t stats_bucket_limit(int bucket) {
+	if (bucket < STATS_SUB_BUCKETS)
+		return bucket;
+	int shift = (bucket - STATS_SUB_BUCKETS) / (STATS_SUB_BUCKETS / 2) + 1;
+	uint64_t low = (uint64_t) (bucket - shift * (STATS_SUB_BUCKETS / 2)) << shift;
+	return low + (1UL << shift) - 1;
+}
+
+
+/*
+ * Adds a value to a histogram of the calling thread. Plain stores
+ * suffice, as no other thread writes it; readers may see the fields
+ * of one value a little apart.
+ */
+static void stats_add(StatsHistogram *h, uint64_t value) {
+	uint64_t *bucket = &h->buckets[stats_bucket(value)];
+	__atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->sum, h->sum + value, __ATOMIC_RELAXED);
+	if (value > h->max)
+		__atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Starts timing a request on the calling thread.
+ */
+void stats_begin() {
+	resolving = 0;
+	waiting = 0;
+}
+
+
+/*
+ * Counts time spent looking up paths, lock waits included, in the
+ * request of the calling thread.
+ */
+void stats_resolve(uint64_t ns) {
+	resolving += ns;
+}
+
+
+/*
+ * Counts time spent blocked on an i-node lock in the request of the
+ * calling thread.
+ */
+void stats_lock_wait(uint64_t ns) {
+	waiting += ns;
+}
+
+
+/*
+ * Records a request served by the calling thread since stats_begin.
+ * Input:
+ *  - op: kind of request, below STATS_OPS (0 for the others)
+ *  - req: the times it entered each stage
+ */
+void stats_record(int op, StatsRequest *req) {
+	StatsRecord *record = stats_self();
+
+	if (op < 0 || op >= STATS_OPS)
+		op = 0;
+	StatsHistogram *h = record->ops[op];
+	if (h == NULL) {
+		h = calloc(STATS_STAGES, sizeof(StatsHistogram));
+		if (h == NULL) {
+			fprintf(stderr, "Error: allocating stats histograms.\n");
+			exit(EXIT_FAILURE);
+		}
+		__atomic_store_n(&record->ops[op], h, __ATOMIC_RELEASE);
+	}
+
+	stats_add(&h[STATS_TOTAL], req->sent - req->received);
+	stats_add(&h[STATS_RECEIVE], req->started - req->parsed);
+	stats_add(&h[STATS_PARSE], req->parsed - req->received);
+	/* every i-node lock is taken by a lookup */
+	stats_add(&h[STATS_RESOLVE], resolving > waiting ? resolving - waiting : 0);
+	stats_add(&h[STATS_LOCK], waiting);
+	stats_add(&h[STATS_EXECUTE], req->executed - req->started);
+	stats_add(&h[STATS_SEND], req->sent - req->executed);
+}
+
+
+/*
+ * Adds up the histograms of every thread for a kind of request.
+ * Returns: false if no thread served any
+ */
+static bool stats_merge(int op, StatsHistogram *merged) {
+	bool any = false;
+
+	for (int stage = 0; stage < STATS_STAGES; stage++) {
+		StatsHistogram *m = &merged[stage];
+		m->count = m->sum = m->max = 0;
+		for (int b = 0; b < STATS_BUCKETS; b++)
+			m->buckets[b] = 0;
+	}
+	for (StatsRecord *r = __atomic_load_n(&records, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+		StatsHistogram *h = __atomic_load_n(&r->ops[op], __ATOMIC_ACQUIRE);
+		if (h == NULL)
+			continue;
+		any = true;
+		for (int stage = 0; stage < STATS_STAGES; stage++) {
+			StatsHistogram *m = &merged[stage];
+			m->sum += __atomic_load_n(&h[stage].sum, __ATOMIC_RELAXED);
+			uint64_t max = __atomic_load_n(&h[stage].max, __ATOMIC_RELAXED);
+			if (max > m->max)
+				m->max = max;
+			/* counted from the buckets, so percentiles add up */
+			for (int b = 0; b < STATS_BUCKETS; b++) {
+				uint64_t n = __atomic_load_n(&h[stage].buckets[b], __ATOMIC_RELAXED);
+				m->buckets[b] += n;
+				m->count += n;
+			}
+		}
+	}
+	return any;
+}
+
+
+/*
+ * Value below which a fraction of a histogram's values fall, as the
+ * largest value of the bucket reaching it.
+ */
+static uint64_t stats_percentile(StatsHistogram *h, int thousandths) {
+	uint64_t rank = (h->count * thousandths + 999) / 1000, seen = 0;
+
+	if (rank == 0)
+		rank = 1;
+	for (int b = 0; b < STATS_BUCKETS; b++) {
+		seen += h->buckets[b];
+		if (seen >= rank)
+			return stats_bucket_limit(b) < h->max ? stats_bucket_limit(b) : h->max;
+	}
+	return h->max;
+}
+
+
+/*
+ * Writes the histograms of every kind of request served so far, then
+ * the hits and misses of the path cache.
+ * Input:
+ *  - fd: where to write
+ *  - format: STATS_TEXT or STATS_JSON
+ *  - names: name of each kind of request, NULL for those never served
+ * Returns: number of bytes written, or FAIL
+ */
+long stats_dump(int fd, int format, const char *const *names) {
+	StatsHistogram *merged = malloc(STATS_STAGES * sizeof(StatsHistogram));
+	long written = 0;
+	int n, first = true;
+
+	if (merged == NULL) {
+		fprintf(stderr, "Error: allocating stats histograms.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (format == STATS_TEXT)
+		n = dprintf(fd, "%-10s %-8s %10s %9s %9s %9s %9s %9s %9s  (us)\n", "request", "stage", "count",
+		            "mean", "p50", "p90", "p99", "p99.9", "max");
+	else
+		n = dprintf(fd, "{\"unit\":\"ns\",\"requests\":{");
+	written += n;
+
+	for (int op = 0; op < STATS_OPS && n >= 0; op++) {
+		if (names[op] == NULL || !stats_merge(op, merged))
+			continue;
+
+		if (format == STATS_JSON) {
+			n = dprintf(fd, "%s\"%s\":{\"count\":%lu", first ? "" : ",", names[op], merged[STATS_TOTAL].count);
+			written += n;
+		}
+		first = false;
+		for (int stage = 0; stage < STATS_STAGES && n >= 0; stage++) {
+			StatsHistogram *h = &merged[stage];
+			uint64_t mean = h->count ? h->sum / h->count : 0;
+			uint64_t p[PERCENTILES];
+			for (int i = 0; i < PERCENTILES; i++)
+				p[i] = stats_percentile(h, percentiles[i]);
+
+			if (format == STATS_TEXT)
+				n = dprintf(fd, "%-10s %-8s %10lu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+				            stage == STATS_TOTAL ? names[op] : "", stage_names[stage], h->count,
+				            mean / 1000.0, p[0] / 1000.0, p[1] / 1000.0, p[2] / 1000.0, p[3] / 1000.0,
+				            h->max / 1000.0);
+			else
+				n = dprintf(fd, ",\"%s\":{\"mean\":%lu,\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,"
+				            "\"p999\":%lu,\"max\":%lu}", stage_names[stage], mean, p[0], p[1], p[2], p[3], h->max);
+			written += n;
+		}
+		if (format == STATS_JSON && n >= 0) {
+			n = dprintf(fd, "}");
+			written += n;
+		}
+	}
+	if (n >= 0) {
+		unsigned long hits, misses;
+		dcache_stats(&hits, &misses);
+		if (format == STATS_TEXT)
+			n = dprintf(fd, "path cache: %lu hits, %lu misses\n", hits, misses);
+		else
+			n = dprintf(fd, "},\"dcache\":{\"hits\":%lu,\"misses\":%lu}}\n", hits, misses);
+		written += n;
+	}
+
+	free(merged);
+	return n < 0 ? FAIL : written;
+}
@@ -0,0 +1,62 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Latency histograms of the requests served, per kind of request and per
+ * stage. Each thread records into histograms of its own with plain
+ * stores, so recording takes no lock and shares no cache line; a dump
+ * adds up the histograms of every thread.
+ *
+ * Histograms are log-linear, as HDR histograms: values below
+ * STATS_SUB_BUCKETS nanoseconds have a bucket each, and every power of two
+ * above is split in STATS_SUB_BUCKETS / 2 buckets, so a percentile is
+ * within 1 / (STATS_SUB_BUCKETS / 2) of the value recorded.
+ */
+#define STATS_SUB_BITS 5
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+/* values are clamped to 2^STATS_MAX_BITS - 1 ns, about 68 s */
+#define STATS_MAX_BITS 36
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 2) * (STATS_SUB_BUCKETS / 2))
+
+/* kinds of request told apart, indexed by opcode */
+#define STATS_OPS 16
+
+/* stages of a request */
+#define STATS_TOTAL 0 /* received to reply sent */
+#define STATS_RECEIVE 1 /* received to taken by a worker */
+#define STATS_PARSE 2 /* decoding */
+#define STATS_RESOLVE 3 /* path lookups, not counting lock waits */
+#define STATS_LOCK 4 /* blocked on i-node locks and the quiescence gate */
+#define STATS_EXECUTE 5 /* running the request, lookups and lock waits included */
+#define STATS_SEND 6 /* sending the reply */
+#define STATS_STAGES 7
+
+/* formats of stats_dump */
+#define STATS_TEXT 0 /* a table in microseconds */
+#define STATS_JSON 1 /* one JSON object, in nanoseconds */
+
+/* the time a request entered each stage, in ns, filled by the server */
+typedef struct statsRequest {
+	uint64_t received;
+	uint64_t parsed;
+	uint64_t started; /* taken by a worker */
+	uint64_t executed;
+	uint64_t sent;
+} StatsRequest;
+
+static inline uint64_t stats_now() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+void stats_begin();
+void stats_resolve(uint64_t ns);
+void stats_lock_wait(uint64_t ns);
+void stats_record(int op, StatsRequest *req);
+long stats_dump(int fd, int format, const char *const *names);
+
+#endif /* STATS_H */
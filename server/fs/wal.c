@@ -0,0 +1,539 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "wal.h"
+#include "state.h"
+
+/* bytes of a header covered by its checksum, those after the lsn */
+#define WAL_HEADER_SUMMED (sizeof(WalRecord) - offsetof(WalRecord, op))
+
+static int log_fd = -1;
+static int durability = WAL_BATCHED;
+static char *log_path = NULL;
+static char *old_path = NULL; /* where wal_rotate moves the log */
+
+/*
+ * Records are appended to the active buffer while the group-commit
+ * thread writes the other one. All of it is protected by log_lock.
+ */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending = PTHREAD_COND_INITIALIZER; /* records to write */
+static pthread_cond_t space = PTHREAD_COND_INITIALIZER; /* the active buffer was swapped */
+static pthread_cond_t durable = PTHREAD_COND_INITIALIZER; /* durable_lsn advanced */
+static char *buffers[2];
+static int active = 0;
+static int active_len = 0;
+static uint64_t last_lsn = 0; /* of the last record appended */
+static uint64_t durable_lsn = 0; /* of the last record written (and synced) */
+static int stopping = false;
+static pthread_t committer;
+static int committing = false; /* the group-commit thread runs */
+static int rotated_fd = -1; /* log the committer still has to finish, see wal_rotate */
+static int switch_at = 0; /* bytes of the active buffer that belong to rotated_fd */
+static unsigned long nrecords = 0, nsyncs = 0;
+
+/* last record the calling thread appended, for wal_commit */
+static __thread uint64_t thread_lsn = 0;
+
+
+/*
+ * Hashes bytes, continuing from a previous hash (FNV-1a over words).
+ * Input:
+ *  - buf: the bytes
+ *  - len: number of bytes
+ *  - hash: hash of the preceding bytes, or the seed
+ */
+uint64_t wal_hash(const void *buf, size_t len, uint64_t hash) {
+	const char *p = buf;
+	uint64_t word;
+
+	for (; len >= sizeof(word); len -= sizeof(word), p += sizeof(word)) {
+		memcpy(&word, p, sizeof(word));
+		hash = (hash ^ word) * 1099511628211UL;
+	}
+	for (; len > 0; len--, p++)
+		hash = (hash ^ (unsigned char) *p) * 1099511628211UL;
+	return hash;
+}
+
+
+/*
+ * Returns the checksum of a record given as its pieces.
+ */
+static uint32_t wal_checksum(WalRecord *rec, char *name, char *name2, char *data, int datalen) {
+	uint64_t hash = wal_hash(&rec->op, WAL_HEADER_SUMMED, WAL_HASH_SEED);
+	hash = wal_hash(name, rec->namelen, hash);
+	hash = wal_hash(name2, rec->name2len, hash);
+	hash = wal_hash(data, datalen, hash);
+	return (uint32_t) (hash ^ (hash >> 32));
+}
+
+
+/*
+ * Writes the whole of a buffer to a log file, exiting if it cannot: the
+ * changes it holds were already made.
+ */
+static void wal_write(int fd, char *buf, int len) {
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			fprintf(stderr, "Error: writing the log.\n");
+			exit(EXIT_FAILURE);
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+
+/*
+ * Makes what was written to a log file durable.
+ */
+static void wal_sync(int fd) {
+	if (fdatasync(fd) < 0) {
+		fprintf(stderr, "Error: syncing the log.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+/*
+ * Makes the names of the log files durable, after wal_rotate changed
+ * them.
+ */
+static void wal_sync_dir() {
+	char *slash = strrchr(log_path, '/');
+	char *dir = slash == NULL ? strdup(".") : strndup(log_path, slash == log_path ? 1 : slash - log_path);
+	if (dir == NULL) {
+		fprintf(stderr, "Error: allocating the log directory name.\n");
+		exit(EXIT_FAILURE);
+	}
+	int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0 || fsync(fd) < 0) {
+		fprintf(stderr, "Error: syncing directory %s.\n", dir);
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+	free(dir);
+}
+
+
+/*
+ * Returns the name a log is moved to by wal_rotate (to be freed).
+ */
+static char *wal_old_path(char *path) {
+	char *old = malloc(strlen(path) + sizeof(".old"));
+	if (old == NULL) {
+		fprintf(stderr, "Error: allocating the log name.\n");
+		exit(EXIT_FAILURE);
+	}
+	strcpy(old, path);
+	strcat(old, ".old");
+	return old;
+}
+
+
+/*
+ * Group commit: writes every record appended since the previous round
+ * with a single write, syncs (unless durability is WAL_NONE) and wakes
+ * the threads waiting for them.
+ */
+static void *wal_committer(void *arg) {
+	pthread_mutex_lock(&log_lock);
+	while (true) {
+		while (active_len == 0 && !stopping)
+			pthread_cond_wait(&pending, &log_lock);
+		if (active_len == 0)
+			break;
+
+		char *buf = buffers[active];
+		int len = active_len;
+		uint64_t upto = last_lsn;
+		int fd = log_fd, old = rotated_fd, split = switch_at;
+		active = !active;
+		active_len = 0;
+		rotated_fd = -1;
+		pthread_cond_broadcast(&space);
+		pthread_mutex_unlock(&log_lock);
+
+		/* the records appended before wal_rotate end the rotated log */
+		if (old >= 0) {
+			wal_write(old, buf, split);
+			if (durability == WAL_BATCHED)
+				wal_sync(old);
+			close(old);
+			wal_sync_dir();
+		}
+		else
+			split = 0;
+		wal_write(fd, buf + split, len - split);
+		if (durability == WAL_BATCHED)
+			wal_sync(fd);
+
+		pthread_mutex_lock(&log_lock);
+		if (durability == WAL_BATCHED)
+			nsyncs++;
+		__atomic_store_n(&durable_lsn, upto, __ATOMIC_RELEASE);
+		pthread_cond_broadcast(&durable);
+	}
+	pthread_mutex_unlock(&log_lock);
+	return NULL;
+}
+
+
+/*
+ * Replays one log file (see wal_replay). A torn or corrupt tail, left by
+ * a crash in the middle of a write, is cut off.
+ */
+static long wal_replay_file(char *path, uint64_t after, void (*apply)(WalEntry *entry)) {
+	struct stat st;
+	long count = 0;
+	off_t pos = 0;
+
+	int fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : FAIL;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return FAIL;
+	}
+
+	char *log = malloc(st.st_size > 0 ? st.st_size : 1);
+	if (log == NULL) {
+		fprintf(stderr, "Error: allocating %ld bytes to replay the log.\n", (long) st.st_size);
+		exit(EXIT_FAILURE);
+	}
+	for (off_t done = 0; done < st.st_size; ) {
+		ssize_t n = pread(fd, log + done, st.st_size - done, done);
+		if (n <= 0) {
+			free(log);
+			close(fd);
+			return FAIL;
+		}
+		done += n;
+	}
+
+	while (st.st_size - pos >= (off_t) sizeof(WalRecord)) {
+		WalRecord rec;
+		WalEntry entry;
+		memcpy(&rec, log + pos, sizeof(rec));
+
+		char *name = log + pos + sizeof(rec);
+		entry.datalen = (long) rec.len - sizeof(rec) - rec.namelen - rec.name2len;
+		if (rec.len > st.st_size - pos || entry.datalen < 0 ||
+		    (pos == 0 ? rec.lsn <= last_lsn : rec.lsn != last_lsn + 1) ||
+		    rec.namelen == 0 || name[rec.namelen - 1] != '\0' ||
+		    (rec.name2len > 0 && name[rec.namelen + rec.name2len - 1] != '\0'))
+			break;
+		entry.op = rec.op;
+		entry.nodeType = rec.nodeType;
+		entry.name = name;
+		entry.name2 = rec.name2len > 0 ? name + rec.namelen : NULL;
+		entry.arg = rec.arg;
+		entry.data = name + rec.namelen + rec.name2len;
+		if (wal_checksum(&rec, entry.name, entry.name2, entry.data, entry.datalen) != rec.checksum)
+			break;
+
+		if (rec.lsn > after) {
+			apply(&entry);
+			count++;
+		}
+		last_lsn = rec.lsn;
+		pos += rec.len;
+	}
+
+	if (pos < st.st_size) {
+		fprintf(stderr, "Warning: discarding %ld bytes of torn records at the end of log %s\n",
+		        (long) (st.st_size - pos), path);
+		if (ftruncate(fd, pos) < 0) {
+			fprintf(stderr, "Error: unable to cut log %s.\n", path);
+			exit(EXIT_FAILURE);
+		}
+	}
+	free(log);
+	close(fd);
+	return count;
+}
+
+
+/*
+ * Replays the log, calling apply for each record in order: first the
+ * log wal_rotate moved aside, if it is still there, then the log itself.
+ * Must be called before wal_start.
+ * Input:
+ *  - path: the log file
+ *  - after: records up to this lsn are already part of the file system
+ *           (saved by a checkpoint) and are skipped
+ *  - apply: function redoing a record
+ * Returns: number of records replayed (0 if there is no log), or FAIL
+ */
+long wal_replay(char *path, uint64_t after, void (*apply)(WalEntry *entry)) {
+	char *old = wal_old_path(path);
+	long count = wal_replay_file(old, after, apply);
+	free(old);
+	if (count != FAIL) {
+		long more = wal_replay_file(path, after, apply);
+		count = more == FAIL ? FAIL : count + more;
+	}
+	/* numbering goes on after the checkpoint even if the log was lost */
+	if (last_lsn < after)
+		last_lsn = after;
+	durable_lsn = last_lsn;
+	return count;
+}
+
+
+/*
+ * Opens the log for appending and starts logging.
+ * Input:
+ *  - path: the log file, created if needed
+ *  - level: WAL_NONE, WAL_BATCHED or WAL_PER_OP
+ *  - discard: whether to empty the log first, when what it holds is
+ *             already part of the file system
+ * Returns: SUCCESS or FAIL
+ */
+int wal_start(char *path, int level, int discard) {
+	log_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC | (discard ? O_TRUNC : 0), 0644);
+	if (log_fd < 0) {
+		fprintf(stderr, "Error: unable to open log %s.\n", path);
+		return FAIL;
+	}
+	if (discard)
+		last_lsn = durable_lsn = 0;
+	durability = level;
+	log_path = strdup(path);
+	old_path = wal_old_path(path);
+	if (log_path == NULL) {
+		fprintf(stderr, "Error: allocating the log name.\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < 2; i++) {
+		if ((buffers[i] = malloc(WAL_BUFFER_SIZE)) == NULL) {
+			fprintf(stderr, "Error: allocating log buffers.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	active = active_len = 0;
+	stopping = false;
+
+	if (durability != WAL_PER_OP) {
+		if (pthread_create(&committer, NULL, wal_committer, NULL) != 0) {
+			fprintf(stderr, "Error: unable to create the log thread.\n");
+			exit(EXIT_FAILURE);
+		}
+		committing = true;
+	}
+	return SUCCESS;
+}
+
+
+/*
+ * Logs a change. Called by the operations once a change is made, while
+ * they still hold its locks; does nothing if the log is not started.
+ * Input:
+ *  - op: kind of change (WAL_CREATE, ...)
+ *  - nodeType: type of the node, for WAL_CREATE
+ *  - name: path of the node
+ *  - name2: new path, for WAL_MOVE, or NULL
+ *  - arg: offset for WAL_WRITE, size for WAL_TRUNCATE
+ *  - data: bytes written, for WAL_WRITE, or NULL
+ *  - datalen: number of bytes of data
+ */
+void wal_append(int op, int nodeType, char *name, char *name2, long arg, char *data, int datalen) {
+	if (log_fd < 0)
+		return;
+
+	WalRecord rec = {
+		.op = op, .nodeType = nodeType, .unused = 0, .arg = arg,
+		.namelen = strlen(name) + 1, .name2len = name2 ? strlen(name2) + 1 : 0
+	};
+	rec.len = sizeof(rec) + rec.namelen + rec.name2len + datalen;
+	rec.checksum = wal_checksum(&rec, name, name2, data, datalen);
+
+	pthread_mutex_lock(&log_lock);
+	while (active_len > 0 && active_len + rec.len > WAL_BUFFER_SIZE)
+		pthread_cond_wait(&space, &log_lock);
+
+	rec.lsn = ++last_lsn;
+	char *dest = buffers[active] + active_len;
+	memcpy(dest, &rec, sizeof(rec));
+	memcpy(dest + sizeof(rec), name, rec.namelen);
+	memcpy(dest + sizeof(rec) + rec.namelen, name2, rec.name2len);
+	memcpy(dest + sizeof(rec) + rec.namelen + rec.name2len, data, datalen);
+	active_len += rec.len;
+	nrecords++;
+	thread_lsn = rec.lsn;
+
+	if (durability == WAL_PER_OP) {
+		wal_write(log_fd, buffers[active], active_len);
+		wal_sync(log_fd);
+		nsyncs++;
+		active_len = 0;
+		__atomic_store_n(&durable_lsn, rec.lsn, __ATOMIC_RELEASE);
+	}
+	else if (active_len == rec.len) {
+		pthread_cond_signal(&pending);
+	}
+	pthread_mutex_unlock(&log_lock);
+}
+
+
+/*
+ * Waits until the changes the calling thread logged are durable, as the
+ * durability level defines. Called before replying to a request.
+ */
+void wal_commit() {
+	uint64_t lsn = thread_lsn;
+
+	if (lsn == 0 || durability == WAL_NONE || __atomic_load_n(&durable_lsn, __ATOMIC_ACQUIRE) >= lsn)
+		return;
+
+	pthread_mutex_lock(&log_lock);
+	while (durable_lsn < lsn)
+		pthread_cond_wait(&durable, &log_lock);
+	pthread_mutex_unlock(&log_lock);
+}
+
+
+/*
+ * Writes and syncs every change logged so far. No change may be logged
+ * meanwhile.
+ * Input:
+ *  - discard: whether to empty the log afterwards, once what it holds
+ *             is saved elsewhere
+ */
+void wal_flush(int discard) {
+	if (log_fd < 0)
+		return;
+
+	pthread_mutex_lock(&log_lock);
+	if (committing) {
+		while (durable_lsn < last_lsn) {
+			pthread_cond_signal(&pending);
+			pthread_cond_wait(&durable, &log_lock);
+		}
+	}
+	else if (active_len > 0) {
+		wal_write(log_fd, buffers[active], active_len);
+		active_len = 0;
+	}
+	wal_sync(log_fd);
+	nsyncs++;
+	durable_lsn = last_lsn;
+	if (discard && ftruncate(log_fd, 0) < 0) {
+		fprintf(stderr, "Error: unable to empty the log.\n");
+		exit(EXIT_FAILURE);
+	}
+	pthread_mutex_unlock(&log_lock);
+}
+
+
+/*
+ * Writes every change logged so far and stops logging.
+ */
+void wal_close() {
+	if (log_fd < 0)
+		return;
+
+	wal_flush(false);
+	if (committing) {
+		pthread_mutex_lock(&log_lock);
+		stopping = true;
+		pthread_cond_signal(&pending);
+		pthread_mutex_unlock(&log_lock);
+		pthread_join(committer, NULL);
+		committing = false;
+	}
+	if (rotated_fd >= 0) {
+		/* the committer wrote and synced all of it already */
+		close(rotated_fd);
+		rotated_fd = -1;
+		wal_sync_dir();
+	}
+	close(log_fd);
+	log_fd = -1;
+	free(log_path);
+	free(old_path);
+	log_path = old_path = NULL;
+	free(buffers[0]);
+	free(buffers[1]);
+	buffers[0] = buffers[1] = NULL;
+	last_lsn = durable_lsn = 0;
+	nrecords = nsyncs = 0;
+}
+
+
+/*
+ * Starts a new log for the changes after the ones logged so far, moving
+ * the current log aside, so a checkpoint saving those changes can drop
+ * it with wal_discard_rotated. Called with the file system quiescent; it
+ * does not wait for the log to be written: the group-commit thread ends
+ * the moved log with what is still buffered. If a log moved aside before
+ * is still there (its checkpoint failed), the log stays where it is.
+ * Returns: the lsn of the last change logged so far (0 without a log)
+ */
+uint64_t wal_rotate() {
+	if (log_fd < 0)
+		return 0;
+
+	pthread_mutex_lock(&log_lock);
+	uint64_t lsn = last_lsn;
+	if (rotated_fd < 0 && access(old_path, F_OK) < 0 && rename(log_path, old_path) == 0) {
+		int fd = open(log_path, O_WRONLY | O_APPEND | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+		if (fd < 0) {
+			fprintf(stderr, "Warning: unable to start a new log %s.\n", log_path);
+			if (rename(old_path, log_path) < 0) {
+				fprintf(stderr, "Error: unable to restore log %s.\n", log_path);
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if (committing) {
+			rotated_fd = log_fd;
+			switch_at = active_len;
+			log_fd = fd;
+		}
+		else {
+			/* per-op: everything logged is already written and synced */
+			close(log_fd);
+			log_fd = fd;
+			wal_sync_dir();
+		}
+	}
+	pthread_mutex_unlock(&log_lock);
+	return lsn;
+}
+
+
+/*
+ * Drops the log moved aside by wal_rotate, once a checkpoint holds all
+ * the changes it logged.
+ */
+void wal_discard_rotated() {
+	if (log_fd < 0)
+		return;
+	if (unlink(old_path) < 0 && errno != ENOENT)
+		fprintf(stderr, "Warning: unable to remove log %s.\n", old_path);
+}
+
+
+/*
+ * Returns how many records were logged and how many syncs they took.
+ * Input:
+ *  - records: where to store the number of records
+ *  - syncs: where to store the number of syncs
+ */
+void wal_stats(unsigned long *records, unsigned long *syncs) {
+	pthread_mutex_lock(&log_lock);
+	*records = nrecords;
+	*syncs = nsyncs;
+	pthread_mutex_unlock(&log_lock);
+}
@@ -0,0 +1,75 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Write-ahead log of the mutations of the file system. Operations append
+ * a logical record of each successful change while they still hold its
+ * locks, so conflicting changes are logged in the order they were made.
+ * A group-commit thread writes the records appended meanwhile with one
+ * write (and one fdatasync, when batched). Replies wait in wal_commit
+ * until the records of their requests are durable. On startup the log is
+ * replayed through the operations themselves.
+ */
+
+/* durability of a logged change once wal_commit returns */
+#define WAL_NONE 0 /* handed to the OS, lost if the machine stops */
+#define WAL_BATCHED 1 /* on disk, synced together with concurrent changes */
+#define WAL_PER_OP 2 /* on disk, synced by the change itself */
+
+/* kinds of records */
+#define WAL_CREATE 1
+#define WAL_DELETE 2
+#define WAL_MOVE 3
+#define WAL_WRITE 4
+#define WAL_TRUNCATE 5
+#define WAL_RMTREE 6
+
+/* initial value for wal_hash */
+#define WAL_HASH_SEED 14695981039346656037UL
+
+/* bytes of records the group-commit thread writes at a time */
+#define WAL_BUFFER_SIZE (1 << 20)
+
+/*
+ * Header of a record in the log file, followed by name, name2 and data.
+ */
+typedef struct walRecord {
+	uint32_t len; /* bytes of the record, header included */
+	uint32_t checksum; /* of the bytes after it */
+	uint64_t lsn; /* sequence number, one more than the previous record's */
+	uint8_t op;
+	uint8_t nodeType; /* for WAL_CREATE */
+	uint16_t namelen; /* bytes of name, its NUL included */
+	uint16_t name2len; /* bytes of name2 (WAL_MOVE), 0 for other records */
+	uint16_t unused;
+	int64_t arg; /* offset for WAL_WRITE, size for WAL_TRUNCATE */
+} WalRecord;
+
+/*
+ * A record as replayed.
+ */
+typedef struct walEntry {
+	int op;
+	int nodeType;
+	char *name;
+	char *name2; /* new name of a WAL_MOVE */
+	long arg;
+	char *data; /* bytes of a WAL_WRITE */
+	int datalen;
+} WalEntry;
+
+uint64_t wal_hash(const void *buf, size_t len, uint64_t hash);
+long wal_replay(char *path, uint64_t after, void (*apply)(WalEntry *entry));
+int wal_start(char *path, int durability, int discard);
+void wal_append(int op, int nodeType, char *name, char *name2, long arg, char *data, int datalen);
+void wal_commit();
+void wal_flush(int discard);
+uint64_t wal_rotate();
+void wal_discard_rotated();
+void wal_close();
+void wal_stats(unsigned long *records, unsigned long *syncs);
+
+#endif /* WAL_H */
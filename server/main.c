@@ -1,28 +1,138 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <getopt.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 #include "fs/operations.h"
 #include <time.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <signal.h>
 #include "circularqueue/circularqueue.h"
+#include "../tecnicofs-protocol.h"
+#include "../tecnicofs-shm.h"
 
 ////////////////////////////////////// Macros ////////////////////////////////////////////
 #define MAX_COMMANDS 10
 #define MAX_INPUT_SIZE 100
 #define TRUE 1
 #define FALSE 0
+/* events an I/O thread handles per epoll_wait */
+#define MAX_EVENTS 256
+/* messages read from one connection before serving the others */
+#define MAX_READS_PER_EVENT 16
+/* requests queued on one worker; receivers wait when it is full */
+#define JOB_QUEUE_CAPACITY 1024
+/* pieces of file storage a read reply may take, plus its header */
+#define READ_MAX_IOV (TFS_MAX_READ / FILE_CHUNK_SIZE + 3)
+
+////////////////////////////////////// Types ////////////////////////////////////////////
+
+/* a decoded client request, from either the binary or the text protocol */
+typedef struct request {
+    int binary;                     /* reply with a tfsResponseHeader */
+    int opcode;
+    int flags;
+    uint32_t id;
+    char name[MAX_FILE_NAME];
+    char last_name[MAX_FILE_NAME];
+    char *payload;                  /* points into the receive buffer */
+    int payloadlen;
+} Request;
+
+/*
+ * A client connection (SOCK_SEQPACKET or SOCK_STREAM). It only holds what
+ * an idle session needs: receive buffers are per I/O thread, and only
+ * the unparsed tail of a stream is kept here.
+ */
+typedef struct connection {
+    int fd;
+    int refs;                       /* the I/O thread's plus one per queued job */
+    pthread_mutex_t send_lock;      /* replies of different workers must not interleave */
+    char *partial;                  /* incomplete request read from a stream */
+    int partiallen;
+    int shmfd;                      /* last fd received (SCM_RIGHTS), -1 if none */
+    struct shmSession *shm;         /* shared-memory rings, if attached */
+    int closed;                     /* no longer read by its I/O thread */
+} Connection;
+
+/* the shared-memory rings of a connection, polled by one worker */
+typedef struct shmSession {
+    tfsShmSegment *seg;
+    Connection *conn;
+    pthread_mutex_t reply_lock;     /* the response ring has a single producer */
+    struct shmSession *next;        /* in its worker's list */
+} ShmSession;
+
+/* a request read by a receiver, waiting for a worker */
+typedef struct job {
+    Connection *conn;               /* connection of the client, NULL for datagrams */
+    ShmSession *shm;                /* answered in its response ring if it came from a ring */
+    struct sockaddr_un addr;        /* datagram sender */
+    socklen_t addrlen;
+    int status;                     /* returned by decodeRequest */
+    StatsRequest stats;             /* when it entered each stage */
+    Request req;                    /* decoded by the receiver, its payload points into data */
+    int len;
+    char data[];                    /* the request, plus room for a terminating NUL */
+} Job;
+
+/*
+ * A filesystem worker and its queue of jobs. Receivers place requests on
+ * the queue of the worker owning their subtree; workers whose queue is
+ * empty steal from the others. Each worker also polls the request rings
+ * of some shared-memory sessions, and queues their requests the same way.
+ */
+typedef struct worker {
+    CircularQueue *queue;
+    unsigned int wake;              /* futex word, bumped to wake the worker */
+    int sleeping;
+    ShmSession *rings;              /* sessions it polls, touched by it only */
+    ShmSession *newrings;           /* sessions attached since it last polled */
+    unsigned long executed;         /* jobs run, written by the worker only */
+    unsigned long stolen;           /* of which taken from other queues */
+} __attribute__((aligned(CACHE_LINE))) Worker;
 
 ////////////////////////////////////// Global Variables ////////////////////////////////////////////
 int numthreads;
+int numiothreads = 1;
+int socktype = SOCK_DGRAM;
 char * namesocket;
 int sockfd;
 
+int statsinterval = 0;
+char *imagefile = NULL;
+char *logfile = NULL;
+int durability = WAL_BATCHED;
+char *checkpointfile = NULL;
+int checkpointinterval = 60;
+int lockprofile = FALSE;
+
+Worker *workers;
+/* names of the opcodes in the latency histograms, 0 for invalid requests */
+const char *opnames[STATS_OPS] = {
+    [0] = "invalid", [TFS_OP_CREATE] = "create", [TFS_OP_DELETE] = "delete",
+    [TFS_OP_LOOKUP] = "lookup", [TFS_OP_MOVE] = "move", [TFS_OP_PRINT] = "print",
+    [TFS_OP_BATCH] = "batch", [TFS_OP_SHM_ATTACH] = "attach", [TFS_OP_WRITE] = "write",
+    [TFS_OP_READ] = "read", [TFS_OP_TRUNCATE] = "truncate", [TFS_OP_SIZE] = "size",
+    [TFS_OP_STATS] = "stats", [TFS_OP_LOCKS] = "locks", [TFS_OP_RMTREE] = "rmtree"
+};
+/* spreads requests without a subtree over the workers */
+unsigned int nextworker = 0;
+
 ////////////////////////////////////// Functions ////////////////////////////////////////////
 
 void errorParse(){
@@ -75,47 +185,192 @@ void socketError(int sockfd, int errorConstant) {
 }
 
 /**
- * @function                    applyCommand
- * @abstract                    run a function depending on the token of the command
- * @param       command         has a token, specific token args
- * @param       serv_sockfd     The server socket file descriptor
- * @return                      the return value of the function executed
+ * @function                decodeText
+ * @abstract                parse a command of the old text protocol ("c /a f")
+ * @param       buf         NUL-terminated command
+ * @param       req         request to fill
+ * @return                  SUCCESS or FAIL
 */
-int applyCommand(char *command, int serv_sockfd){
-    
-    if (command == NULL)
-        socketError(serv_sockfd, TECNICOFS_ERROR_INVALID_COMMAND);
+int decodeText(char *buf, Request *req){
 
     char token;
-    char name[MAX_INPUT_SIZE], last_name[MAX_INPUT_SIZE];
-    
-    int numTokens = sscanf(command, "%c %s %s", &token, name, last_name);
-    
-    if (numTokens < 2) {
-        fprintf(stderr, "Error: invalid command in Queue.\n");
-        exit(EXIT_FAILURE);
-    }
+    int numTokens = sscanf(buf, "%c %99s %99s", &token, req->name, req->last_name);
 
+    if (numTokens < 2)
+        return FAIL;
+
+    req->id = 0;
+    req->flags = 0;
     switch (token) {
         case 'c':
-            switch (last_name[0]) {
-                case 'f':
-                    return create(name, T_FILE);
-                case 'd':
-                    return create(name, T_DIRECTORY);
-                    
-                default:
-                    fprintf(stderr, "Error: invalid node type.\n");
-                    return TECNICOFS_ERROR_INVALID_COMMAND;
-            }
+            req->opcode = TFS_OP_CREATE;
+            if (numTokens < 3)
+                return FAIL;
+            if (req->last_name[0] == 'f')
+                req->flags = T_FILE;
+            else if (req->last_name[0] == 'd')
+                req->flags = T_DIRECTORY;
+            else
+                return FAIL;
+            return SUCCESS;
         case 'm':
-            return move(name, last_name); 
+            req->opcode = TFS_OP_MOVE;
+            return numTokens == 3 ? SUCCESS : FAIL;
         case 'l':
-            return search(name, LOOKUP);
+            req->opcode = TFS_OP_LOOKUP;
+            return SUCCESS;
         case 'd':
-            return delete(name);
+            req->opcode = TFS_OP_DELETE;
+            return SUCCESS;
+        case 'r':
+            req->opcode = TFS_OP_RMTREE;
+            return SUCCESS;
         case 'p':
-            return print_tecnicofs_tree(name);
+            req->opcode = TFS_OP_PRINT;
+            return SUCCESS;
+        default:
+            return FAIL;
+    }
+}
+
+/**
+ * @function                decodeBinary
+ * @abstract                decode one binary request
+ * @param       buf         bytes starting with a tfsRequestHeader
+ * @param       len         number of bytes available
+ * @param       req         request to fill
+ * @return                  the number of bytes the request takes, FAIL if malformed
+*/
+int decodeBinary(char *buf, int len, Request *req){
+
+    tfsRequestHeader header;
+
+    if (len < (int) sizeof(header))
+        return FAIL;
+
+    memcpy(&header, buf, sizeof(header));
+    req->binary = TRUE;
+    req->opcode = header.opcode;
+    req->flags = header.flags;
+    req->id = header.id;
+
+    size_t total = sizeof(header) + header.pathlen + header.path2len + header.payloadlen;
+    if (header.magic != TFS_PROTOCOL_MAGIC || header.version != TFS_PROTOCOL_VERSION ||
+        header.pathlen >= MAX_FILE_NAME || header.path2len >= MAX_FILE_NAME || total > (size_t) len)
+        return FAIL;
+    /* every request but a batch, an attach or starting and stopping the lock
+       profiler names a node, or the file it writes to; a move names two */
+    if ((header.pathlen == 0 && header.opcode != TFS_OP_BATCH && header.opcode != TFS_OP_SHM_ATTACH &&
+         (header.opcode != TFS_OP_LOCKS || header.flags == TFS_LOCKS_DUMP)) ||
+        (header.opcode == TFS_OP_MOVE && header.path2len == 0))
+        return FAIL;
+
+    char *body = buf + sizeof(header);
+    memcpy(req->name, body, header.pathlen);
+    req->name[header.pathlen] = '\0';
+    memcpy(req->last_name, body + header.pathlen, header.path2len);
+    req->last_name[header.path2len] = '\0';
+    req->payload = body + header.pathlen + header.path2len;
+    req->payloadlen = header.payloadlen;
+    return total;
+}
+
+/**
+ * @function                decodeRequest
+ * @abstract                decode a received datagram, binary or text
+ * @param       buf         received bytes, with room for a terminating NUL
+ * @param       len         number of bytes received
+ * @param       req         request to fill
+ * @return                  SUCCESS or FAIL
+*/
+int decodeRequest(char *buf, int len, Request *req){
+
+    if (len < (int) sizeof(tfsRequestHeader) || (unsigned char) buf[0] != TFS_PROTOCOL_MAGIC) {
+        buf[len] = '\0';
+        req->binary = FALSE;
+        return decodeText(buf, req);
+    }
+    return decodeBinary(buf, len, req) == len ? SUCCESS : FAIL;
+}
+
+/**
+ * @function                applyLocks
+ * @abstract                start or stop the lock contention profiler, or dump it
+ * @param       req         a TFS_OP_LOCKS request
+ * @return                  SUCCESS or FAIL
+*/
+int applyLocks(Request *req){
+
+    int32_t top = 0;
+
+    switch (req->flags) {
+        case TFS_LOCKS_START:
+            lockprof_start();
+            return SUCCESS;
+        case TFS_LOCKS_STOP:
+            lockprof_stop();
+            return SUCCESS;
+        case TFS_LOCKS_DUMP:
+            if (req->payloadlen >= (int) sizeof(top))
+                memcpy(&top, req->payload, sizeof(top));
+            return print_lock_profile(req->name, top);
+        default:
+            return TECNICOFS_ERROR_INVALID_COMMAND;
+    }
+}
+
+/**
+ * @function                    applyCommand
+ * @abstract                    run a function depending on the opcode of the request
+ * @param       req             decoded request
+ * @return                      the return value of the function executed
+*/
+int applyCommand(Request *req){
+
+    switch (req->opcode) {
+        case TFS_OP_CREATE:
+            switch (req->flags) {
+                case T_FILE:
+                    return create(req->name, T_FILE);
+                case T_DIRECTORY:
+                    return create(req->name, T_DIRECTORY);
+                default:
+                    fprintf(stderr, "Error: invalid node type.\n");
+                    return TECNICOFS_ERROR_INVALID_COMMAND;
+            }
+        case TFS_OP_MOVE:
+            return move(req->name, req->last_name);
+        case TFS_OP_LOOKUP:
+            return search(req->name, LOOKUP);
+        case TFS_OP_DELETE:
+            return delete(req->name);
+        case TFS_OP_RMTREE:
+            return delete_tree(req->name);
+        case TFS_OP_PRINT:
+            /* the TFS_PRINT_ formats are those of inode_dump_tree */
+            return print_tecnicofs_tree(req->name, req->flags);
+        case TFS_OP_WRITE: {
+            int64_t offset;
+            if (req->payloadlen < (int) sizeof(offset))
+                return TECNICOFS_ERROR_INVALID_COMMAND;
+            memcpy(&offset, req->payload, sizeof(offset));
+            return write_file(req->name, offset, req->payload + sizeof(offset), req->payloadlen - sizeof(offset));
+        }
+        case TFS_OP_TRUNCATE: {
+            int64_t size;
+            if (req->payloadlen < (int) sizeof(size))
+                return TECNICOFS_ERROR_INVALID_COMMAND;
+            memcpy(&size, req->payload, sizeof(size));
+            return truncate_file(req->name, size);
+        }
+        case TFS_OP_SIZE:
+            return size_file(req->name);
+        case TFS_OP_STATS:
+            /* the TFS_STATS_ formats are those of stats_dump */
+            return print_tecnicofs_stats(req->name, req->flags, opnames);
+        case TFS_OP_LOCKS:
+            return applyLocks(req);
+        /* reads answer with data, see serveRead; they are not allowed in batches */
         default: {
             /* error */
             fprintf(stderr, "Error: command to apply.\n");
@@ -124,31 +379,981 @@ int applyCommand(char *command, int serv_sockfd){
     }
 }
 
+/**
+ * @function                applyBatch
+ * @abstract                run the requests packed in a batch request, in order
+ * @param       req         the batch request
+ * @param       results     array to store the result of each request executed
+ * @return                  the number of requests executed, FAIL if the batch is malformed
+*/
+int applyBatch(Request *batch, int32_t *results){
+
+    Request req;
+    char *buf = batch->payload;
+    int len = batch->payloadlen;
+    int count = 0;
+
+    while (len > 0) {
+        int used = decodeBinary(buf, len, &req);
+        if (used == FAIL || req.opcode == TFS_OP_BATCH)
+            return count > 0 ? count : FAIL;
+
+        results[count] = applyCommand(&req);
+        if (results[count++] < 0 && (batch->flags & TFS_BATCH_STOP_ON_FAILURE))
+            break;
+        buf += used;
+        len -= used;
+    }
+    return count;
+}
+
+/**
+ * @function                sendReplyv
+ * @abstract                send the result of a request back to its client, with a
+ *                          payload gathered from several buffers
+ * @param       req         the request
+ * @param       result      value returned by @applyCommand
+ * @param       payload     the pieces of the payload, after a free first entry for
+ *                          the response header
+ * @param       niov        number of entries of payload, including the free one
+ * @param       conn        connection of the client, NULL for datagrams
+ * @param       addr        client address, for datagrams
+ * @param       addrlen     length of the client address
+ * @return                  the number of bytes sent, -1 on error
+*/
+int sendReplyv(Request *req, int result, struct iovec *payload, int niov, Connection *conn,
+               struct sockaddr_un *addr, socklen_t addrlen){
+
+    tfsResponseHeader header;
+    header.magic = TFS_PROTOCOL_MAGIC;
+    header.version = TFS_PROTOCOL_VERSION;
+    header.opcode = req->opcode;
+    header.flags = 0;
+    header.id = req->id;
+    header.result = result;
+    header.payloadlen = 0;
+    for (int i = 1; i < niov; i++)
+        header.payloadlen += payload[i].iov_len;
+
+    payload[0].iov_base = &header;
+    payload[0].iov_len = sizeof(header);
+    struct msghdr msg = {
+        .msg_name = addr, .msg_namelen = addrlen,
+        .msg_iov = payload, .msg_iovlen = niov
+    };
+
+    if (!req->binary) {
+        payload[0].iov_base = &result;
+        payload[0].iov_len = sizeof(result);
+        msg.msg_iovlen = 1;
+    }
+    if (conn == NULL)
+        return sendmsg(sockfd, &msg, 0);
+
+    /* the socket blocks on writes, so a stream reply is sent whole */
+    msg.msg_name = NULL;
+    msg.msg_namelen = 0;
+    pthread_mutex_lock(&conn->send_lock);
+    int sent = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+    pthread_mutex_unlock(&conn->send_lock);
+    return sent;
+}
+
+/**
+ * @function                sendReply
+ * @abstract                @sendReplyv with a payload in one buffer
+ * @param       req         the request
+ * @param       result      value returned by @applyCommand
+ * @param       payload     bytes to send after the response header
+ * @param       payloadlen  number of bytes of payload
+ * @param       conn        connection of the client, NULL for datagrams
+ * @param       addr        client address, for datagrams
+ * @param       addrlen     length of the client address
+ * @return                  the number of bytes sent, -1 on error
+*/
+int sendReply(Request *req, int result, void *payload, int payloadlen, Connection *conn,
+              struct sockaddr_un *addr, socklen_t addrlen){
+
+    struct iovec iov[2] = {
+        { .iov_base = NULL, .iov_len = 0 },
+        { .iov_base = payload, .iov_len = payloadlen }
+    };
+    return sendReplyv(req, result, iov, payloadlen > 0 ? 2 : 1, conn, addr, addrlen);
+}
+
+/**
+ * @function                executeRequest
+ * @abstract                @applyCommand, or @applyBatch, on a decoded request, and wait
+ *                          for the changes made to be durable
+ * @param       req         the request
+ * @param       results     array of TFS_MAX_BATCH results, for batches
+ * @param       payloadlen  where to store the number of bytes of results to reply
+ * @return                  the result to reply
+*/
+int executeRequest(Request *req, int32_t *results, int *payloadlen){
+
+    int result;
+
+    *payloadlen = 0;
+    if (req->opcode == TFS_OP_BATCH) {
+        result = applyBatch(req, results);
+        if (result == FAIL)
+            return TECNICOFS_ERROR_INVALID_COMMAND;
+        *payloadlen = result * sizeof(int32_t);
+    }
+    else
+        result = applyCommand(req);
+
+    /* the reply may only leave once the changes it reports are logged */
+    wal_commit();
+    return result;
+}
+
+/**
+ * @function            releaseConnection
+ * @abstract            drop a reference to a connection, closing it with the last one
+ * @param       conn    the connection
+ * @return              nothing
+*/
+void releaseConnection(Connection *conn){
+
+    if (__atomic_sub_fetch(&conn->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    close(conn->fd);
+    if (conn->shmfd >= 0)
+        close(conn->shmfd);
+    if (conn->shm != NULL) {
+        munmap(conn->shm->seg, sizeof(tfsShmSegment));
+        pthread_mutex_destroy(&conn->shm->reply_lock);
+        free(conn->shm);
+    }
+    pthread_mutex_destroy(&conn->send_lock);
+    free(conn->partial);
+    free(conn);
+}
+
+/**
+ * @function            wakeWorker
+ * @abstract            wake a worker sleeping for lack of jobs
+ * @param       worker  the worker
+ * @return              nothing
+*/
+void wakeWorker(Worker *worker){
+
+    __atomic_fetch_add(&worker->wake, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &worker->wake, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/**
+ * @function                ringReply
+ * @abstract                reply to a request of a shared-memory session in its
+ *                          response ring
+ * @param       session     the session
+ * @param       req         the request
+ * @param       result      value returned by @applyCommand
+ * @param       payload     bytes to send after the response header
+ * @param       payloadlen  number of bytes of payload
+ * @return                  the number of bytes placed in the ring, -1 if it was closed
+*/
+int ringReply(ShmSession *session, Request *req, int result, void *payload, int payloadlen){
+
+    tfsShmSegment *seg = session->seg;
+    tfsShmSlot *reply;
+
+    if (sizeof(tfsResponseHeader) + payloadlen > TFS_SHM_MAX_MESSAGE) {
+        result = TECNICOFS_ERROR_OTHER;
+        payloadlen = 0;
+    }
+    tfsResponseHeader header = {
+        .magic = TFS_PROTOCOL_MAGIC, .version = TFS_PROTOCOL_VERSION, .opcode = req->opcode,
+        .flags = 0, .id = req->id, .result = result, .payloadlen = payloadlen
+    };
+
+    /* the client never has more requests in flight than slots */
+    pthread_mutex_lock(&session->reply_lock);
+    while ((reply = tfsShmProduce(&seg->responses)) == NULL) {
+        if (__atomic_load_n(&seg->closed, __ATOMIC_ACQUIRE)) {
+            pthread_mutex_unlock(&session->reply_lock);
+            return -1;
+        }
+        tfsShmPause();
+    }
+    memcpy(reply->data, &header, sizeof(header));
+    memcpy(reply->data + sizeof(header), payload, payloadlen);
+    tfsShmPublish(&seg->responses, sizeof(header) + payloadlen);
+    pthread_mutex_unlock(&session->reply_lock);
+    return sizeof(header) + payloadlen;
+}
+
+/**
+ * @function            attachRings
+ * @abstract            map the shared-memory segment the client sent with its
+ *                      TFS_OP_SHM_ATTACH request and hand its rings to a worker
+ * @param       conn    connection of the client
+ * @return              SUCCESS, or an error to reply
+*/
+int attachRings(Connection *conn){
+
+    struct stat st;
+    int fd = __atomic_exchange_n(&conn->shmfd, -1, __ATOMIC_ACQ_REL);
+
+    if (fd < 0)
+        return TECNICOFS_ERROR_INVALID_COMMAND;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(tfsShmSegment) || conn->shm != NULL) {
+        close(fd);
+        return TECNICOFS_ERROR_OTHER;
+    }
+
+    tfsShmSegment *seg = mmap(NULL, sizeof(tfsShmSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (seg == MAP_FAILED)
+        return TECNICOFS_ERROR_OTHER;
+    if (seg->magic != TFS_SHM_MAGIC || seg->version != TFS_PROTOCOL_VERSION) {
+        munmap(seg, sizeof(tfsShmSegment));
+        return TECNICOFS_ERROR_INVALID_COMMAND;
+    }
+
+    ShmSession *session = malloc(sizeof(ShmSession));
+    if (session == NULL) {
+        fprintf(stderr, "Error: allocating a shared-memory session.\n");
+        exit(EXIT_FAILURE);
+    }
+    session->seg = seg;
+    session->conn = conn;
+    pthread_mutex_init(&session->reply_lock, NULL);
+    seg->closed = 0;
+
+    /* the polling worker keeps the connection, and so the session, alive */
+    Worker *worker = &workers[__atomic_fetch_add(&nextworker, 1, __ATOMIC_RELAXED) % numthreads];
+    __atomic_add_fetch(&conn->refs, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&conn->shm, session, __ATOMIC_SEQ_CST);
+    session->next = __atomic_load_n(&worker->newrings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&worker->newrings, &session->next, session, TRUE,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    /* it sleeps watching only the rings it had */
+    wakeWorker(worker);
+
+    /* the connection may have closed before it saw the session */
+    if (__atomic_load_n(&conn->closed, __ATOMIC_SEQ_CST))
+        tfsShmClose(seg);
+    return SUCCESS;
+}
+
+/**
+ * @function                serveRead
+ * @abstract                read from a file and reply with the data, sent straight from
+ *                          the file's storage, pinned, once the file's locks are released
+ * @param       job         the job, a TFS_OP_READ request
+ * @return                  the number of bytes sent, -1 on error
+*/
+int serveRead(Job *job){
+
+    Request *req = &job->req;
+    struct iovec iov[READ_MAX_IOV];
+    Ref chunks[READ_MAX_IOV];
+    int64_t offset;
+    int32_t len;
+    int niov = 0, result;
+
+    if (req->payloadlen < (int) (sizeof(offset) + sizeof(len)))
+        return sendReply(req, TECNICOFS_ERROR_INVALID_COMMAND, NULL, 0, job->conn, &job->addr, job->addrlen);
+    memcpy(&offset, req->payload, sizeof(offset));
+    memcpy(&len, req->payload + sizeof(offset), sizeof(len));
+    if (len > (int32_t) TFS_MAX_READ)
+        len = TFS_MAX_READ;
+
+    /* iov[0] is left for the response header */
+    result = read_file(req->name, offset, len, iov + 1, READ_MAX_IOV - 1, &niov, chunks);
+    job->stats.executed = stats_now();
+    /* a slow client holds only the chunks sent, no lock */
+    int sent = sendReplyv(req, result, iov, niov + 1, job->conn, &job->addr, job->addrlen);
+    file_unpin(chunks, niov);
+    return sent;
+}
+
+/**
+ * @function                serveJob
+ * @abstract                @executeRequest a job and reply to its client, recording
+ *                          how long each stage took
+ * @param       job         the job
+ * @param       results     array of TFS_MAX_BATCH results, for batches
+ * @return                  the number of bytes sent, -1 on error
+*/
+int serveJob(Job *job, int32_t *results){
+
+    int result, payloadlen = 0, sent;
+
+    stats_begin();
+    job->stats.started = stats_now();
+    /* reads reply with more than a ring slot holds, clients send them on the socket */
+    if (job->status != FAIL && job->req.opcode == TFS_OP_READ && job->shm == NULL)
+        sent = serveRead(job);
+    else {
+        if (job->status == FAIL) {
+            fprintf(stderr, "Error: invalid command received.\n");
+            result = TECNICOFS_ERROR_INVALID_COMMAND;
+        }
+        /* attaching rings needs the connection, applyCommand only sees the request */
+        else if (job->req.opcode == TFS_OP_SHM_ATTACH)
+            result = job->conn != NULL ? attachRings(job->conn) : TECNICOFS_ERROR_INVALID_COMMAND;
+        else
+            result = executeRequest(&job->req, results, &payloadlen);
+
+        job->stats.executed = stats_now();
+        if (job->shm != NULL)
+            sent = ringReply(job->shm, &job->req, result, results, payloadlen);
+        else
+            sent = sendReply(&job->req, result, results, payloadlen, job->conn, &job->addr, job->addrlen);
+    }
+    job->stats.sent = stats_now();
+    stats_record(job->status == FAIL ? 0 : job->req.opcode, &job->stats);
+    return sent;
+}
+
+/**
+ * @function            wakeIdleWorker
+ * @abstract            wake one sleeping worker, if any, to steal jobs queued behind a
+ *                      busy one
+ * @return              nothing
+*/
+void wakeIdleWorker(){
+
+    for (int i = 0; i < numthreads; i++) {
+        if (__atomic_load_n(&workers[i].sleeping, __ATOMIC_RELAXED)) {
+            wakeWorker(&workers[i]);
+            return;
+        }
+    }
+}
+
+/**
+ * @function            wakeIdleWorkers
+ * @abstract            wake every sleeping worker, to share the reclamation of a
+ *                      deleted subtree
+ * @return              nothing
+*/
+void wakeIdleWorkers(){
+
+    for (int i = 0; i < numthreads; i++) {
+        if (__atomic_load_n(&workers[i].sleeping, __ATOMIC_RELAXED))
+            wakeWorker(&workers[i]);
+    }
+}
+
+/**
+ * @function            pickWorker
+ * @abstract            choose the worker for a request: requests under the same
+ *                      top-level directory go to the same worker, so they find its
+ *                      caches warm; the others are spread round-robin
+ * @param       job     the decoded request
+ * @return              index of the worker
+*/
+int pickWorker(Job *job){
+
+    char *name = job->req.name;
+
+    if (job->status == FAIL || job->req.opcode == TFS_OP_BATCH || job->req.opcode == TFS_OP_PRINT)
+        return __atomic_fetch_add(&nextworker, 1, __ATOMIC_RELAXED) % numthreads;
+
+    while (*name == '/')
+        name++;
+    unsigned int hash = 2166136261u;
+    for (; *name && *name != '/'; name++) {
+        hash ^= (unsigned char) *name;
+        hash *= 16777619u;
+    }
+    return hash % numthreads;
+}
+
+/**
+ * @function            leastLoadedWorker
+ * @abstract            find the worker with the fewest jobs queued
+ * @return              the worker
+*/
+Worker* leastLoadedWorker(){
+
+    Worker *least = &workers[0];
+    unsigned long length = queueLength(least->queue);
+
+    for (int i = 1; i < numthreads && length > 0; i++) {
+        unsigned long other = queueLength(workers[i].queue);
+        if (other < length) {
+            least = &workers[i];
+            length = other;
+        }
+    }
+    return least;
+}
+
+/**
+ * @function            makeJob
+ * @abstract            copy and decode a received request
+ * @param       conn    connection it came from, NULL for datagrams
+ * @param       shm     session whose request ring it came from, NULL for sockets
+ * @param       data    the request
+ * @param       len     length of the request
+ * @param       addr    datagram sender, NULL for connections
+ * @param       addrlen length of the address
+ * @return              the job
+*/
+Job* makeJob(Connection *conn, ShmSession *shm, char *data, int len, struct sockaddr_un *addr, socklen_t addrlen){
+
+    Job *job = malloc(sizeof(Job) + len + 1);
+    if (job == NULL) {
+        fprintf(stderr, "Error: allocating a job.\n");
+        exit(EXIT_FAILURE);
+    }
+    job->stats.received = stats_now();
+    job->conn = conn;
+    job->shm = shm;
+    job->len = len;
+    job->addrlen = addrlen;
+    if (addr != NULL)
+        memcpy(&job->addr, addr, addrlen);
+    memcpy(job->data, data, len);
+    job->status = decodeRequest(job->data, len, &job->req);
+    job->stats.parsed = stats_now();
+    if (conn != NULL)
+        __atomic_add_fetch(&conn->refs, 1, __ATOMIC_RELAXED);
+    return job;
+}
+
+/**
+ * @function            queueJob
+ * @abstract            queue a job on a worker and wake one to run it
+ * @param       job     the job
+ * @param       wait    whether to wait for room when every queue is full
+ * @return              SUCCESS, FAIL if every queue is full and not waiting
+*/
+int queueJob(Job *job, int wait){
+
+    Worker *worker = &workers[pickWorker(job)];
+    /* a full queue must not hold up the receiver while others are idle: the job goes
+       elsewhere, and the receiver only waits when every queue is full */
+    if (enQueue(worker->queue, job) == FAIL) {
+        worker = leastLoadedWorker();
+        if (enQueue(worker->queue, job) == FAIL) {
+            if (!wait)
+                return FAIL;
+            enQueueWait(worker->queue, job);
+        }
+    }
+
+    /* pairs with the fence in workerThread: either we see it sleeping or it sees the job */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&worker->sleeping, __ATOMIC_RELAXED)) {
+        wakeWorker(worker);
+        return SUCCESS;
+    }
+    /* its owner is busy, maybe for long (sending to a slow client): let an idle
+       worker steal the job rather than wait behind it */
+    if (queueLength(worker->queue) > 0)
+        wakeIdleWorker();
+    return SUCCESS;
+}
+
+/**
+ * @function            dispatchRequest
+ * @abstract            decode a request received on a socket and queue it on a worker
+ * @param       conn    connection it came from, NULL for datagrams
+ * @param       data    the request
+ * @param       len     length of the request
+ * @param       addr    datagram sender, NULL for connections
+ * @param       addrlen length of the address
+ * @return              nothing
+*/
+void dispatchRequest(Connection *conn, char *data, int len, struct sockaddr_un *addr, socklen_t addrlen){
+
+    queueJob(makeJob(conn, NULL, data, len, addr, addrlen), TRUE);
+}
+
 /**
  * @function            processInput
- * @abstract            receives input commands from the client through a socket and @applyCommand
+ * @abstract            receives input commands from the clients through the datagram socket
+ *                      and @dispatchRequest them to the workers
  * @param       arg     pointer to an argument
  * @return              NULL
 */
 void* processInput(void *arg){
 
-    clock_gettime(CLOCK_MONOTONIC_RAW, &begin);
     int server_sockfd = *((int *) arg);
-    int result;
+    char in_buffer[TFS_MAX_MESSAGE + 1];
     /* break loop with ^Z or ^D */
     while (TRUE) {
 
-        char in_buffer[MAX_INPUT_SIZE];
         struct sockaddr_un client_addr;
         socklen_t addrlen = sizeof(struct sockaddr_un);
         
-        if (recvfrom(server_sockfd, in_buffer, sizeof(in_buffer)-1, 0, (struct sockaddr *) &client_addr, &addrlen) < 0)
+        ssize_t len = recvfrom(server_sockfd, in_buffer, TFS_MAX_MESSAGE, 0, (struct sockaddr *) &client_addr, &addrlen);
+        if (len < 0)
             socketError(server_sockfd, TECNICOFS_ERROR_CONNECTION_ERROR);
 
-        result = applyCommand(in_buffer, server_sockfd);
+        dispatchRequest(NULL, in_buffer, len, &client_addr, addrlen);
+    }
+    return NULL;
+}
 
-        if (sendto(sockfd, (int *) &result, sizeof(result)+1, 0, (struct sockaddr *) &client_addr, addrlen) < 0)
-            socketError(server_sockfd, TECNICOFS_ERROR_CONNECTION_ERROR);
+/**
+ * @function            stealJob
+ * @abstract            take a job from another worker's queue
+ * @param       self    index of the calling worker
+ * @return              the job, NULL if every queue is empty
+*/
+Job* stealJob(int self){
+
+    for (int i = 1; i < numthreads; i++) {
+        CircularQueue *queue = workers[(self + i) % numthreads].queue;
+        Job *job = deQueue(queue);
+        if (job != NULL) {
+            __atomic_store_n(&workers[self].stolen, workers[self].stolen + 1, __ATOMIC_RELAXED);
+            /* more are left behind a busy owner: pass the wake on */
+            if (queueLength(queue) > 0)
+                wakeIdleWorker();
+            return job;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @function            runJob
+ * @abstract            @serveJob a job, then release it
+ * @param       worker  the worker running it
+ * @param       job     the job
+ * @param       results array of TFS_MAX_BATCH results, for batches
+ * @return              nothing
+*/
+void runJob(Worker *worker, Job *job, int32_t *results){
+
+    /* a client that went away is not an error of the server */
+    if (serveJob(job, results) < 0 && job->conn == NULL)
+        socketError(sockfd, TECNICOFS_ERROR_CONNECTION_ERROR);
+    __atomic_store_n(&worker->executed, worker->executed + 1, __ATOMIC_RELAXED);
+    if (job->conn != NULL)
+        releaseConnection(job->conn);
+    free(job);
+}
+
+/**
+ * @function            pollRings
+ * @abstract            queue the requests waiting in the request rings of a worker's
+ *                      sessions, dropping the sessions closed; a worker never waits
+ *                      for room in the queues, it runs a request itself if all are full
+ * @param       worker  the worker
+ * @param       results array of TFS_MAX_BATCH results, for batches
+ * @return              the number of requests taken
+*/
+int pollRings(Worker *worker, int32_t *results){
+
+    int taken = 0;
+
+    ShmSession *added = __atomic_exchange_n(&worker->newrings, NULL, __ATOMIC_ACQUIRE);
+    while (added != NULL) {
+        ShmSession *next = added->next;
+        added->next = worker->rings;
+        worker->rings = added;
+        added = next;
+    }
+
+    for (ShmSession **link = &worker->rings; *link != NULL; ) {
+        ShmSession *session = *link;
+        tfsShmSegment *seg = session->seg;
+        tfsShmSlot *slot;
+
+        if (__atomic_load_n(&seg->closed, __ATOMIC_ACQUIRE)) {
+            *link = session->next;
+            releaseConnection(session->conn);
+            continue;
+        }
+        while ((slot = tfsShmConsume(&seg->requests)) != NULL) {
+            /* the client shares the slot: the job is a stable copy */
+            uint32_t len = __atomic_load_n(&slot->len, __ATOMIC_RELAXED);
+            if (len > TFS_SHM_MAX_MESSAGE)
+                len = 0;
+            Job *job = makeJob(session->conn, session, slot->data, len, NULL, 0);
+            tfsShmRelease(&seg->requests);
+            if (queueJob(job, FALSE) == FAIL)
+                runJob(worker, job, results);
+            taken++;
+        }
+        link = &session->next;
+    }
+    return taken;
+}
+
+/**
+ * @function            sleepWorker
+ * @abstract            sleep until woken, or until a request arrives in the request
+ *                      ring of one of the worker's sessions
+ * @param       worker  the worker
+ * @param       seen    value of its wake word before it last looked for jobs
+ * @return              nothing
+*/
+void sleepWorker(Worker *worker, unsigned int seen){
+
+    struct futex_waitv waiters[FUTEX_WAITV_MAX];
+    tfsShmRing *rings[FUTEX_WAITV_MAX];
+    ShmSession *session = worker->rings;
+    int count = 1, pending = FALSE;
+
+    if (session == NULL) {
+        syscall(SYS_futex, &worker->wake, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+        return;
+    }
+
+    waiters[0] = (struct futex_waitv) {
+        .val = seen, .uaddr = (uintptr_t) &worker->wake, .flags = FUTEX_32 | FUTEX_PRIVATE_FLAG
+    };
+    /* the rings are in memory shared with the clients, whose publish wakes their tail */
+    for (; session != NULL && count < FUTEX_WAITV_MAX; session = session->next, count++) {
+        rings[count] = &session->seg->requests;
+        __atomic_store_n(&rings[count]->sleeping, 1, __ATOMIC_RELAXED);
+        waiters[count] = (struct futex_waitv) {
+            .val = rings[count]->head, .uaddr = (uintptr_t) &rings[count]->tail, .flags = FUTEX_32
+        };
+    }
+    /* pairs with the fence in tfsShmPublish: either it sees sleeping or we see its tail */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (int i = 1; i < count; i++)
+        pending |= __atomic_load_n(&rings[i]->tail, __ATOMIC_ACQUIRE) != rings[i]->head;
+
+    if (!pending) {
+        /* rings beyond what one wait can watch are polled every millisecond,
+           as all of them are on kernels without futex_waitv (before 5.16) */
+        struct timespec timeout, poll = { 0, 1000000 };
+        clock_gettime(CLOCK_MONOTONIC, &timeout);
+        timeout.tv_nsec += poll.tv_nsec;
+        if (timeout.tv_nsec >= 1000000000) {
+            timeout.tv_sec++;
+            timeout.tv_nsec -= 1000000000;
+        }
+        if (syscall(SYS_futex_waitv, waiters, count, 0, session != NULL ? &timeout : NULL,
+                    CLOCK_MONOTONIC) < 0 && errno == ENOSYS)
+            syscall(SYS_futex, &worker->wake, FUTEX_WAIT_PRIVATE, seen, &poll, NULL, 0);
+    }
+
+    for (int i = 1; i < count; i++)
+        __atomic_store_n(&rings[i]->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * @function            workerThread
+ * @abstract            run the jobs of its queue, stealing when it is empty, and reply;
+ *                      the requests of its sessions' rings are queued as they arrive
+ * @param       arg     index of the worker
+ * @return              NULL
+*/
+void* workerThread(void *arg){
+
+    int self = (int) (intptr_t) arg;
+    Worker *worker = &workers[self];
+    int32_t results[TFS_MAX_BATCH];
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &begin);
+    while (TRUE) {
+        pollRings(worker, results);
+        Job *job = deQueue(worker->queue);
+        if (job == NULL)
+            job = stealJob(self);
+
+        /* with no request waiting, free detached subtrees a batch at a time */
+        if (job == NULL && reclaim_work() > 0)
+            continue;
+
+        if (job == NULL) {
+            unsigned int seen = __atomic_load_n(&worker->wake, __ATOMIC_ACQUIRE);
+            __atomic_store_n(&worker->sleeping, TRUE, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if ((job = deQueue(worker->queue)) == NULL && (job = stealJob(self)) == NULL &&
+                __atomic_load_n(&worker->newrings, __ATOMIC_RELAXED) == NULL)
+                sleepWorker(worker, seen);
+            __atomic_store_n(&worker->sleeping, FALSE, __ATOMIC_RELAXED);
+            if (job == NULL)
+                continue;
+        }
+        runJob(worker, job, results);
+    }
+    return NULL;
+}
+
+/**
+ * @function            statsThread
+ * @abstract            print the depth of each worker's queue and how many jobs it ran
+ *                      and stole, the usage of the slab caches, the latency
+ *                      histograms and the path cache hits, every statsinterval seconds
+ * @param       arg     unused
+ * @return              NULL
+*/
+void* statsThread(void *arg){
+
+    while (TRUE) {
+        sleep(statsinterval);
+        for (int i = 0; i < numthreads; i++) {
+            CircularQueue *queue = workers[i].queue;
+            printf("worker %d: queue depth %lu, executed %lu, stolen %lu\n", i, queueLength(queue),
+                   __atomic_load_n(&workers[i].executed, __ATOMIC_RELAXED),
+                   __atomic_load_n(&workers[i].stolen, __ATOMIC_RELAXED));
+        }
+        slab_stats(stdout);
+        printf("reclaim: %ld i-nodes pending, %lu freed\n", reclaim_pending(), reclaim_total());
+        fflush(stdout);
+        stats_dump(STDOUT_FILENO, STATS_TEXT, opnames);
+    }
+    return NULL;
+}
+
+/**
+ * @function            stopThread
+ * @abstract            wait for SIGINT or SIGTERM (blocked in every other thread), then
+ *                      write a last checkpoint, the file system image back, marked
+ *                      clean, and the log, and exit
+ * @param       arg     the set of signals to wait for
+ * @return              never returns
+*/
+void* stopThread(void *arg){
+
+    int sig;
+    if (sigwait((sigset_t *) arg, &sig) != 0) {
+        fprintf(stderr, "Error: waiting for signals.\n");
+        exit(EXIT_FAILURE);
+    }
+    /* the changes after its cut are in the log, if there is one */
+    if (checkpointfile != NULL && checkpoint_fs(checkpointfile) == FAIL)
+        fprintf(stderr, "Warning: the last checkpoint could not be written.\n");
+    unsigned long hits, misses;
+    dcache_stats(&hits, &misses);
+    printf("Path cache: %lu hits, %lu misses.\n", hits, misses);
+    stop_fs();
+    printf("TecnicoFS saved.\n");
+    exit(EXIT_SUCCESS);
+}
+
+/**
+ * @function            checkpointThread
+ * @abstract            write a checkpoint every checkpointinterval seconds, at idle
+ *                      priority so the workers always run first
+ * @param       arg     unused
+ * @return              NULL
+*/
+void* checkpointThread(void *arg){
+
+    struct sched_param param = { .sched_priority = 0 };
+    if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0)
+        fprintf(stderr, "Warning: unable to lower the priority of the checkpoints.\n");
+
+    while (TRUE) {
+        struct timespec t0, t1;
+        sleep(checkpointinterval);
+        clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
+        long written = checkpoint_fs(checkpointfile);
+        clock_gettime(CLOCK_MONOTONIC_RAW, &t1);
+        if (written != FAIL && statsinterval > 0)
+            printf("Checkpoint %s: %ld bytes in %0.3f ms.\n", checkpointfile, written,
+                   (t1.tv_sec - t0.tv_sec) * 1000.0 + (t1.tv_nsec - t0.tv_nsec) / 1000000.0);
+    }
+    return NULL;
+}
+
+/**
+ * @function            closeConnection
+ * @abstract            stop reading from a connection; replies still queued are dropped
+ * @param       epfd    epoll instance watching it
+ * @param       conn    the connection
+ * @return              nothing
+*/
+void closeConnection(int epfd, Connection *conn){
+
+    epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    shutdown(conn->fd, SHUT_RD);
+
+    /* make the worker polling its rings, if any, drop them: it holds a reference too */
+    __atomic_store_n(&conn->closed, TRUE, __ATOMIC_SEQ_CST);
+    ShmSession *session = __atomic_load_n(&conn->shm, __ATOMIC_SEQ_CST);
+    if (session != NULL)
+        tfsShmClose(session->seg);
+    releaseConnection(conn);
+}
+
+/**
+ * @function            recvConnection
+ * @abstract            receive from a connection without blocking, keeping a file
+ *                      descriptor passed with SCM_RIGHTS for @attachRings
+ * @param       conn    the connection
+ * @param       buf     buffer
+ * @param       len     size of buf
+ * @return              as recv
+*/
+ssize_t recvConnection(Connection *conn, char *buf, int len){
+
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control, .msg_controllen = sizeof(control)
+    };
+
+    ssize_t received = recvmsg(conn->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); received >= 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+            fd = __atomic_exchange_n(&conn->shmfd, fd, __ATOMIC_ACQ_REL);
+            if (fd >= 0)
+                close(fd);
+        }
+    }
+    return received;
+}
+
+/**
+ * @function            readPackets
+ * @abstract            read the requests queued on a SOCK_SEQPACKET connection
+ * @param       conn    the connection
+ * @param       buf     buffer of TFS_MAX_MESSAGE bytes
+ * @return              SUCCESS, or FAIL if the connection must be closed
+*/
+int readPackets(Connection *conn, char *buf){
+
+    for (int i = 0; i < MAX_READS_PER_EVENT; i++) {
+        ssize_t len = recvConnection(conn, buf, TFS_MAX_MESSAGE);
+        if (len < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? SUCCESS : FAIL;
+        if (len == 0)
+            return FAIL;
+        dispatchRequest(conn, buf, len, NULL, 0);
+    }
+    return SUCCESS;
+}
+
+/**
+ * @function            readStream
+ * @abstract            read from a SOCK_STREAM connection and split it into requests;
+ *                      streams carry binary requests only, framed by their headers
+ * @param       conn    the connection
+ * @param       buf     buffer of 2 * TFS_MAX_MESSAGE bytes
+ * @return              SUCCESS, or FAIL if the connection must be closed
+*/
+int readStream(Connection *conn, char *buf){
+
+    for (int i = 0; i < MAX_READS_PER_EVENT; i++) {
+        int avail = conn->partiallen;
+        memcpy(buf, conn->partial, avail);
+
+        ssize_t len = recvConnection(conn, buf + avail, TFS_MAX_MESSAGE);
+        if (len < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? SUCCESS : FAIL;
+        if (len == 0)
+            return FAIL;
+        avail += len;
+
+        char *next = buf;
+        while (avail >= (int) sizeof(tfsRequestHeader)) {
+            tfsRequestHeader header;
+            memcpy(&header, next, sizeof(header));
+            size_t total = sizeof(header) + header.pathlen + header.path2len + header.payloadlen;
+            if (header.magic != TFS_PROTOCOL_MAGIC || total > TFS_MAX_MESSAGE)
+                return FAIL;
+            if ((size_t) avail < total)
+                break;
+            dispatchRequest(conn, next, total, NULL, 0);
+            next += total;
+            avail -= total;
+        }
+
+        /* keep the incomplete tail for the next read */
+        if (avail > conn->partiallen) {
+            char *partial = realloc(conn->partial, avail);
+            if (partial == NULL) {
+                fprintf(stderr, "Error: allocating a connection buffer.\n");
+                exit(EXIT_FAILURE);
+            }
+            conn->partial = partial;
+        }
+        else if (avail == 0) {
+            free(conn->partial);
+            conn->partial = NULL;
+        }
+        memmove(conn->partial, next, avail);
+        conn->partiallen = avail;
+    }
+    return SUCCESS;
+}
+
+/**
+ * @function            acceptConnections
+ * @abstract            accept the pending connections and watch them with epfd
+ * @param       epfd    epoll instance of the calling I/O thread
+ * @return              nothing
+*/
+void acceptConnections(int epfd){
+
+    int fd;
+
+    /* sockets block on writes so workers send whole replies, reads use MSG_DONTWAIT */
+    while ((fd = accept4(sockfd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+        Connection *conn = malloc(sizeof(Connection));
+        if (conn == NULL) {
+            fprintf(stderr, "Error: allocating a connection.\n");
+            exit(EXIT_FAILURE);
+        }
+        conn->fd = fd;
+        conn->refs = 1;
+        conn->partial = NULL;
+        conn->partiallen = 0;
+        conn->shmfd = -1;
+        conn->shm = NULL;
+        conn->closed = FALSE;
+        pthread_mutex_init(&conn->send_lock, NULL);
+
+        struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = conn };
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            fprintf(stderr, "Error: unable to watch a connection.\n");
+            releaseConnection(conn);
+        }
+    }
+}
+
+/**
+ * @function            ioThread
+ * @abstract            multiplex client connections over epoll and queue their requests
+ *                      for the workers; each I/O thread serves the connections it accepted
+ * @param       arg     unused
+ * @return              NULL
+*/
+void* ioThread(void *arg){
+
+    struct epoll_event events[MAX_EVENTS];
+    char *buf = malloc(2 * TFS_MAX_MESSAGE);
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (buf == NULL || epfd < 0) {
+        fprintf(stderr, "Error: unable to start an I/O thread.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* only one of the I/O threads is woken per new connection */
+    struct epoll_event listen_event = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &listen_event) < 0) {
+        fprintf(stderr, "Error: unable to watch the server socket.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    while (TRUE) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (n < 0 && errno != EINTR)
+            socketError(epfd, TECNICOFS_ERROR_CONNECTION_ERROR);
+
+        for (int i = 0; i < n; i++) {
+            Connection *conn = events[i].data.ptr;
+            if (conn == NULL) {
+                acceptConnections(epfd);
+                continue;
+            }
+
+            int status = socktype == SOCK_STREAM ? readStream(conn, buf) : readPackets(conn, buf);
+            if (status == FAIL || (events[i].events & (EPOLLHUP | EPOLLERR)))
+                closeConnection(epfd, conn);
+        }
     }
     return NULL;
 }
@@ -161,21 +1366,49 @@ void* processInput(void *arg){
 */
 void poolThreads(){
 
-    pthread_t consumer[numthreads];
-    // create slave threads
+    int numpool = numthreads + numiothreads + (statsinterval > 0);
+    pthread_t consumer[numpool];
+
+    if (posix_memalign((void **) &workers, CACHE_LINE, sizeof(Worker) * numthreads) != 0) {
+        fprintf(stderr, "Error: allocating workers.\n");
+        exit(EXIT_FAILURE);
+    }
     for (int i = 0; i < numthreads; i++) {
-        if (pthread_create(&consumer[i], NULL, processInput, (void *) &sockfd) != 0) {
+        workers[i].queue = initQueue(JOB_QUEUE_CAPACITY);
+        workers[i].wake = 0;
+        workers[i].sleeping = FALSE;
+        workers[i].rings = NULL;
+        workers[i].newrings = NULL;
+        workers[i].executed = 0;
+        workers[i].stolen = 0;
+    }
+    reclaim_notify(wakeIdleWorkers);
+    // create slave threads: receivers (I/O threads for connections) decode
+    // requests and dispatch them to the workers, which run them
+    for (int i = 0; i < numpool; i++) {
+        int ret;
+        if (i < numthreads)
+            ret = pthread_create(&consumer[i], NULL, workerThread, (void *) (intptr_t) i);
+        else if (i < numthreads + numiothreads)
+            ret = socktype == SOCK_DGRAM ? pthread_create(&consumer[i], NULL, processInput, (void *) &sockfd)
+                                         : pthread_create(&consumer[i], NULL, ioThread, NULL);
+        else
+            ret = pthread_create(&consumer[i], NULL, statsThread, NULL);
+        if (ret != 0) {
             fprintf(stderr, "Error: unable to create applyCommands thread.\n");
             exit(EXIT_FAILURE);
         }
     }
     // slave threads waiting to finish
-    for (int i = 0; i < numthreads; i++) {
+    for (int i = 0; i < numpool; i++) {
         if (pthread_join(consumer[i], NULL) != 0) {
             fprintf(stderr, "Error: unable to join applyCommands threads.\n");
             exit(EXIT_FAILURE);
         }
     }
+    for (int i = 0; i < numthreads; i++)
+        destroyQueue(workers[i].queue);
+    free(workers);
 }
 
 /**
@@ -188,16 +1421,87 @@ void poolThreads(){
 void assignArgs(int argc, char* argv[]){
 
     /*  
-        |  ./tecnicofs | numthreads | namesocket  |
-        |      0       |    1       |    2        | TOTAL: 3
+        |  ./tecnicofs | numthreads | namesocket  | [-t dgram|seqpacket|stream] [-i iothreads] [-s seconds] [-f image] [-l log] [-d none|batched|per-op] [-c checkpoint] [-p seconds] [-k]
+        |      0       |    1       |    2        | TOTAL: 3 plus options
     */
 
+    int opt;
+    while ((opt = getopt(argc, argv, "t:i:s:f:l:d:c:p:k")) != -1) {
+        switch (opt) {
+            case 't':
+                if (strcmp(optarg, "dgram") == 0)
+                    socktype = SOCK_DGRAM;
+                else if (strcmp(optarg, "seqpacket") == 0)
+                    socktype = SOCK_SEQPACKET;
+                else if (strcmp(optarg, "stream") == 0)
+                    socktype = SOCK_STREAM;
+                else {
+                    fprintf(stderr, "Error: invalid socket type (dgram, seqpacket or stream).\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'i':
+                numiothreads = atoi(optarg);
+                if (numiothreads <= 0) {
+                    fprintf(stderr, "Error: invalid number of I/O threads (>0).\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 's':
+                statsinterval = atoi(optarg);
+                if (statsinterval <= 0) {
+                    fprintf(stderr, "Error: invalid statistics interval (>0 seconds).\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'f':
+                imagefile = optarg;
+                break;
+            case 'l':
+                logfile = optarg;
+                break;
+            case 'd':
+                if (strcmp(optarg, "none") == 0)
+                    durability = WAL_NONE;
+                else if (strcmp(optarg, "batched") == 0)
+                    durability = WAL_BATCHED;
+                else if (strcmp(optarg, "per-op") == 0)
+                    durability = WAL_PER_OP;
+                else {
+                    fprintf(stderr, "Error: invalid durability (none, batched or per-op).\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'c':
+                checkpointfile = optarg;
+                break;
+            case 'p':
+                checkpointinterval = atoi(optarg);
+                if (checkpointinterval <= 0) {
+                    fprintf(stderr, "Error: invalid checkpoint interval (>0 seconds).\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'k':
+                lockprofile = TRUE;
+                break;
+            default:
+                errorParse();
+        }
+    }
+
+    /* an image is saved as it is, checkpoints are loaded into memory */
+    if (imagefile != NULL && checkpointfile != NULL) {
+        fprintf(stderr, "Error: -f and -c cannot be used together.\n");
+        exit(EXIT_FAILURE);
+    }
+
     namesocket = malloc(sizeof(char) * 1024);
-    if (argc == 3){
+    if (argc - optind == 2){
 
-        numthreads = atoi(argv[1]);
-        strcpy(namesocket, argv[2]);
-        printf("argv[2]: %s e namesocket: %s\n", argv[2], namesocket);
+        numthreads = atoi(argv[optind]);
+        strcpy(namesocket, argv[optind + 1]);
+        printf("argv[2]: %s e namesocket: %s\n", argv[optind + 1], namesocket);
 
         /* check the numthreads */
         if (numthreads <= 0){
@@ -206,7 +1510,7 @@ void assignArgs(int argc, char* argv[]){
         }
     }
     else{
-        fprintf(stderr, "Error: the command line must have 4 arguments.\nDisplay: ./tecnicofs <numthreads> <namesocket>\n");
+        fprintf(stderr, "Error: the command line must have 3 arguments.\nDisplay: ./tecnicofs <numthreads> <namesocket> [-t dgram|seqpacket|stream] [-i iothreads] [-s seconds] [-f image] [-l log] [-d none|batched|per-op] [-c checkpoint] [-p seconds] [-k]\n");
         exit(EXIT_FAILURE);
     }
 }
@@ -237,10 +1541,65 @@ int main(int argc, char* argv[]){
     
     /* parse the arguments */
     assignArgs(argc, argv);
-    /* init filesystem */
-    init_fs();
+    /* the image, checkpoint and log are saved on SIGINT or SIGTERM, by a thread of its own: the
+       signals are blocked before any other thread starts, so all of them inherit it */
+    static sigset_t stopsignals;
+    sigemptyset(&stopsignals);
+    sigaddset(&stopsignals, SIGINT);
+    sigaddset(&stopsignals, SIGTERM);
+    if ((imagefile != NULL || logfile != NULL || checkpointfile != NULL) && pthread_sigmask(SIG_BLOCK, &stopsignals, NULL) != 0) {
+        fprintf(stderr, "Error: unable to block the stop signals.\n");
+        exit(EXIT_FAILURE);
+    }
+    /* init filesystem, mapping its image if one is given */
+    struct timespec mount_begin, mount_end;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &mount_begin);
+    init_fs(imagefile);
+    clock_gettime(CLOCK_MONOTONIC_RAW, &mount_end);
+    if (imagefile != NULL) {
+        printf("Image %s mounted in %0.3f ms.\n", imagefile, (mount_end.tv_sec - mount_begin.tv_sec) * 1000.0 +
+               (mount_end.tv_nsec - mount_begin.tv_nsec) / 1000000.0);
+    }
+    /* load the last checkpoint, then the changes logged after it */
+    uint64_t checkpointlsn = 0;
+    if (checkpointfile != NULL) {
+        clock_gettime(CLOCK_MONOTONIC_RAW, &mount_begin);
+        long loaded = load_fs(checkpointfile, &checkpointlsn);
+        clock_gettime(CLOCK_MONOTONIC_RAW, &mount_end);
+        if (loaded == FAIL)
+            exit(EXIT_FAILURE);
+        printf("Checkpoint %s: %ld nodes loaded in %0.3f ms.\n", checkpointfile, loaded,
+               (mount_end.tv_sec - mount_begin.tv_sec) * 1000.0 + (mount_end.tv_nsec - mount_begin.tv_nsec) / 1000000.0);
+    }
+    /* recover the changes logged, and log the new ones */
+    if (logfile != NULL) {
+        clock_gettime(CLOCK_MONOTONIC_RAW, &mount_begin);
+        long replayed = start_log(logfile, checkpointlsn, durability);
+        clock_gettime(CLOCK_MONOTONIC_RAW, &mount_end);
+        if (replayed == FAIL)
+            exit(EXIT_FAILURE);
+        printf("Log %s: %ld changes replayed in %0.3f ms.\n", logfile, replayed,
+               (mount_end.tv_sec - mount_begin.tv_sec) * 1000.0 + (mount_end.tv_nsec - mount_begin.tv_nsec) / 1000000.0);
+    }
+    if (imagefile != NULL || logfile != NULL || checkpointfile != NULL) {
+        pthread_t stopper;
+        if (pthread_create(&stopper, NULL, stopThread, &stopsignals) != 0) {
+            fprintf(stderr, "Error: unable to create the thread saving the file system.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    /* after recovery, so only the clients' requests are profiled */
+    if (lockprofile)
+        lockprof_start();
+    if (checkpointfile != NULL) {
+        pthread_t checkpointer;
+        if (pthread_create(&checkpointer, NULL, checkpointThread, NULL) != 0) {
+            fprintf(stderr, "Error: unable to create the checkpoint thread.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
     /* init client socket */
-    if ((sockfd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+    if ((sockfd = socket(AF_UNIX, socktype, 0)) < 0) {
         fprintf(stderr, "Error: Unable to create a server socket.\n");
         exit(EXIT_FAILURE);
     }
@@ -253,6 +1612,13 @@ int main(int argc, char* argv[]){
         fprintf(stderr, "Error: Unable to bind the server socket.\n");
         exit(EXIT_FAILURE);
     }
+    /* the I/O threads accept until EAGAIN */
+    if (socktype != SOCK_DGRAM) {
+        if (listen(sockfd, SOMAXCONN) < 0 || fcntl(sockfd, F_SETFL, O_NONBLOCK) < 0) {
+            fprintf(stderr, "Error: Unable to listen on the server socket.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
     /* create a pool of threads & process input & apply commands*/
     poolThreads();
     /* release allocated memory */
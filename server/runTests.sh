@@ -1,39 +1,77 @@
 #!/bin/bash
 
-inputdir=$1
-outputdir=$2
-maxthread=$3
+# Runs the load generator against the server with 1 to maxthread worker
+# threads and prints, as JSON, the throughput and p99 latency of each run
+# and its speedup over one thread. Options after maxthread are passed to
+# tecnicofs-load (e.g. -t seqpacket -c 8 -m move-heavy -d 5); the server
+# is started with the socket type they ask for.
 
-# check if there are only 3 arguments
-if [ ! $# == 3 ] 
-	then
-		echo "Error: Invalid number of arguments, must be 4 arguments."
-		exit 1
-fi
-# check if arg 1 and 2 are directories
-if [ ! -d "$inputdir" ] 
+maxthread=$1
+load=../client/tecnicofs-load
+socket=/tmp/tecnicofs-sweep-$$
+
+# check there is at least 1 argument
+if [ $# -lt 1 ]
 	then
-		echo "Error: Invalid input directory."
+		echo "Usage: $0 maxthreads [tecnicofs-load options]"
 		exit 1
 fi
-if [ ! -d "$outputdir" ] 
+# check the maxthreads parameter is not 0 or less
+if [ ! "$maxthread" -gt 0 ] 2>/dev/null
 	then
-		echo "Error: Invalid output directory."
+		echo "Error: Invalid number, MaxThreads must be greater than 0."
 		exit 1
 fi
-# check the maxthreads parameter is not 0 or less
-if [ ! $maxthread -gt 0 ] 
+shift
+# check both programs are built
+if [ ! -x ./tecnicofs ] || [ ! -x $load ]
 	then
-		echo "Error: Invalid number, MaxThreads must be greater than 0."
+		echo "Error: build the server and $load first."
 		exit 1
 fi
 
-for input in $inputdir/*.txt
+# the server serves the shared-memory rings over its seqpacket or stream socket
+socktype=dgram
+args=("$@")
+for i in "${!args[@]}"
 do
-	for i in $(seq 1 $maxthread)
+	if [ "${args[$i]}" == "-t" ]
+		then
+			socktype=${args[$((i + 1))]%-shm}
+	fi
+done
+
+trap 'kill $server 2>/dev/null; rm -f $socket' EXIT
+
+echo "{\"socket\": \"$socktype\", \"runs\": ["
+for i in $(seq 1 $maxthread)
+do
+	rm -f $socket
+	./tecnicofs $i $socket -t $socktype > /dev/null &
+	server=$!
+	# wait for the server to listen
+	while [ ! -S $socket ] && kill -0 $server 2>/dev/null
 	do
-		output="$((basename $input) | sed "s/\.[a-z]*//g")-$i"
-		echo InputFile=$input NumThread=$i
-		./tecnicofs $input $outputdir/$output.txt $i | tail -1
+		sleep 0.1
 	done
+
+	result=$($load $socket "$@")
+	kill $server
+	wait $server 2>/dev/null
+
+	throughput=$(echo "$result" | sed -n 's/.*"throughput": \([0-9.]*\).*/\1/p')
+	p99=$(echo "$result" | sed -n 's/.*"latency_us": {[^}]*"p99": \([0-9.]*\).*/\1/p' | head -1)
+	if [ -z "$throughput" ]
+		then
+			echo "Error: no result with $i threads." >&2
+			exit 1
+	fi
+	if [ $i == 1 ]
+		then
+			base=$throughput
+	fi
+	speedup=$(echo "$throughput $base" | awk '{ printf "%.2f", ($2 > 0 ? $1 / $2 : 0) }')
+	[ $i == $maxthread ] && sep="" || sep=","
+	echo "  {\"numthreads\": $i, \"throughput\": $throughput, \"p99_us\": $p99, \"speedup\": $speedup}$sep"
 done
+echo "]}"
@@ -0,0 +1,136 @@
+/* tecnicofs-protocol.h */
+#ifndef TECNICOFS_PROTOCOL_H
+#define TECNICOFS_PROTOCOL_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Binary wire format. Every message starts with a fixed header followed
+ * by the bytes it announces: the request's paths (not NUL-terminated)
+ * and an opcode-specific payload. Fields are in host byte order, since
+ * client and server always share a host.
+ *
+ * The server still accepts the old text commands ("c /a f", ...): the
+ * magic byte is never the first byte of a text command.
+ */
+#define TFS_PROTOCOL_MAGIC 0xF5
+#define TFS_PROTOCOL_VERSION 1
+
+/* largest datagram either side sends */
+#define TFS_MAX_MESSAGE 65536
+
+#define TFS_OP_CREATE 1
+#define TFS_OP_DELETE 2
+#define TFS_OP_LOOKUP 3
+#define TFS_OP_MOVE 4
+#define TFS_OP_PRINT 5
+#define TFS_OP_BATCH 6
+#define TFS_OP_SHM_ATTACH 7 /* see tecnicofs-shm.h */
+#define TFS_OP_WRITE 8
+#define TFS_OP_READ 9
+#define TFS_OP_TRUNCATE 10
+#define TFS_OP_SIZE 11
+#define TFS_OP_STATS 12
+#define TFS_OP_LOCKS 13
+#define TFS_OP_RMTREE 14 /* delete a node and everything below it */
+
+/* formats of TFS_OP_PRINT, given in its flags */
+#define TFS_PRINT_TEXT 0 /* one path per line */
+#define TFS_PRINT_NDJSON 1 /* one JSON object per line */
+#define TFS_PRINT_BINARY 2 /* see DumpRecord in server/fs/state.h */
+
+/*
+ * TFS_OP_STATS writes the server's latency histograms, per opcode and
+ * per stage of a request, and its path cache hits and misses, to the
+ * file named by its path, in the format given in its flags.
+ */
+#define TFS_STATS_TEXT 0 /* a table in microseconds */
+#define TFS_STATS_JSON 1 /* one JSON object, in nanoseconds */
+
+/*
+ * TFS_OP_LOCKS controls the server's lock contention profiler, as given
+ * in its flags. TFS_LOCKS_DUMP writes the most contended i-nodes to the
+ * file named by its path; its payload, if any, is the int32_t number of
+ * them to list.
+ */
+#define TFS_LOCKS_DUMP 0
+#define TFS_LOCKS_START 1 /* clear the counters and start profiling */
+#define TFS_LOCKS_STOP 2
+
+/*
+ * File contents. The payload of TFS_OP_WRITE is an int64_t offset
+ * followed by the bytes to write, and its result the number written.
+ * The payload of TFS_OP_READ is an int64_t offset and an int32_t length
+ * (at most TFS_MAX_READ); its result is the number of bytes read, which
+ * follow as the response payload. The payload of TFS_OP_TRUNCATE is the
+ * int64_t new size. TFS_OP_SIZE answers with the size as its result.
+ */
+#define TFS_MAX_READ (TFS_MAX_MESSAGE - sizeof(tfsResponseHeader))
+
+/*
+ * A TFS_OP_BATCH request carries complete requests (header and paths) as
+ * its payload. The server runs them in order and answers with the
+ * number it ran as the result, followed by one int32_t result per
+ * request run.
+ */
+#define TFS_BATCH_STOP_ON_FAILURE 1 /* flag: stop at the first negative result */
+#define TFS_MAX_BATCH (TFS_MAX_MESSAGE / sizeof(tfsRequestHeader))
+
+typedef struct tfsRequestHeader {
+	uint8_t magic;
+	uint8_t version;
+	uint8_t opcode;
+	uint8_t flags; /* opcode-specific, the node type for TFS_OP_CREATE */
+	uint32_t id; /* chosen by the client, echoed in the response */
+	uint16_t pathlen;
+	uint16_t path2len;
+	uint32_t payloadlen;
+} tfsRequestHeader;
+
+typedef struct tfsResponseHeader {
+	uint8_t magic;
+	uint8_t version;
+	uint8_t opcode;
+	uint8_t flags;
+	uint32_t id;
+	int32_t result;
+	uint32_t payloadlen;
+} tfsResponseHeader;
+
+/*
+ * Writes a request into buf.
+ * Returns: the number of bytes used, or -1 if it does not fit in size
+ */
+static inline int tfsEncodeRequest(char *buf, int size, int opcode, int flags, uint32_t id,
+                                   const char *path, const char *path2,
+                                   const void *payload, int payloadlen) {
+	tfsRequestHeader header;
+	int pathlen = path ? strlen(path) : 0;
+	int path2len = path2 ? strlen(path2) : 0;
+	int total = sizeof(header) + pathlen + path2len + payloadlen;
+
+	if (total > size || pathlen > UINT16_MAX || path2len > UINT16_MAX)
+		return -1;
+
+	header.magic = TFS_PROTOCOL_MAGIC;
+	header.version = TFS_PROTOCOL_VERSION;
+	header.opcode = opcode;
+	header.flags = flags;
+	header.id = id;
+	header.pathlen = pathlen;
+	header.path2len = path2len;
+	header.payloadlen = payloadlen;
+
+	memcpy(buf, &header, sizeof(header));
+	buf += sizeof(header);
+	if (pathlen > 0)
+		memcpy(buf, path, pathlen);
+	if (path2len > 0)
+		memcpy(buf + pathlen, path2, path2len);
+	if (payloadlen > 0)
+		memcpy(buf + pathlen + path2len, payload, payloadlen);
+	return total;
+}
+
+#endif /* TECNICOFS_PROTOCOL_H */
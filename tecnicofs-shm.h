@@ -0,0 +1,144 @@
+/* tecnicofs-shm.h */
+#ifndef TECNICOFS_SHM_H
+#define TECNICOFS_SHM_H
+
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "tecnicofs-protocol.h"
+
+/*
+ * Shared-memory transport. A client creates a segment with memfd_create,
+ * sends its fd to the server in a TFS_OP_SHM_ATTACH request (SCM_RIGHTS)
+ * and from then on may place requests in the segment's request ring and
+ * collect their responses from the response ring, without syscalls while
+ * both sides are busy. Messages use the binary wire format.
+ *
+ * Each ring has a single producer and a single consumer, so it is the
+ * same circular buffer as circularqueue/, with free-running head and
+ * tail counters instead of front/rear indexes: no lock is needed and the
+ * counters mean the same in both processes. An idle consumer sleeps on a
+ * futex on the tail counter.
+ */
+#define TFS_SHM_MAGIC 0x54465352 /* "TFSR" */
+#define TFS_SHM_SLOTS 256 /* power of two */
+#define TFS_SHM_SLOT_SIZE 1024
+#define TFS_SHM_MAX_MESSAGE (TFS_SHM_SLOT_SIZE - sizeof(uint32_t))
+/* polls of an empty ring before sleeping, when the other side can run
+   on another CPU meanwhile */
+#define TFS_SHM_SPINS 1024
+
+#define TFS_SHM_ALIGN __attribute__((aligned(64)))
+
+typedef struct tfsShmSlot {
+	uint32_t len;
+	char data[TFS_SHM_MAX_MESSAGE];
+} tfsShmSlot;
+
+typedef struct tfsShmRing {
+	uint32_t head TFS_SHM_ALIGN; /* next slot to consume, written by the consumer */
+	uint32_t sleeping; /* the consumer is (about to be) waiting on tail */
+	uint32_t tail TFS_SHM_ALIGN; /* next slot to fill, written by the producer */
+	tfsShmSlot slots[TFS_SHM_SLOTS] TFS_SHM_ALIGN;
+} tfsShmRing;
+
+typedef struct tfsShmSegment {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t closed; /* set by the server when it stops serving the rings */
+	tfsShmRing requests; /* client -> server */
+	tfsShmRing responses; /* server -> client */
+} tfsShmSegment;
+
+static inline void tfsShmPause() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+/*
+ * Returns how long to poll an empty ring: on a single CPU the producer
+ * cannot run while we spin, so go straight to sleep.
+ */
+static inline int tfsShmSpins() {
+	static int spins = -1;
+	if (spins < 0)
+		spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? TFS_SHM_SPINS : 0;
+	return spins;
+}
+
+/*
+ * Producer: returns the slot to fill next, or NULL if the ring is full.
+ */
+static inline tfsShmSlot *tfsShmProduce(tfsShmRing *ring) {
+	uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	if (ring->tail - head == TFS_SHM_SLOTS)
+		return NULL;
+	return &ring->slots[ring->tail & (TFS_SHM_SLOTS - 1)];
+}
+
+/*
+ * Producer: publishes the slot returned by tfsShmProduce, waking the
+ * consumer if it sleeps.
+ */
+static inline void tfsShmPublish(tfsShmRing *ring, uint32_t len) {
+	ring->slots[ring->tail & (TFS_SHM_SLOTS - 1)].len = len;
+	__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+	/* pairs with the fence in tfsShmWait */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->sleeping, __ATOMIC_RELAXED))
+		syscall(SYS_futex, &ring->tail, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/*
+ * Consumer: returns the oldest published slot, or NULL if the ring is
+ * empty.
+ */
+static inline tfsShmSlot *tfsShmConsume(tfsShmRing *ring) {
+	if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ring->head)
+		return NULL;
+	return &ring->slots[ring->head & (TFS_SHM_SLOTS - 1)];
+}
+
+/*
+ * Consumer: gives the slot returned by tfsShmConsume back to the producer.
+ */
+static inline void tfsShmRelease(tfsShmRing *ring) {
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Consumer: waits until the ring is not empty or *closed is set. Polls
+ * for a while, then sleeps on the futex for at most timeout_ms.
+ */
+static inline void tfsShmWait(tfsShmRing *ring, uint32_t *closed, int timeout_ms) {
+	for (int i = 0; i < tfsShmSpins(); i++) {
+		if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != ring->head ||
+		    __atomic_load_n(closed, __ATOMIC_ACQUIRE))
+			return;
+		tfsShmPause();
+	}
+
+	struct timespec timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+	uint32_t tail = ring->head;
+	__atomic_store_n(&ring->sleeping, 1, __ATOMIC_RELAXED);
+	/* pairs with the fence in tfsShmPublish: either it sees sleeping or
+	   we see its tail */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == tail && !__atomic_load_n(closed, __ATOMIC_ACQUIRE))
+		syscall(SYS_futex, &ring->tail, FUTEX_WAIT, tail, &timeout, NULL, 0);
+	__atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * Marks the segment closed and wakes both sides.
+ */
+static inline void tfsShmClose(tfsShmSegment *seg) {
+	__atomic_store_n(&seg->closed, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &seg->requests.tail, FUTEX_WAKE, 1, NULL, NULL, 0);
+	syscall(SYS_futex, &seg->responses.tail, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+#endif /* TECNICOFS_SHM_H */